@@ -11,8 +11,11 @@
 ******************************************************************************/
 
 #include "color_matrix.h"
+#include "color_matrix_kernels.h"
+#include "packed_mask.h"
 
 #include <cassert>
+#include <cmath>
 #include <opencv2/core.hpp>
 #include <opencv2/imgproc.hpp>
 namespace cspace
@@ -22,6 +25,9 @@ namespace cspace
 * Definitions
 *******************************************************************************/
 
+// hue used when there is only a single highlight
+#define SINGLE_HL_HUE 100
+
 /*******************************************************************************
 * Types
 *******************************************************************************/
@@ -73,148 +79,174 @@ void Mat::setColorspace(colorspace_t c)
     colorspace = c;
 }
 
-Mat &Mat::toGray()
+// Every conversion goes through the planner, which knows the direct route between each pair of
+// colorspaces
+void Mat::toColorspace(Mat &dst, colorspace_t c, bool gray) const
 {
-    Mat *out = new Mat();
-    out->setColorspace(GRAY);
-
-    switch (colorspace)
+    INSTRUMENT_SCOPE("cspace::toColorspace");
+    ConversionPlan plan = planConversion(colorspace, c, gray);
+    if (!plan.stages)
     {
-    case GRAY:
-    case WHITE_ON_BLACK:
-        *out = *this;
-        out->setColorspace(GRAY);
-        break;
-    case HSV:
-        cvtColor(*this, *out, cv::COLOR_HSV2BGR);
-        // Fallthrough - can't get directly to gray from HSV, so use BGR as proxy
-    case BGR:
-        cvtColor(*this, *out, cv::COLOR_BGR2GRAY);
-        break;
-    case RGB:
-        cvtColor(*this, *out, cv::COLOR_RGB2GRAY);
-        break;
-    default:
-        throw std::runtime_error("Colorspace not implemented");
-        break;
+        throw std::runtime_error(gray ? "colorspace 3 channel / not fully implemented"
+                                      : "colorspace not implemented");
     }
 
-    return *out;
+    runPlan(plan, *this, dst);
+    dst.markModified();
+    dst.setColorspace(c);
+}
+
+void Mat::toGray(Mat &dst) const
+{
+    toColorspace(dst, GRAY);
 }
 
 // https://en.cppreference.com/w/cpp/language/throw
 // https://en.cppreference.com/w/cpp/error/assert
-Mat &Mat::to3ChannelGray(colorspace_t c)
+void Mat::to3ChannelGray(Mat &dst, colorspace_t c) const
 {
     assert(("known colorspace", c != UNKNOWN));
 
-    Mat *out = new Mat;
-    out->setColorspace(c);
+    toColorspace(dst, c, true);
+}
 
-    switch (colorspace)
+void Mat::toHSV(Mat &dst) const
+{
+    toColorspace(dst, HSV);
+}
+
+void Mat::toBGR(Mat &dst) const
+{
+    toColorspace(dst, BGR);
+}
+
+// The value flavour, where no conversion is required we hand back a header sharing our pixels
+
+Mat Mat::toGray() const &
+{
+    Mat out;
+    if (colorspace == GRAY || colorspace == WHITE_ON_BLACK)
     {
-    case GRAY:
-    case WHITE_ON_BLACK:
-        *out = *this;
-        out->setColorspace(GRAY);
-        break;
-    default:
-        *out = toGray(); // rely on this function to find unsupported cspaces
-        break;
+        out = *this;
+    }
+    else
+    {
+        out = converted(GRAY, false);
     }
+    out.setColorspace(GRAY);
+    return out;
+}
 
-    switch (c)
+Mat Mat::toBGR() const &
+{
+    Mat out;
+    out.setColorspace(BGR);
+    if (colorspace == BGR)
     {
-    case BGR:
-    case RGB:
-        // R=G=B for each pixel, so it doesn't matter which of the two conversions is used
-        *out = out->toBGR();
-        break;
-    case HSV:
-        *out = out->toHSV();
-        break;
-    default:
-        throw std::runtime_error("colorspace 3 channel / not fully implemented");
-        break;
+        out = *this;
     }
+    else
+    {
+        out = converted(BGR, false);
+    }
+    return out;
+}
 
-    return *out;
+Mat Mat::toHSV() const &
+{
+    Mat out;
+    out.setColorspace(HSV);
+    if (colorspace == HSV)
+    {
+        out = *this;
+    }
+    else
+    {
+        out = converted(HSV, false);
+    }
+    return out;
 }
 
-Mat &Mat::toHSV()
+Mat Mat::to3ChannelGray(colorspace_t c) const &
 {
-    Mat *out = new Mat;
-    out->setColorspace(HSV);
+    assert(("known colorspace", c != UNKNOWN));
+
+    return converted(c, true);
+}
 
-    switch (colorspace)
+// The rvalue flavour, a temporary already in the colorspace is simply moved on
+
+Mat Mat::toGray() &&
+{
+    if (colorspace == GRAY || colorspace == WHITE_ON_BLACK)
     {
-    case HSV:
-        *out = *this;
-        break;
-    case BGR:
-        cvtColor(*this, *out, cv::COLOR_BGR2HSV);
-        break;
-    case RGB:
-        cvtColor(*this, *out, cv::COLOR_RGB2HSV);
-        break;
-    case GRAY:
-    case WHITE_ON_BLACK:
-        cvtColor(*this, *out, cv::COLOR_GRAY2BGR);
-        cvtColor(*out, *out, cv::COLOR_BGR2HSV);
-        break;
-    default:
-        throw std::runtime_error("colorspace not implemented");
-        break;
+        colorspace = GRAY;
+        return std::move(*this);
     }
-
-    return *out;
+    return movedConverted(GRAY, false);
 }
 
-Mat &Mat::toBGR()
+Mat Mat::toBGR() &&
 {
-    Mat *out = new Mat;
-    out->setColorspace(BGR);
+    if (colorspace == BGR)
+    {
+        return std::move(*this);
+    }
+    return movedConverted(BGR, false);
+}
 
-    switch (colorspace)
+Mat Mat::toHSV() &&
+{
+    if (colorspace == HSV)
     {
-    case BGR:
-        *out = *this;
-    case HSV:
-        cvtColor(*this, *out, cv::COLOR_HSV2BGR);
-        break;
-    case RGB:
-        cvtColor(*this, *out, cv::COLOR_RGB2BGR);
-        break;
-    case GRAY:
-    case WHITE_ON_BLACK:
-        cvtColor(*this, *out, cv::COLOR_GRAY2BGR);
-        break;
-    default:
-        throw std::runtime_error("colorspace not implemented");
-        break;
+        return std::move(*this);
     }
+    return movedConverted(HSV, false);
+}
 
-    return *out;
+Mat Mat::to3ChannelGray(colorspace_t c) &&
+{
+    assert(("known colorspace", c != UNKNOWN));
+
+    return movedConverted(c, true);
 }
 
-cspace::Mat &cspace::Mat::operator=(const cv::Mat &m)
+// Converting over our own pixels is only fair when no other header can see them. Headers over a
+// user buffer (no u) can't tell, and a cache means the caller wants the results kept.
+Mat Mat::movedConverted(colorspace_t c, bool gray)
 {
-    if (this != &m)
+    ConversionPlan plan = planConversion(colorspace, c, gray);
+    if (plan.stages && plan.out_type == type() && u && u->refcount == 1 && !cache)
     {
-        checkColorspaceMatch(m, this->getColorspace());
+        toColorspace(*this, c, gray);
+        return std::move(*this);
+    }
+    return converted(c, gray);
+}
 
-        if (m.type() == CV_8UC1)
-        {
-            setColorspace(GRAY);
-        }
+void Mat::retagFor(const cv::Mat &m)
+{
+    checkColorspaceMatch(m, this->getColorspace());
 
-        if (m.type() == CV_8UC3)
+    if (m.type() == CV_8UC1)
+    {
+        setColorspace(GRAY);
+    }
+
+    if (m.type() == CV_8UC3)
+    {
+        if (colorspace == GRAY)
         {
-            if (colorspace == GRAY)
-            {
-                setColorspace(BGR); // we aren't sure, set to the default 3 channel colorscheme
-            }
+            setColorspace(BGR); // we aren't sure, set to the default 3 channel colorscheme
         }
+    }
+}
+
+cspace::Mat &cspace::Mat::operator=(const cv::Mat &m)
+{
+    if (this != &m)
+    {
+        retagFor(m);
 
         if (m.u)
         {
@@ -240,129 +272,300 @@ cspace::Mat &cspace::Mat::operator=(const cv::Mat &m)
         datalimit = m.datalimit;
         allocator = m.allocator;
         u = m.u;
+
+        // new pixels, whatever was derived from the old ones stays with their other headers
+        if (cache)
+        {
+            enableCache(cacheStats().max_bytes);
+        }
     }
     return *this;
 }
 
-Mat &highlightOverBg(Mat bg, Mat hl)
+// Takes m's buffer over, without touching the reference count
+cspace::Mat &cspace::Mat::operator=(cv::Mat &&m)
 {
-    Mat *out = new Mat;
-    out->setColorspace(HSV);
-    *out = bg.to3ChannelGray(HSV);
+    if (this != &m)
+    {
+        retagFor(m);
 
-    cv::MatIterator_<uchar> it_hl = hl.begin<uchar>();
-    cv::MatIterator_<cv::Vec3b> it_out = out->begin<cv::Vec3b>();
-    for (;
-         it_out != out->end<cv::Vec3b>();
-         std::advance(it_out, 1), std::advance(it_hl, 1))
+        cv::Mat::operator=(std::move(m));
+
+        if (cache)
+        {
+            enableCache(cacheStats().max_bytes);
+        }
+    }
+    return *this;
+}
+
+// The BGR values that fully saturated pixels of the given hues convert to, taken from cvtColor
+// so that they are exactly what the HSV path would produce
+static void huesToBgr(const uchar *hues, cv::Vec3b *bgr, int n)
+{
+    cv::Vec3b hsv_px[MAX_HIGHLIGHTS + 1];
+    for (int i = 0; i < n; i++)
+    {
+        hsv_px[i] = cv::Vec3b(hues[i], 255, 255);
+    }
+    cv::Mat hsv(1, n, CV_8UC3, hsv_px);
+    cv::Mat out(1, n, CV_8UC3, bgr);
+    cvtColor(hsv, out, cv::COLOR_HSV2BGR);
+}
+
+// Checked ahead of the lut and the rows of the masks, which are sized for MAX_HIGHLIGHTS at most
+static void checkNumHighlights(int num_hls)
+{
+    if (num_hls < 0 || num_hls > MAX_HIGHLIGHTS)
+    {
+        throw std::runtime_error("color depth insufficient for visualization");
+    }
+}
+
+// Each mask gets its own hue, evenly spaced, mask i colors with lut[i + 1]
+static void highlightLut(int num_hls, cv::Vec3b *lut)
+{
+    if (num_hls)
     {
-        if ((*it_hl) > 127)
+        uchar hue_step = 255 / num_hls;
+        uchar hues[MAX_HIGHLIGHTS];
+        for (int i = 0; i < num_hls; i++)
         {
-            (*it_out)[0] = 100;
-            (*it_out)[1] = 255;
-            (*it_out)[2] = 255;
+            hues[i] = (i + 1) * hue_step;
         }
+        huesToBgr(hues, lut + 1, num_hls);
     }
-    return out->toBGR();
 }
 
-// this seems simple - both list and vector are acceptable for this operation, 
-// and the code within is identical, however on account of auto, I cannot simplify both functions down to one
+// A header on the background which the row kernels can gray directly, that is BGR, RGB or gray.
+// Anything else is converted to gray in the scratch. b_idx is set to where blue is.
+static cv::Mat grayableBg(const Mat &bg, Mat &scratch, int &b_idx)
+{
+    b_idx = 0;
+    switch (bg.getColorspace())
+    {
+    case BGR:
+    case GRAY:
+    case WHITE_ON_BLACK:
+        return bg;
+    case RGB:
+        b_idx = 2;
+        return bg;
+    default:
+    {
+        // the scratch lives as long as the thread, likely longer than a pool would
+        AllocatorScope std_allocator(nullptr);
+        bg.toGray(scratch); // rely on this function to find unsupported cspaces
+        return scratch;
+    }
+    }
+}
 
-Mat &highlightOverBg(Mat bg, std::list<Mat> hls)
+// Single pass: gray the background, tint and convert to BGR all at once, rather than going
+// via a full HSV image
+void highlightOverBg(const Mat &bg, const Mat &hl, Mat &dst)
 {
-    Mat *out = new Mat;
-    out->setColorspace(HSV);
-    *out = bg.to3ChannelGray(HSV);
+    INSTRUMENT_SCOPE("cspace::highlightOverBg");
+    assert(("highlight is a single channel matrix", hl.type() == CV_8UC1));
+    assert(("highlight matches the background", hl.size() == bg.size()));
 
-    auto it_hls = hls.begin();
-    auto end_hls = hls.end();
-    cv::MatIterator_<uchar> it_hl;
-    cv::MatIterator_<cv::Vec3b> it_out = out->begin<cv::Vec3b>();
+    static thread_local Mat gray_scratch;
 
-    assert(("color depth insufficient for visualization",
-            hls.size() < 256));
+    // headers are held locally in case dst aliases one of the inputs
+    int b_idx;
+    cv::Mat src = grayableBg(bg, gray_scratch, b_idx);
+    cv::Mat mask = hl;
 
-    uchar num_hls = hls.size();
-    uchar hue_step = 255 / num_hls;
-    std::vector<uchar> hue_map;
-    uchar hue;
+    uchar hue = SINGLE_HL_HUE;
+    cv::Vec3b tint;
+    huesToBgr(&hue, &tint, 1);
 
-    for (uchar i = 0; i < num_hls; i++)
+    createCounted(dst, src.size(), CV_8UC3);
+    forEachStripe(src.rows, [&](const cv::Range &r) {
+        for (int y = r.start; y < r.end; y++)
+        {
+            highlightRow(src.ptr<uchar>(y), src.channels(), b_idx, mask.ptr<uchar>(y),
+                         tint, dst.ptr<uchar>(y), src.cols);
+        }
+    });
+
+    dst.markModified();
+    dst.setColorspace(BGR);
+}
+
+void highlightOverBg(const Mat &bg, const cv::Mat *const *hls, int num_hls, Mat &dst)
+{
+    INSTRUMENT_SCOPE("cspace::highlightOverBg");
+    checkNumHighlights(num_hls);
+
+    static thread_local Mat gray_scratch;
+
+    int b_idx;
+    cv::Mat src = grayableBg(bg, gray_scratch, b_idx);
+
+    for (int i = 0; i < num_hls; i++)
     {
-        hue_map.push_back((i + 1) * hue_step);
+        assert(("highlight is a single channel matrix", hls[i]->type() == CV_8UC1));
+        assert(("highlight matches the background", hls[i]->size() == src.size()));
+        assert(("highlight is not the destination", hls[i] != &dst));
     }
 
-    int hue_idx = 0;
-    for ( ; it_hls != end_hls; std::advance(it_hls,1))
-    {
-        it_hl = it_hls->begin<uchar>();
-        it_out = out->begin<cv::Vec3b>();
-        hue = hue_map[hue_idx++];
-
-        for (;
-             it_out < out->end<cv::Vec3b>();
-             std::advance(it_hl, 1),
-             std::advance(it_out, 1))
+    cv::Vec3b lut[MAX_HIGHLIGHTS + 1];
+    highlightLut(num_hls, lut);
+
+    createCounted(dst, src.size(), CV_8UC3);
+    forEachStripe(src.rows, [&](const cv::Range &r) {
+        const uchar *mask_rows[MAX_HIGHLIGHTS];
+        for (int y = r.start; y < r.end; y++)
         {
-            if ((*it_hl) > 127)
+            for (int i = 0; i < num_hls; i++)
             {
-                (*it_out)[0] = hue;
-                (*it_out)[1] = 255;
-                (*it_out)[2] = 255;
+                mask_rows[i] = hls[i]->ptr<uchar>(y);
             }
+            highlightManyRow(src.ptr<uchar>(y), src.channels(), b_idx, mask_rows, num_hls,
+                             lut, dst.ptr<uchar>(y), src.cols);
         }
-    }
+    });
 
-    return out->toBGR();
+    dst.markModified();
+    dst.setColorspace(BGR);
 }
 
-Mat &highlightOverBg(Mat bg, std::vector<Mat> hls)
+// The packed masks are tinted straight from their bits, an empty byte of a mask skips eight
+// pixels of it at once
+static void highlightPacked(const cv::Mat &src, int b_idx, const PackedMask *const *hls,
+                            int num_hls, const cv::Vec3b *lut, Mat &dst)
 {
-    Mat *out = new Mat;
-    out->setColorspace(HSV);
-    *out = bg.to3ChannelGray(HSV);
+    createCounted(dst, src.size(), CV_8UC3);
+    forEachStripe(src.rows, [&](const cv::Range &r) {
+        const uchar *mask_rows[MAX_HIGHLIGHTS];
+        for (int y = r.start; y < r.end; y++)
+        {
+            for (int i = 0; i < num_hls; i++)
+            {
+                mask_rows[i] = hls[i]->ptr(y);
+            }
+            highlightPackedRow(src.ptr<uchar>(y), src.channels(), b_idx, mask_rows, num_hls,
+                               lut, dst.ptr<uchar>(y), src.cols);
+        }
+    });
 
-    auto it_hls = hls.begin();
-    auto end_hls = hls.end();
-    cv::MatIterator_<uchar> it_hl;
-    cv::MatIterator_<cv::Vec3b> it_out = out->begin<cv::Vec3b>();
+    dst.markModified();
+    dst.setColorspace(BGR);
+}
+
+void highlightOverBg(const Mat &bg, const PackedMask &hl, Mat &dst)
+{
+    INSTRUMENT_SCOPE("cspace::highlightOverBg");
+    assert(("highlight matches the background", hl.size() == bg.size()));
 
-    assert(("color depth insufficient for visualization",
-            hls.size() < 256));
+    static thread_local Mat gray_scratch;
 
-    uchar num_hls = hls.size();
-    uchar hue_step = 255 / num_hls;
-    std::vector<uchar> hue_map;
-    uchar hue;
+    int b_idx;
+    cv::Mat src = grayableBg(bg, gray_scratch, b_idx);
 
-    for (uchar i = 0; i < num_hls; i++)
+    uchar hue = SINGLE_HL_HUE;
+    cv::Vec3b lut[2];
+    huesToBgr(&hue, lut + 1, 1);
+
+    const PackedMask *hls = &hl;
+    highlightPacked(src, b_idx, &hls, 1, lut, dst);
+}
+
+void highlightOverBg(const Mat &bg, const PackedMask *const *hls, int num_hls, Mat &dst)
+{
+    INSTRUMENT_SCOPE("cspace::highlightOverBg");
+    checkNumHighlights(num_hls);
+
+    static thread_local Mat gray_scratch;
+
+    int b_idx;
+    cv::Mat src = grayableBg(bg, gray_scratch, b_idx);
+
+    for (int i = 0; i < num_hls; i++)
     {
-        hue_map.push_back((i + 1) * hue_step);
+        assert(("highlight matches the background", hls[i]->size() == src.size()));
     }
 
-    int hue_idx = 0;
-    for ( ; it_hls != end_hls; std::advance(it_hls,1))
-    {
-        it_hl = it_hls->begin<uchar>();
-        it_out = out->begin<cv::Vec3b>();
-        hue = hue_map[hue_idx++];
-
-        for (;
-             it_out < out->end<cv::Vec3b>();
-             std::advance(it_hl, 1),
-             std::advance(it_out, 1))
+    cv::Vec3b lut[MAX_HIGHLIGHTS + 1];
+    highlightLut(num_hls, lut);
+
+    highlightPacked(src, b_idx, hls, num_hls, lut, dst);
+}
+
+Mat highlightOverBg(const Mat &bg, const PackedMask &hl)
+{
+    Mat out;
+    highlightOverBg(bg, hl, out);
+    return out;
+}
+
+void highlightOverBg(const Mat &bg, const cv::Mat &labels, const palette_t &palette, Mat &dst)
+{
+    INSTRUMENT_SCOPE("cspace::highlightOverBg");
+    assert(("labels are 16 bit unsigned or 32 bit signed",
+            labels.type() == CV_16UC1 || labels.type() == CV_32SC1));
+    assert(("labels match the background", labels.size() == bg.size()));
+    assert(("labels are not the destination", &labels != &dst));
+
+    static thread_local Mat gray_scratch;
+
+    int b_idx;
+    cv::Mat src = grayableBg(bg, gray_scratch, b_idx);
+
+    createCounted(dst, src.size(), CV_8UC3);
+    forEachStripe(src.rows, [&](const cv::Range &r) {
+        for (int y = r.start; y < r.end; y++)
         {
-            if ((*it_hl) > 127)
+            if (labels.depth() == CV_16U)
+            {
+                highlightLabelsRow(src.ptr<uchar>(y), src.channels(), b_idx, labels.ptr<ushort>(y),
+                                   palette.data(), palette.size(), dst.ptr<uchar>(y), src.cols);
+            }
+            else
             {
-                (*it_out)[0] = hue;
-                (*it_out)[1] = 255;
-                (*it_out)[2] = 255;
+                highlightLabelsRow(src.ptr<uchar>(y), src.channels(), b_idx, labels.ptr<int>(y),
+                                   palette.data(), palette.size(), dst.ptr<uchar>(y), src.cols);
             }
         }
+    });
+
+    dst.markModified();
+    dst.setColorspace(BGR);
+}
+
+Mat highlightOverBg(const Mat &bg, const cv::Mat &labels, const palette_t &palette)
+{
+    Mat out;
+    highlightOverBg(bg, labels, palette, out);
+    return out;
+}
+
+palette_t makePalette(int num_labels)
+{
+    // golden ratio steps around the hue circle (0..180 in 8 bit HSV), never repeating
+    // a hue exactly, and alternating the brightness a little to separate similar hues further
+    cv::Mat hsv(1, num_labels + 1, CV_8UC3, cv::Scalar(0, 0, 0));
+    double hue = 0;
+    for (int l = 1; l <= num_labels; l++)
+    {
+        hue = std::fmod(hue + 180 * 0.618033988749895, 180);
+        hsv.at<cv::Vec3b>(0, l) = cv::Vec3b((uchar)hue, 255, (l & 1) ? 255 : 191);
     }
 
-    return out->toBGR();
+    cv::Mat bgr;
+    cvtColor(hsv, bgr, cv::COLOR_HSV2BGR);
+
+    palette_t palette(bgr.begin<cv::Vec3b>(), bgr.end<cv::Vec3b>());
+    palette[0] = cv::Vec3b(0, 0, 0);
+    return palette;
+}
+
+Mat highlightOverBg(const Mat &bg, const Mat &hl)
+{
+    Mat out;
+    highlightOverBg(bg, hl, out);
+    return out;
 }
 
 } // namespace cspace
\ No newline at end of file
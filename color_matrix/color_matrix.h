@@ -12,7 +12,14 @@
 * Includes
 ******************************************************************************/
 
+#include <cassert>
+#include <cstdint>
+#include <iterator>
 #include <list>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
 #include <opencv2/core.hpp>
 
 /*! @defgroup color_matrix Color_matrix.
@@ -38,6 +45,60 @@ typedef enum colorspace
     WHITE_ON_BLACK
 } colorspace_t;
 
+// How the frames of a batch lie in its blob, a 4 dimensional CV_8U matrix
+typedef enum blob_layout
+{
+    BLOB_NCHW,  // planar: frame, channel, row, column
+    BLOB_NHWC   // interleaved: frame, row, column, channel
+} blob_layout_t;
+
+// each highlight gets its own hue, and there are only so many hues in 8 bits; more masks than this
+// in one call throw
+#define MAX_HIGHLIGHTS 255
+
+// A BGR color per label, entry 0 belongs to the background and is never used
+typedef std::vector<cv::Vec3b> palette_t;
+
+// How the per-pixel kernels spread over threads. Every conversion and highlight is cut into
+// stripes of rows run through cv::parallel_for_, at least grain_rows each, and with never more
+// stripes than max_threads (max_threads <= 0 means as many as OpenCV has). Output is byte for
+// byte the same whatever the configuration.
+struct ParallelConfig
+{
+    ParallelConfig(int grain_rows = 32, int max_threads = -1)
+        : grain_rows(grain_rows), max_threads(max_threads) {}
+
+    int grain_rows;
+    int max_threads;
+};
+
+// Default cap on the memory held by the derived representations cached on a single image
+#define DEFAULT_CACHE_BYTES (64 << 20)
+
+// Counters of the conversion cache, per image (see Mat::cacheStats) or summed over all images
+// (see getCacheStats). A miss is a conversion that was carried out, a hit one that was saved.
+struct CacheStats
+{
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0; // entries dropped to stay under max_bytes
+    size_t bytes = 0;       // currently held
+    size_t max_bytes = 0;
+};
+
+// Counters of the conversions run through the planner (Mat::toColorspace and the calls built on it),
+// summed over all threads. image_rows counts the rows the kernels read from the image buffers, the
+// source or the destination, rather than from a scratch tile; image_rows / rows is how many full
+// passes over the images were made.
+struct ConversionStats
+{
+    uint64_t conversions = 0;
+    uint64_t rows = 0;       // of the images converted
+    uint64_t image_rows = 0;
+};
+
+struct ConversionCache;
+
 /*******************************************************************************
 * Data
 *******************************************************************************/
@@ -62,32 +123,226 @@ typedef enum colorspace
 // so in order to make this class minimally involved, we are asking for a little discipline...
 // that is, set the expectation of the type of colorspace, and you will be rewarded with a runtime error of what has not occurred
 
+// Conversions come in two flavours. The dst flavour writes into a caller owned matrix, and
+// reuses its buffer when the size and type already match, so a steady-state loop that converts
+// into the same dst every frame does not touch the heap. The value flavour is a convenience
+// wrapper on top of it; when no conversion is needed it returns a header sharing our pixels.
+
+// The value flavour can also memoize its results. With enableCache() each derived representation
+// (gray, HSV, 3 channel gray...) is converted once, then copied out for as long as our pixels
+// stay the same. What comes back is the caller's own, to draw on or reuse as a dst.
+// The cache belongs to the pixels: copies of the header share it, and assigning other pixels
+// through operator= starts afresh. Writes into our buffer through this library (as a dst) drop
+// the entries; writes made behind its back (setTo, drawing, at<>...) must call markModified().
+
+// Moving a temporary is free, and so the value flavour has rvalue overloads too. When the
+// conversion keeps the channel count (BGR <-> RGB <-> HSV, and the 3 channel grays) and nobody
+// else references our buffer, it is converted in place and stolen, e.g.
+//     cspace::Mat hsv = std::move(frame).toHSV(); // no allocation, frame is left empty
+
 class Mat : public cv::Mat 
 {
     public :
         using cv::Mat::Mat;
 
-        Mat& toGray();
-        Mat& toBGR();
-        Mat& toHSV();
+        // the colorspace, like the pixels, goes along with copies and moves
+        Mat() = default;
+        Mat(const Mat&) = default;
+        Mat(Mat&&) = default;
+        Mat& operator = (const Mat&) = default;
+        Mat& operator = (Mat&&) = default;
+
+        void toGray(Mat& dst) const;
+        void toBGR(Mat& dst) const;
+        void toHSV(Mat& dst) const;
+        void to3ChannelGray(Mat& dst, colorspace_t c) const;
+
+        // The general form of the conversions above, to any colorspace, optionally as 3 channel gray
+        void toColorspace(Mat& dst, colorspace_t c, bool gray = false) const;
+
+        Mat toGray() const &;
+        Mat toBGR() const &;
+        Mat toHSV() const &;
+        Mat to3ChannelGray(colorspace_t c) const &;
+
+        Mat toGray() &&;
+        Mat toBGR() &&;
+        Mat toHSV() &&;
+        Mat to3ChannelGray(colorspace_t c) &&;
+
         Mat& operator = (const cv::Mat& m);
+        Mat& operator = (cv::Mat&& m);
         void setColorspace( colorspace_t c);
-        colorspace_t getColorspace() { return colorspace; }
+        colorspace_t getColorspace() const { return colorspace; }
 
-        Mat& to3ChannelGray(colorspace_t c);
+        void enableCache(size_t max_bytes = DEFAULT_CACHE_BYTES);
+        void disableCache();
+        bool cacheEnabled() const { return (bool)cache; }
+        // Our pixels were written to, drop whatever was derived from them
+        void markModified();
+        CacheStats cacheStats() const;
 
     protected :
         colorspace_t colorspace = UNKNOWN;
+        std::shared_ptr<ConversionCache> cache;
+
+        // The value flavour of toColorspace, through the cache when there is one
+        Mat converted(colorspace_t c, bool gray) const;
+        // The same for a temporary, in place when the buffer is ours alone
+        Mat movedConverted(colorspace_t c, bool gray);
+        // The tag that goes with pixels m assigned to us
+        void retagFor(const cv::Mat& m);
+
+};
+
+// How a conversion is carried out. Each one is either a single direct kernel, or a short chain of
+// kernels run tile by tile through a small scratch buffer, so none takes more than one full pass
+// over the image (see getConversionStats).
+struct ConversionPlan
+{
+    colorspace_t from;
+    colorspace_t to;
+    bool gray;        // to a 3 channel gray rendition, see to3ChannelGray
+    const char* path; // e.g. "HSV>BGR>GRAY", nullptr when there is no such conversion
+    int kernels[2];   // internal kernel ids, the first stages of them are used
+    int stages;       // kernels chained on each tile
+    int out_type;
+};
 
+// Overrides the global ParallelConfig for the calls made by this thread while in scope, e.g.
+//     {
+//         cspace::ParallelScope serial(cspace::ParallelConfig(32, 1));
+//         frame.toHSV(hsv);
+//     }
+class ParallelScope
+{
+    public :
+        ParallelScope(const ParallelConfig& cfg);
+        ~ParallelScope();
+        ParallelScope(const ParallelScope&) = delete;
+        ParallelScope& operator = (const ParallelScope&) = delete;
+
+    private :
+        ParallelConfig cfg;
+        const ParallelConfig* prev;
 };
+
+// Overrides the allocator outputs are created with (see setOutputAllocator) for the calls made by
+// this thread while in scope, nullptr being OpenCV's own, e.g. in each stage of a pipeline
+//     cspace::AllocatorScope pooled(&pool);
+class AllocatorScope
+{
+    public :
+        AllocatorScope(cv::MatAllocator* allocator);
+        ~AllocatorScope();
+        AllocatorScope(const AllocatorScope&) = delete;
+        AllocatorScope& operator = (const AllocatorScope&) = delete;
+
+    private :
+        cv::MatAllocator* allocator;
+        const AllocatorScope* prev;
+
+        friend cv::MatAllocator* getOutputAllocator();
+};
+
 /*******************************************************************************
 * Function prototypes
 *******************************************************************************/
 
-Mat& highlightOverBg(Mat bg, Mat hl);
-Mat& highlightOverBg(Mat bg, std::vector<Mat> hls);
-Mat &highlightOverBg(Mat bg, std::list<Mat> hls);
+// The cache counters summed over every image, bytes and max_bytes over those alive
+CacheStats getCacheStats();
+void resetCacheStats();
+
+// Which kernels a conversion from -> to is done with
+ConversionPlan planConversion(colorspace_t from, colorspace_t to, bool gray = false);
+
+ConversionStats getConversionStats();
+void resetConversionStats();
+
+// The configuration used by calls outside of any ParallelScope
+void setParallelConfig(const ParallelConfig& cfg);
+// The configuration in effect for this thread
+ParallelConfig getParallelConfig();
+
+// The allocator the outputs of the conversions and highlights are created with outside of any
+// AllocatorScope, e.g. a PoolAllocator (pool_allocator.h); nullptr, the default, is OpenCV's own.
+// It is only used when a buffer is allocated, a dst of the right size and type is written as it is.
+// The allocator must outlive the matrices allocated with it.
+void setOutputAllocator(cv::MatAllocator* allocator);
+// The allocator in effect for this thread
+cv::MatAllocator* getOutputAllocator();
+
+// Gray the background and tint every pixel where a highlight mask is > 127.
+// The output is BGR. With several masks each gets its own hue, and the last mask wins.
+void highlightOverBg(const Mat& bg, const Mat& hl, Mat& dst);
+void highlightOverBg(const Mat& bg, const cv::Mat* const* hls, int num_hls, Mat& dst);
 
+Mat highlightOverBg(const Mat& bg, const Mat& hl);
+
+// What a range of masks is handed on as, cv::Mat unless specialized (see packed_mask.h)
+template <typename T>
+struct MaskElement
+{
+    typedef cv::Mat type;
+};
+
+// Any range of masks will do (vector, list, deque...), they are all read in a single pass
+template <typename MaskRange>
+void highlightOverBg(const Mat& bg, const MaskRange& hls, Mat& dst)
+{
+    typedef typename std::decay<decltype(*std::begin(hls))>::type element_t;
+    const typename MaskElement<element_t>::type* masks[MAX_HIGHLIGHTS];
+    int num_hls = 0;
+    for (const auto& hl : hls)
+    {
+        if (num_hls == MAX_HIGHLIGHTS)
+        {
+            throw std::runtime_error("color depth insufficient for visualization");
+        }
+        masks[num_hls++] = &hl;
+    }
+    highlightOverBg(bg, masks, num_hls, dst);
+}
+
+template <typename MaskRange>
+Mat highlightOverBg(const Mat& bg, const MaskRange& hls)
+{
+    Mat out;
+    highlightOverBg(bg, hls, out);
+    return out;
+}
+
+// Highlighting from a single label image (CV_16UC1 or CV_32SC1, as connectedComponents gives),
+// rather than a mask per highlight. Label l takes palette[l]; label 0, and labels the palette
+// doesn't cover, are left gray. There is no limit on the number of labels other than the palette.
+void highlightOverBg(const Mat& bg, const cv::Mat& labels, const palette_t& palette, Mat& dst);
+Mat highlightOverBg(const Mat& bg, const cv::Mat& labels, const palette_t& palette);
+
+// Colors for labels 1..num_labels, with the hues spread so that neighbouring labels stand apart
+palette_t makePalette(int num_labels);
+
+// A batch of frames of one size, each in its own colorspace, converted to c (to3ChannelGray's
+// rendition with gray) and written one after the other into blob, e.g. to feed batch inference.
+// Each tile of rows is converted and, planar, split into the channel planes while it is in cache,
+// so every frame is read once and the blob written once. Frames and tiles are spread over the
+// threads as the ParallelConfig allows. blob is reused when it has the size already.
+// Throws, before anything is written, on an empty batch, frames of different sizes, or frames whose
+// conversions give different types.
+void toBlob(const Mat* const* frames, int num_frames, colorspace_t c, blob_layout_t layout,
+            cv::Mat& blob, bool gray = false);
+
+// Any range of cspace::Mat will do
+template <typename FrameRange>
+void toBlob(const FrameRange& frames, colorspace_t c, blob_layout_t layout, cv::Mat& blob,
+            bool gray = false)
+{
+    std::vector<const Mat*> ptrs;
+    for (const auto& f : frames)
+    {
+        ptrs.push_back(&f);
+    }
+    toBlob(ptrs.data(), (int)ptrs.size(), c, layout, blob, gray);
+}
 
 }
 
@@ -0,0 +1,126 @@
+/******************************************************************************/
+/*!
+ * @file  color_matrix_batch.cpp
+ * @brief Batches of frames converted straight into a planar or interleaved
+ *        4 dimensional blob
+ *
+ * @author Cathal Harte <cathal.harte@protonmail.com>
+ */
+
+/*******************************************************************************
+* Includes
+******************************************************************************/
+
+#include "color_matrix_kernels.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+namespace cspace
+{
+
+/*******************************************************************************
+* Functions
+*******************************************************************************/
+
+// blob.create(), with the output allocator in effect, unless it is already the size asked for
+static void createBlob(cv::Mat &blob, const int *sizes)
+{
+    bool allocates = !(blob.data && blob.dims == 4 && blob.type() == CV_8UC1 && blob.isContinuous());
+    for (int d = 0; d < 4 && !allocates; d++)
+    {
+        allocates = blob.size[d] != sizes[d];
+    }
+    if (!allocates)
+    {
+        return;
+    }
+    blob.release();
+    blob.allocator = getOutputAllocator();
+    blob.create(4, sizes, CV_8UC1);
+    INSTRUMENT_ALLOC(blob.total());
+}
+
+// The stripes are cut over the rows of all the frames end to end, so that a batch of small frames
+// spreads over the threads as well as one large frame does. Interleaved, or with a single channel,
+// each tile is converted straight into the blob; planar, it goes through a scratch tile that
+// cv::split then de-interleaves into the planes while it is still in cache.
+void toBlob(const Mat *const *frames, int num_frames, colorspace_t c, blob_layout_t layout,
+            cv::Mat &blob, bool gray)
+{
+    INSTRUMENT_SCOPE("cspace::toBlob");
+    if (num_frames < 1)
+    {
+        throw std::runtime_error("a batch has a frame at least");
+    }
+
+    const int rows = frames[0]->rows;
+    const int cols = frames[0]->cols;
+    std::vector<ConversionPlan> plans(num_frames);
+    for (int i = 0; i < num_frames; i++)
+    {
+        if (frames[i]->rows != rows || frames[i]->cols != cols)
+        {
+            throw std::runtime_error("the frames of a batch are of one size");
+        }
+        plans[i] = planConversion(frames[i]->getColorspace(), c, gray);
+        if (!plans[i].stages)
+        {
+            throw std::runtime_error("colorspace not implemented");
+        }
+        if (plans[i].out_type != plans[0].out_type)
+        {
+            throw std::runtime_error("the frames of a batch convert to one type");
+        }
+    }
+
+    const int out_type = plans[0].out_type;
+    const int channels = CV_MAT_CN(out_type);
+    const bool planar = layout == BLOB_NCHW && channels > 1;
+    assert(("The conversions give at most 4 channels", channels <= 4));
+    int sizes[4] = {num_frames, channels, rows, cols};
+    if (layout == BLOB_NHWC)
+    {
+        sizes[1] = rows;
+        sizes[2] = cols;
+        sizes[3] = channels;
+    }
+    createBlob(blob, sizes);
+
+    const size_t plane_bytes = (size_t)rows * cols;
+    const size_t frame_bytes = plane_bytes * channels;
+
+    forEachStripe(num_frames * rows, [&](const cv::Range &r) {
+        static thread_local cv::Mat tile_out;
+        static thread_local cv::Mat tile_scratch;
+        for (int g = r.start; g < r.end;)
+        {
+            const int i = g / rows;
+            const int y = g % rows;
+            const int n = std::min(std::min(plan_tile_rows, rows - y), r.end - g);
+            uchar *frame_data = blob.data + frame_bytes * i;
+
+            cv::Mat src = frames[i]->rowRange(y, y + n);
+            if (!planar)
+            {
+                cv::Mat dst(n, cols, out_type, frame_data + (size_t)y * cols * channels);
+                runPlanTile(plans[i], src, dst, tile_scratch);
+            }
+            else
+            {
+                cv::Mat interleaved = scratchRows(tile_out, n, cols, out_type);
+                runPlanTile(plans[i], src, interleaved, tile_scratch);
+
+                cv::Mat planes[4];
+                for (int k = 0; k < channels; k++)
+                {
+                    planes[k] = cv::Mat(n, cols, CV_8UC1, frame_data + plane_bytes * k + (size_t)y * cols);
+                }
+                cv::split(interleaved, planes);
+            }
+            g += n;
+        }
+    });
+}
+
+} // namespace cspace
@@ -0,0 +1,672 @@
+/**
+* \file color_matrix_bench.cpp
+*
+* \brief color_matrix benchmarks
+*
+* \author Cathal Harte  <cathal.harte@protonmail.com>
+*/
+
+/*******************************************************************************
+* Includes
+*******************************************************************************/
+
+#include <benchmark/benchmark.h>
+#include <color_matrix.h>
+#include <typed_color_matrix.h>
+#include <packed_mask.h>
+#include <planar_mat.h>
+#include <pool_allocator.h>
+#include <tile_stream.h>
+#include <opencv2/opencv.hpp>
+#include <cstdio>
+#include <fstream>
+namespace
+{
+
+/*******************************************************************************
+* Definitions and types
+*******************************************************************************/
+
+/*******************************************************************************
+* Local Function prototypes
+*******************************************************************************/
+
+/*******************************************************************************
+* Data
+*******************************************************************************/
+
+/*******************************************************************************
+* Functions
+*******************************************************************************/
+
+// Synthetic background and a mask covering roughly a quarter of it, so no image files are needed
+void makeFrame(int width, int height, cspace::Mat &bg, cspace::Mat &hl)
+{
+    bg.setColorspace(cspace::BGR);
+    bg = cv::Mat(height, width, CV_8UC3);
+    cv::randu(bg, cv::Scalar::all(0), cv::Scalar::all(256));
+
+    hl = cv::Mat(height, width, CV_8UC1, cv::Scalar(0));
+    cv::circle(hl, cv::Point(width / 2, height / 2), height / 3, cv::Scalar(255), cv::FILLED);
+}
+
+// n masks, each a disc at a different spot of the frame
+void makeMasks(const cspace::Mat &bg, int n, std::vector<cspace::Mat> &hls)
+{
+    cv::RNG rng(n);
+    hls.resize(n);
+    for (auto &hl : hls)
+    {
+        hl = cv::Mat(bg.size(), CV_8UC1, cv::Scalar(0));
+        cv::Point centre(rng.uniform(0, bg.cols), rng.uniform(0, bg.rows));
+        cv::circle(hl, centre, bg.rows / 8, cv::Scalar(255), cv::FILLED);
+    }
+}
+
+// The highlight as it was done before the fused kernels: an iterator walk painting hue over an
+// HSV image
+void legacyTint(cspace::Mat &hsv, const cspace::Mat &hl, uchar hue)
+{
+    cv::MatConstIterator_<uchar> it_hl = hl.begin<uchar>();
+    cv::MatIterator_<cv::Vec3b> it_out = hsv.begin<cv::Vec3b>();
+    for (;
+         it_out != hsv.end<cv::Vec3b>();
+         std::advance(it_out, 1), std::advance(it_hl, 1))
+    {
+        if ((*it_hl) > 127)
+        {
+            (*it_out)[0] = hue;
+            (*it_out)[1] = 255;
+            (*it_out)[2] = 255;
+        }
+    }
+}
+
+// gray -> HSV, tint, then a full HSV -> BGR conversion
+void legacyHighlightOverBg(const cspace::Mat &bg, const cspace::Mat &hl, cspace::Mat &hsv, cspace::Mat &out)
+{
+    bg.to3ChannelGray(hsv, cspace::HSV);
+    legacyTint(hsv, hl, 100);
+    hsv.toBGR(out);
+}
+
+// as above, with one full sweep of the image per mask
+void legacyHighlightOverBg(const cspace::Mat &bg, const std::vector<cspace::Mat> &hls,
+                           cspace::Mat &hsv, cspace::Mat &out)
+{
+    bg.to3ChannelGray(hsv, cspace::HSV);
+    uchar hue_step = 255 / hls.size();
+    uchar hue = 0;
+    for (auto &hl : hls)
+    {
+        legacyTint(hsv, hl, hue += hue_step);
+    }
+    hsv.toBGR(out);
+}
+
+void BM_highlight_legacy(benchmark::State &state)
+{
+    cspace::Mat bg, hl, hsv, out;
+    makeFrame(state.range(0), state.range(1), bg, hl);
+
+    for (auto _ : state)
+    {
+        legacyHighlightOverBg(bg, hl, hsv, out);
+        benchmark::DoNotOptimize(out.data);
+    }
+    state.SetItemsProcessed(state.iterations() * bg.total());
+}
+
+void BM_highlight_fused(benchmark::State &state)
+{
+    cspace::Mat bg, hl, out;
+    makeFrame(state.range(0), state.range(1), bg, hl);
+
+    for (auto _ : state)
+    {
+        cspace::highlightOverBg(bg, hl, out);
+        benchmark::DoNotOptimize(out.data);
+    }
+    state.SetItemsProcessed(state.iterations() * bg.total());
+}
+
+void BM_multi_highlight_legacy(benchmark::State &state)
+{
+    cspace::Mat bg, hl, hsv, out;
+    std::vector<cspace::Mat> hls;
+    makeFrame(1920, 1080, bg, hl);
+    makeMasks(bg, state.range(0), hls);
+
+    for (auto _ : state)
+    {
+        legacyHighlightOverBg(bg, hls, hsv, out);
+        benchmark::DoNotOptimize(out.data);
+    }
+    state.SetItemsProcessed(state.iterations() * bg.total());
+}
+
+void BM_multi_highlight_single_pass(benchmark::State &state)
+{
+    cspace::Mat bg, hl, out;
+    std::vector<cspace::Mat> hls;
+    makeFrame(1920, 1080, bg, hl);
+    makeMasks(bg, state.range(0), hls);
+
+    for (auto _ : state)
+    {
+        cspace::highlightOverBg(bg, hls, out);
+        benchmark::DoNotOptimize(out.data);
+    }
+    state.SetItemsProcessed(state.iterations() * bg.total());
+}
+
+// Scaling over threads of the striped kernels, range(0) is max_threads
+void BM_threads_highlight_many(benchmark::State &state)
+{
+    cspace::Mat bg, hl, out;
+    std::vector<cspace::Mat> hls;
+    makeFrame(1920, 1080, bg, hl);
+    makeMasks(bg, 20, hls);
+
+    cspace::ParallelScope scope(cspace::ParallelConfig(16, state.range(0)));
+    for (auto _ : state)
+    {
+        cspace::highlightOverBg(bg, hls, out);
+        benchmark::DoNotOptimize(out.data);
+    }
+    state.SetItemsProcessed(state.iterations() * bg.total());
+}
+
+void BM_threads_to_hsv(benchmark::State &state)
+{
+    cspace::Mat bg, hl, out;
+    makeFrame(1920, 1080, bg, hl);
+
+    cspace::ParallelScope scope(cspace::ParallelConfig(16, state.range(0)));
+    for (auto _ : state)
+    {
+        bg.toHSV(out);
+        benchmark::DoNotOptimize(out.data);
+    }
+    state.SetItemsProcessed(state.iterations() * bg.total());
+}
+
+// Runtime tagged against compile time typed conversion, on small tiles where the per call
+// dispatch is most visible
+void BM_runtime_to_gray3(benchmark::State &state)
+{
+    cspace::Mat bg, hl, out;
+    makeFrame(state.range(0), state.range(0), bg, hl);
+
+    for (auto _ : state)
+    {
+        bg.to3ChannelGray(out, cspace::HSV);
+        benchmark::DoNotOptimize(out.data);
+    }
+}
+
+void BM_typed_to_gray3(benchmark::State &state)
+{
+    cspace::Mat bg, hl;
+    makeFrame(state.range(0), state.range(0), bg, hl);
+    cspace::BgrMat typed_bg = cspace::BgrMat::fromRuntime(bg);
+    cspace::HsvMat out;
+
+    for (auto _ : state)
+    {
+        typed_bg.to3ChannelGray(out);
+        benchmark::DoNotOptimize(out.data);
+    }
+}
+
+// A frame read by several steps of a graph, each asking for its gray and HSV renditions; the
+// counters show how many of the conversions were redundant
+void BM_graph_conversions(benchmark::State &state)
+{
+    cspace::Mat bg, hl;
+    makeFrame(1920, 1080, bg, hl);
+    if (state.range(0))
+    {
+        bg.enableCache();
+    }
+
+    for (auto _ : state)
+    {
+        bg.markModified(); // a new frame
+        for (int step = 0; step < 4; step++)
+        {
+            benchmark::DoNotOptimize(bg.toGray().data);
+            benchmark::DoNotOptimize(bg.toHSV().data);
+        }
+    }
+
+    cspace::CacheStats stats = bg.cacheStats();
+    state.counters["hits"] = stats.hits;
+    state.counters["misses"] = stats.misses;
+}
+
+// A fresh frame each iteration converted to HSV, either copied out or converted in place
+void BM_frame_to_hsv(benchmark::State &state)
+{
+    cspace::Mat bg, hl;
+    makeFrame(1920, 1080, bg, hl);
+
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+        cspace::Mat frame;
+        frame = bg.clone();
+        frame.setColorspace(cspace::BGR);
+        state.ResumeTiming();
+
+        cspace::Mat hsv = state.range(0) ? std::move(frame).toHSV() : frame.toHSV();
+        benchmark::DoNotOptimize(hsv.data);
+    }
+}
+
+// The same masks bit packed, with the bytes they hold reported
+void BM_multi_highlight_packed(benchmark::State &state)
+{
+    cspace::Mat bg, hl, out;
+    std::vector<cspace::Mat> hls;
+    makeFrame(1920, 1080, bg, hl);
+    makeMasks(bg, state.range(0), hls);
+
+    std::vector<cspace::PackedMask> packed;
+    size_t bytes = 0;
+    for (auto &m : hls)
+    {
+        packed.push_back(cspace::PackedMask(m));
+        bytes += packed.back().bits().total();
+    }
+
+    for (auto _ : state)
+    {
+        cspace::highlightOverBg(bg, packed, out);
+        benchmark::DoNotOptimize(out.data);
+    }
+    state.SetItemsProcessed(state.iterations() * bg.total());
+    state.counters["mask_bytes"] = bytes;
+}
+
+// A new output each frame, as the value flavour gives, from the heap or from a PoolAllocator
+void BM_fresh_outputs(benchmark::State &state)
+{
+    cspace::Mat bg, hl;
+    makeFrame(1920, 1080, bg, hl);
+    cspace::PoolAllocator pool;
+    cspace::AllocatorScope scope(state.range(0) ? &pool : nullptr);
+
+    for (auto _ : state)
+    {
+        cspace::Mat hsv = bg.toHSV();
+        cspace::Mat out = cspace::highlightOverBg(hsv, hl);
+        benchmark::DoNotOptimize(out.data);
+    }
+    state.SetItemsProcessed(state.iterations() * bg.total());
+    uint64_t misses = 0;
+    for (auto &s : pool.stats().sizes)
+    {
+        misses += s.misses;
+    }
+    state.counters["pool_misses"] = misses;
+}
+
+// A batch of 1080p frames, half BGR and half RGB, to a planar HSV blob: converted, split and
+// copied frame by frame, against toBlob. range(0) is the batch size.
+void BM_batch_legacy(benchmark::State &state)
+{
+    cspace::Mat bg, hl;
+    makeFrame(1920, 1080, bg, hl);
+    std::vector<cspace::Mat> frames(state.range(0));
+    for (size_t i = 0; i < frames.size(); i++)
+    {
+        bg.toColorspace(frames[i], i % 2 ? cspace::RGB : cspace::BGR);
+    }
+    int sizes[4] = {(int)frames.size(), 3, bg.rows, bg.cols};
+    cv::Mat blob(4, sizes, CV_8UC1);
+
+    for (auto _ : state)
+    {
+        for (size_t i = 0; i < frames.size(); i++)
+        {
+            cspace::Mat hsv = frames[i].toHSV();
+            std::vector<cv::Mat> planes;
+            cv::split(hsv, planes);
+            for (int k = 0; k < 3; k++)
+            {
+                planes[k].copyTo(cv::Mat(bg.rows, bg.cols, CV_8UC1, blob.ptr((int)i, k)));
+            }
+        }
+        benchmark::DoNotOptimize(blob.data);
+    }
+    state.SetItemsProcessed(state.iterations() * frames.size() * bg.total());
+}
+
+void BM_batch_to_blob(benchmark::State &state)
+{
+    cspace::Mat bg, hl;
+    makeFrame(1920, 1080, bg, hl);
+    std::vector<cspace::Mat> frames(state.range(0));
+    for (size_t i = 0; i < frames.size(); i++)
+    {
+        bg.toColorspace(frames[i], i % 2 ? cspace::RGB : cspace::BGR);
+    }
+    cv::Mat blob;
+
+    for (auto _ : state)
+    {
+        cspace::toBlob(frames, cspace::HSV, cspace::BLOB_NCHW, blob);
+        benchmark::DoNotOptimize(blob.data);
+    }
+    state.SetItemsProcessed(state.iterations() * frames.size() * bg.total());
+}
+
+// Per channel work on a 1080p HSV frame, the mean of V and a hue threshold: split out of the
+// interleaved frame, against the view of a PlanarMat's plane
+void BM_hsv_channel_split(benchmark::State &state)
+{
+    cspace::Mat bg, hl;
+    makeFrame(1920, 1080, bg, hl);
+    cspace::Mat hsv = bg.toHSV();
+    cv::Mat mask;
+
+    for (auto _ : state)
+    {
+        std::vector<cv::Mat> planes;
+        cv::split(hsv, planes);
+        benchmark::DoNotOptimize(cv::mean(planes[2])[0]);
+        cv::inRange(planes[0], 20, 40, mask);
+        benchmark::DoNotOptimize(mask.data);
+    }
+    state.SetItemsProcessed(state.iterations() * bg.total());
+}
+
+void BM_hsv_channel_planar(benchmark::State &state)
+{
+    cspace::Mat bg, hl;
+    makeFrame(1920, 1080, bg, hl);
+    cspace::PlanarMat hsv(bg.toHSV());
+    cv::Mat mask;
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(cv::mean(hsv.channel('V'))[0]);
+        cv::inRange(hsv.channel('H'), 20, 40, mask);
+        benchmark::DoNotOptimize(mask.data);
+    }
+    state.SetItemsProcessed(state.iterations() * bg.total());
+}
+
+// range(0) selects interleaved or planar input
+void BM_gray_from_layout(benchmark::State &state)
+{
+    cspace::Mat bg, hl, out;
+    makeFrame(1920, 1080, bg, hl);
+    cspace::PlanarMat planar(bg);
+
+    for (auto _ : state)
+    {
+        if (state.range(0))
+        {
+            planar.toGray(out);
+        }
+        else
+        {
+            bg.toGray(out);
+        }
+        benchmark::DoNotOptimize(out.data);
+    }
+    state.SetItemsProcessed(state.iterations() * bg.total());
+}
+
+// A 4K BGR frame in a raw file streamed to HSV in another, under budgets of range(0) MB, against
+// the whole frame converted in memory (range(0) 0). The counters show how long the work waited on
+// reads.
+void BM_stream_to_hsv(benchmark::State &state)
+{
+    cspace::Mat bg, hl, out;
+    makeFrame(3840, 2160, bg, hl);
+    const std::string in_path = "bm_stream_in.raw";
+    const std::string out_path = "bm_stream_out.raw";
+    std::ofstream(in_path, std::ios::binary).write((const char *)bg.data, bg.total() * bg.elemSize());
+
+    cspace::StreamConfig cfg;
+    cfg.memory_budget = (size_t)state.range(0) << 20;
+    cspace::StreamStats stats;
+    for (auto _ : state)
+    {
+        if (state.range(0))
+        {
+            cspace::MappedSource src(in_path, bg.size(), CV_8UC3);
+            cspace::MappedSink dst(out_path, bg.size(), CV_8UC3);
+            stats = cspace::streamConversion(src, cspace::BGR, dst, cspace::HSV, false, cfg);
+        }
+        else
+        {
+            bg.toHSV(out);
+            benchmark::DoNotOptimize(out.data);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * bg.total());
+    state.counters["tiles"] = (double)stats.tiles;
+    state.counters["read_wait_ms"] = stats.read_wait_ns / 1e6;
+    std::remove(in_path.c_str());
+    std::remove(out_path.c_str());
+}
+
+BENCHMARK(BM_highlight_legacy)->Args({640, 480})->Args({1920, 1080})->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_highlight_fused)->Args({640, 480})->Args({1920, 1080})->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_multi_highlight_legacy)->Arg(1)->Arg(8)->Arg(20)->Arg(50)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_multi_highlight_single_pass)->Arg(1)->Arg(8)->Arg(20)->Arg(50)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_multi_highlight_packed)->Arg(1)->Arg(8)->Arg(20)->Arg(50)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_runtime_to_gray3)->Arg(16)->Arg(64)->Arg(512);
+BENCHMARK(BM_typed_to_gray3)->Arg(16)->Arg(64)->Arg(512);
+BENCHMARK(BM_graph_conversions)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_frame_to_hsv)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_fresh_outputs)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_batch_legacy)->Arg(1)->Arg(8)->UseRealTime()->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_batch_to_blob)->Arg(1)->Arg(8)->UseRealTime()->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_hsv_channel_split)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_hsv_channel_planar)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_gray_from_layout)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_stream_to_hsv)->Arg(0)->Arg(4)->Arg(64)->UseRealTime()->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_threads_highlight_many)->Arg(1)->Arg(2)->Arg(4)->Arg(8)->UseRealTime()->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_threads_to_hsv)->Arg(1)->Arg(2)->Arg(4)->Arg(8)->UseRealTime()->Unit(benchmark::kMillisecond);
+
+/*******************************************************************************
+* The regression suite: every conversion and highlight at 640x480, 1080p and 4K
+*******************************************************************************/
+
+const int suite_sizes[][2] = {{640, 480}, {1920, 1080}, {3840, 2160}};
+
+// A synthetic frame in any colorspace, converted from the BGR one
+void makeFrameIn(int width, int height, cspace::colorspace_t c, cspace::Mat &src)
+{
+    cspace::Mat bg, hl;
+    makeFrame(width, height, bg, hl);
+    if (c == cspace::WHITE_ON_BLACK)
+    {
+        src = hl;
+        src.setColorspace(c);
+    }
+    else
+    {
+        bg.toColorspace(src, c);
+    }
+}
+
+// n labels, each a disc at a different spot of the frame, as connectedComponents would give
+void makeLabels(const cspace::Mat &bg, int n, cv::Mat &labels)
+{
+    cv::RNG rng(n);
+    labels = cv::Mat(bg.size(), CV_32SC1, cv::Scalar(0));
+    for (int l = 1; l <= n; l++)
+    {
+        cv::Point centre(rng.uniform(0, bg.cols), rng.uniform(0, bg.rows));
+        cv::circle(labels, centre, bg.rows / 8, cv::Scalar(l), cv::FILLED);
+    }
+}
+
+// args are from, to, gray, width, height; only the pairs planConversion has a plan for
+void conversionArgs(benchmark::internal::Benchmark *b)
+{
+    const cspace::colorspace_t froms[] = {cspace::BGR, cspace::RGB, cspace::HSV, cspace::GRAY,
+                                          cspace::WHITE_ON_BLACK};
+    const cspace::colorspace_t tos[] = {cspace::BGR, cspace::RGB, cspace::HSV, cspace::GRAY};
+    for (auto &size : suite_sizes)
+    {
+        for (int gray = 0; gray < 2; gray++)
+        {
+            for (auto from : froms)
+            {
+                for (auto to : tos)
+                {
+                    if (cspace::planConversion(from, to, gray).path)
+                    {
+                        b->Args({from, to, gray, size[0], size[1]});
+                    }
+                }
+            }
+        }
+    }
+}
+
+// args are the number of masks, width, height
+void maskArgs(benchmark::internal::Benchmark *b)
+{
+    for (auto &size : suite_sizes)
+    {
+        for (int n = 1; n <= 64; n *= 2)
+        {
+            b->Args({n, size[0], size[1]});
+        }
+    }
+}
+
+void sizeArgs(benchmark::internal::Benchmark *b)
+{
+    for (auto &size : suite_sizes)
+    {
+        b->Args({size[0], size[1]});
+    }
+}
+
+void BM_suite_convert(benchmark::State &state)
+{
+    cspace::colorspace_t from = (cspace::colorspace_t)state.range(0);
+    cspace::colorspace_t to = (cspace::colorspace_t)state.range(1);
+    bool gray = state.range(2);
+    cspace::Mat src, out;
+    makeFrameIn(state.range(3), state.range(4), from, src);
+
+    for (auto _ : state)
+    {
+        src.toColorspace(out, to, gray);
+        benchmark::DoNotOptimize(out.data);
+    }
+    state.SetItemsProcessed(state.iterations() * src.total());
+    state.SetLabel(cspace::planConversion(from, to, gray).path);
+}
+
+void BM_suite_highlight_one(benchmark::State &state)
+{
+    cspace::Mat bg, hl, out;
+    makeFrame(state.range(0), state.range(1), bg, hl);
+
+    for (auto _ : state)
+    {
+        cspace::highlightOverBg(bg, hl, out);
+        benchmark::DoNotOptimize(out.data);
+    }
+    state.SetItemsProcessed(state.iterations() * bg.total());
+}
+
+// the value flavour, a new output each call
+void BM_suite_highlight_one_value(benchmark::State &state)
+{
+    cspace::Mat bg, hl;
+    makeFrame(state.range(0), state.range(1), bg, hl);
+
+    for (auto _ : state)
+    {
+        cspace::Mat out = cspace::highlightOverBg(bg, hl);
+        benchmark::DoNotOptimize(out.data);
+    }
+    state.SetItemsProcessed(state.iterations() * bg.total());
+}
+
+void BM_suite_highlight_one_packed(benchmark::State &state)
+{
+    cspace::Mat bg, hl, out;
+    makeFrame(state.range(0), state.range(1), bg, hl);
+    cspace::PackedMask packed(hl);
+
+    for (auto _ : state)
+    {
+        cspace::highlightOverBg(bg, packed, out);
+        benchmark::DoNotOptimize(out.data);
+    }
+    state.SetItemsProcessed(state.iterations() * bg.total());
+}
+
+void BM_suite_highlight_many(benchmark::State &state)
+{
+    cspace::Mat bg, hl, out;
+    std::vector<cspace::Mat> hls;
+    makeFrame(state.range(1), state.range(2), bg, hl);
+    makeMasks(bg, state.range(0), hls);
+
+    for (auto _ : state)
+    {
+        cspace::highlightOverBg(bg, hls, out);
+        benchmark::DoNotOptimize(out.data);
+    }
+    state.SetItemsProcessed(state.iterations() * bg.total());
+}
+
+void BM_suite_highlight_many_packed(benchmark::State &state)
+{
+    cspace::Mat bg, hl, out;
+    std::vector<cspace::Mat> hls;
+    makeFrame(state.range(1), state.range(2), bg, hl);
+    makeMasks(bg, state.range(0), hls);
+    std::vector<cspace::PackedMask> packed;
+    for (auto &m : hls)
+    {
+        packed.push_back(cspace::PackedMask(m));
+    }
+
+    for (auto _ : state)
+    {
+        cspace::highlightOverBg(bg, packed, out);
+        benchmark::DoNotOptimize(out.data);
+    }
+    state.SetItemsProcessed(state.iterations() * bg.total());
+}
+
+void BM_suite_highlight_labels(benchmark::State &state)
+{
+    cspace::Mat bg, hl, out;
+    cv::Mat labels;
+    makeFrame(state.range(1), state.range(2), bg, hl);
+    makeLabels(bg, state.range(0), labels);
+    cspace::palette_t palette = cspace::makePalette(state.range(0));
+
+    for (auto _ : state)
+    {
+        cspace::highlightOverBg(bg, labels, palette, out);
+        benchmark::DoNotOptimize(out.data);
+    }
+    state.SetItemsProcessed(state.iterations() * bg.total());
+}
+
+BENCHMARK(BM_suite_convert)->Apply(conversionArgs)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_suite_highlight_one)->Apply(sizeArgs)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_suite_highlight_one_value)->Apply(sizeArgs)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_suite_highlight_one_packed)->Apply(sizeArgs)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_suite_highlight_many)->Apply(maskArgs)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_suite_highlight_many_packed)->Apply(maskArgs)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_suite_highlight_labels)->Apply(maskArgs)->Unit(benchmark::kMillisecond);
+
+} // namespace
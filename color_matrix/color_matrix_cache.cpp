@@ -0,0 +1,233 @@
+/******************************************************************************/
+/*!
+ * @file  color_matrix_cache.cpp
+ * @brief Memoized conversions of a cspace::Mat
+ *
+ * @author Cathal Harte <cathal.harte@protonmail.com>
+ */
+
+/*******************************************************************************
+* Includes
+******************************************************************************/
+
+#include "color_matrix.h"
+#include "color_matrix_kernels.h"
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+namespace cspace
+{
+
+/*******************************************************************************
+* Types
+*******************************************************************************/
+
+// What has been derived from one set of pixels. The pixels are recognised by their address, size,
+// type and colorspace, so that anything which reallocates them behind our back (cv::Mat::create,
+// the cv::Mat assignments...) is noticed even without going through Mat::operator=.
+struct ConversionCache
+{
+    struct Entry
+    {
+        colorspace_t to;
+        bool gray;
+        Mat mat;
+        size_t bytes;
+        uint64_t last_use;
+    };
+
+    ConversionCache(size_t max_bytes) : max_bytes(max_bytes) {}
+    ~ConversionCache();
+
+    // Drops every entry, the lock is held
+    void clearLocked();
+    void dropLocked(size_t i);
+    // Makes sure the entries were derived from src, the lock is held
+    void validateLocked(const Mat &src);
+
+    std::mutex lock;
+    std::vector<Entry> entries;
+    size_t max_bytes;
+    CacheStats stats;
+    uint64_t tick = 0;
+
+    const uchar *src_data = nullptr;
+    cv::Size src_size;
+    int src_type = -1;
+    colorspace_t src_colorspace = UNKNOWN;
+};
+
+/*******************************************************************************
+* Data
+*******************************************************************************/
+
+static std::atomic<uint64_t> total_hits(0);
+static std::atomic<uint64_t> total_misses(0);
+static std::atomic<uint64_t> total_evictions(0);
+static std::atomic<size_t> total_bytes(0);
+static std::atomic<size_t> total_max_bytes(0);
+
+/*******************************************************************************
+* Classes
+*******************************************************************************/
+
+ConversionCache::~ConversionCache()
+{
+    total_bytes -= stats.bytes;
+    total_max_bytes -= max_bytes;
+}
+
+void ConversionCache::dropLocked(size_t i)
+{
+    stats.bytes -= entries[i].bytes;
+    total_bytes -= entries[i].bytes;
+    entries.erase(entries.begin() + i);
+}
+
+void ConversionCache::clearLocked()
+{
+    total_bytes -= stats.bytes;
+    stats.bytes = 0;
+    entries.clear();
+}
+
+void ConversionCache::validateLocked(const Mat &src)
+{
+    if (src.data != src_data || src.size() != src_size || src.type() != src_type ||
+        src.getColorspace() != src_colorspace)
+    {
+        clearLocked();
+        src_data = src.data;
+        src_size = src.size();
+        src_type = src.type();
+        src_colorspace = src.getColorspace();
+    }
+}
+
+/*******************************************************************************
+* Functions
+*******************************************************************************/
+
+// The cache's buffers are never handed out: a caller reusing the result as a dst, as it would
+// with cvtColor, would otherwise write over the entry and every later hit would serve that
+static void copyOut(const Mat &from, Mat &to)
+{
+    createCounted(to, from.size(), from.type());
+    from.copyTo(to);
+    to.setColorspace(from.getColorspace());
+}
+
+void Mat::enableCache(size_t max_bytes)
+{
+    cache = std::make_shared<ConversionCache>(max_bytes);
+    cache->stats.max_bytes = max_bytes;
+    total_max_bytes += max_bytes;
+}
+
+void Mat::disableCache()
+{
+    cache.reset();
+}
+
+void Mat::markModified()
+{
+    if (cache)
+    {
+        std::lock_guard<std::mutex> guard(cache->lock);
+        cache->clearLocked();
+    }
+}
+
+CacheStats Mat::cacheStats() const
+{
+    if (!cache)
+    {
+        return CacheStats();
+    }
+    std::lock_guard<std::mutex> guard(cache->lock);
+    return cache->stats;
+}
+
+// The conversion runs under the lock, so that steps asking for the same representation at the
+// same time wait for the one conversion rather than each doing their own
+Mat Mat::converted(colorspace_t c, bool gray) const
+{
+    Mat out;
+    if (!cache)
+    {
+        toColorspace(out, c, gray);
+        return out;
+    }
+
+    std::lock_guard<std::mutex> guard(cache->lock);
+    ConversionCache &cc = *cache;
+    cc.validateLocked(*this);
+
+    for (ConversionCache::Entry &e : cc.entries)
+    {
+        if (e.to == c && e.gray == gray)
+        {
+            e.last_use = ++cc.tick;
+            cc.stats.hits++;
+            total_hits++;
+            copyOut(e.mat, out);
+            return out;
+        }
+    }
+
+    toColorspace(out, c, gray);
+    cc.stats.misses++;
+    total_misses++;
+
+    // make room by dropping the least recently used, what can never fit is not kept at all
+    size_t bytes = out.total() * out.elemSize();
+    if (bytes > cc.max_bytes)
+    {
+        return out;
+    }
+    while (cc.stats.bytes + bytes > cc.max_bytes)
+    {
+        size_t lru = 0;
+        for (size_t i = 1; i < cc.entries.size(); i++)
+        {
+            if (cc.entries[i].last_use < cc.entries[lru].last_use)
+            {
+                lru = i;
+            }
+        }
+        cc.dropLocked(lru);
+        cc.stats.evictions++;
+        total_evictions++;
+    }
+
+    // the entry's copy is OpenCV's own, it may outlive any pool the outputs are taken from
+    ConversionCache::Entry e = {c, gray, Mat(), bytes, ++cc.tick};
+    out.copyTo(e.mat);
+    e.mat.setColorspace(out.getColorspace());
+    cc.entries.push_back(e);
+    cc.stats.bytes += bytes;
+    total_bytes += bytes;
+    return out;
+}
+
+CacheStats getCacheStats()
+{
+    CacheStats s;
+    s.hits = total_hits;
+    s.misses = total_misses;
+    s.evictions = total_evictions;
+    s.bytes = total_bytes;
+    s.max_bytes = total_max_bytes;
+    return s;
+}
+
+void resetCacheStats()
+{
+    total_hits = 0;
+    total_misses = 0;
+    total_evictions = 0;
+}
+
+} // namespace cspace
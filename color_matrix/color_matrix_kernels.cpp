@@ -0,0 +1,609 @@
+/******************************************************************************/
+/*!
+ * @file  color_matrix_kernels.cpp
+ * @brief Row kernels and row parallelism behind the color_matrix conversions
+ * 
+ * @author Cathal Harte <cathal.harte@protonmail.com>
+ */
+
+/*******************************************************************************
+* Includes
+******************************************************************************/
+
+#include "color_matrix_kernels.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <opencv2/core/hal/intrin.hpp>
+namespace cspace
+{
+
+/*******************************************************************************
+* Data
+*******************************************************************************/
+
+// The global configuration is set from any thread, so it is kept in atomics
+static std::atomic<int> global_grain_rows(ParallelConfig().grain_rows);
+static std::atomic<int> global_max_threads(ParallelConfig().max_threads);
+
+// The configuration of the innermost ParallelScope on this thread, if any
+static thread_local const ParallelConfig *scoped_config = nullptr;
+
+static std::atomic<cv::MatAllocator *> global_allocator(nullptr);
+
+// The innermost AllocatorScope on this thread, if any
+static thread_local const AllocatorScope *scoped_allocator = nullptr;
+
+/*******************************************************************************
+* Classes
+*******************************************************************************/
+
+ParallelScope::ParallelScope(const ParallelConfig &cfg) : cfg(cfg), prev(scoped_config)
+{
+    scoped_config = &this->cfg;
+}
+
+ParallelScope::~ParallelScope()
+{
+    scoped_config = prev;
+}
+
+AllocatorScope::AllocatorScope(cv::MatAllocator *allocator) : allocator(allocator), prev(scoped_allocator)
+{
+    scoped_allocator = this;
+}
+
+AllocatorScope::~AllocatorScope()
+{
+    scoped_allocator = prev;
+}
+
+/*******************************************************************************
+* Functions
+*******************************************************************************/
+
+void setParallelConfig(const ParallelConfig &cfg)
+{
+    global_grain_rows = cfg.grain_rows;
+    global_max_threads = cfg.max_threads;
+}
+
+ParallelConfig getParallelConfig()
+{
+    if (scoped_config)
+    {
+        return *scoped_config;
+    }
+
+    ParallelConfig cfg;
+    cfg.grain_rows = global_grain_rows;
+    cfg.max_threads = global_max_threads;
+    return cfg;
+}
+
+void setOutputAllocator(cv::MatAllocator *allocator)
+{
+    global_allocator = allocator;
+}
+
+cv::MatAllocator *getOutputAllocator()
+{
+    if (scoped_allocator)
+    {
+        return scoped_allocator->allocator;
+    }
+    return global_allocator;
+}
+
+int numStripes(int rows)
+{
+    ParallelConfig cfg = getParallelConfig();
+
+    int grain = std::max(1, cfg.grain_rows);
+    int threads = cfg.max_threads > 0 ? cfg.max_threads : cv::getNumThreads();
+
+    return std::max(1, std::min((rows + grain - 1) / grain, threads));
+}
+
+cv::Mat scratchRows(cv::Mat &scratch, int rows, int cols, int type)
+{
+    if (scratch.type() != type || scratch.cols != cols || scratch.rows < rows)
+    {
+        scratch.create(std::max(rows, scratch.rows), cols, type);
+    }
+    return scratch.rowRange(0, rows);
+}
+
+#if CV_SIMD
+static inline cv::v_uint8 v_bgrToGray(const cv::v_uint8 &b, const cv::v_uint8 &g, const cv::v_uint8 &r)
+{
+    cv::v_uint16 b0, b1, g0, g1, r0, r1;
+    cv::v_expand(b, b0, b1);
+    cv::v_expand(g, g0, g1);
+    cv::v_expand(r, r0, r1);
+
+    const cv::v_uint16 cb = cv::vx_setall_u16(gray_b);
+    const cv::v_uint16 cg = cv::vx_setall_u16(gray_g);
+    const cv::v_uint16 cr = cv::vx_setall_u16(gray_r);
+    const cv::v_uint32 delta = cv::vx_setall_u32(1 << (gray_shift - 1));
+
+    cv::v_uint32 pb0, pb1, pg0, pg1, pr0, pr1;
+    cv::v_uint32 y[4];
+    cv::v_mul_expand(b0, cb, pb0, pb1);
+    cv::v_mul_expand(g0, cg, pg0, pg1);
+    cv::v_mul_expand(r0, cr, pr0, pr1);
+    y[0] = (pb0 + pg0 + pr0 + delta) >> gray_shift;
+    y[1] = (pb1 + pg1 + pr1 + delta) >> gray_shift;
+    cv::v_mul_expand(b1, cb, pb0, pb1);
+    cv::v_mul_expand(g1, cg, pg0, pg1);
+    cv::v_mul_expand(r1, cr, pr0, pr1);
+    y[2] = (pb0 + pg0 + pr0 + delta) >> gray_shift;
+    y[3] = (pb1 + pg1 + pr1 + delta) >> gray_shift;
+
+    return cv::v_pack(cv::v_pack(y[0], y[1]), cv::v_pack(y[2], y[3]));
+}
+
+// Gray values of the pixels [x, x + nlanes) of a 3 channel (b_idx says where blue is, 0 for BGR,
+// 2 for RGB) or single channel row
+static inline cv::v_uint8 v_loadGray(const uchar *src, int src_cn, int b_idx, int x)
+{
+    if (src_cn == 1)
+    {
+        return cv::vx_load(src + x);
+    }
+
+    cv::v_uint8 c0, c1, c2;
+    cv::v_load_deinterleave(src + 3 * x, c0, c1, c2);
+    return b_idx ? v_bgrToGray(c2, c1, c0) : v_bgrToGray(c0, c1, c2);
+}
+#endif
+
+void highlightRow(const uchar *src, int src_cn, int b_idx, const uchar *mask,
+                         const cv::Vec3b &tint, uchar *out, int width)
+{
+    int x = 0;
+#if CV_SIMD
+    const int VECSZ = cv::v_uint8::nlanes;
+    const cv::v_uint8 thresh = cv::vx_setall_u8(127);
+    const cv::v_uint8 tb = cv::vx_setall_u8(tint[0]);
+    const cv::v_uint8 tg = cv::vx_setall_u8(tint[1]);
+    const cv::v_uint8 tr = cv::vx_setall_u8(tint[2]);
+
+    for (; x <= width - VECSZ; x += VECSZ)
+    {
+        cv::v_uint8 y = v_loadGray(src, src_cn, b_idx, x);
+        cv::v_uint8 m = cv::vx_load(mask + x) > thresh;
+        cv::v_store_interleave(out + 3 * x,
+                               cv::v_select(m, tb, y),
+                               cv::v_select(m, tg, y),
+                               cv::v_select(m, tr, y));
+    }
+    cv::vx_cleanup();
+#endif
+
+    for (; x < width; x++)
+    {
+        uchar *px_out = out + 3 * x;
+        if (mask[x] > 127)
+        {
+            px_out[0] = tint[0];
+            px_out[1] = tint[1];
+            px_out[2] = tint[2];
+        }
+        else
+        {
+            px_out[0] = px_out[1] = px_out[2] = grayAt(src, src_cn, b_idx, x);
+        }
+    }
+}
+
+void highlightManyRow(const uchar *src, int src_cn, int b_idx, const uchar *const *masks,
+                             int num_masks, const cv::Vec3b *lut, uchar *out, int width)
+{
+    int x = 0;
+#if CV_SIMD
+    const int VECSZ = cv::v_uint8::nlanes;
+    const cv::v_uint8 thresh = cv::vx_setall_u8(127);
+    const cv::v_uint8 zero = cv::vx_setzero_u8();
+    uchar idx_buf[CV_SIMD_WIDTH];
+
+    for (; x <= width - VECSZ; x += VECSZ)
+    {
+        cv::v_uint8 idx = zero;
+        for (int i = 0; i < num_masks; i++)
+        {
+            cv::v_uint8 m = cv::vx_load(masks[i] + x) > thresh;
+            idx = cv::v_select(m, cv::vx_setall_u8((uchar)(i + 1)), idx);
+        }
+
+        cv::v_uint8 y = v_loadGray(src, src_cn, b_idx, x);
+        cv::v_store_interleave(out + 3 * x, y, y, y);
+
+        // most pixels of a typical overlay are not highlighted, only touch the ones that are
+        if (cv::v_check_any(idx != zero))
+        {
+            cv::v_store(idx_buf, idx);
+            for (int k = 0; k < VECSZ; k++)
+            {
+                if (idx_buf[k])
+                {
+                    const cv::Vec3b &c = lut[idx_buf[k]];
+                    uchar *px_out = out + 3 * (x + k);
+                    px_out[0] = c[0];
+                    px_out[1] = c[1];
+                    px_out[2] = c[2];
+                }
+            }
+        }
+    }
+    cv::vx_cleanup();
+#endif
+
+    for (; x < width; x++)
+    {
+        int idx = 0;
+        for (int i = 0; i < num_masks; i++)
+        {
+            if (masks[i][x] > 127)
+            {
+                idx = i + 1;
+            }
+        }
+
+        uchar *px_out = out + 3 * x;
+        if (idx)
+        {
+            px_out[0] = lut[idx][0];
+            px_out[1] = lut[idx][1];
+            px_out[2] = lut[idx][2];
+        }
+        else
+        {
+            px_out[0] = px_out[1] = px_out[2] = grayAt(src, src_cn, b_idx, x);
+        }
+    }
+}
+
+#if CV_SIMD
+// Whether any of the labels [0, v_uint8::nlanes) is set
+static inline bool v_anyLabel(const ushort *labels)
+{
+    const int n = cv::v_uint16::nlanes;
+    cv::v_uint16 l = cv::vx_load(labels) | cv::vx_load(labels + n);
+    return cv::v_check_any(l != cv::vx_setzero_u16());
+}
+
+static inline bool v_anyLabel(const int *labels)
+{
+    const int n = cv::v_int32::nlanes;
+    cv::v_int32 l = cv::vx_load(labels) | cv::vx_load(labels + n) |
+                    cv::vx_load(labels + 2 * n) | cv::vx_load(labels + 3 * n);
+    return cv::v_check_any(l != cv::vx_setzero_s32());
+}
+#endif
+
+// The gray is written for the whole row, then the pixels with a label the palette covers are
+// looked up. For int labels a negative label wraps to a huge index, which the palette never covers.
+template <typename LabelT>
+static void highlightLabelsRowT(const uchar *src, int src_cn, int b_idx, const LabelT *labels,
+                               const cv::Vec3b *palette, size_t palette_size, uchar *out, int width)
+{
+    int x = 0;
+#if CV_SIMD
+    const int VECSZ = cv::v_uint8::nlanes;
+
+    for (; x <= width - VECSZ; x += VECSZ)
+    {
+        cv::v_uint8 y = v_loadGray(src, src_cn, b_idx, x);
+        cv::v_store_interleave(out + 3 * x, y, y, y);
+
+        if (v_anyLabel(labels + x))
+        {
+            for (int k = x; k < x + VECSZ; k++)
+            {
+                size_t l = static_cast<size_t>(labels[k]);
+                if (l && l < palette_size)
+                {
+                    uchar *px_out = out + 3 * k;
+                    px_out[0] = palette[l][0];
+                    px_out[1] = palette[l][1];
+                    px_out[2] = palette[l][2];
+                }
+            }
+        }
+    }
+    cv::vx_cleanup();
+#endif
+
+    for (; x < width; x++)
+    {
+        size_t l = static_cast<size_t>(labels[x]);
+        uchar *px_out = out + 3 * x;
+        if (l && l < palette_size)
+        {
+            px_out[0] = palette[l][0];
+            px_out[1] = palette[l][1];
+            px_out[2] = palette[l][2];
+        }
+        else
+        {
+            px_out[0] = px_out[1] = px_out[2] = grayAt(src, src_cn, b_idx, x);
+        }
+    }
+}
+
+
+void highlightLabelsRow(const uchar *src, int src_cn, int b_idx, const ushort *labels,
+                        const cv::Vec3b *palette, size_t palette_size, uchar *out, int width)
+{
+    highlightLabelsRowT(src, src_cn, b_idx, labels, palette, palette_size, out, width);
+}
+
+void highlightLabelsRow(const uchar *src, int src_cn, int b_idx, const int *labels,
+                        const cv::Vec3b *palette, size_t palette_size, uchar *out, int width)
+{
+    highlightLabelsRowT(src, src_cn, b_idx, labels, palette, palette_size, out, width);
+}
+
+// The 8 mask bytes each packed byte stands for, 0 or 255
+struct UnpackTable
+{
+    UnpackTable()
+    {
+        for (int b = 0; b < 256; b++)
+        {
+            for (int k = 0; k < 8; k++)
+            {
+                bytes[b][k] = (b >> k) & 1 ? 255 : 0;
+            }
+        }
+    }
+
+    uchar bytes[256][8];
+};
+
+static const UnpackTable unpack_table;
+
+void highlightPackedRow(const uchar *src, int src_cn, int b_idx, const uchar *const *bits,
+                        int num_masks, const cv::Vec3b *lut, uchar *out, int width)
+{
+    int x = 0;
+#if CV_SIMD
+    const int VECSZ = cv::v_uint8::nlanes;
+    const int PACKSZ = VECSZ / 8;
+    const cv::v_uint8 zero = cv::vx_setzero_u8();
+    uchar idx_buf[CV_SIMD_WIDTH];
+    uchar set_buf[CV_SIMD_WIDTH];
+
+    for (; x <= width - VECSZ; x += VECSZ)
+    {
+        // a whole vector of pixels is only VECSZ / 8 bytes per mask, so empty stretches of a
+        // mask are skipped without expanding them
+        cv::v_uint8 idx = zero;
+        bool any = false;
+        for (int i = 0; i < num_masks; i++)
+        {
+            const uchar *b = bits[i] + x / 8;
+            uchar set = 0;
+            for (int k = 0; k < PACKSZ; k++)
+            {
+                set |= b[k];
+            }
+            if (!set)
+            {
+                continue;
+            }
+
+            for (int k = 0; k < PACKSZ; k++)
+            {
+                memcpy(set_buf + 8 * k, unpack_table.bytes[b[k]], 8);
+            }
+            idx = cv::v_select(cv::vx_load(set_buf) != zero, cv::vx_setall_u8((uchar)(i + 1)), idx);
+            any = true;
+        }
+
+        cv::v_uint8 y = v_loadGray(src, src_cn, b_idx, x);
+        cv::v_store_interleave(out + 3 * x, y, y, y);
+
+        if (any)
+        {
+            cv::v_store(idx_buf, idx);
+            for (int k = 0; k < VECSZ; k++)
+            {
+                if (idx_buf[k])
+                {
+                    const cv::Vec3b &c = lut[idx_buf[k]];
+                    uchar *px_out = out + 3 * (x + k);
+                    px_out[0] = c[0];
+                    px_out[1] = c[1];
+                    px_out[2] = c[2];
+                }
+            }
+        }
+    }
+    cv::vx_cleanup();
+#endif
+
+    for (; x < width; x++)
+    {
+        int idx = 0;
+        for (int i = 0; i < num_masks; i++)
+        {
+            if ((bits[i][x >> 3] >> (x & 7)) & 1)
+            {
+                idx = i + 1;
+            }
+        }
+
+        uchar *px_out = out + 3 * x;
+        if (idx)
+        {
+            px_out[0] = lut[idx][0];
+            px_out[1] = lut[idx][1];
+            px_out[2] = lut[idx][2];
+        }
+        else
+        {
+            px_out[0] = px_out[1] = px_out[2] = grayAt(src, src_cn, b_idx, x);
+        }
+    }
+}
+
+// > 127 is exactly the sign bit of a byte, so a whole vector packs with one v_signmask
+void packRow(const uchar *mask, uchar *bits, int width)
+{
+    int x = 0;
+#if CV_SIMD
+    const int VECSZ = cv::v_uint8::nlanes;
+
+    for (; x <= width - VECSZ; x += VECSZ)
+    {
+        int64 m = cv::v_signmask(cv::vx_load(mask + x));
+        for (int k = 0; k < VECSZ / 8; k++)
+        {
+            bits[x / 8 + k] = (uchar)(m >> (8 * k));
+        }
+    }
+    cv::vx_cleanup();
+#endif
+
+    // x is a multiple of 8 here
+    for (; x < width; x += 8)
+    {
+        uchar b = 0;
+        for (int k = 0; k < 8 && x + k < width; k++)
+        {
+            b |= (mask[x + k] > 127) << k;
+        }
+        bits[x / 8] = b;
+    }
+}
+
+void unpackRow(const uchar *bits, uchar *mask, int width)
+{
+    int x = 0;
+    for (; x <= width - 8; x += 8)
+    {
+        memcpy(mask + x, unpack_table.bytes[bits[x / 8]], 8);
+    }
+    if (x < width)
+    {
+        memcpy(mask + x, unpack_table.bytes[bits[x / 8]], width - x);
+    }
+}
+
+void grayReplicateRow(const uchar *src, int src_cn, int b_idx, uchar *out, int width)
+{
+    int x = 0;
+#if CV_SIMD
+    const int VECSZ = cv::v_uint8::nlanes;
+
+    for (; x <= width - VECSZ; x += VECSZ)
+    {
+        cv::v_uint8 y = v_loadGray(src, src_cn, b_idx, x);
+        cv::v_store_interleave(out + 3 * x, y, y, y);
+    }
+    cv::vx_cleanup();
+#endif
+
+    for (; x < width; x++)
+    {
+        uchar *px_out = out + 3 * x;
+        px_out[0] = px_out[1] = px_out[2] = grayAt(src, src_cn, b_idx, x);
+    }
+}
+
+void grayHsvRow(const uchar *src, int src_cn, int b_idx, uchar *out, int width)
+{
+    int x = 0;
+#if CV_SIMD
+    const int VECSZ = cv::v_uint8::nlanes;
+    const cv::v_uint8 zero = cv::vx_setzero_u8();
+
+    for (; x <= width - VECSZ; x += VECSZ)
+    {
+        cv::v_store_interleave(out + 3 * x, zero, zero, v_loadGray(src, src_cn, b_idx, x));
+    }
+    cv::vx_cleanup();
+#endif
+
+    for (; x < width; x++)
+    {
+        uchar *px_out = out + 3 * x;
+        px_out[0] = 0;
+        px_out[1] = 0;
+        px_out[2] = grayAt(src, src_cn, b_idx, x);
+    }
+}
+
+void deinterleaveRow(const uchar *src, uchar *p0, uchar *p1, uchar *p2, int width)
+{
+    int x = 0;
+#if CV_SIMD
+    const int VECSZ = cv::v_uint8::nlanes;
+
+    for (; x <= width - VECSZ; x += VECSZ)
+    {
+        cv::v_uint8 c0, c1, c2;
+        cv::v_load_deinterleave(src + 3 * x, c0, c1, c2);
+        cv::v_store(p0 + x, c0);
+        cv::v_store(p1 + x, c1);
+        cv::v_store(p2 + x, c2);
+    }
+    cv::vx_cleanup();
+#endif
+
+    for (; x < width; x++)
+    {
+        const uchar *px = src + 3 * x;
+        p0[x] = px[0];
+        p1[x] = px[1];
+        p2[x] = px[2];
+    }
+}
+
+void interleaveRow(const uchar *p0, const uchar *p1, const uchar *p2, uchar *out, int width)
+{
+    int x = 0;
+#if CV_SIMD
+    const int VECSZ = cv::v_uint8::nlanes;
+
+    for (; x <= width - VECSZ; x += VECSZ)
+    {
+        cv::v_store_interleave(out + 3 * x, cv::vx_load(p0 + x), cv::vx_load(p1 + x), cv::vx_load(p2 + x));
+    }
+    cv::vx_cleanup();
+#endif
+
+    for (; x < width; x++)
+    {
+        uchar *px_out = out + 3 * x;
+        px_out[0] = p0[x];
+        px_out[1] = p1[x];
+        px_out[2] = p2[x];
+    }
+}
+
+// No deinterleaving to be done, the planes are loaded as they are
+void grayPlanesRow(const uchar *b, const uchar *g, const uchar *r, uchar *out, int width)
+{
+    int x = 0;
+#if CV_SIMD
+    const int VECSZ = cv::v_uint8::nlanes;
+
+    for (; x <= width - VECSZ; x += VECSZ)
+    {
+        cv::v_store(out + x, v_bgrToGray(cv::vx_load(b + x), cv::vx_load(g + x), cv::vx_load(r + x)));
+    }
+    cv::vx_cleanup();
+#endif
+
+    for (; x < width; x++)
+    {
+        out[x] = (uchar)((b[x] * gray_b + g[x] * gray_g + r[x] * gray_r + (1 << (gray_shift - 1))) >>
+                         gray_shift);
+    }
+}
+
+} // namespace cspace
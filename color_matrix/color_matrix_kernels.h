@@ -0,0 +1,138 @@
+/******************************************************************************/
+/*!
+ * @file  color_matrix_kernels.h
+ * @brief Row kernels and conversion plans behind the color_matrix conversions,
+ *        internal to the color_matrix module
+ * 
+ * @author Cathal Harte <cathal.harte@protonmail.com>
+ */
+#ifndef _COLOR_MATRIX_KERNELS_H
+#define _COLOR_MATRIX_KERNELS_H
+
+/*******************************************************************************
+* Includes
+******************************************************************************/
+
+#include "color_matrix.h"
+#include "color_matrix_rows.h"
+
+#include <instrument.h>
+#include <opencv2/core.hpp>
+
+/*! @addtogroup color_matrix
+ * @{
+ */
+
+namespace cspace
+{
+/*******************************************************************************
+* Definitions and types
+*******************************************************************************/
+
+/*******************************************************************************
+* Class prototypes
+*******************************************************************************/
+
+/*******************************************************************************
+* Function prototypes
+*******************************************************************************/
+
+// dst.create(), with the output allocator in effect, telling the instrumentation when it
+// allocates. cv::Mat::create() keeps the buffer when the size and type are already those asked for.
+inline void createCounted(cv::Mat &dst, cv::Size size, int type)
+{
+    bool allocates = !(dst.data && dst.dims <= 2 && dst.size() == size && dst.type() == type);
+    if (allocates)
+    {
+        // and not whichever allocator dst was last created with, which may be gone by now
+        dst.allocator = getOutputAllocator();
+    }
+    dst.create(size, type);
+    if (allocates)
+    {
+        INSTRUMENT_ALLOC(dst.total() * dst.elemSize());
+    }
+}
+
+static inline uchar grayAt(const uchar *src, int src_cn, int b_idx, int x)
+{
+    if (src_cn == 1)
+    {
+        return src[x];
+    }
+
+    const uchar *px = src + 3 * x;
+    return (uchar)((px[b_idx] * gray_b + px[1] * gray_g + px[2 - b_idx] * gray_r +
+                    (1 << (gray_shift - 1))) >> gray_shift);
+}
+
+// The row kernels all take a background row src which is either 3 channel (b_idx says where blue
+// is, 0 for BGR, 2 for RGB) or already gray, and write a BGR row.
+
+// Pixels where the mask is > 127 become the tint, all others become the gray value replicated
+void highlightRow(const uchar *src, int src_cn, int b_idx, const uchar *mask,
+                  const cv::Vec3b &tint, uchar *out, int width);
+
+// All the mask rows are read together and the index of the last mask that is set decides the
+// color, taken from lut (index 0, no mask set, is the gray value)
+void highlightManyRow(const uchar *src, int src_cn, int b_idx, const uchar *const *masks,
+                      int num_masks, const cv::Vec3b *lut, uchar *out, int width);
+
+// Label l takes palette[l], label 0 and labels beyond the palette are the gray value
+void highlightLabelsRow(const uchar *src, int src_cn, int b_idx, const ushort *labels,
+                        const cv::Vec3b *palette, size_t palette_size, uchar *out, int width);
+void highlightLabelsRow(const uchar *src, int src_cn, int b_idx, const int *labels,
+                        const cv::Vec3b *palette, size_t palette_size, uchar *out, int width);
+
+// The same as highlightManyRow, from bit packed mask rows (see PackedMask)
+void highlightPackedRow(const uchar *src, int src_cn, int b_idx, const uchar *const *bits,
+                        int num_masks, const cv::Vec3b *lut, uchar *out, int width);
+
+// Bit x of a packed row is mask[x] > 127, least significant bit first. Bits past width are cleared.
+void packRow(const uchar *mask, uchar *bits, int width);
+// Back to 0 / 255
+void unpackRow(const uchar *bits, uchar *mask, int width);
+
+// A 3 channel row to and from its three planes (see PlanarMat)
+void deinterleaveRow(const uchar *src, uchar *p0, uchar *p1, uchar *p2, int width);
+void interleaveRow(const uchar *p0, const uchar *p1, const uchar *p2, uchar *out, int width);
+
+// The gray value from the planes of a row, bit exact with cv::COLOR_BGR2GRAY
+void grayPlanesRow(const uchar *b, const uchar *g, const uchar *r, uchar *out, int width);
+
+// The kernels a ConversionPlan chains, each applied to a tile of rows
+typedef enum kernel
+{
+    K_NONE,
+    K_COPY,
+    K_BGR2GRAY,
+    K_RGB2GRAY,
+    K_BGR2HSV,
+    K_RGB2HSV,
+    K_HSV2BGR,
+    K_HSV2RGB,
+    K_SWAP_RB,     // BGR <-> RGB
+    K_GRAY2GRAY3,  // gray replicated over three channels
+    K_BGR2GRAY3,
+    K_RGB2GRAY3,
+    K_GRAY2HSV,    // analytic (0, 0, v)
+    K_BGR2GRAYHSV, // gray, as HSV
+    K_RGB2GRAYHSV
+} kernel_t;
+
+// Apply one kernel to a tile, dst is already sized to the kernel output
+void applyKernel(kernel_t k, const cv::Mat &src, cv::Mat &dst);
+
+// Execute a plan from src into dst, in a single pass over the image
+void runPlan(const ConversionPlan &plan, const cv::Mat &src, cv::Mat &dst);
+
+// The plan's kernels over a tile of rows into dst, of the right size and type already, chained
+// through the thread's scratch_rows when there are two, as runPlan does
+void runPlanTile(const ConversionPlan &plan, const cv::Mat &src, cv::Mat &dst, cv::Mat &scratch_rows);
+
+}
+
+/*! @}
+ */
+
+#endif  // _COLOR_MATRIX_KERNELS_H
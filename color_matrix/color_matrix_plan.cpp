@@ -0,0 +1,288 @@
+/******************************************************************************/
+/*!
+ * @file  color_matrix_plan.cpp
+ * @brief Conversion planner, picks the kernels a conversion between two
+ *        colorspaces is done with, and runs them in a single pass
+ * 
+ * @author Cathal Harte <cathal.harte@protonmail.com>
+ */
+
+/*******************************************************************************
+* Includes
+******************************************************************************/
+
+#include "color_matrix_kernels.h"
+
+#include <atomic>
+#include <opencv2/imgproc.hpp>
+namespace cspace
+{
+
+/*******************************************************************************
+* Data
+*******************************************************************************/
+
+static std::atomic<uint64_t> total_conversions(0);
+static std::atomic<uint64_t> total_rows(0);
+static std::atomic<uint64_t> total_image_rows(0);
+
+/*******************************************************************************
+* Functions
+*******************************************************************************/
+
+static ConversionPlan makePlan(colorspace_t from, colorspace_t to, bool gray,
+                               const char *path, kernel_t k0, kernel_t k1, int out_type)
+{
+    ConversionPlan plan;
+    plan.from = from;
+    plan.to = to;
+    plan.gray = gray;
+    plan.path = path;
+    plan.kernels[0] = k0;
+    plan.kernels[1] = k1;
+    plan.stages = (k0 != K_NONE) + (k1 != K_NONE);
+    plan.out_type = out_type;
+    return plan;
+}
+
+ConversionPlan planConversion(colorspace_t from, colorspace_t to, bool gray)
+{
+#define PLAN(path, k0, k1, type) return makePlan(from, to, gray, path, k0, k1, type)
+
+    if (gray)
+    {
+        switch (from)
+        {
+        case GRAY:
+        case WHITE_ON_BLACK:
+            if (to == BGR || to == RGB) PLAN("GRAY>GRAY3", K_GRAY2GRAY3, K_NONE, CV_8UC3);
+            if (to == HSV) PLAN("GRAY>HSV", K_GRAY2HSV, K_NONE, CV_8UC3);
+            break;
+        case BGR:
+            if (to == BGR || to == RGB) PLAN("BGR>GRAY3", K_BGR2GRAY3, K_NONE, CV_8UC3);
+            if (to == HSV) PLAN("BGR>GRAY>HSV (fused)", K_BGR2GRAYHSV, K_NONE, CV_8UC3);
+            break;
+        case RGB:
+            if (to == BGR || to == RGB) PLAN("RGB>GRAY3", K_RGB2GRAY3, K_NONE, CV_8UC3);
+            if (to == HSV) PLAN("RGB>GRAY>HSV (fused)", K_RGB2GRAYHSV, K_NONE, CV_8UC3);
+            break;
+        case HSV:
+            if (to == BGR || to == RGB) PLAN("HSV>BGR>GRAY3", K_HSV2BGR, K_BGR2GRAY3, CV_8UC3);
+            if (to == HSV) PLAN("HSV>BGR>GRAY>HSV", K_HSV2BGR, K_BGR2GRAYHSV, CV_8UC3);
+            break;
+        default:
+            break;
+        }
+    }
+    else
+    {
+        switch (from)
+        {
+        case GRAY:
+        case WHITE_ON_BLACK:
+            if (to == GRAY) PLAN("GRAY", K_COPY, K_NONE, CV_8UC1);
+            if (to == BGR || to == RGB) PLAN("GRAY>GRAY3", K_GRAY2GRAY3, K_NONE, CV_8UC3);
+            if (to == HSV) PLAN("GRAY>HSV (analytic)", K_GRAY2HSV, K_NONE, CV_8UC3);
+            break;
+        case BGR:
+            if (to == GRAY) PLAN("BGR>GRAY", K_BGR2GRAY, K_NONE, CV_8UC1);
+            if (to == BGR) PLAN("BGR", K_COPY, K_NONE, CV_8UC3);
+            if (to == RGB) PLAN("BGR>RGB", K_SWAP_RB, K_NONE, CV_8UC3);
+            if (to == HSV) PLAN("BGR>HSV", K_BGR2HSV, K_NONE, CV_8UC3);
+            break;
+        case RGB:
+            if (to == GRAY) PLAN("RGB>GRAY", K_RGB2GRAY, K_NONE, CV_8UC1);
+            if (to == BGR) PLAN("RGB>BGR", K_SWAP_RB, K_NONE, CV_8UC3);
+            if (to == RGB) PLAN("RGB", K_COPY, K_NONE, CV_8UC3);
+            if (to == HSV) PLAN("RGB>HSV", K_RGB2HSV, K_NONE, CV_8UC3);
+            break;
+        case HSV:
+            // there is no direct HSV -> GRAY in OpenCV, BGR is chained through the tile scratch
+            if (to == GRAY) PLAN("HSV>BGR>GRAY", K_HSV2BGR, K_BGR2GRAY, CV_8UC1);
+            if (to == BGR) PLAN("HSV>BGR", K_HSV2BGR, K_NONE, CV_8UC3);
+            if (to == RGB) PLAN("HSV>RGB", K_HSV2RGB, K_NONE, CV_8UC3);
+            if (to == HSV) PLAN("HSV", K_COPY, K_NONE, CV_8UC3);
+            break;
+        default:
+            break;
+        }
+    }
+
+    PLAN(nullptr, K_NONE, K_NONE, -1);
+#undef PLAN
+}
+
+// Row by row through one of the gray row kernels
+static void grayRows(const cv::Mat &src, cv::Mat &dst, int b_idx, bool hsv)
+{
+    for (int y = 0; y < src.rows; y++)
+    {
+        if (hsv)
+        {
+            grayHsvRow(src.ptr<uchar>(y), src.channels(), b_idx, dst.ptr<uchar>(y), src.cols);
+        }
+        else
+        {
+            grayReplicateRow(src.ptr<uchar>(y), src.channels(), b_idx, dst.ptr<uchar>(y), src.cols);
+        }
+    }
+}
+
+void applyKernel(kernel_t k, const cv::Mat &src, cv::Mat &dst)
+{
+    switch (k)
+    {
+    case K_COPY:
+        src.copyTo(dst);
+        break;
+    case K_BGR2GRAY:
+        cvtColor(src, dst, cv::COLOR_BGR2GRAY);
+        break;
+    case K_RGB2GRAY:
+        cvtColor(src, dst, cv::COLOR_RGB2GRAY);
+        break;
+    case K_BGR2HSV:
+        cvtColor(src, dst, cv::COLOR_BGR2HSV);
+        break;
+    case K_RGB2HSV:
+        cvtColor(src, dst, cv::COLOR_RGB2HSV);
+        break;
+    case K_HSV2BGR:
+        cvtColor(src, dst, cv::COLOR_HSV2BGR);
+        break;
+    case K_HSV2RGB:
+        cvtColor(src, dst, cv::COLOR_HSV2RGB);
+        break;
+    case K_SWAP_RB:
+        cvtColor(src, dst, cv::COLOR_RGB2BGR);
+        break;
+    case K_GRAY2GRAY3:
+    case K_BGR2GRAY3:
+        grayRows(src, dst, 0, false);
+        break;
+    case K_RGB2GRAY3:
+        grayRows(src, dst, 2, false);
+        break;
+    case K_GRAY2HSV:
+    case K_BGR2GRAYHSV:
+        grayRows(src, dst, 0, true);
+        break;
+    case K_RGB2GRAYHSV:
+        grayRows(src, dst, 2, true);
+        break;
+    default:
+        throw std::runtime_error("kernel not implemented");
+        break;
+    }
+}
+
+void runPlan(const ConversionPlan &plan, const cv::Mat &src_in, cv::Mat &dst)
+{
+    if (!plan.stages)
+    {
+        throw std::runtime_error("colorspace not implemented");
+    }
+
+    cv::Mat src = src_in; // keep the source alive should dst be the same matrix
+
+    // in place, dst keeps the buffer and each tile is copied aside to be read back from, the
+    // copy being small enough to stay in cache, rather than cloning the whole source
+    const bool in_place = src.data == dst.data && src.type() == plan.out_type;
+    if (in_place && plan.kernels[0] == K_COPY)
+    {
+        return; // already there
+    }
+
+    createCounted(dst, src.size(), plan.out_type);
+
+    const kernel_t k0 = (kernel_t)plan.kernels[0];
+    const kernel_t k1 = (kernel_t)plan.kernels[1];
+
+    // whether m is rows of the source or of dst, rather than of a scratch tile
+    auto inImage = [&](const cv::Mat &m) {
+        return (m.data >= src.datastart && m.data < src.dataend) ||
+               (m.data >= dst.datastart && m.data < dst.dataend);
+    };
+
+    forEachStripe(src.rows, [&](const cv::Range &r) {
+        uint64_t image_rows = 0;
+        auto sweep = [&](kernel_t k, const cv::Mat &in, cv::Mat &out) {
+            image_rows += inImage(in) ? in.rows : 0;
+            applyKernel(k, in, out);
+        };
+
+        if (plan.stages == 1 && !in_place)
+        {
+            cv::Mat dst_stripe = dst.rowRange(r);
+            sweep(k0, src.rowRange(r), dst_stripe);
+            total_image_rows += image_rows;
+            return;
+        }
+
+        // chained kernels meet in a scratch tile, which stays in cache between the two
+        static thread_local cv::Mat tile_in;
+        static thread_local cv::Mat tile_scratch;
+        for (int y = r.start; y < r.end; y += plan_tile_rows)
+        {
+            cv::Range tile(y, std::min(y + plan_tile_rows, r.end));
+            cv::Mat src_tile = src.rowRange(tile);
+            cv::Mat dst_tile = dst.rowRange(tile);
+            if (in_place)
+            {
+                cv::Mat in = scratchRows(tile_in, tile.size(), src.cols, src.type());
+                src_tile.copyTo(in);
+                image_rows += tile.size();
+                src_tile = in;
+            }
+
+            if (plan.stages == 1)
+            {
+                sweep(k0, src_tile, dst_tile);
+            }
+            else
+            {
+                cv::Mat scratch = scratchRows(tile_scratch, tile.size(), src.cols, CV_8UC3);
+                sweep(k0, src_tile, scratch);
+                sweep(k1, scratch, dst_tile);
+            }
+        }
+        total_image_rows += image_rows;
+    });
+
+    total_conversions++;
+    total_rows += src.rows;
+}
+
+ConversionStats getConversionStats()
+{
+    ConversionStats s;
+    s.conversions = total_conversions;
+    s.rows = total_rows;
+    s.image_rows = total_image_rows;
+    return s;
+}
+
+void resetConversionStats()
+{
+    total_conversions = 0;
+    total_rows = 0;
+    total_image_rows = 0;
+}
+
+void runPlanTile(const ConversionPlan &plan, const cv::Mat &src, cv::Mat &dst, cv::Mat &scratch_rows)
+{
+    const kernel_t k0 = (kernel_t)plan.kernels[0];
+    const kernel_t k1 = (kernel_t)plan.kernels[1];
+    if (plan.stages == 1)
+    {
+        applyKernel(k0, src, dst);
+    }
+    else
+    {
+        cv::Mat scratch = scratchRows(scratch_rows, src.rows, src.cols, CV_8UC3);
+        applyKernel(k0, src, scratch);
+        applyKernel(k1, scratch, dst);
+    }
+}
+
+} // namespace cspace
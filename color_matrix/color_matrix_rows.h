@@ -0,0 +1,94 @@
+/******************************************************************************/
+/*!
+ * @file  color_matrix_rows.h
+ * @brief The gray row kernels and the row parallelism that the header only
+ *        parts of color_matrix (TypedMat) are built from
+ *
+ * @author Cathal Harte <cathal.harte@protonmail.com>
+ */
+#ifndef _COLOR_MATRIX_ROWS_H
+#define _COLOR_MATRIX_ROWS_H
+
+/*******************************************************************************
+* Includes
+******************************************************************************/
+
+#include <opencv2/core.hpp>
+
+/*! @addtogroup color_matrix
+ * @{
+ */
+
+namespace cspace
+{
+/*******************************************************************************
+* Definitions and types
+*******************************************************************************/
+
+// Fixed point coefficients of cv::COLOR_BGR2GRAY, using these keeps our fused kernels bit exact
+// with cvtColor
+constexpr int gray_shift = 14;
+constexpr int gray_b = 1868;
+constexpr int gray_g = 9617;
+constexpr int gray_r = 4899;
+
+// Rows per tile when chaining kernels, small enough that the scratch stays in cache
+constexpr int plan_tile_rows = 8;
+
+/*******************************************************************************
+* Class prototypes
+*******************************************************************************/
+
+// Adapts any callable taking a row range to cv::parallel_for_, without the allocation
+// that wrapping it in a std::function would cost
+template <typename Fn>
+class StripeBody : public cv::ParallelLoopBody
+{
+    public :
+        StripeBody(const Fn &fn) : fn(fn) {}
+        void operator()(const cv::Range &r) const override { fn(r); }
+
+    private :
+        const Fn &fn;
+};
+
+/*******************************************************************************
+* Function prototypes
+*******************************************************************************/
+
+// How many stripes rows should be cut into under the active ParallelConfig
+int numStripes(int rows);
+
+// Run fn over [0, rows) cut into stripes of rows, in parallel where the active ParallelConfig
+// allows. Stripes are at least grain_rows tall, and there are never more than max_threads of
+// them, so that no more than max_threads workers are ever busy on one call.
+template <typename Fn>
+void forEachStripe(int rows, const Fn &fn)
+{
+    int stripes = numStripes(rows);
+    if (stripes <= 1)
+    {
+        fn(cv::Range(0, rows));
+        return;
+    }
+    cv::parallel_for_(cv::Range(0, rows), StripeBody<Fn>(fn), stripes);
+}
+
+// The first rows of a scratch matrix, which is only ever grown. Kept thread_local by the
+// callers, so that each worker allocates its scratch once.
+cv::Mat scratchRows(cv::Mat &scratch, int rows, int cols, int type);
+
+// src is either 3 channel (b_idx says where blue is, 0 for BGR, 2 for RGB) or already gray
+
+// The gray value replicated over B, G and R
+void grayReplicateRow(const uchar *src, int src_cn, int b_idx, uchar *out, int width);
+
+// The gray value as HSV, a gray pixel has no hue or saturation so that is (0, 0, v)
+void grayHsvRow(const uchar *src, int src_cn, int b_idx, uchar *out, int width);
+
+}
+
+/*! @}
+ */
+
+#endif  // _COLOR_MATRIX_ROWS_H
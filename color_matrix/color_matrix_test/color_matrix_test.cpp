@@ -14,7 +14,102 @@
 #include <gtest_helpers.h>
 #include <cv_helpers.h>
 #include <color_matrix.h>
+#include <typed_color_matrix.h>
+#include <packed_mask.h>
+#include <planar_mat.h>
+#include <mat_snapshot.h>
+#include <pool_allocator.h>
+#include <tile_stream.h>
 #include <opencv2/opencv.hpp>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <new>
+
+/*******************************************************************************
+* Heap allocation counting
+*******************************************************************************/
+
+// Every heap allocation of the test binary, OpenCV's and the standard library's included, is
+// counted while heap_counting is set. With glibc the malloc family is interposed, which
+// operator new goes through too; elsewhere operator new is replaced.
+static std::atomic<bool> heap_counting(false);
+static std::atomic<long> heap_allocations(0);
+
+static void countHeapAllocation()
+{
+    if (heap_counting.load(std::memory_order_relaxed))
+    {
+        heap_allocations++;
+    }
+}
+
+#ifdef __GLIBC__
+extern "C"
+{
+void *__libc_malloc(size_t n);
+void *__libc_calloc(size_t count, size_t n);
+void *__libc_realloc(void *p, size_t n);
+void *__libc_memalign(size_t align, size_t n);
+
+void *malloc(size_t n)
+{
+    countHeapAllocation();
+    return __libc_malloc(n);
+}
+
+void *calloc(size_t count, size_t n)
+{
+    countHeapAllocation();
+    return __libc_calloc(count, n);
+}
+
+void *realloc(void *p, size_t n)
+{
+    countHeapAllocation();
+    return __libc_realloc(p, n);
+}
+
+void *memalign(size_t align, size_t n)
+{
+    countHeapAllocation();
+    return __libc_memalign(align, n);
+}
+
+void *aligned_alloc(size_t align, size_t n)
+{
+    countHeapAllocation();
+    return __libc_memalign(align, n);
+}
+
+int posix_memalign(void **p, size_t align, size_t n)
+{
+    countHeapAllocation();
+    *p = __libc_memalign(align, n);
+    return *p ? 0 : ENOMEM;
+}
+}
+#else
+void *operator new(std::size_t n)
+{
+    countHeapAllocation();
+    void *p = std::malloc(n ? n : 1);
+    if (!p)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+#endif
+
 namespace
 {
 
@@ -24,6 +119,36 @@ namespace
 
 #define THREEXTHREEX1 (cv::Mat_<char>(3, 3) << 1, 1, 1, 1, 1, 1, 1, 1, 1)
 
+// Forwards to the standard OpenCV allocator, but keeps count of how many buffers were requested
+class CountingAllocator : public cv::MatAllocator
+{
+public:
+    CountingAllocator() : std_alloc(cv::Mat::getStdAllocator()) {}
+
+    cv::UMatData *allocate(int dims, const int *sizes, int type, void *data, size_t *step,
+                           cv::AccessFlag flags, cv::UMatUsageFlags usageFlags) const override
+    {
+        if (!data)
+        {
+            allocations++;
+        }
+        return std_alloc->allocate(dims, sizes, type, data, step, flags, usageFlags);
+    }
+
+    bool allocate(cv::UMatData *u, cv::AccessFlag accessFlags, cv::UMatUsageFlags usageFlags) const override
+    {
+        return std_alloc->allocate(u, accessFlags, usageFlags);
+    }
+
+    void deallocate(cv::UMatData *u) const override
+    {
+        std_alloc->deallocate(u);
+    }
+
+    cv::MatAllocator *std_alloc;
+    mutable int allocations = 0;
+};
+
 /*******************************************************************************
 * Local Function prototypes
 *******************************************************************************/
@@ -313,4 +438,934 @@ TEST(colorspace, multi_hl_over_bg)
     TODO_VERIFY;
 }
 
+// The fused highlight kernel has to reproduce the HSV route it replaced exactly
+TEST(colorspace, fused_highlight_matches_hsv_path)
+{
+    cspace::Mat bg(97, 131, CV_8UC3); // odd sizes so that the scalar tail is exercised
+    cv::randu(bg, cv::Scalar::all(0), cv::Scalar::all(256));
+    bg.setColorspace(cspace::BGR);
+
+    cspace::Mat hl(bg.size(), CV_8UC1);
+    cv::randu(hl, cv::Scalar::all(0), cv::Scalar::all(256));
+
+    cspace::Mat expected = bg.to3ChannelGray(cspace::HSV);
+    for (int i = 0; i < expected.rows; i++)
+    {
+        for (int j = 0; j < expected.cols; j++)
+        {
+            if (hl.at<uchar>(i, j) > 127)
+            {
+                expected.at<cv::Vec3b>(i, j) = cv::Vec3b(100, 255, 255);
+            }
+        }
+    }
+    expected = expected.toBGR();
+
+    cspace::Mat out = cspace::highlightOverBg(bg, hl);
+
+    ASSERT_EQ(out.getColorspace(), cspace::BGR);
+    EXPECT_EQ(cv::norm(out, expected, cv::NORM_INF), 0);
+}
+
+// Several overlapping masks, the last mask set at a pixel decides its hue, exactly as it did
+// when each mask was painted over an HSV image in turn
+TEST(colorspace, multi_highlight_last_mask_wins)
+{
+    cspace::Mat bg(61, 77, CV_8UC3);
+    cv::randu(bg, cv::Scalar::all(0), cv::Scalar::all(256));
+    bg.setColorspace(cspace::BGR);
+
+    std::deque<cspace::Mat> hls(5); // any range of masks is accepted
+    for (auto &hl : hls)
+    {
+        hl = cv::Mat(bg.size(), CV_8UC1);
+        cv::randu(hl, cv::Scalar::all(0), cv::Scalar::all(256));
+    }
+
+    cspace::Mat expected = bg.to3ChannelGray(cspace::HSV);
+    uchar hue_step = 255 / hls.size();
+    uchar hue = 0;
+    for (auto &hl : hls)
+    {
+        hue += hue_step;
+        for (int i = 0; i < expected.rows; i++)
+        {
+            for (int j = 0; j < expected.cols; j++)
+            {
+                if (hl.at<uchar>(i, j) > 127)
+                {
+                    expected.at<cv::Vec3b>(i, j) = cv::Vec3b(hue, 255, 255);
+                }
+            }
+        }
+    }
+    expected = expected.toBGR();
+
+    cspace::Mat out = cspace::highlightOverBg(bg, hls);
+
+    ASSERT_EQ(out.getColorspace(), cspace::BGR);
+    EXPECT_EQ(cv::norm(out, expected, cv::NORM_INF), 0);
+}
+
+// MAX_HIGHLIGHTS masks are the most there are hues for; one more throws, whichever overload
+TEST(colorspace, too_many_highlights_throw)
+{
+    cspace::Mat bg(8, 8, CV_8UC3, cv::Scalar::all(100));
+    bg.setColorspace(cspace::BGR);
+    cv::Mat mask(bg.size(), CV_8UC1, cv::Scalar(255));
+
+    std::vector<cv::Mat> hls(MAX_HIGHLIGHTS, mask);
+    cspace::Mat out;
+    EXPECT_NO_THROW(cspace::highlightOverBg(bg, hls, out));
+    hls.push_back(mask);
+    EXPECT_THROW(cspace::highlightOverBg(bg, hls, out), std::runtime_error);
+
+    std::vector<const cv::Mat *> ptrs(hls.size(), &mask);
+    EXPECT_THROW(cspace::highlightOverBg(bg, ptrs.data(), (int)ptrs.size(), out), std::runtime_error);
+
+    cspace::PackedMask packed(mask);
+    std::vector<cspace::PackedMask> packed_hls(MAX_HIGHLIGHTS + 1, packed);
+    EXPECT_THROW(cspace::highlightOverBg(bg, packed_hls, out), std::runtime_error);
+    std::vector<const cspace::PackedMask *> packed_ptrs(packed_hls.size(), &packed);
+    EXPECT_THROW(cspace::highlightOverBg(bg, packed_ptrs.data(), (int)packed_ptrs.size(), out),
+                 std::runtime_error);
+}
+
+// A grid of small squares labelled by connectedComponents, far more labels than masks could give
+TEST(colorspace, label_highlight_over_bg)
+{
+    cspace::Mat bg(200, 300, CV_8UC3);
+    cv::randu(bg, cv::Scalar::all(0), cv::Scalar::all(256));
+    bg.setColorspace(cspace::BGR);
+
+    cv::Mat blobs(bg.size(), CV_8UC1, cv::Scalar(0));
+    for (int i = 1; i + 2 < blobs.rows; i += 4)
+    {
+        for (int j = 1; j + 2 < blobs.cols; j += 4)
+        {
+            blobs(cv::Rect(j, i, 2, 2)).setTo(255);
+        }
+    }
+
+    cv::Mat labels;
+    int num_labels = cv::connectedComponents(blobs, labels, 8, CV_32S) - 1;
+    ASSERT_GT(num_labels, 1000);
+
+    cspace::palette_t palette = cspace::makePalette(num_labels);
+    ASSERT_EQ(palette.size(), (size_t)num_labels + 1);
+
+    cv::Mat labels16;
+    labels.convertTo(labels16, CV_16U);
+
+    cspace::Mat gray = bg.toGray();
+    for (const cv::Mat &l : {labels, labels16})
+    {
+        cspace::Mat out = cspace::highlightOverBg(bg, l, palette);
+        ASSERT_EQ(out.getColorspace(), cspace::BGR);
+
+        for (int i = 0; i < out.rows; i++)
+        {
+            for (int j = 0; j < out.cols; j++)
+            {
+                int label = labels.at<int>(i, j);
+                uchar g = gray.at<uchar>(i, j);
+                cv::Vec3b expected = label ? palette[label] : cv::Vec3b(g, g, g);
+                ASSERT_EQ(out.at<cv::Vec3b>(i, j), expected);
+            }
+        }
+    }
+}
+
+// No conversion may take more than one full pass over the image, and chained ones must give what
+// the equivalent chain of cvtColor calls would
+TEST(colorspace, conversion_plans_are_single_pass)
+{
+    const cspace::colorspace_t spaces[] = {cspace::BGR, cspace::RGB, cspace::HSV, cspace::GRAY};
+    cspace::Mat bgr(61, 83, CV_8UC3);
+    cv::randu(bgr, cv::Scalar::all(0), cv::Scalar::all(256));
+    bgr.setColorspace(cspace::BGR);
+
+    for (auto from : spaces)
+    {
+        cspace::Mat src;
+        bgr.toColorspace(src, from);
+        for (auto to : spaces)
+        {
+            for (bool gray : {false, true})
+            {
+                cspace::ConversionPlan plan = cspace::planConversion(from, to, gray);
+                if (!plan.path)
+                {
+                    continue;
+                }
+
+                // out of place, then in place where the type allows (an in place copy reads
+                // nothing), each image read once
+                cspace::resetConversionStats();
+                cspace::Mat dst;
+                src.toColorspace(dst, to, gray);
+                cspace::Mat same;
+                same = src.clone();
+                same.setColorspace(from);
+                if (plan.out_type == src.type())
+                {
+                    same.toColorspace(same, to, gray);
+                }
+                cspace::ConversionStats stats = cspace::getConversionStats();
+                GTEST_COUT << plan.path << " : " << (double)stats.image_rows / stats.rows << " pass, "
+                           << plan.stages << " stage(s)" << std::endl;
+                EXPECT_EQ(stats.image_rows, stats.rows) << plan.path;
+                EXPECT_LE(plan.stages, 2) << plan.path;
+            }
+        }
+    }
+
+    EXPECT_EQ(cspace::planConversion(cspace::HSV, cspace::GRAY).stages, 2);
+    EXPECT_EQ(cspace::planConversion(cspace::GRAY, cspace::HSV).stages, 1);
+    EXPECT_EQ(cspace::planConversion(cspace::BGR, cspace::HSV, true).stages, 1);
+    EXPECT_EQ(cspace::planConversion(cspace::UNKNOWN, cspace::HSV).path, nullptr);
+}
+
+TEST(colorspace, chained_conversions_match_cvtColor)
+{
+    cspace::Mat hsv(123, 77, CV_8UC3);
+    cv::randu(hsv, cv::Scalar::all(0), cv::Scalar(180, 256, 256));
+    hsv.setColorspace(cspace::HSV);
+
+    cv::Mat bgr, gray, expected;
+    cv::cvtColor(hsv, bgr, cv::COLOR_HSV2BGR);
+    cv::cvtColor(bgr, gray, cv::COLOR_BGR2GRAY);
+
+    cspace::Mat out;
+    hsv.toGray(out);
+    EXPECT_EQ(cv::norm(out, gray, cv::NORM_INF), 0);
+
+    hsv.to3ChannelGray(out, cspace::BGR);
+    cv::cvtColor(gray, expected, cv::COLOR_GRAY2BGR);
+    EXPECT_EQ(cv::norm(out, expected, cv::NORM_INF), 0);
+
+    hsv.to3ChannelGray(out, cspace::HSV);
+    cv::cvtColor(expected, expected, cv::COLOR_BGR2HSV);
+    EXPECT_EQ(cv::norm(out, expected, cv::NORM_INF), 0);
+
+    cspace::Mat bgr_in;
+    bgr_in.setColorspace(cspace::BGR);
+    bgr_in = bgr;
+    bgr_in.to3ChannelGray(out, cspace::HSV);
+    EXPECT_EQ(cv::norm(out, expected, cv::NORM_INF), 0);
+}
+
+// The compile time typed conversions have to agree with the runtime ones. Conversions that don't
+// exist, such as cspace::GrayMat().to<cspace::WHITE_ON_BLACK>(), fail to compile.
+TEST(typed_colorspace, typed_matches_runtime)
+{
+    cspace::BgrMat bgr(91, 67);
+    cv::randu(bgr, cv::Scalar::all(0), cv::Scalar::all(256));
+
+    cspace::Mat runtime = bgr.toRuntime();
+    ASSERT_EQ(runtime.getColorspace(), cspace::BGR);
+    ASSERT_EQ(runtime.data, bgr.data);
+
+    cspace::HsvMat hsv = bgr.to<cspace::HSV>();
+    EXPECT_EQ(cv::norm(hsv, runtime.toHSV(), cv::NORM_INF), 0);
+
+    cspace::GrayMat gray = hsv.to<cspace::GRAY>();
+    EXPECT_EQ(cv::norm(gray, runtime.toHSV().toGray(), cv::NORM_INF), 0);
+
+    cspace::HsvMat gray_hsv = bgr.to3ChannelGray<cspace::HSV>();
+    EXPECT_EQ(cv::norm(gray_hsv, runtime.to3ChannelGray(cspace::HSV), cv::NORM_INF), 0);
+
+    cspace::BgrMat back = cspace::BgrMat::fromRuntime(runtime);
+    EXPECT_EQ(back.data, bgr.data);
+    EXPECT_THROW(cspace::HsvMat::fromRuntime(runtime), std::runtime_error);
+}
+
+// Once the destination and scratch buffers have been sized by the first frames, converting every
+// following frame into the same destinations must not touch the heap at all: no pixel buffers,
+// and no headers, containers or OpenCV internals either. That holds serially; in parallel OpenCV's
+// thread pool allocates a job per parallel_for_, and a worker sizes its scratch the first time it
+// is handed a stripe, so there only the output buffers are counted.
+TEST(colorspace, steady_state_conversion_does_not_allocate)
+{
+    cspace::Mat frame(480, 640, CV_8UC3, cv::Scalar(10, 120, 240));
+    frame.setColorspace(cspace::BGR);
+
+    cspace::Mat mask(frame.size(), CV_8UC1, cv::Scalar(0));
+    mask(cv::Rect(100, 100, 200, 150)).setTo(255);
+    std::vector<cspace::Mat> masks{mask, mask};
+
+    cspace::Mat gray, hsv, bgr, gray3, gray_hsv, hl_one, hl_many;
+
+    auto convertFrame = [&]() {
+        frame.toGray(gray);
+        frame.toHSV(hsv);
+        hsv.toBGR(bgr);
+        hsv.toGray(gray);
+        gray.toHSV(gray_hsv);
+        frame.to3ChannelGray(gray3, cspace::BGR);
+        cspace::highlightOverBg(frame, mask, hl_one);
+        cspace::highlightOverBg(frame, masks, hl_many);
+    };
+
+    auto heapAllocations = [&](int frames) {
+        heap_allocations = 0;
+        heap_counting = true;
+        for (int i = 0; i < frames; i++)
+        {
+            convertFrame();
+        }
+        heap_counting = false;
+        return heap_allocations.load();
+    };
+
+    uchar *gray_data;
+    {
+        cspace::ParallelScope serial(cspace::ParallelConfig(32, 1));
+        convertFrame(); // warm up - destinations and scratch buffers get sized here
+        gray_data = gray.data;
+
+        CountingAllocator counter;
+        cv::MatAllocator *prev = cv::Mat::getDefaultAllocator();
+        cv::Mat::setDefaultAllocator(&counter);
+        EXPECT_EQ(heapAllocations(10), 0);
+        cv::Mat::setDefaultAllocator(prev);
+        EXPECT_EQ(counter.allocations, 0);
+    }
+
+    CountingAllocator outputs;
+    {
+        cspace::AllocatorScope counted(&outputs);
+        for (int i = 0; i < 10; i++)
+        {
+            convertFrame();
+        }
+    }
+    EXPECT_EQ(outputs.allocations, 0);
+
+    EXPECT_EQ(gray.data, gray_data);
+    EXPECT_EQ(gray_hsv.getColorspace(), cspace::HSV);
+    EXPECT_EQ(hl_many.getColorspace(), cspace::BGR);
+}
+
+// Cutting the work into stripes over threads must not change a single byte
+TEST(colorspace, parallel_matches_serial)
+{
+    cspace::Mat frame(301, 257, CV_8UC3);
+    cv::randu(frame, cv::Scalar::all(0), cv::Scalar::all(256));
+    frame.setColorspace(cspace::BGR);
+
+    std::vector<cspace::Mat> masks(3);
+    for (auto &hl : masks)
+    {
+        hl = cv::Mat(frame.size(), CV_8UC1);
+        cv::randu(hl, cv::Scalar::all(0), cv::Scalar::all(256));
+    }
+
+    auto convertFrame = [&](std::vector<cspace::Mat> &out) {
+        out.resize(6);
+        frame.toGray(out[0]);
+        frame.toHSV(out[1]);
+        out[1].toGray(out[2]);
+        frame.to3ChannelGray(out[3], cspace::HSV);
+        cspace::highlightOverBg(frame, masks[0], out[4]);
+        cspace::highlightOverBg(frame, masks, out[5]);
+    };
+
+    std::vector<cspace::Mat> serial_out, parallel_out;
+    {
+        cspace::ParallelScope serial(cspace::ParallelConfig(32, 1));
+        convertFrame(serial_out);
+    }
+    {
+        cspace::ParallelScope parallel(cspace::ParallelConfig(7, 8));
+        convertFrame(parallel_out);
+    }
+
+    for (size_t i = 0; i < serial_out.size(); i++)
+    {
+        EXPECT_EQ(cv::norm(serial_out[i], parallel_out[i], cv::NORM_INF), 0) << "output " << i;
+    }
+}
+
+TEST(colorspace, value_conversion_shares_unconverted_pixels)
+{
+    cspace::Mat gray(4, 4, CV_8UC1, cv::Scalar(42));
+    gray.setColorspace(cspace::GRAY);
+
+    cspace::Mat same = gray.toGray();
+    EXPECT_EQ(same.data, gray.data);
+    EXPECT_EQ(same.getColorspace(), cspace::GRAY);
+
+    cspace::Mat hsv = gray.toHSV();
+    EXPECT_EQ(hsv.getColorspace(), cspace::HSV);
+    EXPECT_EQ(hsv.at<cv::Vec3b>(0, 0), cv::Vec3b(0, 0, 42));
+}
+
+// Repeated value conversions of a cached image are converted once, and the cache follows the pixels.
+// What comes back is a copy, writing into it leaves the cache as it was.
+TEST(colorspace, cached_conversions)
+{
+    cspace::Mat bgr(8, 8, CV_8UC3);
+    cv::randu(bgr, 0, 255);
+    bgr.setColorspace(cspace::BGR);
+    bgr.enableCache();
+
+    cspace::Mat gray = bgr.toGray();
+    cspace::Mat again = bgr.toGray();
+    EXPECT_NE(again.data, gray.data);
+    EXPECT_EQ(cv::norm(again, gray, cv::NORM_INF), 0);
+    EXPECT_EQ(again.getColorspace(), cspace::GRAY);
+    cspace::Mat white(8, 8, CV_8UC3, cv::Scalar::all(255));
+    white.setColorspace(cspace::BGR);
+    white.toGray(again); // the result reused as a dst
+    EXPECT_EQ(cv::norm(bgr.toGray(), gray, cv::NORM_INF), 0);
+    bgr.toHSV();
+    bgr.to3ChannelGray(cspace::HSV);
+
+    cspace::CacheStats stats = bgr.cacheStats();
+    EXPECT_EQ(stats.hits, 2u);
+    EXPECT_EQ(stats.misses, 3u);
+    EXPECT_EQ(stats.bytes, (size_t)(8 * 8 * (1 + 3 + 3)));
+
+    // a copy of the header shares the pixels, and so the cache
+    cspace::Mat copy = bgr;
+    EXPECT_EQ(cv::norm(copy.toGray(), gray, cv::NORM_INF), 0);
+    EXPECT_EQ(bgr.cacheStats().hits, 3u);
+
+    // writing the pixels drops the entries, and the result follows the new pixels
+    bgr.setTo(cv::Scalar(10, 20, 30));
+    bgr.markModified();
+    cspace::Mat fresh = bgr.toGray();
+    EXPECT_NE(fresh.data, gray.data);
+    cspace::Mat expected;
+    cvtColor(bgr, expected, cv::COLOR_BGR2GRAY);
+    EXPECT_EQ(cv::norm(fresh, expected, cv::NORM_INF), 0);
+
+    // new pixels through operator= start a fresh cache, the old one stays with the copy
+    cv::Mat other(8, 8, CV_8UC3, cv::Scalar(1, 2, 3));
+    bgr = other;
+    EXPECT_EQ(bgr.cacheStats().misses, 0u);
+    EXPECT_EQ(copy.cacheStats().misses, 4u);
+    EXPECT_EQ(bgr.toGray().at<uchar>(0, 0), 2);
+}
+
+TEST(colorspace, cache_stays_under_its_cap)
+{
+    cspace::Mat bgr(8, 8, CV_8UC3, cv::Scalar(0, 0, 255));
+    bgr.setColorspace(cspace::BGR);
+    bgr.enableCache(8 * 8 * 4); // room for a gray and a 3 channel image, not two 3 channel
+
+    bgr.toGray();
+    bgr.toHSV();
+    bgr.toGray();
+    bgr.to3ChannelGray(cspace::HSV); // HSV was used last, it goes
+    cspace::CacheStats stats = bgr.cacheStats();
+    EXPECT_EQ(stats.evictions, 1u);
+    EXPECT_LE(stats.bytes, stats.max_bytes);
+
+    bgr.toGray();
+    EXPECT_EQ(bgr.cacheStats().hits, 2u);
+}
+
+// A temporary nobody else holds is converted in place, anything shared is left alone
+TEST(colorspace, moved_conversions_steal_the_buffer)
+{
+    cspace::Mat bgr(16, 16, CV_8UC3);
+    cv::randu(bgr, 0, 255);
+    bgr.setColorspace(cspace::BGR);
+    cv::Mat expected;
+    cvtColor(bgr, expected, cv::COLOR_BGR2HSV);
+
+    cspace::Mat frame;
+    frame = bgr.clone();
+    frame.setColorspace(cspace::BGR);
+    const uchar *pixels = frame.data;
+    cspace::Mat hsv = std::move(frame).toHSV();
+    EXPECT_EQ(hsv.data, pixels);
+    EXPECT_EQ(hsv.getColorspace(), cspace::HSV);
+    EXPECT_EQ(cv::norm(hsv, expected, cv::NORM_INF), 0);
+    EXPECT_TRUE(frame.empty());
+
+    // chained through a temporary, and back again
+    cspace::Mat hsv_ref;
+    hsv_ref = expected;
+    hsv_ref.setColorspace(cspace::HSV);
+    cspace::Mat chained = std::move(hsv).to3ChannelGray(cspace::BGR);
+    EXPECT_EQ(chained.data, pixels);
+    EXPECT_EQ(cv::norm(chained, hsv_ref.to3ChannelGray(cspace::BGR), cv::NORM_INF), 0);
+
+    // another header shares the buffer, so it must not change under it
+    cspace::Mat shared = bgr;
+    cspace::Mat other = bgr;
+    cspace::Mat converted = std::move(other).toHSV();
+    EXPECT_NE(converted.data, bgr.data);
+    EXPECT_EQ(cv::norm(converted, expected, cv::NORM_INF), 0);
+    EXPECT_EQ(shared.getColorspace(), cspace::BGR);
+
+    // a change in channel count can't be done in place
+    cspace::Mat temp;
+    temp = bgr.clone();
+    temp.setColorspace(cspace::BGR);
+    EXPECT_EQ(std::move(temp).toGray().getColorspace(), cspace::GRAY);
+}
+
+TEST(colorspace, moves_keep_the_colorspace)
+{
+    cspace::Mat hsv(4, 4, CV_8UC3);
+    hsv.setColorspace(cspace::HSV);
+    const uchar *pixels = hsv.data;
+
+    cspace::Mat moved(std::move(hsv));
+    EXPECT_EQ(moved.getColorspace(), cspace::HSV);
+    EXPECT_EQ(moved.data, pixels);
+
+    cspace::Mat assigned;
+    assigned = std::move(moved);
+    EXPECT_EQ(assigned.getColorspace(), cspace::HSV);
+    EXPECT_EQ(assigned.data, pixels);
+
+    // a plain cv::Mat is taken over, and retagged like any assignment
+    cv::Mat plain(4, 4, CV_8UC1);
+    const uchar *plain_pixels = plain.data;
+    assigned = std::move(plain);
+    EXPECT_EQ(assigned.data, plain_pixels);
+    EXPECT_EQ(assigned.u->refcount, 1);
+    EXPECT_EQ(assigned.getColorspace(), cspace::GRAY);
+    EXPECT_TRUE(plain.empty());
+}
+
+// Widths that are not a multiple of 8, or of a vector, exercise the tails
+TEST(packed_mask, pack_round_trip)
+{
+    cv::Mat mask(13, 101, CV_8UC1);
+    cv::randu(mask, cv::Scalar::all(0), cv::Scalar::all(256));
+
+    cspace::PackedMask packed(mask);
+    EXPECT_EQ(packed.size(), mask.size());
+    EXPECT_EQ(packed.bits().cols % PACKED_ROW_ALIGN, 0);
+    EXPECT_LE(packed.bits().total(), mask.total() / 8 + PACKED_ROW_ALIGN * mask.rows);
+
+    cv::Mat thresholded = (mask > 127);
+    cspace::Mat unpacked = packed.unpack();
+    EXPECT_EQ(unpacked.getColorspace(), cspace::WHITE_ON_BLACK);
+    EXPECT_EQ(cv::norm(unpacked, thresholded, cv::NORM_INF), 0);
+    EXPECT_EQ(packed.count(), (size_t)cv::countNonZero(thresholded));
+
+    // unpacked through the output allocator, as every other output
+    cspace::PoolAllocator pool;
+    {
+        cspace::AllocatorScope pooled(&pool);
+        cspace::Mat again = packed.unpack();
+        EXPECT_EQ(again.u->currAllocator, &pool);
+    }
+}
+
+TEST(packed_mask, bitwise_ops_match_the_unpacked_masks)
+{
+    cv::Mat a(9, 45, CV_8UC1), b(9, 45, CV_8UC1);
+    cv::randu(a, cv::Scalar::all(0), cv::Scalar::all(256));
+    cv::randu(b, cv::Scalar::all(0), cv::Scalar::all(256));
+    a = (a > 127);
+    b = (b > 127);
+    cspace::PackedMask pa(a), pb(b);
+
+    cv::Mat expected;
+    cv::bitwise_and(a, b, expected);
+    EXPECT_EQ(cv::norm((pa & pb).unpack(), expected, cv::NORM_INF), 0);
+    cv::bitwise_or(a, b, expected);
+    EXPECT_EQ(cv::norm((pa | pb).unpack(), expected, cv::NORM_INF), 0);
+    cv::bitwise_xor(a, b, expected);
+    EXPECT_EQ(cv::norm((pa ^ pb).unpack(), expected, cv::NORM_INF), 0);
+    EXPECT_EQ((pa ^ pb).count(), (size_t)cv::countNonZero(expected));
+
+    // the operators leave their operands alone
+    EXPECT_EQ(cv::norm(pa.unpack(), a, cv::NORM_INF), 0);
+}
+
+TEST(packed_mask, highlight_matches_byte_masks)
+{
+    cspace::Mat bg(61, 77, CV_8UC3);
+    cv::randu(bg, cv::Scalar::all(0), cv::Scalar::all(256));
+    bg.setColorspace(cspace::BGR);
+
+    std::vector<cspace::Mat> hls(5);
+    std::vector<cspace::PackedMask> packed;
+    for (auto &hl : hls)
+    {
+        hl = cv::Mat(bg.size(), CV_8UC1);
+        cv::randu(hl, cv::Scalar::all(0), cv::Scalar::all(256));
+        packed.push_back(cspace::PackedMask(hl));
+    }
+
+    cspace::Mat single = cspace::highlightOverBg(bg, hls[0]);
+    EXPECT_EQ(cv::norm(cspace::highlightOverBg(bg, packed[0]), single, cv::NORM_INF), 0);
+
+    cspace::Mat many = cspace::highlightOverBg(bg, hls);
+    cspace::Mat many_packed = cspace::highlightOverBg(bg, packed);
+    ASSERT_EQ(many_packed.getColorspace(), cspace::BGR);
+    EXPECT_EQ(cv::norm(many_packed, many, cv::NORM_INF), 0);
+}
+
+// Only the tiles under a write are copied, and the snapshot shows the pixels from before it
+TEST(mat_snapshot, copies_only_written_tiles)
+{
+    cspace::Mat img(200, 300, CV_8UC3);
+    cv::randu(img, cv::Scalar::all(0), cv::Scalar::all(256));
+    img.setColorspace(cspace::BGR);
+    cv::Mat before = img.clone();
+
+    cspace::MatSnapshot snap(img);
+    EXPECT_EQ(snap.view().data, img.data);
+
+    // a 10x10 square across the corner of 4 tiles
+    cv::Mat roi = img(cv::Rect(SNAPSHOT_TILE - 5, SNAPSHOT_TILE - 5, 10, 10));
+    snap.beforeWrite(roi);
+    roi.setTo(cv::Scalar::all(0));
+    EXPECT_EQ(snap.savedTiles(), 4);
+    EXPECT_EQ(snap.savedBytes(), (size_t)4 * SNAPSHOT_TILE * SNAPSHOT_TILE * 3);
+
+    // already saved, nothing more to copy
+    snap.beforeWrite(roi);
+    EXPECT_EQ(snap.savedTiles(), 4);
+
+    cspace::Mat view = snap.view();
+    EXPECT_NE(view.data, img.data);
+    EXPECT_EQ(view.getColorspace(), cspace::BGR);
+    EXPECT_EQ(cv::norm(view, before, cv::NORM_INF), 0);
+
+    // writes to other buffers are none of its business
+    cv::Mat other = before.clone();
+    snap.beforeWrite(other);
+    EXPECT_EQ(snap.savedTiles(), 4);
+}
+
+// A snapshot of a roi, written through the whole image
+TEST(mat_snapshot, roi_of_a_roi)
+{
+    cspace::Mat img(100, 100, CV_8UC1);
+    cv::randu(img, cv::Scalar::all(0), cv::Scalar::all(256));
+    cspace::Mat part;
+    part = img(cv::Rect(40, 40, 50, 50));
+    cv::Mat before = part.clone();
+
+    cspace::MatSnapshot snap(part, 16);
+    snap.beforeWrite(img(cv::Rect(0, 0, 45, 100)));
+    EXPECT_EQ(snap.savedTiles(), 4); // the first column of tiles
+    img.setTo(cv::Scalar::all(7));
+    EXPECT_NE(cv::norm(snap.view(), before, cv::NORM_INF), 0); // the rest was not announced
+
+    snap.take(part, 16);
+    snap.beforeWrite(img);
+    EXPECT_EQ(snap.savedTiles(), 16);
+    img.setTo(cv::Scalar::all(9));
+    EXPECT_EQ(cv::norm(snap.view(), cv::Mat(50, 50, CV_8UC1, cv::Scalar::all(7)), cv::NORM_INF), 0);
+}
+
+// Snapshots sharing a store save each tile once between them, and each sees the buffer as it was
+// when it was taken
+TEST(mat_snapshot, shared_store_saves_once)
+{
+    cspace::Mat img(100, 100, CV_8UC1, cv::Scalar::all(1));
+    std::shared_ptr<cspace::SnapshotStore> store = std::make_shared<cspace::SnapshotStore>();
+    cspace::Mat part;
+    part = img(cv::Rect(50, 50, 50, 50));
+    cspace::MatSnapshot first, second, roi;
+    first.take(img, store);
+    roi.take(part, store);
+
+    // announced through one, saved for both
+    EXPECT_EQ(store->savedTiles(), 0);
+    first.beforeWrite(img);
+    img.setTo(cv::Scalar::all(2));
+    EXPECT_EQ(store->savedTiles(), 4);
+    EXPECT_EQ(store->savedBytes(), (size_t)100 * 100);
+    EXPECT_EQ(roi.savedBytes(), store->savedBytes());
+
+    // a snapshot taken since has the tiles saved again, each once
+    second.take(img, store);
+    roi.beforeWrite(cv::Rect(0, 0, 10, 10)); // the top left tile
+    EXPECT_EQ(store->savedTiles(), 5);
+    store->beforeWrite(img);
+    EXPECT_EQ(store->savedTiles(), 8);
+    store->beforeWrite(img);
+    EXPECT_EQ(store->savedTiles(), 8);
+    img.setTo(cv::Scalar::all(4));
+
+    EXPECT_EQ(cv::norm(first.view(), cv::Mat(100, 100, CV_8UC1, cv::Scalar::all(1)), cv::NORM_INF), 0);
+    EXPECT_EQ(cv::norm(roi.view(), cv::Mat(50, 50, CV_8UC1, cv::Scalar::all(1)), cv::NORM_INF), 0);
+    EXPECT_EQ(cv::norm(second.view(), cv::Mat(100, 100, CV_8UC1, cv::Scalar::all(2)), cv::NORM_INF), 0);
+}
+
+// Outputs made anew each frame come back out of the pool once it has seen a frame through
+TEST(pool_allocator, steady_state_stops_missing)
+{
+    cspace::Mat frame(480, 640, CV_8UC3, cv::Scalar(10, 120, 240));
+    frame.setColorspace(cspace::BGR);
+    cspace::Mat mask(frame.size(), CV_8UC1, cv::Scalar(0));
+    mask(cv::Rect(100, 100, 200, 150)).setTo(255);
+
+    cspace::PoolAllocator pool;
+    {
+        cspace::AllocatorScope pooled(&pool);
+        for (int i = 0; i < 5; i++)
+        {
+            cspace::Mat hsv = frame.toHSV();
+            cspace::Mat gray = frame.toGray();
+            cspace::Mat hl = cspace::highlightOverBg(frame, mask);
+            EXPECT_EQ((size_t)hsv.data % POOL_ALIGN, 0u);
+            EXPECT_EQ((size_t)gray.data % POOL_ALIGN, 0u);
+            EXPECT_EQ(hsv.u->currAllocator, &pool);
+            EXPECT_EQ(hl.getColorspace(), cspace::BGR);
+        }
+    }
+
+    cspace::PoolStats stats = pool.stats();
+    ASSERT_EQ(stats.sizes.size(), 2u); // CV_8UC1 and CV_8UC3 at 640x480
+    for (auto &s : stats.sizes)
+    {
+        EXPECT_EQ(s.rows, 480);
+        EXPECT_EQ(s.cols, 640);
+        EXPECT_EQ(s.live, 0u);
+        EXPECT_EQ(s.misses, s.type == CV_8UC3 ? 2u : 1u); // hsv and hl are alive at once
+        EXPECT_GT(s.hits, 0u);
+    }
+    EXPECT_EQ(stats.live_bytes, 0u);
+    EXPECT_EQ(stats.pooled_bytes, (size_t)480 * 640 * 7);
+    EXPECT_EQ(stats.high_water_bytes, stats.pooled_bytes);
+
+    // outside of the scope the default allocator is back
+    cspace::Mat hsv = frame.toHSV();
+    EXPECT_NE(hsv.u->currAllocator, &pool);
+
+    EXPECT_EQ(pool.trim(480 * 640), (size_t)480 * 640 * 6); // the 3 channel ones go first
+    EXPECT_EQ(pool.stats().pooled_bytes, (size_t)480 * 640);
+    pool.resetStats();
+    EXPECT_EQ(pool.stats().high_water_bytes, (size_t)480 * 640);
+}
+
+// Past the cap buffers are freed rather than kept, and other sizes never share a class
+TEST(pool_allocator, cap_and_size_classes)
+{
+    cspace::PoolAllocator pool(100 * 100 * 3);
+    {
+        cv::Mat a, b, c;
+        a.allocator = b.allocator = c.allocator = &pool;
+        a.create(100, 100, CV_8UC3);
+        b.create(100, 100, CV_8UC3);
+        c.create(100, 300, CV_8UC1); // as many bytes, another class
+    }
+    cspace::PoolStats stats = pool.stats();
+    EXPECT_EQ(stats.pooled_bytes, (size_t)100 * 100 * 3);
+    EXPECT_EQ(stats.high_water_bytes, (size_t)100 * 100 * 9);
+    ASSERT_EQ(stats.sizes.size(), 2u);
+
+    cv::Mat d;
+    d.allocator = &pool;
+    d.create(100, 300, CV_8UC1);
+    uint64_t hits = 0, misses = 0;
+    for (auto &s : pool.stats().sizes)
+    {
+        hits += s.hits;
+        misses += s.misses;
+    }
+    EXPECT_EQ(hits, 1u); // c's buffer, the one kept
+    EXPECT_EQ(misses, 3u);
+}
+
+// A batch of frames in mixed colorspaces comes out as each converted on its own, split into planes
+TEST(batch, blob_matches_per_frame_conversion)
+{
+    cspace::Mat bgr(37, 53, CV_8UC3);
+    cv::randu(bgr, cv::Scalar::all(0), cv::Scalar::all(256));
+    bgr.setColorspace(cspace::BGR);
+    std::vector<cspace::Mat> frames(4);
+    frames[0] = bgr;
+    bgr.toHSV(frames[1]);
+    bgr.toGray(frames[2]);
+    bgr.toColorspace(frames[3], cspace::RGB);
+
+    for (int gray = 0; gray < 2; gray++)
+    {
+        cv::Mat planar, interleaved;
+        cspace::toBlob(frames, cspace::HSV, cspace::BLOB_NCHW, planar, gray);
+        cspace::toBlob(frames, cspace::HSV, cspace::BLOB_NHWC, interleaved, gray);
+        ASSERT_EQ(planar.dims, 4);
+        EXPECT_EQ(planar.size[0], 4);
+        EXPECT_EQ(planar.size[1], 3);
+        EXPECT_EQ(planar.size[2], 37);
+        EXPECT_EQ(planar.size[3], 53);
+        ASSERT_EQ(interleaved.dims, 4);
+        EXPECT_EQ(interleaved.size[1], 37);
+        EXPECT_EQ(interleaved.size[3], 3);
+
+        for (int i = 0; i < 4; i++)
+        {
+            cspace::Mat expected;
+            frames[i].toColorspace(expected, cspace::HSV, gray);
+            cv::Mat planes[3];
+            cv::split(expected, planes);
+            for (int k = 0; k < 3; k++)
+            {
+                cv::Mat plane(37, 53, CV_8UC1, planar.ptr(i, k));
+                EXPECT_EQ(cv::norm(plane, planes[k], cv::NORM_INF), 0) << i << " " << k;
+            }
+            cv::Mat pixels(37, 53, CV_8UC3, interleaved.ptr(i));
+            EXPECT_EQ(cv::norm(pixels, expected, cv::NORM_INF), 0) << i;
+        }
+    }
+
+    // the blob is written where it is once it has the size, and a single channel is the same
+    // either way
+    cv::Mat blob;
+    cspace::toBlob(frames, cspace::GRAY, cspace::BLOB_NCHW, blob);
+    uchar *data = blob.data;
+    cspace::toBlob(frames, cspace::GRAY, cspace::BLOB_NCHW, blob);
+    EXPECT_EQ(blob.data, data);
+    cv::Mat nhwc;
+    cspace::toBlob(frames, cspace::GRAY, cspace::BLOB_NHWC, nhwc);
+    EXPECT_EQ(cv::norm(cv::Mat(4 * 37, 53, CV_8UC1, blob.data),
+                       cv::Mat(4 * 37, 53, CV_8UC1, nhwc.data), cv::NORM_INF), 0);
+}
+
+// A batch that can't make one blob is refused before the blob is touched
+TEST(batch, mismatched_frames_throw)
+{
+    std::vector<cspace::Mat> frames(2);
+    frames[0] = cspace::Mat(37, 53, CV_8UC3);
+    frames[1] = cspace::Mat(37, 54, CV_8UC3);
+    for (auto &f : frames)
+    {
+        cv::randu(f, cv::Scalar::all(0), cv::Scalar::all(256));
+        f.setColorspace(cspace::BGR);
+    }
+
+    cv::Mat blob;
+    EXPECT_THROW(cspace::toBlob(frames, cspace::HSV, cspace::BLOB_NCHW, blob), std::runtime_error);
+    EXPECT_TRUE(blob.empty());
+    EXPECT_THROW(cspace::toBlob(std::vector<cspace::Mat>(), cspace::HSV, cspace::BLOB_NCHW, blob),
+                 std::runtime_error);
+}
+
+// The planes are those split() gives, each handed out as a view, and the conversions from them
+// are byte for byte those from the interleaved image
+TEST(planar_mat, matches_interleaved)
+{
+    cspace::Mat bgr(61, 83, CV_8UC3); // odd widths leave a tail after the vector loops
+    cv::randu(bgr, cv::Scalar::all(0), cv::Scalar::all(256));
+    bgr.setColorspace(cspace::BGR);
+    cspace::Mat hsv = bgr.toHSV();
+
+    cspace::PlanarMat planar(hsv);
+    EXPECT_EQ(planar.getColorspace(), cspace::HSV);
+    cv::Mat planes[3];
+    cv::split(hsv, planes);
+    for (int k = 0; k < 3; k++)
+    {
+        EXPECT_EQ(cv::norm(planar.channel(k), planes[k], cv::NORM_INF), 0);
+    }
+    cv::Mat v = planar.channel('V');
+    EXPECT_EQ(v.data, planar.data().ptr<uchar>(2 * 61));
+    EXPECT_TRUE(v.isContinuous());
+    EXPECT_THROW(planar.channel('R'), std::runtime_error);
+
+    cspace::Mat back = planar.toInterleaved();
+    EXPECT_EQ(back.getColorspace(), cspace::HSV);
+    EXPECT_EQ(cv::norm(back, hsv, cv::NORM_INF), 0);
+
+    cspace::Mat rgb;
+    bgr.toColorspace(rgb, cspace::RGB);
+    const cspace::colorspace_t targets[] = {cspace::BGR, cspace::RGB, cspace::HSV, cspace::GRAY};
+    for (const cspace::Mat &src : {bgr, hsv, rgb})
+    {
+        cspace::PlanarMat p(src);
+        for (auto c : targets)
+        {
+            for (int gray = 0; gray < 2; gray++)
+            {
+                if (gray && c == cspace::GRAY)
+                {
+                    continue;
+                }
+                cspace::Mat expected, got;
+                src.toColorspace(expected, c, gray);
+                p.toColorspace(got, c, gray);
+                EXPECT_EQ(got.getColorspace(), c);
+                EXPECT_EQ(cv::norm(got, expected, cv::NORM_INF), 0) << src.getColorspace() << ">" << c;
+            }
+            if (c != cspace::GRAY)
+            {
+                cspace::Mat expected;
+                src.toColorspace(expected, c);
+                cspace::PlanarMat q = p.clone();
+                q.toColorspace(q, c); // in place
+                EXPECT_EQ(q.getColorspace(), c);
+                EXPECT_EQ(cv::norm(q.toInterleaved(), expected, cv::NORM_INF), 0);
+            }
+        }
+    }
+}
+
+// Streamed through a budget of a few rows at a time, in bands and in a grid of tiles, the files
+// written hold what the conversions in memory give
+TEST(tile_stream, matches_in_memory)
+{
+    const cv::Size size(75, 203);
+    cspace::Mat bgr(size, CV_8UC3);
+    cv::randu(bgr, cv::Scalar::all(0), cv::Scalar::all(256));
+    bgr.setColorspace(cspace::BGR);
+    cv::Mat mask(size, CV_8UC1);
+    cv::randu(mask, cv::Scalar::all(0), cv::Scalar::all(2));
+    mask *= 255;
+
+    const std::string in_path = testing::TempDir() + "tile_stream_in.raw";
+    const std::string mask_path = testing::TempDir() + "tile_stream_mask.raw";
+    const std::string out_path = testing::TempDir() + "tile_stream_out.raw";
+    std::ofstream(in_path, std::ios::binary).write((const char *)bgr.data, bgr.total() * bgr.elemSize());
+    std::ofstream(mask_path, std::ios::binary).write((const char *)mask.data, mask.total());
+
+    cspace::Mat expected = bgr.toHSV();
+    cspace::Mat highlighted = cspace::highlightOverBg(bgr, mask);
+
+    cspace::StreamConfig bands;
+    bands.memory_budget = 16 * size.width * 3 * 4;
+    // cut down to 12 rows for the conversion and 9 for the highlight, its mask read ahead too
+    cspace::StreamConfig grid;
+    grid.tile = cv::Size(32, 16);
+    grid.memory_budget = 12 * size.width * (3 + 3 * 3);
+    for (const cspace::StreamConfig &cfg : {bands, grid})
+    {
+        cspace::MappedSource src(in_path, size, CV_8UC3);
+        cspace::MappedSource hl(mask_path, size, CV_8UC1);
+        {
+            cspace::MappedSink dst(out_path, size, CV_8UC3);
+            cspace::StreamStats stats = cspace::streamConversion(src, cspace::BGR, dst, cspace::HSV, false, cfg);
+            EXPECT_GT(stats.tiles, 1u);
+            EXPECT_EQ(stats.tile.width, cfg.tile.empty() ? size.width : cfg.tile.width);
+            EXPECT_EQ(stats.tile.height, cfg.tile.empty() ? 16 : 12);
+            EXPECT_LE(stats.buffer_bytes, cfg.memory_budget);
+        }
+        cv::Mat got(size, CV_8UC3);
+        std::ifstream(out_path, std::ios::binary).read((char *)got.data, got.total() * got.elemSize());
+        EXPECT_EQ(cv::norm(got, expected, cv::NORM_INF), 0);
+
+        {
+            cspace::MappedSink dst(out_path, size, CV_8UC3);
+            cspace::StreamStats stats = cspace::streamHighlight(src, cspace::BGR, hl, dst, cfg);
+            EXPECT_LE(stats.buffer_bytes, cfg.memory_budget);
+            EXPECT_EQ(stats.tile.height, cfg.tile.empty() ? 12 : 9);
+        }
+        std::ifstream(out_path, std::ios::binary).read((char *)got.data, got.total() * got.elemSize());
+        EXPECT_EQ(cv::norm(got, highlighted, cv::NORM_INF), 0);
+    }
+
+    cspace::MappedSource src(in_path, size, CV_8UC3);
+    cspace::MappedSink gray(out_path, size, CV_8UC3);
+    EXPECT_THROW(cspace::streamConversion(src, cspace::BGR, gray, cspace::GRAY), std::runtime_error);
+    EXPECT_THROW(cspace::MappedSource(in_path, cv::Size(76, 203), CV_8UC3), std::runtime_error);
+
+    std::remove(in_path.c_str());
+    std::remove(mask_path.c_str());
+    std::remove(out_path.c_str());
+}
+
 } // namespace
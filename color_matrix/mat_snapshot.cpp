@@ -0,0 +1,243 @@
+/******************************************************************************/
+/*!
+ * @file  mat_snapshot.cpp
+ * @brief cspace::MatSnapshot, the pixels of a matrix as they were when it was
+ *        taken, copied tile by tile only as they are written over
+ *
+ * @author Cathal Harte <cathal.harte@protonmail.com>
+ */
+
+/*******************************************************************************
+* Includes
+******************************************************************************/
+
+#include "mat_snapshot.h"
+
+#include <cassert>
+
+namespace cspace
+{
+
+/*******************************************************************************
+* Functions
+*******************************************************************************/
+
+// Where m lies in the whole of its buffer
+static cv::Rect regionOf(const cv::Mat &m)
+{
+    cv::Size whole;
+    cv::Point ofs;
+    m.locateROI(whole, ofs);
+    return cv::Rect(ofs, m.size());
+}
+
+static bool sameBuffer(const cv::Mat &a, const cv::Mat &b)
+{
+    if (a.empty() || b.empty())
+    {
+        return false;
+    }
+    return a.u ? a.u == b.u : a.datastart == b.datastart;
+}
+
+/*******************************************************************************
+* Classes
+*******************************************************************************/
+
+// The vectors' storage is kept
+void SnapshotStore::reset()
+{
+    whole = cv::Mat();
+    tiles_x = tiles_y = 0;
+    covered = cv::Rect();
+    clock = last_take = 0;
+    last_saved.clear();
+    saved.clear();
+    saved_bytes = 0;
+}
+
+bool SnapshotStore::aliases(const cv::Mat &m) const
+{
+    return sameBuffer(whole, m);
+}
+
+uint64_t SnapshotStore::attach(const Mat &m, int tile, cv::Rect &region)
+{
+    assert(("Tiles are at least a pixel", tile > 0));
+    if (whole.empty())
+    {
+        cv::Size size;
+        cv::Point ofs;
+        m.locateROI(size, ofs);
+        whole = m;
+        whole.adjustROI(ofs.y, size.height - ofs.y - m.rows, ofs.x, size.width - ofs.x - m.cols);
+        this->tile = tile;
+        tiles_x = (size.width + tile - 1) / tile;
+        tiles_y = (size.height + tile - 1) / tile;
+        last_saved.assign(tiles_x * tiles_y, 0);
+    }
+    else if (!aliases(m) || m.step[0] != whole.step[0] || m.elemSize() != whole.elemSize())
+    {
+        return 0;
+    }
+
+    region = regionOf(m);
+    covered = covered.empty() ? region : (covered | region);
+    last_take = ++clock;
+    return last_take;
+}
+
+void SnapshotStore::beforeWrite(const cv::Mat &target)
+{
+    if (!aliases(target))
+    {
+        return;
+    }
+    if (target.step[0] != whole.step[0] || target.elemSize() != whole.elemSize())
+    {
+        // a different view of the bytes, keep the lot
+        beforeWrite(covered);
+        return;
+    }
+    beforeWrite(regionOf(target));
+}
+
+// A tile is copied if a snapshot has been taken since it was last copied, and only as far as the
+// snapshots cover it
+void SnapshotStore::beforeWrite(const cv::Rect &rect)
+{
+    cv::Rect r = rect & covered;
+    if (r.empty())
+    {
+        return;
+    }
+
+    uint64_t now = ++clock;
+    for (int ty = r.y / tile; ty <= (r.y + r.height - 1) / tile; ty++)
+    {
+        for (int tx = r.x / tile; tx <= (r.x + r.width - 1) / tile; tx++)
+        {
+            int index = ty * tiles_x + tx;
+            if (last_saved[index] < last_take)
+            {
+                Saved s;
+                s.rect = tileRect(index) & covered;
+                s.pixels = whole(s.rect).clone();
+                s.index = index;
+                s.at = now;
+                saved_bytes += s.pixels.total() * s.pixels.elemSize();
+                saved.push_back(s);
+                last_saved[index] = now;
+            }
+        }
+    }
+}
+
+// Tiles on the right and bottom edges are cut short
+cv::Rect SnapshotStore::tileRect(int index) const
+{
+    cv::Rect r((index % tiles_x) * tile, (index / tiles_x) * tile, tile, tile);
+    return r & cv::Rect(0, 0, whole.cols, whole.rows);
+}
+
+// A store of our own is reused when no other snapshot shares it
+void MatSnapshot::take(const Mat &m, int tile)
+{
+    if (tiles && tiles.use_count() == 1)
+    {
+        tiles->reset();
+    }
+    else
+    {
+        tiles = std::make_shared<SnapshotStore>();
+    }
+    source = m;
+    region = cv::Rect();
+    taken_at = m.empty() ? 0 : tiles->attach(m, tile, region);
+}
+
+void MatSnapshot::take(const Mat &m, const std::shared_ptr<SnapshotStore> &store)
+{
+    assert(("A store to share", store));
+    const int tile = store->tile;
+    source = m;
+    region = cv::Rect();
+    taken_at = 0;
+    tiles = store;
+    if (m.empty())
+    {
+        return;
+    }
+    taken_at = tiles->attach(m, tile, region);
+    if (!taken_at)
+    {
+        tiles = std::make_shared<SnapshotStore>();
+        taken_at = tiles->attach(m, tile, region);
+    }
+}
+
+void MatSnapshot::reset()
+{
+    source = Mat();
+    region = cv::Rect();
+    taken_at = 0;
+    tiles.reset();
+}
+
+bool MatSnapshot::aliases(const cv::Mat &m) const
+{
+    return sameBuffer(source, m);
+}
+
+void MatSnapshot::beforeWrite(const cv::Mat &target)
+{
+    if (tiles && aliases(target))
+    {
+        tiles->beforeWrite(target);
+    }
+}
+
+void MatSnapshot::beforeWrite(const cv::Rect &roi)
+{
+    cv::Rect r = roi & cv::Rect(0, 0, source.cols, source.rows);
+    if (tiles && !r.empty())
+    {
+        tiles->beforeWrite(r + region.tl());
+    }
+}
+
+// The copies saved since the snapshot was taken are laid over the live pixels latest first, so that
+// of each tile the first copy saved after the snapshot, the pixels as it saw them, is what is left
+Mat MatSnapshot::view() const
+{
+    if (!tiles || !taken_at)
+    {
+        return source;
+    }
+
+    Mat out;
+    const std::vector<SnapshotStore::Saved> &saved = tiles->saved;
+    for (size_t i = saved.size(); i > 0 && saved[i - 1].at > taken_at; i--)
+    {
+        const SnapshotStore::Saved &s = saved[i - 1];
+        cv::Rect r = s.rect & region;
+        if (r.empty())
+        {
+            continue;
+        }
+        if (out.empty())
+        {
+            source.copyTo(out);
+        }
+        cv::Mat dst = out(r - region.tl());
+        s.pixels(r - s.rect.tl()).copyTo(dst);
+    }
+    if (out.empty())
+    {
+        return source;
+    }
+    out.setColorspace(source.getColorspace());
+    return out;
+}
+
+}
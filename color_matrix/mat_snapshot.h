@@ -0,0 +1,154 @@
+/******************************************************************************/
+/*!
+ * @file  mat_snapshot.h
+ * @brief cspace::MatSnapshot, the pixels of a matrix as they were when it was
+ *        taken, copied tile by tile only as they are written over
+ *
+ * @author Cathal Harte <cathal.harte@protonmail.com>
+ */
+#ifndef _MAT_SNAPSHOT_H
+#define _MAT_SNAPSHOT_H
+
+/*******************************************************************************
+* Includes
+******************************************************************************/
+
+#include "color_matrix.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <opencv2/core.hpp>
+
+/*! @addtogroup color_matrix
+ * @{
+ */
+
+namespace cspace
+{
+/*******************************************************************************
+* Definitions and types
+*******************************************************************************/
+
+// Side of the square tiles a snapshot saves, in pixels
+#define SNAPSHOT_TILE 64
+
+/*******************************************************************************
+* Class prototypes
+*******************************************************************************/
+
+// The tiles of one buffer as they were before each write announced on it, shared by every snapshot
+// of the buffer, so that a tile written over is copied once however many snapshots see it. Tiles
+// are cut from the whole buffer, whatever the regions of it the snapshots are of, and only those
+// under some snapshot are saved. A tile is saved again only if a snapshot has been taken since it
+// was last saved, each snapshot seeing the first copy saved after it was taken.
+class SnapshotStore
+{
+    public :
+        // Lets go of the buffer and of the tiles saved, keeping the storage for the next buffer
+        void reset();
+
+        bool empty() const { return whole.empty(); }
+
+        // Whether m is a header on the buffer, whatever its region of it
+        bool aliases(const cv::Mat& m) const;
+
+        // To be called before writing into target, a header on any region of the buffer. The
+        // tiles under it which a snapshot still needs are copied aside; a target on another
+        // buffer is ignored.
+        void beforeWrite(const cv::Mat& target);
+
+        // Of the buffer, over every snapshot of it
+        int savedTiles() const { return (int)saved.size(); }
+        size_t savedBytes() const { return saved_bytes; }
+
+    private :
+        friend class MatSnapshot;
+
+        struct Saved
+        {
+            cv::Mat pixels;
+            cv::Rect rect;      // in the whole buffer
+            int index;          // of the tile
+            uint64_t at;        // the clock when it was saved
+        };
+
+        // Joins m, a header on the buffer cut the same way, to the store, the first sets the
+        // buffer and tile size. Returns the clock it was taken at, 0 if m can't join.
+        uint64_t attach(const Mat& m, int tile, cv::Rect& region);
+        // A rectangle of the whole buffer
+        void beforeWrite(const cv::Rect& r);
+        cv::Rect tileRect(int index) const;
+
+        cv::Mat whole;                      // a header on the whole buffer
+        int tile = SNAPSHOT_TILE;
+        int tiles_x = 0;
+        int tiles_y = 0;
+        cv::Rect covered;                   // the bounding box of the snapshots' regions
+        uint64_t clock = 0;                 // counts the takes and the writes
+        uint64_t last_take = 0;
+        std::vector<uint64_t> last_saved;   // per tile, row major, 0 until first saved
+        std::vector<Saved> saved;           // in the order saved
+        size_t saved_bytes = 0;
+};
+
+// Taking a snapshot takes a header on the pixels, nothing is copied. Whoever is about to write into
+// the buffer calls beforeWrite() with the region they will write, and the tiles of that region the
+// snapshot has not saved yet are copied aside. view() gives back the pixels as they were, the live
+// buffer itself while nothing has been saved.
+//
+// Snapshots of one buffer may share a SnapshotStore, so that the tiles are saved once for all of
+// them; a snapshot taken without one has a store of its own.
+//
+// This is cooperative: a write that is not announced with beforeWrite() shows through the snapshot.
+class MatSnapshot
+{
+    public :
+        MatSnapshot() {}
+        explicit MatSnapshot(const Mat& m, int tile = SNAPSHOT_TILE) { take(m, tile); }
+
+        // A snapshot of m from here on, anything saved before is dropped
+        void take(const Mat& m, int tile = SNAPSHOT_TILE);
+        // The same, sharing the tiles of store, which is of m's buffer or empty. When m is not cut
+        // the way the store's buffer is (a reshape...) the snapshot gets a store of its own.
+        void take(const Mat& m, const std::shared_ptr<SnapshotStore>& store);
+        // Lets go of the pixels and of the store
+        void reset();
+
+        bool empty() const { return source.empty(); }
+
+        // Whether m is a header on the same buffer, whatever its region of it
+        bool aliases(const cv::Mat& m) const;
+
+        // To be called before writing into target, a header on any region of the buffer (the
+        // snapshot's own region, a roi of it, the whole of which it is a roi...). Only what target
+        // and the snapshots have in common is saved; a target on another buffer is ignored.
+        void beforeWrite(const cv::Mat& target);
+        // The same, for a rectangle of the snapshot's own region
+        void beforeWrite(const cv::Rect& roi);
+
+        // The pixels as they were taken, with their colorspace. Shares the live buffer when no tile
+        // of its region has been saved since, else is a copy.
+        Mat view() const;
+
+        // The live header the snapshot was taken from
+        const Mat& live() const { return source; }
+
+        // The tiles saved for the buffer, shared with the other snapshots of the store
+        const SnapshotStore* store() const { return tiles.get(); }
+        int savedTiles() const { return tiles ? tiles->savedTiles() : 0; }
+        size_t savedBytes() const { return tiles ? tiles->savedBytes() : 0; }
+
+    private :
+        Mat source;
+        cv::Rect region;    // of the whole buffer
+        uint64_t taken_at = 0;
+        std::shared_ptr<SnapshotStore> tiles;
+};
+
+}
+
+/*! @}
+ */
+
+#endif  // _MAT_SNAPSHOT_H
@@ -0,0 +1,149 @@
+/******************************************************************************/
+/*!
+ * @file  packed_mask.cpp
+ * @brief cspace::PackedMask, a WHITE_ON_BLACK mask at one bit per pixel
+ *
+ * @author Cathal Harte <cathal.harte@protonmail.com>
+ */
+
+/*******************************************************************************
+* Includes
+******************************************************************************/
+
+#include "packed_mask.h"
+#include "color_matrix_kernels.h"
+
+#include <cassert>
+
+namespace cspace
+{
+
+/*******************************************************************************
+* Classes
+*******************************************************************************/
+
+PackedMask::PackedMask(int rows, int cols) : width(0)
+{
+    create(rows, cols);
+}
+
+PackedMask::PackedMask(const cv::Mat &mask) : width(0)
+{
+    pack(mask);
+}
+
+// The bits are cleared, padding included, on every (re)creation
+void PackedMask::create(int rows, int cols)
+{
+    packed.create(rows, (int)cv::alignSize((cols + 7) / 8, PACKED_ROW_ALIGN), CV_8UC1);
+    packed.setTo(cv::Scalar(0));
+    width = cols;
+}
+
+void PackedMask::pack(const cv::Mat &mask)
+{
+    assert(("mask is a single channel matrix", mask.type() == CV_8UC1));
+
+    // create() clears the padding, which packRow leaves alone
+    if (mask.rows != packed.rows || mask.cols != width)
+    {
+        create(mask.rows, mask.cols);
+    }
+
+    forEachStripe(mask.rows, [&](const cv::Range &r) {
+        for (int y = r.start; y < r.end; y++)
+        {
+            packRow(mask.ptr<uchar>(y), packed.ptr<uchar>(y), width);
+        }
+    });
+}
+
+void PackedMask::unpack(Mat &dst) const
+{
+    createCounted(dst, cv::Size(width, packed.rows), CV_8UC1);
+    forEachStripe(packed.rows, [&](const cv::Range &r) {
+        for (int y = r.start; y < r.end; y++)
+        {
+            unpackRow(packed.ptr<uchar>(y), dst.ptr<uchar>(y), width);
+        }
+    });
+
+    dst.markModified();
+    dst.setColorspace(WHITE_ON_BLACK);
+}
+
+Mat PackedMask::unpack() const
+{
+    Mat out;
+    unpack(out);
+    return out;
+}
+
+PackedMask PackedMask::clone() const
+{
+    PackedMask out;
+    out.packed = packed.clone();
+    out.width = width;
+    return out;
+}
+
+// A clear padding adds nothing to the count
+size_t PackedMask::count() const
+{
+    if (packed.empty())
+    {
+        return 0;
+    }
+    return (size_t)cv::norm(packed, cv::NORM_HAMMING);
+}
+
+PackedMask &PackedMask::operator&=(const PackedMask &m)
+{
+    assert(("masks are the same size", m.size() == size()));
+
+    cv::bitwise_and(packed, m.packed, packed);
+    return *this;
+}
+
+PackedMask &PackedMask::operator|=(const PackedMask &m)
+{
+    assert(("masks are the same size", m.size() == size()));
+
+    cv::bitwise_or(packed, m.packed, packed);
+    return *this;
+}
+
+PackedMask &PackedMask::operator^=(const PackedMask &m)
+{
+    assert(("masks are the same size", m.size() == size()));
+
+    cv::bitwise_xor(packed, m.packed, packed);
+    return *this;
+}
+
+/*******************************************************************************
+* Functions
+*******************************************************************************/
+
+PackedMask operator&(const PackedMask &a, const PackedMask &b)
+{
+    PackedMask out = a.clone();
+    out &= b;
+    return out;
+}
+
+PackedMask operator|(const PackedMask &a, const PackedMask &b)
+{
+    PackedMask out = a.clone();
+    out |= b;
+    return out;
+}
+
+PackedMask operator^(const PackedMask &a, const PackedMask &b)
+{
+    PackedMask out = a.clone();
+    out ^= b;
+    return out;
+}
+
+} // namespace cspace
@@ -0,0 +1,107 @@
+/******************************************************************************/
+/*!
+ * @file  packed_mask.h
+ * @brief cspace::PackedMask, a WHITE_ON_BLACK mask at one bit per pixel
+ *
+ * @author Cathal Harte <cathal.harte@protonmail.com>
+ */
+#ifndef _PACKED_MASK_H
+#define _PACKED_MASK_H
+
+/*******************************************************************************
+* Includes
+******************************************************************************/
+
+#include "color_matrix.h"
+
+#include <opencv2/core.hpp>
+
+/*! @addtogroup color_matrix
+ * @{
+ */
+
+namespace cspace
+{
+/*******************************************************************************
+* Definitions and types
+*******************************************************************************/
+
+// Packed rows are padded to a multiple of this many bytes
+#define PACKED_ROW_ALIGN 16
+
+/*******************************************************************************
+* Class prototypes
+*******************************************************************************/
+
+// A mask holds one bit of information per pixel, set where the WHITE_ON_BLACK image is > 127, and
+// this holds just that: bit x of row y is bit (x % 8) of byte x / 8 of bits().row(y). The rows are
+// padded to PACKED_ROW_ALIGN bytes and the padding bits are always clear, so whole rows can be
+// worked on a vector at a time. A 1080p mask is 270KB rather than 2MB.
+//
+// Like cv::Mat, copies share the bits; clone() for a deep copy.
+class PackedMask
+{
+    public :
+        PackedMask() : width(0) {}
+        // All clear
+        PackedMask(int rows, int cols);
+        // Packed from a CV_8UC1 mask
+        explicit PackedMask(const cv::Mat& mask);
+
+        void create(int rows, int cols);
+        void pack(const cv::Mat& mask);
+
+        // As a WHITE_ON_BLACK image of 0 and 255
+        void unpack(Mat& dst) const;
+        Mat unpack() const;
+
+        PackedMask clone() const;
+
+        int rows() const { return packed.rows; }
+        int cols() const { return width; }
+        cv::Size size() const { return cv::Size(width, packed.rows); }
+        bool empty() const { return packed.empty(); }
+
+        const cv::Mat& bits() const { return packed; }
+        const uchar* ptr(int y) const { return packed.ptr<uchar>(y); }
+        uchar* ptr(int y) { return packed.ptr<uchar>(y); }
+
+        // The number of set pixels
+        size_t count() const;
+
+        PackedMask& operator &= (const PackedMask& m);
+        PackedMask& operator |= (const PackedMask& m);
+        PackedMask& operator ^= (const PackedMask& m);
+
+    private :
+        cv::Mat packed; // rows x padded bytes, CV_8UC1
+        int width;
+};
+
+/*******************************************************************************
+* Function prototypes
+*******************************************************************************/
+
+PackedMask operator & (const PackedMask& a, const PackedMask& b);
+PackedMask operator | (const PackedMask& a, const PackedMask& b);
+PackedMask operator ^ (const PackedMask& a, const PackedMask& b);
+
+// highlightOverBg straight from the bits, the output is the same as from the unpacked masks
+void highlightOverBg(const Mat& bg, const PackedMask& hl, Mat& dst);
+void highlightOverBg(const Mat& bg, const PackedMask* const* hls, int num_hls, Mat& dst);
+
+Mat highlightOverBg(const Mat& bg, const PackedMask& hl);
+
+// Ranges of packed masks go through the templates in color_matrix.h
+template <>
+struct MaskElement<PackedMask>
+{
+    typedef PackedMask type;
+};
+
+}
+
+/*! @}
+ */
+
+#endif  // _PACKED_MASK_H
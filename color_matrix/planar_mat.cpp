@@ -0,0 +1,250 @@
+/******************************************************************************/
+/*!
+ * @file  planar_mat.cpp
+ * @brief cspace::PlanarMat, a 3 channel image stored a channel at a time
+ *
+ * @author Cathal Harte <cathal.harte@protonmail.com>
+ */
+
+/*******************************************************************************
+* Includes
+******************************************************************************/
+
+#include "planar_mat.h"
+#include "color_matrix_kernels.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <stdexcept>
+
+namespace cspace
+{
+
+/*******************************************************************************
+* Functions
+*******************************************************************************/
+
+static bool isThreeChannel(colorspace_t c)
+{
+    return c == BGR || c == RGB || c == HSV;
+}
+
+// The channels of each 3 channel colorspace, in the order of the planes
+static const char *channelNames(colorspace_t c)
+{
+    switch (c)
+    {
+    case BGR:
+        return "BGR";
+    case RGB:
+        return "RGB";
+    case HSV:
+        return "HSV";
+    default:
+        return "";
+    }
+}
+
+/*******************************************************************************
+* Classes
+*******************************************************************************/
+
+PlanarMat::PlanarMat(int rows, int cols, colorspace_t c)
+{
+    create(rows, cols, c);
+}
+
+PlanarMat::PlanarMat(const Mat &interleaved)
+{
+    fromInterleaved(interleaved);
+}
+
+void PlanarMat::create(int rows, int cols, colorspace_t c)
+{
+    assert(("a 3 channel colorspace", c == UNKNOWN || isThreeChannel(c)));
+    createCounted(planes, cv::Size(cols, 3 * rows), CV_8UC1);
+    colorspace = c;
+}
+
+void PlanarMat::fromInterleaved(const Mat &src)
+{
+    INSTRUMENT_SCOPE("cspace::PlanarMat::fromInterleaved");
+    assert(("this is a 3 channel matrix", src.type() == CV_8UC3));
+
+    create(src.rows, src.cols, src.getColorspace());
+    forEachStripe(src.rows, [&](const cv::Range &r) {
+        for (int y = r.start; y < r.end; y++)
+        {
+            deinterleaveRow(src.ptr<uchar>(y), planeRow(0, y), planeRow(1, y), planeRow(2, y), src.cols);
+        }
+    });
+}
+
+void PlanarMat::toInterleaved(Mat &dst) const
+{
+    INSTRUMENT_SCOPE("cspace::PlanarMat::toInterleaved");
+    createCounted(dst, size(), CV_8UC3);
+    forEachStripe(rows(), [&](const cv::Range &r) {
+        for (int y = r.start; y < r.end; y++)
+        {
+            interleaveRow(planeRow(0, y), planeRow(1, y), planeRow(2, y), dst.ptr<uchar>(y), cols());
+        }
+    });
+
+    dst.markModified();
+    dst.setColorspace(colorspace);
+}
+
+Mat PlanarMat::toInterleaved() const
+{
+    Mat out;
+    toInterleaved(out);
+    return out;
+}
+
+// Gray from BGR or RGB is worked out from the planes directly. Otherwise each tile is interleaved
+// into a scratch small enough to stay in cache and goes through the planner's kernels from there,
+// so the image is still read once and written once.
+void PlanarMat::toColorspace(Mat &dst, colorspace_t c, bool gray) const
+{
+    INSTRUMENT_SCOPE("cspace::PlanarMat::toColorspace");
+    if (!gray && c == colorspace)
+    {
+        toInterleaved(dst);
+        return;
+    }
+
+    if (!gray && c == GRAY && (colorspace == BGR || colorspace == RGB))
+    {
+        const int b = colorspace == BGR ? 0 : 2;
+        createCounted(dst, size(), CV_8UC1);
+        forEachStripe(rows(), [&](const cv::Range &r) {
+            for (int y = r.start; y < r.end; y++)
+            {
+                grayPlanesRow(planeRow(b, y), planeRow(1, y), planeRow(2 - b, y), dst.ptr<uchar>(y), cols());
+            }
+        });
+    }
+    else
+    {
+        ConversionPlan plan = planConversion(colorspace, c, gray);
+        if (!plan.stages)
+        {
+            throw std::runtime_error(gray ? "colorspace 3 channel / not fully implemented"
+                                          : "colorspace not implemented");
+        }
+
+        createCounted(dst, size(), plan.out_type);
+        forEachStripe(rows(), [&](const cv::Range &r) {
+            static thread_local cv::Mat tile_in;
+            static thread_local cv::Mat tile_scratch;
+            for (int y = r.start; y < r.end; y += plan_tile_rows)
+            {
+                const int n = std::min(plan_tile_rows, r.end - y);
+                cv::Mat in = scratchRows(tile_in, n, cols(), CV_8UC3);
+                for (int i = 0; i < n; i++)
+                {
+                    interleaveRow(planeRow(0, y + i), planeRow(1, y + i), planeRow(2, y + i),
+                                  in.ptr<uchar>(i), cols());
+                }
+                cv::Mat dst_tile = dst.rowRange(y, y + n);
+                runPlanTile(plan, in, dst_tile, tile_scratch);
+            }
+        });
+    }
+
+    dst.markModified();
+    dst.setColorspace(c);
+}
+
+Mat PlanarMat::toColorspace(colorspace_t c, bool gray) const
+{
+    Mat out;
+    toColorspace(out, c, gray);
+    return out;
+}
+
+// Tile by tile through interleaved scratch, and back out to the planes. Each tile is read in full
+// before it is written, so dst may be this very image.
+void PlanarMat::toColorspace(PlanarMat &dst, colorspace_t c) const
+{
+    INSTRUMENT_SCOPE("cspace::PlanarMat::toColorspace");
+    if (!isThreeChannel(c))
+    {
+        throw std::runtime_error("planar images are 3 channel");
+    }
+    if (c == colorspace)
+    {
+        if (&dst != this)
+        {
+            dst.create(rows(), cols(), c);
+            planes.copyTo(dst.planes);
+        }
+        return;
+    }
+
+    ConversionPlan plan = planConversion(colorspace, c, false);
+    if (!plan.stages)
+    {
+        throw std::runtime_error("colorspace not implemented");
+    }
+
+    PlanarMat src = *this; // keeps the pixels alive should dst be this image
+    dst.create(src.rows(), src.cols(), c);
+    forEachStripe(src.rows(), [&](const cv::Range &r) {
+        static thread_local cv::Mat tile_in;
+        static thread_local cv::Mat tile_out;
+        static thread_local cv::Mat tile_scratch;
+        for (int y = r.start; y < r.end; y += plan_tile_rows)
+        {
+            const int n = std::min(plan_tile_rows, r.end - y);
+            cv::Mat in = scratchRows(tile_in, n, src.cols(), CV_8UC3);
+            cv::Mat out = scratchRows(tile_out, n, src.cols(), CV_8UC3);
+            for (int i = 0; i < n; i++)
+            {
+                interleaveRow(src.planeRow(0, y + i), src.planeRow(1, y + i), src.planeRow(2, y + i),
+                              in.ptr<uchar>(i), src.cols());
+            }
+            runPlanTile(plan, in, out, tile_scratch);
+            for (int i = 0; i < n; i++)
+            {
+                deinterleaveRow(out.ptr<uchar>(i), dst.planeRow(0, y + i), dst.planeRow(1, y + i),
+                                dst.planeRow(2, y + i), src.cols());
+            }
+        }
+    });
+}
+
+cv::Mat PlanarMat::channel(int k) const
+{
+    assert(("one of the 3 planes", k >= 0 && k < 3));
+    return planes.rowRange(k * rows(), (k + 1) * rows());
+}
+
+cv::Mat PlanarMat::channel(char name) const
+{
+    const char *names = channelNames(colorspace);
+    const char *found = std::strchr(names, name);
+    if (!name || !found)
+    {
+        throw std::runtime_error("no such channel in the colorspace");
+    }
+    return channel((int)(found - names));
+}
+
+PlanarMat PlanarMat::clone() const
+{
+    PlanarMat out;
+    out.planes = planes.clone();
+    out.colorspace = colorspace;
+    return out;
+}
+
+void PlanarMat::setColorspace(colorspace_t c)
+{
+    assert(("a 3 channel colorspace", c == UNKNOWN || isThreeChannel(c)));
+    colorspace = c;
+}
+
+} // namespace cspace
@@ -0,0 +1,91 @@
+/******************************************************************************/
+/*!
+ * @file  planar_mat.h
+ * @brief cspace::PlanarMat, a 3 channel image stored a channel at a time
+ *
+ * @author Cathal Harte <cathal.harte@protonmail.com>
+ */
+#ifndef _PLANAR_MAT_H
+#define _PLANAR_MAT_H
+
+/*******************************************************************************
+* Includes
+******************************************************************************/
+
+#include "color_matrix.h"
+
+#include <opencv2/core.hpp>
+
+/*! @addtogroup color_matrix
+ * @{
+ */
+
+namespace cspace
+{
+/*******************************************************************************
+* Class prototypes
+*******************************************************************************/
+
+// A BGR, RGB or HSV image with each channel a contiguous plane, in the colorspace's order: the
+// planes of an HSV image are H, S then V. Work on a single channel (a hue threshold, statistics of
+// V...) reads just that plane, and channel() hands it out as a view, not a split() copy. The
+// colorspace tag travels with it as with a Mat.
+//
+// The conversions read the planes as they are: gray straight from the B, G and R planes, the rest
+// interleaving a tile at a time in cache on the way to the kernels of the planner.
+//
+// Like cv::Mat, copies share the pixels; clone() for a deep copy.
+class PlanarMat
+{
+    public :
+        PlanarMat() = default;
+        PlanarMat(int rows, int cols, colorspace_t c);
+        // The planes of an interleaved 3 channel image
+        explicit PlanarMat(const Mat& interleaved);
+
+        void create(int rows, int cols, colorspace_t c);
+        void fromInterleaved(const Mat& src);
+
+        void toInterleaved(Mat& dst) const;
+        Mat toInterleaved() const;
+
+        // To any colorspace, interleaved, optionally as 3 channel gray (see Mat::to3ChannelGray)
+        void toColorspace(Mat& dst, colorspace_t c, bool gray = false) const;
+        Mat toColorspace(colorspace_t c, bool gray = false) const;
+        // To another 3 channel colorspace, planar
+        void toColorspace(PlanarMat& dst, colorspace_t c) const;
+
+        void toGray(Mat& dst) const { toColorspace(dst, GRAY); }
+
+        // Plane k, or the plane of a channel by name ('H', 'S' or 'V' of HSV...), as a single
+        // channel view of the pixels, no copy
+        cv::Mat channel(int k) const;
+        cv::Mat channel(char name) const;
+
+        PlanarMat clone() const;
+
+        void setColorspace(colorspace_t c);
+        colorspace_t getColorspace() const { return colorspace; }
+
+        int rows() const { return planes.rows / 3; }
+        int cols() const { return planes.cols; }
+        cv::Size size() const { return cv::Size(cols(), rows()); }
+        bool empty() const { return planes.empty(); }
+
+        // All three planes, one above the other: 3 * rows x cols, CV_8UC1
+        const cv::Mat& data() const { return planes; }
+
+    private :
+        const uchar* planeRow(int k, int y) const { return planes.ptr<uchar>(k * rows() + y); }
+        uchar* planeRow(int k, int y) { return planes.ptr<uchar>(k * rows() + y); }
+
+        cv::Mat planes;
+        colorspace_t colorspace = UNKNOWN;
+};
+
+}
+
+/*! @}
+ */
+
+#endif  // _PLANAR_MAT_H
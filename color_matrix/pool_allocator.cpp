@@ -0,0 +1,264 @@
+/******************************************************************************/
+/*!
+ * @file  pool_allocator.cpp
+ * @brief cspace::PoolAllocator, a cv::MatAllocator recycling the buffers of
+ *        each size and type, so that a steady-state pipeline stops allocating
+ *
+ * @author Cathal Harte <cathal.harte@protonmail.com>
+ */
+
+/*******************************************************************************
+* Includes
+******************************************************************************/
+
+#include "pool_allocator.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <new>
+
+namespace cspace
+{
+
+/*******************************************************************************
+* Classes
+*******************************************************************************/
+
+bool PoolAllocator::SizeKey::operator < (const SizeKey &k) const
+{
+    if (rows != k.rows)
+    {
+        return rows < k.rows;
+    }
+    if (cols != k.cols)
+    {
+        return cols < k.cols;
+    }
+    return type < k.type;
+}
+
+PoolAllocator::PoolAllocator(size_t max_pooled_bytes) : max_pooled_bytes(max_pooled_bytes)
+{
+}
+
+PoolAllocator::~PoolAllocator()
+{
+    assert(("The pool outlives the matrices allocated from it", live_bytes == 0));
+    trim();
+}
+
+// The block is over-allocated, so that the data can be aligned with room for the header before it
+uchar *PoolAllocator::newBuffer(const SizeKey &key, size_t bytes)
+{
+    void *block = std::malloc(bytes + sizeof(BufferHeader) + POOL_ALIGN);
+    if (!block)
+    {
+        throw std::bad_alloc();
+    }
+    uchar *data = cv::alignPtr((uchar *)block + sizeof(BufferHeader), POOL_ALIGN);
+    header(data).block = block;
+    header(data).key = key;
+    return data;
+}
+
+void PoolAllocator::freeBuffer(uchar *data)
+{
+    std::free(header(data).block);
+}
+
+PoolAllocator::BufferHeader &PoolAllocator::header(uchar *data)
+{
+    return *((BufferHeader *)data - 1);
+}
+
+// As OpenCV's own allocator, but for where the data comes from. Matrices over data of the caller's
+// are wrapped, not pooled.
+cv::UMatData *PoolAllocator::allocate(int dims, const int *sizes, int type, void *data0,
+                                      size_t *step, cv::AccessFlag, cv::UMatUsageFlags) const
+{
+    size_t total = CV_ELEM_SIZE(type);
+    for (int i = dims - 1; i >= 0; i--)
+    {
+        if (step)
+        {
+            if (data0 && step[i] != CV_AUTOSTEP)
+            {
+                CV_Assert(total <= step[i]);
+                total = step[i];
+            }
+            else
+            {
+                step[i] = total;
+            }
+        }
+        total *= sizes[i];
+    }
+
+    cv::UMatData *u = new cv::UMatData(this);
+    u->size = total;
+    if (data0)
+    {
+        u->data = u->origdata = (uchar *)data0;
+        u->flags |= cv::UMatData::USER_ALLOCATED;
+        return u;
+    }
+
+    SizeKey key;
+    key.rows = 1;
+    for (int i = 0; i < dims - 1; i++)
+    {
+        key.rows *= sizes[i];
+    }
+    key.cols = dims ? sizes[dims - 1] : 0;
+    key.type = type;
+
+    uchar *data = nullptr;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        SizeClass &c = classes[key];
+        c.bytes = total;
+        c.live++;
+        if (!c.free.empty())
+        {
+            data = c.free.back();
+            c.free.pop_back();
+            c.hits++;
+            pooled_bytes -= total;
+        }
+        else
+        {
+            c.misses++;
+        }
+        live_bytes += total;
+        high_water_bytes = std::max(high_water_bytes, live_bytes + pooled_bytes);
+    }
+
+    // a miss goes to the heap outside of the lock
+    if (!data)
+    {
+        try
+        {
+            data = newBuffer(key, total);
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            classes[key].live--;
+            live_bytes -= total;
+            delete u;
+            throw;
+        }
+    }
+    u->data = u->origdata = data;
+    return u;
+}
+
+bool PoolAllocator::allocate(cv::UMatData *u, cv::AccessFlag, cv::UMatUsageFlags) const
+{
+    return u != nullptr;
+}
+
+void PoolAllocator::deallocate(cv::UMatData *u) const
+{
+    if (!u)
+    {
+        return;
+    }
+    CV_Assert(u->urefcount == 0);
+    CV_Assert(u->refcount == 0);
+
+    if (!(u->flags & cv::UMatData::USER_ALLOCATED))
+    {
+        uchar *data = u->origdata;
+        bool kept = false;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            SizeClass &c = classes[header(data).key];
+            c.live--;
+            live_bytes -= u->size;
+            if (pooled_bytes + u->size <= max_pooled_bytes)
+            {
+                c.free.push_back(data);
+                pooled_bytes += u->size;
+                kept = true;
+            }
+        }
+        if (!kept)
+        {
+            freeBuffer(data);
+        }
+        u->origdata = nullptr;
+    }
+    delete u;
+}
+
+size_t PoolAllocator::trim(size_t keep_bytes)
+{
+    std::vector<uchar *> freed;
+    size_t freed_bytes = 0;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        std::vector<SizeClass *> by_size;
+        for (auto &c : classes)
+        {
+            by_size.push_back(&c.second);
+        }
+        std::sort(by_size.begin(), by_size.end(), [](const SizeClass *a, const SizeClass *b) {
+            return a->bytes > b->bytes;
+        });
+
+        for (SizeClass *c : by_size)
+        {
+            while (pooled_bytes > keep_bytes && !c->free.empty())
+            {
+                freed.push_back(c->free.back());
+                c->free.pop_back();
+                pooled_bytes -= c->bytes;
+                freed_bytes += c->bytes;
+            }
+        }
+    }
+
+    for (uchar *data : freed)
+    {
+        freeBuffer(data);
+    }
+    return freed_bytes;
+}
+
+PoolStats PoolAllocator::stats() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    PoolStats out;
+    out.live_bytes = live_bytes;
+    out.pooled_bytes = pooled_bytes;
+    out.high_water_bytes = high_water_bytes;
+    for (auto &c : classes)
+    {
+        PoolSizeStats s;
+        s.rows = c.first.rows;
+        s.cols = c.first.cols;
+        s.type = c.first.type;
+        s.bytes = c.second.bytes;
+        s.hits = c.second.hits;
+        s.misses = c.second.misses;
+        s.live = c.second.live;
+        s.pooled = c.second.free.size();
+        out.sizes.push_back(s);
+    }
+    return out;
+}
+
+void PoolAllocator::resetStats()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto &c : classes)
+    {
+        c.second.hits = 0;
+        c.second.misses = 0;
+    }
+    high_water_bytes = live_bytes + pooled_bytes;
+}
+
+} // namespace cspace
@@ -0,0 +1,137 @@
+/******************************************************************************/
+/*!
+ * @file  pool_allocator.h
+ * @brief cspace::PoolAllocator, a cv::MatAllocator recycling the buffers of
+ *        each size and type, so that a steady-state pipeline stops allocating
+ *
+ * @author Cathal Harte <cathal.harte@protonmail.com>
+ */
+#ifndef _POOL_ALLOCATOR_H
+#define _POOL_ALLOCATOR_H
+
+/*******************************************************************************
+* Includes
+******************************************************************************/
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <vector>
+#include <opencv2/core.hpp>
+
+/*! @addtogroup color_matrix
+ * @{
+ */
+
+namespace cspace
+{
+/*******************************************************************************
+* Definitions and types
+*******************************************************************************/
+
+// Buffers are aligned for the widest vector loads and so as not to share a cache line
+#define POOL_ALIGN 64
+
+// A size class, buffers are only ever handed back for the same rows, cols and type. The rows of
+// matrices of more than 2 dimensions are those of all but the last.
+struct PoolSizeStats
+{
+    int rows;
+    int cols;
+    int type;
+    size_t bytes;     // of each buffer
+    uint64_t hits;    // allocations served from the pool
+    uint64_t misses;  // allocations that went to the heap
+    size_t live;      // buffers held by matrices
+    size_t pooled;    // buffers waiting to be reused
+};
+
+struct PoolStats
+{
+    size_t live_bytes = 0;
+    size_t pooled_bytes = 0;
+    size_t high_water_bytes = 0; // the most live and pooled bytes there have been at once
+    std::vector<PoolSizeStats> sizes;
+};
+
+/*******************************************************************************
+* Class prototypes
+*******************************************************************************/
+
+// A cv::MatAllocator keeping the buffers matrices let go of, to hand back to the next matrix of
+// the same size and type. Once a pipeline has been round once the misses stop, and with them the
+// heap traffic and the page faults of fresh buffers.
+// Opt in with cspace::setOutputAllocator(&pool), or cspace::AllocatorScope for a pipeline's
+// threads alone; or for every cv::Mat with cv::Mat::setDefaultAllocator(&pool). The pool must
+// outlive the matrices allocated from it. Thread safe.
+class PoolAllocator : public cv::MatAllocator
+{
+    public :
+        // Buffers let go of beyond max_pooled_bytes are freed rather than kept
+        explicit PoolAllocator(size_t max_pooled_bytes = std::numeric_limits<size_t>::max());
+        ~PoolAllocator();
+        PoolAllocator(const PoolAllocator&) = delete;
+        PoolAllocator& operator = (const PoolAllocator&) = delete;
+
+        cv::UMatData* allocate(int dims, const int* sizes, int type, void* data, size_t* step,
+                               cv::AccessFlag flags, cv::UMatUsageFlags usage_flags) const override;
+        bool allocate(cv::UMatData* u, cv::AccessFlag access_flags,
+                      cv::UMatUsageFlags usage_flags) const override;
+        void deallocate(cv::UMatData* u) const override;
+
+        // Frees pooled buffers, largest first, until no more than keep_bytes are pooled.
+        // Returns the bytes freed.
+        size_t trim(size_t keep_bytes = 0);
+
+        PoolStats stats() const;
+        // Zeroes the hits and misses, and brings the high-water mark down to what is held now
+        void resetStats();
+
+    private :
+        struct SizeKey
+        {
+            int rows;
+            int cols;
+            int type;
+            bool operator < (const SizeKey& k) const;
+        };
+
+        struct SizeClass
+        {
+            size_t bytes = 0;
+            uint64_t hits = 0;
+            uint64_t misses = 0;
+            size_t live = 0;
+            std::vector<uchar*> free; // the data of buffers waiting
+        };
+
+        // Just before the data of each buffer, which is where the block allocated starts and what
+        // it is for
+        struct BufferHeader
+        {
+            void* block;
+            SizeKey key;
+        };
+
+        static uchar* newBuffer(const SizeKey& key, size_t bytes);
+        static void freeBuffer(uchar* data);
+        static BufferHeader& header(uchar* data);
+
+        size_t max_pooled_bytes;
+
+        // allocate() and deallocate() are const in cv::MatAllocator
+        mutable std::mutex lock;
+        mutable std::map<SizeKey, SizeClass> classes;
+        mutable size_t live_bytes = 0;
+        mutable size_t pooled_bytes = 0;
+        mutable size_t high_water_bytes = 0;
+};
+
+}
+
+/*! @}
+ */
+
+#endif  // _POOL_ALLOCATOR_H
@@ -0,0 +1,394 @@
+/******************************************************************************/
+/*!
+ * @file  tile_stream.cpp
+ * @brief Conversions and highlights of images too large for memory, streamed
+ *        through a tile at a time from memory mapped or tiled sources
+ *
+ * @author Cathal Harte <cathal.harte@protonmail.com>
+ */
+
+/*******************************************************************************
+* Includes
+******************************************************************************/
+
+#include "tile_stream.h"
+#include "color_matrix_kernels.h"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace cspace
+{
+
+/*******************************************************************************
+* Definitions and types
+*******************************************************************************/
+
+// The tiles read ahead wait in slots of a ring, one per tile
+struct TileSlot
+{
+    cv::Mat in[2];
+    bool ready = false;
+};
+
+/*******************************************************************************
+* Functions
+*******************************************************************************/
+
+static int64_t steadyNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+static size_t pageSize()
+{
+    static const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    return page;
+}
+
+// Gives back the pages wholly within [begin, end), those shared with the rows either side are kept
+static void releasePages(uchar *begin, uchar *end)
+{
+    uchar *first = cv::alignPtr(begin, (int)pageSize());
+    uchar *last = cv::alignPtr(end - pageSize() + 1, (int)pageSize());
+    if (end - begin >= (ptrdiff_t)pageSize() && last > first)
+    {
+        madvise(first, last - first, MADV_DONTNEED);
+    }
+}
+
+static void mapFile(const std::string &path, int fd, size_t bytes, int prot, uchar *&map)
+{
+    void *m = mmap(nullptr, bytes, prot, MAP_SHARED, fd, 0);
+    if (m == MAP_FAILED)
+    {
+        close(fd);
+        throw std::runtime_error("cannot map " + path);
+    }
+    map = (uchar *)m;
+    madvise(map, bytes, MADV_SEQUENTIAL);
+}
+
+// The tiles of the image cut to the tile size, a row of tiles at a time
+static std::vector<cv::Rect> tileRects(cv::Size size, cv::Size tile)
+{
+    std::vector<cv::Rect> rects;
+    for (int y = 0; y < size.height; y += tile.height)
+    {
+        for (int x = 0; x < size.width; x += tile.width)
+        {
+            rects.push_back(cv::Rect(x, y, tile.width, tile.height) & cv::Rect(cv::Point(), size));
+        }
+    }
+    return rects;
+}
+
+// A thread reads the tiles of every source into the ring, up to cfg.prefetch ahead of this one,
+// which works on them and writes the results to dst. Each row of tiles is released once done.
+template <typename Fn>
+static StreamStats streamTiles(TileSource *const *srcs, int num_srcs, TileSink &dst,
+                               const StreamConfig &cfg, const Fn &process)
+{
+    const cv::Size size = srcs[0]->size();
+    assert(("A source has pixels", size.area() > 0));
+    size_t px_bytes = CV_ELEM_SIZE(dst.type());
+    const int ahead = std::max(0, cfg.prefetch);
+    for (int s = 0; s < num_srcs; s++)
+    {
+        if (srcs[s]->size() != size)
+        {
+            throw std::runtime_error("the sources of a stream are of one size");
+        }
+        px_bytes += (ahead + 1) * CV_ELEM_SIZE(srcs[s]->type());
+    }
+    if (dst.size() != size)
+    {
+        throw std::runtime_error("the sink is the size of the source");
+    }
+
+    // Whatever the tile width, the sources are paged in and the sink written a band of whole rows
+    // at a time, and the reading ahead can reach a band further on for each tile ahead. So the
+    // budget is of bands the tile's height across the image, and the tile is cut down to fit it.
+    size_t rows = cfg.memory_budget / (px_bytes * size.width);
+    if (!rows)
+    {
+        throw std::runtime_error("the memory budget is too small for a row of pixels");
+    }
+    cv::Size tile = cfg.tile.empty() ? cv::Size(size.width, size.height) : cfg.tile;
+    tile.width = std::min(tile.width, size.width);
+    tile.height = (int)std::min((size_t)std::min(tile.height, size.height), rows);
+
+    StreamStats stats;
+    stats.tile = tile;
+    stats.buffer_bytes = px_bytes * tile.height * size.width;
+    const std::vector<cv::Rect> rects = tileRects(size, tile);
+
+    std::vector<TileSlot> slots(ahead + 1);
+    std::mutex lock;
+    std::condition_variable changed;
+    std::exception_ptr read_error;
+    bool stop = false;
+
+    std::thread reader([&] {
+        for (size_t t = 0; t < rects.size(); t++)
+        {
+            TileSlot &slot = slots[t % slots.size()];
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                changed.wait(guard, [&] { return !slot.ready || stop; });
+                if (stop)
+                {
+                    return;
+                }
+            }
+            try
+            {
+                for (int s = 0; s < num_srcs; s++)
+                {
+                    srcs[s]->read(rects[t], slot.in[s]);
+                }
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                read_error = std::current_exception();
+                changed.notify_all();
+                return;
+            }
+            std::lock_guard<std::mutex> guard(lock);
+            slot.ready = true;
+            changed.notify_all();
+        }
+    });
+
+    auto stopReader = [&] {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stop = true;
+            changed.notify_all();
+        }
+        reader.join();
+    };
+
+    try
+    {
+        for (size_t t = 0; t < rects.size(); t++)
+        {
+            TileSlot &slot = slots[t % slots.size()];
+            {
+                int64_t start = steadyNs();
+                std::unique_lock<std::mutex> guard(lock);
+                changed.wait(guard, [&] { return slot.ready || read_error; });
+                stats.read_wait_ns += steadyNs() - start;
+                if (!slot.ready)
+                {
+                    std::rethrow_exception(read_error);
+                }
+            }
+
+            const cv::Rect &r = rects[t];
+            int64_t start = steadyNs();
+            cv::Mat out = dst.region(r);
+            process(slot.in, out);
+            dst.commit(r);
+            stats.compute_ns += steadyNs() - start;
+            stats.tiles++;
+
+            if (r.x + r.width == size.width)
+            {
+                cv::Rect band(0, r.y, size.width, r.height);
+                for (int s = 0; s < num_srcs; s++)
+                {
+                    srcs[s]->release(band);
+                }
+                dst.release(band);
+            }
+
+            std::lock_guard<std::mutex> guard(lock);
+            slot.ready = false;
+            changed.notify_all();
+        }
+    }
+    catch (...)
+    {
+        stopReader();
+        throw;
+    }
+    stopReader();
+    return stats;
+}
+
+StreamStats streamConversion(TileSource &src, colorspace_t from, TileSink &dst, colorspace_t c,
+                             bool gray, const StreamConfig &cfg)
+{
+    INSTRUMENT_SCOPE("cspace::streamConversion");
+    ConversionPlan plan = planConversion(from, c, gray);
+    if (!plan.stages)
+    {
+        throw std::runtime_error("colorspace not implemented");
+    }
+    if (dst.type() != plan.out_type)
+    {
+        throw std::runtime_error("the sink is not of the type the conversion gives");
+    }
+
+    TileSource *srcs[] = {&src};
+    return streamTiles(srcs, 1, dst, cfg, [&](const cv::Mat *in, cv::Mat &out) {
+        Mat tile, result;
+        tile = in[0];
+        tile.setColorspace(from);
+        result = out; // written in place, it is the size and type already
+        tile.toColorspace(result, c, gray);
+    });
+}
+
+StreamStats streamHighlight(TileSource &bg, colorspace_t bg_c, TileSource &mask, TileSink &dst,
+                            const StreamConfig &cfg)
+{
+    INSTRUMENT_SCOPE("cspace::streamHighlight");
+    if (mask.type() != CV_8UC1 || dst.type() != CV_8UC3)
+    {
+        throw std::runtime_error("the mask is CV_8UC1 and the sink CV_8UC3");
+    }
+
+    TileSource *srcs[] = {&bg, &mask};
+    return streamTiles(srcs, 2, dst, cfg, [&](const cv::Mat *in, cv::Mat &out) {
+        Mat tile, hl, result;
+        tile = in[0];
+        tile.setColorspace(bg_c);
+        hl = in[1];
+        result = out;
+        highlightOverBg(tile, hl, result);
+    });
+}
+
+/*******************************************************************************
+* Classes
+*******************************************************************************/
+
+MappedSource::MappedSource(const std::string &path, cv::Size size, int type, size_t offset)
+    : offset(offset), image_size(size), image_type(type)
+{
+    assert(("An image has pixels", size.area() > 0));
+    fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        throw std::runtime_error("cannot open " + path);
+    }
+    map_bytes = offset + (size_t)size.area() * CV_ELEM_SIZE(type);
+    struct stat st;
+    if (fstat(fd, &st) || (size_t)st.st_size < map_bytes)
+    {
+        close(fd);
+        throw std::runtime_error(path + " is smaller than the image");
+    }
+    mapFile(path, fd, map_bytes, PROT_READ, map);
+}
+
+MappedSource::~MappedSource()
+{
+    munmap(map, map_bytes);
+    close(fd);
+}
+
+cv::Mat MappedSource::image() const
+{
+    return cv::Mat(image_size, image_type, map + offset);
+}
+
+// The view is paged in here, on the stream's reading thread, rather than on first touch by the
+// kernels. The mapping is read only, so are the views.
+void MappedSource::read(const cv::Rect &r, cv::Mat &dst)
+{
+    dst = image()(r);
+    const size_t row_bytes = image_size.width * CV_ELEM_SIZE(image_type);
+    uchar *begin = map + offset + r.y * row_bytes;
+    uchar *end = begin + r.height * row_bytes;
+    uchar *first = cv::alignPtr(begin - pageSize() + 1, (int)pageSize());
+    madvise(first, end - first, MADV_WILLNEED);
+
+    volatile uchar sink = 0;
+    for (int y = 0; y < dst.rows; y++)
+    {
+        const uchar *row = dst.ptr<uchar>(y);
+        const size_t bytes = dst.cols * dst.elemSize();
+        for (size_t i = 0; i < bytes; i += pageSize())
+        {
+            sink = sink + row[i];
+        }
+        sink = sink + row[bytes - 1];
+    }
+}
+
+void MappedSource::release(const cv::Rect &r)
+{
+    const size_t row_bytes = image_size.width * CV_ELEM_SIZE(image_type);
+    uchar *begin = map + offset + r.y * row_bytes;
+    releasePages(begin, begin + r.height * row_bytes);
+}
+
+MappedSink::MappedSink(const std::string &path, cv::Size size, int type)
+    : image_size(size), image_type(type)
+{
+    assert(("An image has pixels", size.area() > 0));
+    fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        throw std::runtime_error("cannot create " + path);
+    }
+    map_bytes = (size_t)size.area() * CV_ELEM_SIZE(type);
+    if (ftruncate(fd, (off_t)map_bytes))
+    {
+        close(fd);
+        throw std::runtime_error("cannot size " + path);
+    }
+    mapFile(path, fd, map_bytes, PROT_READ | PROT_WRITE, map);
+}
+
+MappedSink::~MappedSink()
+{
+    msync(map, map_bytes, MS_SYNC);
+    munmap(map, map_bytes);
+    close(fd);
+}
+
+cv::Mat MappedSink::image() const
+{
+    return cv::Mat(image_size, image_type, map);
+}
+
+cv::Mat MappedSink::region(const cv::Rect &r)
+{
+    return image()(r);
+}
+
+void MappedSink::commit(const cv::Rect &)
+{
+}
+
+// Written back in the background, and out of our memory; the page cache has the pixels still
+void MappedSink::release(const cv::Rect &r)
+{
+    const size_t row_bytes = image_size.width * CV_ELEM_SIZE(image_type);
+    uchar *begin = map + r.y * row_bytes;
+    uchar *end = begin + r.height * row_bytes;
+    uchar *first = cv::alignPtr(begin - pageSize() + 1, (int)pageSize());
+    msync(first, end - first, MS_ASYNC);
+    releasePages(begin, end);
+}
+
+} // namespace cspace
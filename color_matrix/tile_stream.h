@@ -0,0 +1,162 @@
+/******************************************************************************/
+/*!
+ * @file  tile_stream.h
+ * @brief Conversions and highlights of images too large for memory, streamed
+ *        through a tile at a time from memory mapped or tiled sources
+ *
+ * @author Cathal Harte <cathal.harte@protonmail.com>
+ */
+#ifndef _TILE_STREAM_H
+#define _TILE_STREAM_H
+
+/*******************************************************************************
+* Includes
+******************************************************************************/
+
+#include "color_matrix.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <opencv2/core.hpp>
+
+/*! @addtogroup color_matrix
+ * @{
+ */
+
+namespace cspace
+{
+/*******************************************************************************
+* Definitions and types
+*******************************************************************************/
+
+struct StreamConfig
+{
+    // The most bytes of pixels held at once, the tiles read ahead included
+    size_t memory_budget = (size_t)256 << 20;
+    // Tiles read ahead of the one being worked on, on a thread of their own
+    int prefetch = 2;
+    // The tile size; empty for bands across the whole width, as tall as the budget allows. A
+    // tile taller than the budget allows is cut down to fit it.
+    cv::Size tile;
+};
+
+struct StreamStats
+{
+    uint64_t tiles = 0;
+    cv::Size tile;
+    size_t buffer_bytes = 0;  // of pixels held at once, at most, whole rows of the image
+    int64_t compute_ns = 0;
+    int64_t read_wait_ns = 0; // computing held up waiting on a tile, the prefetch not keeping up
+};
+
+/*******************************************************************************
+* Class prototypes
+*******************************************************************************/
+
+// Where the pixels of a streamed image come from. Tiles are read in order, row of tiles by row of
+// tiles, from a thread of the stream's own; read() is never called concurrently.
+class TileSource
+{
+    public :
+        virtual ~TileSource() {}
+
+        virtual cv::Size size() const = 0;
+        virtual int type() const = 0;
+
+        // The pixels of r into dst, which the source may make a view of memory of its own that
+        // stays valid until release() of the band
+        virtual void read(const cv::Rect& r, cv::Mat& dst) = 0;
+        // Every tile of the rows of r has been worked on, whatever memory backs them can go
+        virtual void release(const cv::Rect& r) { (void)r; }
+};
+
+// Where the pixels of a streamed result go
+class TileSink
+{
+    public :
+        virtual ~TileSink() {}
+
+        virtual cv::Size size() const = 0;
+        virtual int type() const = 0;
+
+        // A matrix the size of r, the result of the tile is written into. Until commit().
+        virtual cv::Mat region(const cv::Rect& r) = 0;
+        virtual void commit(const cv::Rect& r) = 0;
+        // As TileSource::release()
+        virtual void release(const cv::Rect& r) { (void)r; }
+};
+
+// A raw image file, its rows one after the other from offset, mapped into memory. Tiles are views
+// of the mapping, paged in as they are read, ahead of the work, and given back once done with, so
+// that the memory held stays at the stream's budget however large the file.
+class MappedSource : public TileSource
+{
+    public :
+        MappedSource(const std::string& path, cv::Size size, int type, size_t offset = 0);
+        ~MappedSource();
+        MappedSource(const MappedSource&) = delete;
+        MappedSource& operator = (const MappedSource&) = delete;
+
+        cv::Size size() const override { return image_size; }
+        int type() const override { return image_type; }
+        void read(const cv::Rect& r, cv::Mat& dst) override;
+        void release(const cv::Rect& r) override;
+
+    private :
+        cv::Mat image() const;
+
+        int fd = -1;
+        uchar* map = nullptr;
+        size_t map_bytes = 0;
+        size_t offset;
+        cv::Size image_size;
+        int image_type;
+};
+
+// The raw image file of a result, created (or truncated) to the size of the image and mapped.
+// Tiles are written straight into the mapping, and flushed and given back a band at a time.
+class MappedSink : public TileSink
+{
+    public :
+        MappedSink(const std::string& path, cv::Size size, int type);
+        ~MappedSink();
+        MappedSink(const MappedSink&) = delete;
+        MappedSink& operator = (const MappedSink&) = delete;
+
+        cv::Size size() const override { return image_size; }
+        int type() const override { return image_type; }
+        cv::Mat region(const cv::Rect& r) override;
+        void commit(const cv::Rect& r) override;
+        void release(const cv::Rect& r) override;
+
+    private :
+        cv::Mat image() const;
+
+        int fd = -1;
+        uchar* map = nullptr;
+        size_t map_bytes = 0;
+        cv::Size image_size;
+        int image_type;
+};
+
+/*******************************************************************************
+* Function prototypes
+*******************************************************************************/
+
+// src, in colorspace from, converted to c (to3ChannelGray's rendition with gray) tile by tile into
+// dst, which is the size of src and of the type the conversion gives
+StreamStats streamConversion(TileSource& src, colorspace_t from, TileSink& dst, colorspace_t c,
+                             bool gray = false, const StreamConfig& cfg = StreamConfig());
+
+// highlightOverBg tile by tile, bg in colorspace bg_c, mask a CV_8UC1 image of the same size, into
+// a CV_8UC3 dst
+StreamStats streamHighlight(TileSource& bg, colorspace_t bg_c, TileSource& mask, TileSink& dst,
+                            const StreamConfig& cfg = StreamConfig());
+
+}
+
+/*! @}
+ */
+
+#endif  // _TILE_STREAM_H
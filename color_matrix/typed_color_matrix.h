@@ -0,0 +1,272 @@
+/******************************************************************************/
+/*!
+ * @file  typed_color_matrix.h
+ * @brief cspace::TypedMat, a matrix with its colorspace fixed at compile time
+ * 
+ *        Header only template class
+ * 
+ * @author Cathal Harte <cathal.harte@protonmail.com>
+ */
+#ifndef _TYPED_COLOR_MATRIX_H
+#define _TYPED_COLOR_MATRIX_H
+
+/*******************************************************************************
+* Includes
+******************************************************************************/
+
+#include "color_matrix.h"
+#include "color_matrix_rows.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <type_traits>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+/*! @addtogroup color_matrix
+ * @{
+ */
+
+namespace cspace
+{
+/*******************************************************************************
+* Definitions and types
+*******************************************************************************/
+
+// What a colorspace is stored as. Only colorspaces with a fixed layout have traits, so there is
+// no TypedMat<UNKNOWN>.
+template <colorspace_t C>
+struct ColorspaceTraits;
+
+template <> struct ColorspaceTraits<BGR> { static const int type = CV_8UC3; };
+template <> struct ColorspaceTraits<RGB> { static const int type = CV_8UC3; };
+template <> struct ColorspaceTraits<HSV> { static const int type = CV_8UC3; };
+template <> struct ColorspaceTraits<GRAY> { static const int type = CV_8UC1; };
+template <> struct ColorspaceTraits<WHITE_ON_BLACK> { static const int type = CV_8UC1; };
+
+namespace typed
+{
+
+template <colorspace_t C>
+struct always_false : std::false_type {};
+
+// The kernels, as types so that the conversion resolves at compile time and inlines
+
+struct Copy
+{
+    static void apply(const cv::Mat &src, cv::Mat &dst) { src.copyTo(dst); }
+};
+
+template <int Code>
+struct Cvt
+{
+    static void apply(const cv::Mat &src, cv::Mat &dst) { cv::cvtColor(src, dst, Code); }
+};
+
+// gray of a BGR (BIdx 0), RGB (BIdx 2) or single channel source, replicated or as HSV
+template <int BIdx, bool Hsv>
+struct Gray3
+{
+    static void apply(const cv::Mat &src, cv::Mat &dst)
+    {
+        for (int y = 0; y < src.rows; y++)
+        {
+            if (Hsv)
+            {
+                grayHsvRow(src.ptr<uchar>(y), src.channels(), BIdx, dst.ptr<uchar>(y), src.cols);
+            }
+            else
+            {
+                grayReplicateRow(src.ptr<uchar>(y), src.channels(), BIdx, dst.ptr<uchar>(y), src.cols);
+            }
+        }
+    }
+};
+
+// A single kernel over stripes of rows
+template <typename K>
+struct Direct
+{
+    static void run(const cv::Mat &src, cv::Mat &dst)
+    {
+        forEachStripe(src.rows, [&](const cv::Range &r) {
+            cv::Mat dst_stripe = dst.rowRange(r);
+            K::apply(src.rowRange(r), dst_stripe);
+        });
+    }
+};
+
+// Two kernels meeting in a per-thread BGR scratch tile, still a single pass over the image
+template <typename K0, typename K1>
+struct Chain
+{
+    static void run(const cv::Mat &src, cv::Mat &dst)
+    {
+        forEachStripe(src.rows, [&](const cv::Range &r) {
+            static thread_local cv::Mat tile_scratch;
+            for (int y = r.start; y < r.end; y += plan_tile_rows)
+            {
+                cv::Range tile(y, std::min(y + plan_tile_rows, r.end));
+                cv::Mat scratch = scratchRows(tile_scratch, tile.size(), src.cols, CV_8UC3);
+                cv::Mat dst_tile = dst.rowRange(tile);
+                K0::apply(src.rowRange(tile), scratch);
+                K1::apply(scratch, dst_tile);
+            }
+        });
+    }
+};
+
+// From -> To, only the conversions that exist are defined, the rest fail to compile
+template <colorspace_t From, colorspace_t To>
+struct Converter
+{
+    static_assert(always_false<From>::value, "no conversion between these colorspaces");
+};
+
+template <> struct Converter<GRAY, GRAY> : Direct<Copy> {};
+template <> struct Converter<GRAY, BGR> : Direct<Gray3<0, false>> {};
+template <> struct Converter<GRAY, RGB> : Direct<Gray3<0, false>> {};
+template <> struct Converter<GRAY, HSV> : Direct<Gray3<0, true>> {};
+template <> struct Converter<WHITE_ON_BLACK, GRAY> : Direct<Copy> {};
+template <> struct Converter<WHITE_ON_BLACK, BGR> : Direct<Gray3<0, false>> {};
+template <> struct Converter<WHITE_ON_BLACK, RGB> : Direct<Gray3<0, false>> {};
+template <> struct Converter<WHITE_ON_BLACK, HSV> : Direct<Gray3<0, true>> {};
+template <> struct Converter<BGR, GRAY> : Direct<Cvt<cv::COLOR_BGR2GRAY>> {};
+template <> struct Converter<BGR, BGR> : Direct<Copy> {};
+template <> struct Converter<BGR, RGB> : Direct<Cvt<cv::COLOR_BGR2RGB>> {};
+template <> struct Converter<BGR, HSV> : Direct<Cvt<cv::COLOR_BGR2HSV>> {};
+template <> struct Converter<RGB, GRAY> : Direct<Cvt<cv::COLOR_RGB2GRAY>> {};
+template <> struct Converter<RGB, BGR> : Direct<Cvt<cv::COLOR_RGB2BGR>> {};
+template <> struct Converter<RGB, RGB> : Direct<Copy> {};
+template <> struct Converter<RGB, HSV> : Direct<Cvt<cv::COLOR_RGB2HSV>> {};
+template <> struct Converter<HSV, GRAY> : Chain<Cvt<cv::COLOR_HSV2BGR>, Cvt<cv::COLOR_BGR2GRAY>> {};
+template <> struct Converter<HSV, BGR> : Direct<Cvt<cv::COLOR_HSV2BGR>> {};
+template <> struct Converter<HSV, RGB> : Direct<Cvt<cv::COLOR_HSV2RGB>> {};
+template <> struct Converter<HSV, HSV> : Direct<Copy> {};
+
+// From -> a 3 channel gray rendition in To
+template <colorspace_t From, colorspace_t To>
+struct GrayConverter
+{
+    static_assert(always_false<From>::value, "no 3 channel gray rendition between these colorspaces");
+};
+
+template <> struct GrayConverter<GRAY, BGR> : Direct<Gray3<0, false>> {};
+template <> struct GrayConverter<GRAY, RGB> : Direct<Gray3<0, false>> {};
+template <> struct GrayConverter<GRAY, HSV> : Direct<Gray3<0, true>> {};
+template <> struct GrayConverter<WHITE_ON_BLACK, BGR> : Direct<Gray3<0, false>> {};
+template <> struct GrayConverter<WHITE_ON_BLACK, RGB> : Direct<Gray3<0, false>> {};
+template <> struct GrayConverter<WHITE_ON_BLACK, HSV> : Direct<Gray3<0, true>> {};
+template <> struct GrayConverter<BGR, BGR> : Direct<Gray3<0, false>> {};
+template <> struct GrayConverter<BGR, RGB> : Direct<Gray3<0, false>> {};
+template <> struct GrayConverter<BGR, HSV> : Direct<Gray3<0, true>> {};
+template <> struct GrayConverter<RGB, BGR> : Direct<Gray3<2, false>> {};
+template <> struct GrayConverter<RGB, RGB> : Direct<Gray3<2, false>> {};
+template <> struct GrayConverter<RGB, HSV> : Direct<Gray3<2, true>> {};
+template <> struct GrayConverter<HSV, BGR> : Chain<Cvt<cv::COLOR_HSV2BGR>, Gray3<0, false>> {};
+template <> struct GrayConverter<HSV, RGB> : Chain<Cvt<cv::COLOR_HSV2BGR>, Gray3<0, false>> {};
+template <> struct GrayConverter<HSV, HSV> : Chain<Cvt<cv::COLOR_HSV2BGR>, Gray3<0, true>> {};
+
+} // namespace typed
+
+/*******************************************************************************
+* Class prototypes
+*******************************************************************************/
+
+// The colorspace is part of the type, so conversions pick their kernel at compile time, with no
+// switch or channel checks per call, and a conversion that doesn't exist doesn't compile.
+// For fixed pipelines, with cspace::Mat at the edges:
+//     auto hsv = cspace::TypedMat<cspace::BGR>::fromRuntime(frame).to<cspace::HSV>();
+//     cspace::Mat out = hsv.toRuntime();
+template <colorspace_t C>
+class TypedMat : public cv::Mat
+{
+    public :
+        static const colorspace_t colorspace = C;
+        static const int mat_type = ColorspaceTraits<C>::type;
+
+        TypedMat() {}
+        TypedMat(int rows, int cols) : cv::Mat(rows, cols, mat_type) {}
+        TypedMat(cv::Size size) : cv::Mat(size, mat_type) {}
+        TypedMat(int rows, int cols, const cv::Scalar &s) : cv::Mat(rows, cols, mat_type, s) {}
+
+        // Take a header on pixels already known to be in C
+        explicit TypedMat(const cv::Mat &m) : cv::Mat(m)
+        {
+            if (!m.empty() && m.type() != mat_type)
+            {
+                throw std::runtime_error("matrix type does not match the colorspace");
+            }
+        }
+
+        template <colorspace_t To>
+        void to(TypedMat<To> &dst) const
+        {
+            cv::Mat src = *this; // keep the source alive should dst share our buffer
+            if (src.data == dst.data && mat_type == TypedMat<To>::mat_type)
+            {
+                src = src.clone();
+            }
+            dst.create(src.size(), TypedMat<To>::mat_type);
+            typed::Converter<C, To>::run(src, dst);
+        }
+
+        template <colorspace_t To>
+        TypedMat<To> to() const
+        {
+            TypedMat<To> out;
+            to(out);
+            return out;
+        }
+
+        template <colorspace_t To>
+        void to3ChannelGray(TypedMat<To> &dst) const
+        {
+            cv::Mat src = *this;
+            if (src.data == dst.data && mat_type == TypedMat<To>::mat_type)
+            {
+                src = src.clone();
+            }
+            dst.create(src.size(), TypedMat<To>::mat_type);
+            typed::GrayConverter<C, To>::run(src, dst);
+        }
+
+        template <colorspace_t To>
+        TypedMat<To> to3ChannelGray() const
+        {
+            TypedMat<To> out;
+            to3ChannelGray(out);
+            return out;
+        }
+
+        // Bridging to and from the runtime tagged cspace::Mat, headers only, the pixels are shared
+        cspace::Mat toRuntime() const
+        {
+            cspace::Mat out;
+            out.setColorspace(C);
+            out = static_cast<const cv::Mat &>(*this);
+            out.setColorspace(C); // assignment retags single channel matrices as GRAY
+            return out;
+        }
+
+        static TypedMat fromRuntime(const cspace::Mat &m)
+        {
+            if (m.getColorspace() != C)
+            {
+                throw std::runtime_error("colorspace does not match");
+            }
+            return TypedMat(static_cast<const cv::Mat &>(m));
+        }
+};
+
+typedef TypedMat<BGR> BgrMat;
+typedef TypedMat<RGB> RgbMat;
+typedef TypedMat<HSV> HsvMat;
+typedef TypedMat<GRAY> GrayMat;
+
+}
+
+/*! @}
+ */
+
+#endif  // _TYPED_COLOR_MATRIX_H
@@ -0,0 +1,284 @@
+/******************************************************************************/
+/*!
+ * @file  instrument.cpp
+ * @brief Scoped timers and counters for the hot paths, written to per thread
+ *        buffers and exported as a Chrome trace
+ *
+ * @author Cathal Harte <cathal.harte@protonmail.com>
+ */
+
+/*******************************************************************************
+* Includes
+******************************************************************************/
+
+#include "instrument.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+
+namespace instrument
+{
+
+/*******************************************************************************
+* Definitions and types
+*******************************************************************************/
+
+// A thread's events, written by the thread alone. The array is allocated once, so the events below
+// count, published with a release store, can be read by collect() while the thread carries on.
+struct ThreadBuffer
+{
+    std::unique_ptr<Event[]> events{new Event[INSTRUMENT_BUFFER_EVENTS]};
+    std::atomic<std::size_t> count{0};
+    std::atomic<uint64_t> dropped{0};
+    uint32_t tid = 0;
+};
+
+// The buffers outlive their threads, so that events of threads gone are still collected
+struct Registry
+{
+    std::mutex lock;
+    std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+    std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+};
+
+/*******************************************************************************
+* Internal function prototypes
+*******************************************************************************/
+
+/*******************************************************************************
+* Data
+*******************************************************************************/
+
+// the innermost open scope of the thread
+static thread_local Scope *innermost = nullptr;
+
+/*******************************************************************************
+* Functions
+*******************************************************************************/
+
+// Never destroyed, threads may still be recording as statics are torn down
+static Registry &registry()
+{
+    static Registry *r = new Registry;
+    return *r;
+}
+
+static ThreadBuffer &threadBuffer()
+{
+    static thread_local std::shared_ptr<ThreadBuffer> buffer;
+    if (!buffer)
+    {
+        buffer = std::make_shared<ThreadBuffer>();
+        Registry &r = registry();
+        std::lock_guard<std::mutex> guard(r.lock);
+        buffer->tid = (uint32_t)r.buffers.size();
+        r.buffers.push_back(buffer);
+    }
+    return *buffer;
+}
+
+static void append(const Event &e)
+{
+    ThreadBuffer &b = threadBuffer();
+    std::size_t n = b.count.load(std::memory_order_relaxed);
+    if (n == INSTRUMENT_BUFFER_EVENTS)
+    {
+        b.dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    b.events[n] = e;
+    b.events[n].tid = b.tid;
+    b.count.store(n + 1, std::memory_order_release);
+}
+
+int64_t now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now() - registry().origin)
+        .count();
+}
+
+void counter(const char *name, double value)
+{
+    Event e = Event();
+    e.name = name;
+    e.phase = EVENT_COUNTER;
+    e.start_ns = now();
+    e.value = value;
+    append(e);
+}
+
+void allocation(std::size_t bytes)
+{
+    if (innermost)
+    {
+        innermost->allocs++;
+        innermost->alloc_bytes += bytes;
+    }
+}
+
+std::vector<Event> collect()
+{
+    std::vector<Event> out;
+    Registry &r = registry();
+    std::lock_guard<std::mutex> guard(r.lock);
+    for (auto &b : r.buffers)
+    {
+        std::size_t n = b->count.load(std::memory_order_acquire);
+        out.insert(out.end(), b->events.get(), b->events.get() + n);
+    }
+    std::stable_sort(out.begin(), out.end(), [](const Event &a, const Event &b) {
+        return a.start_ns < b.start_ns;
+    });
+    return out;
+}
+
+uint64_t dropped()
+{
+    uint64_t total = 0;
+    Registry &r = registry();
+    std::lock_guard<std::mutex> guard(r.lock);
+    for (auto &b : r.buffers)
+    {
+        total += b->dropped.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+void reset()
+{
+    Registry &r = registry();
+    std::lock_guard<std::mutex> guard(r.lock);
+    for (auto &b : r.buffers)
+    {
+        b->count.store(0, std::memory_order_relaxed);
+        b->dropped.store(0, std::memory_order_relaxed);
+    }
+}
+
+// Times are inclusive, a scope's total includes the scopes nested in it
+std::vector<ScopeTotal> totals(const std::vector<Event> &events)
+{
+    std::map<std::string, ScopeTotal> by_name;
+    for (auto &e : events)
+    {
+        if (e.phase != EVENT_SCOPE)
+        {
+            continue;
+        }
+        ScopeTotal &t = by_name[e.name];
+        t.name = e.name;
+        t.count++;
+        t.total_ns += e.duration_ns;
+        t.max_ns = std::max(t.max_ns, e.duration_ns);
+        t.allocs += e.allocs;
+        t.alloc_bytes += e.alloc_bytes;
+    }
+
+    std::vector<ScopeTotal> out;
+    for (auto &t : by_name)
+    {
+        out.push_back(t.second);
+    }
+    std::sort(out.begin(), out.end(), [](const ScopeTotal &a, const ScopeTotal &b) {
+        return a.total_ns > b.total_ns;
+    });
+    return out;
+}
+
+static void writeJsonString(std::ostream &out, const char *s)
+{
+    out << '"';
+    for (; *s; s++)
+    {
+        if (*s == '"' || *s == '\\')
+        {
+            out << '\\' << *s;
+        }
+        else if ((unsigned char)*s < 0x20)
+        {
+            out << ' ';
+        }
+        else
+        {
+            out << *s;
+        }
+    }
+    out << '"';
+}
+
+// Chrome wants microseconds, kept to the nanosecond
+void writeChromeTrace(std::ostream &out, const std::vector<Event> &events)
+{
+    std::ios::fmtflags flags = out.flags();
+    out << std::fixed << std::setprecision(3);
+    out << "{\"traceEvents\":[";
+    for (std::size_t i = 0; i < events.size(); i++)
+    {
+        const Event &e = events[i];
+        out << (i ? ",\n" : "\n") << "{\"name\":";
+        writeJsonString(out, e.name);
+        out << ",\"cat\":\"trace_opencv\",\"pid\":1,\"tid\":" << e.tid
+            << ",\"ts\":" << e.start_ns / 1000.0;
+        if (e.phase == EVENT_SCOPE)
+        {
+            out << ",\"ph\":\"X\",\"dur\":" << e.duration_ns / 1000.0
+                << ",\"args\":{\"allocs\":" << e.allocs << ",\"alloc_bytes\":" << e.alloc_bytes
+                << "}}";
+        }
+        else
+        {
+            out << ",\"ph\":\"C\",\"args\":{\"value\":" << e.value << "}}";
+        }
+    }
+    out << "\n],\"displayTimeUnit\":\"ns\"}\n";
+    out.flags(flags);
+}
+
+bool writeChromeTrace(const std::string &path)
+{
+    std::ofstream out(path);
+    if (!out)
+    {
+        return false;
+    }
+    writeChromeTrace(out, collect());
+    return (bool)out;
+}
+
+/*******************************************************************************
+* Classes
+*******************************************************************************/
+
+Scope::Scope(const char *name) : name(name), start_ns(now()), outer(innermost)
+{
+    innermost = this;
+}
+
+// What was charged to this scope is charged to the one around it as well
+Scope::~Scope()
+{
+    Event e = Event();
+    e.name = name;
+    e.phase = EVENT_SCOPE;
+    e.start_ns = start_ns;
+    e.duration_ns = now() - start_ns;
+    e.allocs = allocs;
+    e.alloc_bytes = alloc_bytes;
+    append(e);
+
+    innermost = outer;
+    if (outer)
+    {
+        outer->allocs += allocs;
+        outer->alloc_bytes += alloc_bytes;
+    }
+}
+
+} // namespace instrument
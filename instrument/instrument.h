@@ -0,0 +1,145 @@
+/******************************************************************************/
+/*!
+ * @file  instrument.h
+ * @brief Scoped timers and counters for the hot paths, written to per thread
+ *        buffers and exported as a Chrome trace
+ *
+ * @author Cathal Harte <cathal.harte@protonmail.com>
+ */
+#ifndef _INSTRUMENT_H
+#define _INSTRUMENT_H
+
+/*******************************************************************************
+* Includes
+******************************************************************************/
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/*! @defgroup instrument Instrument.
+ *
+ * @addtogroup instrument
+ * @{
+ * @brief
+ */
+
+/*******************************************************************************
+* Definitions and types
+*******************************************************************************/
+
+// Events each thread can hold before it starts dropping them, until reset()
+#ifndef INSTRUMENT_BUFFER_EVENTS
+#define INSTRUMENT_BUFFER_EVENTS (1 << 16)
+#endif
+
+#define INSTRUMENT_CONCAT_(a, b) a##b
+#define INSTRUMENT_CONCAT(a, b) INSTRUMENT_CONCAT_(a, b)
+
+// The instrumentation is compiled in with TRACE_OPENCV_INSTRUMENT defined (cmake -DINSTRUMENT=ON),
+// otherwise the macros are empty and cost nothing, their arguments are not even evaluated. Names
+// are not copied, use string literals (or names that outlive the export).
+//      INSTRUMENT_SCOPE(name)          times the enclosing scope
+//      INSTRUMENT_COUNTER(name, value) the value of a counter, from now on
+//      INSTRUMENT_ALLOC(bytes)         an allocation, charged to the innermost scope
+#ifdef TRACE_OPENCV_INSTRUMENT
+#define INSTRUMENT_SCOPE(name) instrument::Scope INSTRUMENT_CONCAT(instrument_scope_, __LINE__)(name)
+#define INSTRUMENT_COUNTER(name, value) instrument::counter(name, value)
+#define INSTRUMENT_ALLOC(bytes) instrument::allocation(bytes)
+#else
+#define INSTRUMENT_SCOPE(name) do {} while (0)
+#define INSTRUMENT_COUNTER(name, value) do {} while (0)
+#define INSTRUMENT_ALLOC(bytes) do {} while (0)
+#endif
+
+namespace instrument
+{
+
+typedef enum event_phase
+{
+    EVENT_SCOPE,    // a span of time, Chrome's complete event
+    EVENT_COUNTER   // a counter's value from then on
+} event_phase_t;
+
+struct Event
+{
+    const char *name;
+    event_phase_t phase;
+    uint32_t tid;           // in order of each thread's first event
+    int64_t start_ns;       // since the process started recording
+    int64_t duration_ns;    // scopes
+    uint64_t allocs;        // scopes, allocations charged to the scope and those within it
+    uint64_t alloc_bytes;
+    double value;           // counters
+};
+
+// What one scope name has cost, summed over its events
+struct ScopeTotal
+{
+    std::string name;
+    uint64_t count = 0;
+    int64_t total_ns = 0;
+    int64_t max_ns = 0;
+    uint64_t allocs = 0;
+    uint64_t alloc_bytes = 0;
+};
+
+/*******************************************************************************
+* Class prototypes
+*******************************************************************************/
+
+// Times its lifetime. Allocations made meanwhile on the thread, in nested scopes too, are charged
+// to it.
+class Scope
+{
+    public :
+        explicit Scope(const char *name);
+        ~Scope();
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+
+    private :
+        friend void allocation(std::size_t bytes);
+
+        const char *name;
+        int64_t start_ns;
+        uint64_t allocs = 0;
+        uint64_t alloc_bytes = 0;
+        Scope *outer;
+};
+
+/*******************************************************************************
+* Function prototypes
+*******************************************************************************/
+
+void counter(const char *name, double value);
+void allocation(std::size_t bytes);
+
+// Nanoseconds on the clock events are stamped with
+int64_t now();
+
+// The events of every thread so far, merged in time order. Safe while threads are recording, what
+// they record meanwhile may or may not be in.
+std::vector<Event> collect();
+
+// Events dropped for want of room in a thread's buffer
+uint64_t dropped();
+
+// Forgets every event, the buffers are kept. Only at a quiescent point, no thread recording.
+void reset();
+
+// Sums over the events of each scope name, slowest total first: what dominates the latency
+std::vector<ScopeTotal> totals(const std::vector<Event> &events);
+
+// The Chrome trace event JSON read by chrome://tracing and Perfetto
+void writeChromeTrace(std::ostream &out, const std::vector<Event> &events);
+bool writeChromeTrace(const std::string &path);
+
+}
+
+/*! @}
+ */
+
+#endif  // _INSTRUMENT_H
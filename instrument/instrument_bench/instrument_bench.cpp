@@ -0,0 +1,83 @@
+/**
+* \file instrument_bench.cpp
+*
+* \brief What the instrumentation costs where it is compiled in
+*
+* \author Cathal Harte  <cathal.harte@protonmail.com>
+*/
+
+/*******************************************************************************
+* Includes
+*******************************************************************************/
+
+#include <benchmark/benchmark.h>
+#include <instrument.h>
+#include <sstream>
+namespace
+{
+
+/*******************************************************************************
+* Definitions and types
+*******************************************************************************/
+
+/*******************************************************************************
+* Local Function prototypes
+*******************************************************************************/
+
+/*******************************************************************************
+* Data
+*******************************************************************************/
+
+/*******************************************************************************
+* Functions
+*******************************************************************************/
+
+// Compiled out, the macros are empty, there is nothing to measure. Compiled in, a scope is two clock
+// reads and a store to the thread's buffer.
+void BM_scope(benchmark::State &state)
+{
+    uint64_t n = 0;
+    for (auto _ : state)
+    {
+        INSTRUMENT_SCOPE("bench");
+        if ((++n & 0xffff) == 0)
+        {
+            instrument::reset(); // keeps the buffer from filling, rarely enough not to count
+        }
+    }
+}
+
+void BM_counter(benchmark::State &state)
+{
+    uint64_t n = 0;
+    for (auto _ : state)
+    {
+        INSTRUMENT_COUNTER("bench", (double)n);
+        if ((++n & 0xffff) == 0)
+        {
+            instrument::reset();
+        }
+    }
+}
+
+void BM_export(benchmark::State &state)
+{
+    instrument::reset();
+    for (int i = 0; i < state.range(0); i++)
+    {
+        INSTRUMENT_SCOPE("bench");
+    }
+    for (auto _ : state)
+    {
+        std::ostringstream out;
+        instrument::writeChromeTrace(out, instrument::collect());
+        benchmark::DoNotOptimize(out.str().size());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+BENCHMARK(BM_scope);
+BENCHMARK(BM_counter);
+BENCHMARK(BM_export)->Arg(1000)->Arg(60000);
+
+} // namespace
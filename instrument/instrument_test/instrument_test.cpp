@@ -0,0 +1,159 @@
+/**
+* \file instrument_test.cpp
+*
+* \brief instrument unit test
+*
+* \author Cathal Harte  <cathal.harte@protonmail.com>
+*/
+
+/*******************************************************************************
+* Includes
+*******************************************************************************/
+
+#include <gtest/gtest.h>
+#include <instrument.h>
+#include <chrono>
+#include <set>
+#include <sstream>
+#include <thread>
+namespace
+{
+
+/*******************************************************************************
+* Definitions and types
+*******************************************************************************/
+
+/*******************************************************************************
+* Local Function prototypes
+*******************************************************************************/
+
+/*******************************************************************************
+* Data
+*******************************************************************************/
+
+/*******************************************************************************
+* Functions
+*******************************************************************************/
+
+const instrument::Event *find(const std::vector<instrument::Event> &events, const std::string &name)
+{
+    for (auto &e : events)
+    {
+        if (name == e.name)
+        {
+            return &e;
+        }
+    }
+    return nullptr;
+}
+
+TEST(instrument, scopes_nest_and_charge_allocations)
+{
+    instrument::reset();
+    {
+        INSTRUMENT_SCOPE("outer");
+        INSTRUMENT_ALLOC(100);
+        {
+            INSTRUMENT_SCOPE("inner");
+            INSTRUMENT_ALLOC(50);
+            INSTRUMENT_COUNTER("queue_depth", 3);
+        }
+    }
+    INSTRUMENT_ALLOC(7); // outside any scope, charged to none
+
+    std::vector<instrument::Event> events = instrument::collect();
+    ASSERT_EQ(events.size(), 3u);
+    const instrument::Event *outer = find(events, "outer");
+    const instrument::Event *inner = find(events, "inner");
+    const instrument::Event *depth = find(events, "queue_depth");
+    ASSERT_TRUE(outer && inner && depth);
+
+    EXPECT_EQ(inner->allocs, 1u);
+    EXPECT_EQ(inner->alloc_bytes, 50u);
+    EXPECT_EQ(outer->allocs, 2u);
+    EXPECT_EQ(outer->alloc_bytes, 150u);
+    EXPECT_LE(outer->start_ns, inner->start_ns);
+    EXPECT_GE(outer->start_ns + outer->duration_ns, inner->start_ns + inner->duration_ns);
+    EXPECT_EQ(depth->phase, instrument::EVENT_COUNTER);
+    EXPECT_EQ(depth->value, 3);
+    EXPECT_EQ(events.front().name, outer->name); // in time order
+}
+
+// Each thread writes its own buffer, they come together in time order
+TEST(instrument, threads_are_merged)
+{
+    instrument::reset();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++)
+    {
+        threads.emplace_back([] {
+            for (int i = 0; i < 100; i++)
+            {
+                INSTRUMENT_SCOPE("work");
+            }
+        });
+    }
+    for (auto &t : threads)
+    {
+        t.join();
+    }
+
+    std::vector<instrument::Event> events = instrument::collect();
+    ASSERT_EQ(events.size(), 400u);
+    std::set<uint32_t> tids;
+    for (std::size_t i = 0; i < events.size(); i++)
+    {
+        tids.insert(events[i].tid);
+        if (i)
+        {
+            EXPECT_LE(events[i - 1].start_ns, events[i].start_ns);
+        }
+    }
+    EXPECT_EQ(tids.size(), 4u);
+}
+
+TEST(instrument, full_buffers_drop)
+{
+    instrument::reset();
+    for (int i = 0; i < INSTRUMENT_BUFFER_EVENTS + 10; i++)
+    {
+        INSTRUMENT_COUNTER("n", i);
+    }
+    EXPECT_EQ(instrument::collect().size(), (std::size_t)INSTRUMENT_BUFFER_EVENTS);
+    EXPECT_EQ(instrument::dropped(), 10u);
+    instrument::reset();
+    EXPECT_EQ(instrument::dropped(), 0u);
+}
+
+// The slowest step comes out on top
+TEST(instrument, totals_and_chrome_trace)
+{
+    instrument::reset();
+    for (int i = 0; i < 3; i++)
+    {
+        {
+            INSTRUMENT_SCOPE("fast");
+        }
+        {
+            INSTRUMENT_SCOPE("slow \"step\"");
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+    }
+    std::vector<instrument::Event> events = instrument::collect();
+
+    std::vector<instrument::ScopeTotal> totals = instrument::totals(events);
+    ASSERT_EQ(totals.size(), 2u);
+    EXPECT_EQ(totals[0].name, "slow \"step\"");
+    EXPECT_EQ(totals[0].count, 3u);
+    EXPECT_GE(totals[0].total_ns, 6000000);
+
+    std::ostringstream json;
+    instrument::writeChromeTrace(json, events);
+    std::string s = json.str();
+    EXPECT_EQ(s.find("{\"traceEvents\":["), 0u);
+    EXPECT_NE(s.find("\"name\":\"slow \\\"step\\\"\""), std::string::npos);
+    EXPECT_NE(s.find("\"ph\":\"X\""), std::string::npos);
+    EXPECT_NE(s.find("\"displayTimeUnit\":\"ns\"}"), std::string::npos);
+}
+
+} // namespace
@@ -0,0 +1,459 @@
+/******************************************************************************/
+/*!
+ * @file  concurrent_tree.h
+ * @brief An unsorted tree that many threads may append to, and read, at once
+ *
+ *        Header only template class
+ *
+ *
+ * @author Cathal Harte <cathal.harte@protonmail.com>
+ */
+#ifndef _CONCURRENT_TREE_H
+#define _CONCURRENT_TREE_H
+
+/*******************************************************************************
+* Includes
+******************************************************************************/
+
+#include "flat_tree.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace smart_tree
+{
+
+/*! @addtogroup smart_tree
+ * @{
+ */
+/*******************************************************************************
+* Definitions and types
+*******************************************************************************/
+
+// Nodes in the first segment of a ConcurrentTree, each segment after is twice the one before
+#define CONCURRENT_TREE_BASE_SEGMENT 1024
+// which makes for room for 1024 * (2^22 - 1) nodes
+#define CONCURRENT_TREE_MAX_SEGMENTS 22
+
+/*******************************************************************************
+* Class prototypes
+*******************************************************************************/
+
+//  This class implements an unsorted tree for many threads at once
+//  Design parameters :
+//      As with Branch, a node without a parent is a root, and a node may have 1 parent and an
+//      unlimited number of children, kept in the order they were added.
+//      Adding a child is lock-free. The node comes from an atomic reservation in segmented
+//      storage, whose segments never move, and is then appended to the tail of its parent's
+//      child list with a compare and swap, in the manner of the Michael & Scott queue (a thread
+//      that finds the tail lagging helps it along rather than wait).
+//      Readers may walk the tree while children are being added; a child is only linked once
+//      it is complete.
+//      Removal is logical: the child is marked, and from then on skipped by readers, but stays
+//      linked. Unlike Branch a removed child, and its subtree, are gone for good. Their nodes are
+//      reclaimed for reuse at reclaim(), which waits for a quiescent point, no operation in
+//      flight, and holds new ones off while it unlinks them.
+//      Nodes are addressed by NodeHandle, whose epoch is the generation of the node, so that a
+//      handle to a reclaimed node is known to be stale.
+template <typename T>
+class ConcurrentTree
+{
+public:
+    ConcurrentTree()
+    {
+        for (auto &s : segments)
+        {
+            s = nullptr;
+        }
+    }
+
+    ~ConcurrentTree()
+    {
+        for (auto &s : segments)
+        {
+            delete[] s.load();
+        }
+    }
+
+    ConcurrentTree(const ConcurrentTree &) = delete;
+    ConcurrentTree &operator=(const ConcurrentTree &) = delete;
+
+    // Live nodes, removed ones not counted
+    std::size_t size() const { return live; }
+
+    // A new parentless node, that is a root
+    NodeHandle create(const T &data)
+    {
+        OpGuard guard(*this);
+        return allocate(data, NodeHandle::NONE);
+    }
+
+    // A new child of parent, after any it already has
+    NodeHandle addChild(NodeHandle parent, const T &data)
+    {
+        OpGuard guard(*this);
+        Node &p = node(parent);
+        NodeHandle child = allocate(data, parent.index);
+        append(p, child.index);
+        return child;
+    }
+
+    // The child and its subtree are skipped from now on, and reclaimed at the next reclaim()
+    void removeChild(NodeHandle parent, NodeHandle child)
+    {
+        OpGuard guard(*this);
+        Node &c = node(child);
+        uint8_t state = LIVE;
+        if (c.parent != parent.index || !c.state.compare_exchange_strong(state, REMOVED))
+        {
+            throw "is not a child of parent";
+        }
+        node(parent).num_children--;
+        live--;
+    }
+
+    bool valid(NodeHandle h) const
+    {
+        return h.index < reserved && at(h.index).generation.load(std::memory_order_acquire) == h.epoch &&
+               at(h.index).state != FREE;
+    }
+
+    bool isRemoved(NodeHandle h) const { return node(h).state == REMOVED; }
+    bool isRoot(NodeHandle h) const { return node(h).parent == NodeHandle::NONE; }
+
+    T &data(NodeHandle h) { return node(h).data; }
+    const T &data(NodeHandle h) const { return node(h).data; }
+
+    NodeHandle getParent(NodeHandle h) const { return handle(node(h).parent); }
+    std::size_t getNumChildren(NodeHandle h) const { return node(h).num_children; }
+
+    // fn(NodeHandle) for each child of h that is not removed, in order. Children added meanwhile
+    // may or may not be seen.
+    template <typename Fn>
+    void forEachChild(NodeHandle h, Fn fn) const
+    {
+        OpGuard guard(*this);
+        uint32_t i = node(h).first_child.load(std::memory_order_acquire);
+        while (i != NodeHandle::NONE)
+        {
+            const Node &c = at(i);
+            if (c.state == LIVE)
+            {
+                fn(handle(i));
+            }
+            i = c.next_sibling.load(std::memory_order_acquire);
+        }
+    }
+
+    // Reclaims the removed nodes. Waits for the operations in flight to finish, and holds new ones
+    // off meanwhile; must not be called from inside one (e.g. a forEachChild callback).
+    void reclaim()
+    {
+        std::lock_guard<std::mutex> lock(reclaim_lock);
+        reclaiming = true;
+        while (active)
+        {
+            std::this_thread::yield();
+        }
+
+        uint32_t n = (uint32_t)std::min<uint64_t>(reserved, capacity());
+
+        // unlink, we are alone so plain relinking will do
+        for (uint32_t i = 0; i < n; i++)
+        {
+            Node &p = at(i);
+            if (p.state != LIVE)
+            {
+                continue;
+            }
+            uint32_t prev = NodeHandle::NONE;
+            for (uint32_t c = p.first_child; c != NodeHandle::NONE; c = at(c).next_sibling)
+            {
+                if (at(c).state == LIVE)
+                {
+                    prev = c;
+                }
+                else if (prev == NodeHandle::NONE)
+                {
+                    p.first_child = at(c).next_sibling.load();
+                }
+                else
+                {
+                    at(prev).next_sibling = at(c).next_sibling.load();
+                }
+            }
+            p.last_child = prev;
+        }
+
+        // a removed node takes its subtree with it
+        std::vector<uint32_t> stack;
+        for (uint32_t i = 0; i < n; i++)
+        {
+            if (at(i).state == REMOVED)
+            {
+                stack.push_back(i);
+            }
+        }
+        while (!stack.empty())
+        {
+            Node &r = at(stack.back());
+            stack.pop_back();
+            if (r.state == FREE)
+            {
+                continue; // removed within a removed subtree, already taken care of
+            }
+            for (uint32_t c = r.first_child; c != NodeHandle::NONE; c = at(c).next_sibling)
+            {
+                if (at(c).state == LIVE)
+                {
+                    live--;
+                }
+                stack.push_back(c);
+            }
+            r.state = FREE;
+            r.generation++;
+        }
+
+        free_slots.clear();
+        for (uint32_t i = 0; i < n; i++)
+        {
+            if (at(i).state == FREE)
+            {
+                free_slots.push_back(i);
+            }
+        }
+        free_next = 0;
+        reserved = n;
+
+        reclaiming = false;
+    }
+
+private:
+    enum : uint8_t
+    {
+        FREE,
+        LIVE,
+        REMOVED
+    };
+
+    struct Node
+    {
+        T data;
+        std::atomic<uint32_t> parent{NodeHandle::NONE};
+        std::atomic<uint32_t> first_child{NodeHandle::NONE};
+        std::atomic<uint32_t> last_child{NodeHandle::NONE};
+        std::atomic<uint32_t> next_sibling{NodeHandle::NONE};
+        std::atomic<uint32_t> num_children{0};
+        std::atomic<uint32_t> generation{0};
+        std::atomic<uint8_t> state{FREE};
+    };
+
+    // Counts this thread in as an operation in flight, for reclaim() to wait on. Nested operations
+    // on the same tree (from a forEachChild callback) are already counted.
+    class OpGuard
+    {
+    public:
+        OpGuard(const ConcurrentTree &tree) : tree(tree), prev(current())
+        {
+            if (prev == &tree)
+            {
+                return;
+            }
+            for (;;)
+            {
+                tree.active++;
+                if (!tree.reclaiming)
+                {
+                    break;
+                }
+                tree.active--;
+                while (tree.reclaiming)
+                {
+                    std::this_thread::yield();
+                }
+            }
+            current() = &tree;
+        }
+
+        ~OpGuard()
+        {
+            if (prev != &tree)
+            {
+                tree.active--;
+                current() = prev;
+            }
+        }
+
+    private:
+        static const ConcurrentTree *&current()
+        {
+            static thread_local const ConcurrentTree *tree = nullptr;
+            return tree;
+        }
+
+        const ConcurrentTree &tree;
+        const ConcurrentTree *prev;
+    };
+
+    static uint64_t capacity()
+    {
+        return (uint64_t)CONCURRENT_TREE_BASE_SEGMENT * ((1ull << CONCURRENT_TREE_MAX_SEGMENTS) - 1);
+    }
+
+    // Segment s holds the indices [BASE * (2^s - 1), BASE * (2^(s+1) - 1))
+    static int segmentOf(uint32_t index, uint32_t &offset)
+    {
+        uint32_t v = index / CONCURRENT_TREE_BASE_SEGMENT + 1;
+        int s = 0;
+        while (v >>= 1)
+        {
+            s++;
+        }
+        offset = index - CONCURRENT_TREE_BASE_SEGMENT * ((1u << s) - 1);
+        return s;
+    }
+
+    Node &at(uint32_t index) const
+    {
+        uint32_t offset;
+        int s = segmentOf(index, offset);
+        return segments[s].load(std::memory_order_acquire)[offset];
+    }
+
+    // Makes sure the segment of index exists, the first to get there allocates it
+    void reserveSegment(uint32_t index)
+    {
+        uint32_t offset;
+        int s = segmentOf(index, offset);
+        if (segments[s].load(std::memory_order_acquire))
+        {
+            return;
+        }
+        Node *fresh = new Node[(std::size_t)CONCURRENT_TREE_BASE_SEGMENT << s];
+        Node *expected = nullptr;
+        if (!segments[s].compare_exchange_strong(expected, fresh))
+        {
+            delete[] fresh;
+        }
+    }
+
+    NodeHandle allocate(const T &data, uint32_t parent)
+    {
+        uint32_t index;
+        std::size_t f = free_next++;
+        if (f < free_slots.size())
+        {
+            index = free_slots[f];
+        }
+        else
+        {
+            uint64_t r = reserved++;
+            if (r >= capacity())
+            {
+                throw "concurrent tree is full";
+            }
+            index = (uint32_t)r;
+            reserveSegment(index);
+        }
+
+        Node &n = at(index);
+        n.data = data;
+        n.parent.store(parent, std::memory_order_relaxed);
+        n.first_child.store(NodeHandle::NONE, std::memory_order_relaxed);
+        n.last_child.store(NodeHandle::NONE, std::memory_order_relaxed);
+        n.next_sibling.store(NodeHandle::NONE, std::memory_order_relaxed);
+        n.num_children.store(0, std::memory_order_relaxed);
+        n.state.store(LIVE, std::memory_order_release);
+        live++;
+
+        NodeHandle h;
+        h.index = index;
+        h.epoch = n.generation.load(std::memory_order_relaxed);
+        return h;
+    }
+
+    // Links child after the current tail of p's children
+    void append(Node &p, uint32_t child)
+    {
+        for (;;)
+        {
+            uint32_t tail = p.last_child.load(std::memory_order_acquire);
+            if (tail == NodeHandle::NONE)
+            {
+                uint32_t first = NodeHandle::NONE;
+                if (p.first_child.compare_exchange_strong(first, child, std::memory_order_acq_rel))
+                {
+                    uint32_t none = NodeHandle::NONE;
+                    p.last_child.compare_exchange_strong(none, child, std::memory_order_acq_rel);
+                    break;
+                }
+                // another child got there first, help its tail into place
+                uint32_t none = NodeHandle::NONE;
+                p.last_child.compare_exchange_strong(none, first, std::memory_order_acq_rel);
+                continue;
+            }
+
+            Node &t = at(tail);
+            uint32_t next = t.next_sibling.load(std::memory_order_acquire);
+            if (next != NodeHandle::NONE)
+            {
+                // the tail is lagging
+                p.last_child.compare_exchange_strong(tail, next, std::memory_order_acq_rel);
+                continue;
+            }
+            if (t.next_sibling.compare_exchange_strong(next, child, std::memory_order_acq_rel))
+            {
+                p.last_child.compare_exchange_strong(tail, child, std::memory_order_acq_rel);
+                break;
+            }
+        }
+        p.num_children++;
+    }
+
+    Node &node(NodeHandle h)
+    {
+        assert(("Handle is of this tree, and not stale", valid(h)));
+        return at(h.index);
+    }
+
+    const Node &node(NodeHandle h) const
+    {
+        assert(("Handle is of this tree, and not stale", valid(h)));
+        return at(h.index);
+    }
+
+    NodeHandle handle(uint32_t index) const
+    {
+        NodeHandle h;
+        if (index != NodeHandle::NONE)
+        {
+            h.index = index;
+            h.epoch = at(index).generation.load(std::memory_order_relaxed);
+        }
+        return h;
+    }
+
+    mutable std::atomic<Node *> segments[CONCURRENT_TREE_MAX_SEGMENTS];
+    std::atomic<uint64_t> reserved{0};
+    std::atomic<std::size_t> live{0};
+
+    // refilled by reclaim(), and only handed out meanwhile
+    std::vector<uint32_t> free_slots;
+    std::atomic<std::size_t> free_next{0};
+
+    mutable std::atomic<int> active{0};
+    std::atomic<bool> reclaiming{false};
+    std::mutex reclaim_lock;
+};
+
+/*! @}
+ */
+
+} // namespace smart_tree
+
+#endif // _CONCURRENT_TREE_H
@@ -0,0 +1,209 @@
+/******************************************************************************/
+/*!
+ * @file  dag.h
+ * @brief A directed acyclic graph node, the Branch of smart_tree.h allowed
+ *        any number of parents
+ *
+ *        Header only template class
+ *
+ *
+ * @author Cathal Harte <cathal.harte@protonmail.com>
+ */
+#ifndef _DAG_H
+#define _DAG_H
+
+/*******************************************************************************
+* Includes
+******************************************************************************/
+
+#include <cstddef>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace smart_tree
+{
+
+/*! @addtogroup smart_tree
+ * @{
+ */
+/*******************************************************************************
+* Class prototypes
+*******************************************************************************/
+
+//  This class implements a node of a directed acyclic graph
+//  Design parameters :
+//      As with Branch, a node without a parent is a root, and smart ptrs are used throughout:
+//      parents own their children, children only see their parents.
+//      A node may have any number of parents, kept in the order they were added, and so stays
+//      alive for as long as any of them does. A node whose parents have all expired is a root.
+//      Edges that would close a cycle are refused.
+template <typename T>
+class DagNode
+{
+public:
+    DagNode() {}
+    DagNode(T data) : data(data) {}
+    T data;
+
+    bool isRoot()
+    {
+        for (auto &p : parents)
+        {
+            if (!p.expired())
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+    std::size_t getNumParents() { return parents.size(); }
+    // Null if that parent has expired
+    std::shared_ptr<DagNode<T>> getParent(std::size_t i) { return parents[i].lock(); }
+    std::size_t getNumChildren() { return children.size(); }
+    typename std::vector<std::shared_ptr<DagNode<T>>>::iterator childrenBegin() { return children.begin(); }
+    typename std::vector<std::shared_ptr<DagNode<T>>>::iterator childrenEnd() { return children.end(); }
+
+private:
+    std::vector<std::weak_ptr<DagNode<T>>> parents;
+    std::vector<std::shared_ptr<DagNode<T>>> children;
+
+    template <typename Y>
+    friend void addChild(std::shared_ptr<DagNode<Y>> parent, std::shared_ptr<DagNode<Y>> child);
+    template <typename Y>
+    friend void removeChild(std::shared_ptr<DagNode<Y>> parent, std::shared_ptr<DagNode<Y>> child);
+};
+
+/*******************************************************************************
+* Function prototypes
+*******************************************************************************/
+
+// Whether to is reachable from from, following children. The graph must not change meanwhile.
+template <typename T>
+bool reaches(DagNode<T> *from, DagNode<T> *to)
+{
+    std::vector<DagNode<T> *> stack(1, from);
+    std::unordered_map<DagNode<T> *, bool> seen;
+    while (!stack.empty())
+    {
+        DagNode<T> *n = stack.back();
+        stack.pop_back();
+        if (n == to)
+        {
+            return true;
+        }
+        if (seen[n])
+        {
+            continue;
+        }
+        seen[n] = true;
+        for (auto it = n->childrenBegin(); it != n->childrenEnd(); ++it)
+        {
+            stack.push_back(it->get());
+        }
+    }
+    return false;
+}
+
+// Throws if the edge is already there, or if child reaches parent (which costs a walk over the
+// descendants of child)
+template <typename Y>
+void addChild(std::shared_ptr<DagNode<Y>> parent, std::shared_ptr<DagNode<Y>> child)
+{
+    for (auto &c : parent->children)
+    {
+        if (c == child)
+        {
+            throw "is already a child of parent";
+        }
+    }
+    if (reaches(child.get(), parent.get()))
+    {
+        throw "would make a cycle";
+    }
+    parent->children.emplace_back(child);
+    child->parents.emplace_back(parent);
+}
+
+template <typename Y>
+void removeChild(std::shared_ptr<DagNode<Y>> parent, std::shared_ptr<DagNode<Y>> child)
+{
+    for (auto iter = parent->children.begin(); iter != parent->children.end(); ++iter)
+    {
+        if (child == *iter)
+        {
+            parent->children.erase(iter);
+            for (auto p = child->parents.begin(); p != child->parents.end(); ++p)
+            {
+                if (p->lock() == parent)
+                {
+                    child->parents.erase(p);
+                    break;
+                }
+            }
+            return;
+        }
+    }
+    throw "is not a child of parent";
+}
+
+// Every node reachable from the roots, each after all of its parents that are (Kahn's algorithm,
+// ties in the order they were found). As with the tree iterators the nodes are raw pointers, the
+// graph must outlive the result and not change meanwhile.
+template <typename T>
+std::vector<DagNode<T> *> topologicalOrder(const std::vector<std::shared_ptr<DagNode<T>>> &roots)
+{
+    // the parents of each node that are themselves reachable
+    std::unordered_map<DagNode<T> *, std::size_t> waiting_on;
+    std::vector<DagNode<T> *> stack;
+    for (auto &r : roots)
+    {
+        if (waiting_on.emplace(r.get(), 0).second)
+        {
+            stack.push_back(r.get());
+        }
+    }
+    while (!stack.empty())
+    {
+        DagNode<T> *n = stack.back();
+        stack.pop_back();
+        for (auto it = n->childrenBegin(); it != n->childrenEnd(); ++it)
+        {
+            auto found = waiting_on.emplace(it->get(), 0);
+            found.first->second++;
+            if (found.second)
+            {
+                stack.push_back(it->get());
+            }
+        }
+    }
+
+    std::vector<DagNode<T> *> order;
+    order.reserve(waiting_on.size());
+    for (auto &r : roots)
+    {
+        if (waiting_on[r.get()] == 0)
+        {
+            order.push_back(r.get());
+            waiting_on[r.get()] = 1; // a root listed twice goes in once
+        }
+    }
+    for (std::size_t i = 0; i < order.size(); i++)
+    {
+        for (auto it = order[i]->childrenBegin(); it != order[i]->childrenEnd(); ++it)
+        {
+            if (--waiting_on[it->get()] == 0)
+            {
+                order.push_back(it->get());
+            }
+        }
+    }
+    return order;
+}
+
+/*! @}
+ */
+
+} // namespace smart_tree
+
+#endif // _DAG_H
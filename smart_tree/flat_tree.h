@@ -0,0 +1,243 @@
+/******************************************************************************/
+/*!
+ * @file  flat_tree.h
+ * @brief An unsorted tree with the same parent / child semantics as Branch,
+ *        its nodes held in a single contiguous array
+ *
+ *        Header only template class
+ *
+ *
+ * @author Cathal Harte <cathal.harte@protonmail.com>
+ */
+#ifndef _FLAT_TREE_H
+#define _FLAT_TREE_H
+
+/*******************************************************************************
+* Includes
+******************************************************************************/
+
+#include <cassert>
+#include <cstdint>
+#include <vector>
+
+namespace smart_tree
+{
+
+/*! @addtogroup smart_tree
+ * @{
+ */
+/*******************************************************************************
+* Definitions and types
+*******************************************************************************/
+
+// A node of a FlatTree. The index never changes for as long as the node lives, the epoch says which
+// generation of the tree it belongs to, so that a handle kept across a clear() is known to be stale.
+struct NodeHandle
+{
+    static const uint32_t NONE = UINT32_MAX;
+
+    uint32_t index = NONE;
+    uint32_t epoch = 0;
+
+    bool isNull() const { return index == NONE; }
+    bool operator==(const NodeHandle &h) const { return index == h.index && epoch == h.epoch; }
+    bool operator!=(const NodeHandle &h) const { return !(*this == h); }
+};
+
+/*******************************************************************************
+* Class prototypes
+*******************************************************************************/
+
+//  This class implements an unsorted tree, holding any number of roots, with its nodes in one array
+//  Design parameters :
+//      As with Branch, a node without a parent is a root, and a node may have 1 parent and an
+//      unlimited number of children, kept in the order they were added.
+//      The links are indices, parent, first / last child and next / previous sibling, so adding
+//      or removing a child is O(1) and there is a single allocation for the whole tree (none at
+//      all once it has reached its working size).
+//      Nodes are never freed one by one. A removed child becomes a root, as with Branch, and
+//      every node lives until clear(), which keeps the storage for the next frame. clear() resets
+//      the data of every node to T(), so that nothing the nodes held outlives them, and a node
+//      is always handed out afresh.
+template <typename T>
+class FlatTree
+{
+public:
+    FlatTree() {}
+
+    void reserve(std::size_t n) { nodes.reserve(n); }
+
+    // Forget every node, handles taken before are stale from here on. O(size()), for resetting the
+    // data of each.
+    void clear()
+    {
+        for (std::size_t i = 0; i < used; i++)
+        {
+            nodes[i].data = T();
+        }
+        used = 0;
+        epoch++;
+    }
+
+    std::size_t size() const { return used; }
+    std::size_t capacity() const { return nodes.size(); }
+
+    // A new parentless node, that is a root
+    NodeHandle create(const T &data)
+    {
+        NodeHandle h = create();
+        nodes[h.index].data = data;
+        return h;
+    }
+
+    // The same, with the data default constructed, for callers that fill it in place
+    NodeHandle create()
+    {
+        if (used == nodes.size())
+        {
+            nodes.emplace_back();
+        }
+        Node &n = nodes[used];
+        n.parent = n.first_child = n.last_child = NodeHandle::NONE;
+        n.next_sibling = n.prev_sibling = NodeHandle::NONE;
+        n.num_children = 0;
+
+        NodeHandle h;
+        h.index = (uint32_t)used++;
+        h.epoch = epoch;
+        return h;
+    }
+
+    // create() and addChild() in one
+    NodeHandle emplaceChild(NodeHandle parent, const T &data)
+    {
+        NodeHandle child = create(data);
+        addChild(parent, child);
+        return child;
+    }
+
+    bool valid(NodeHandle h) const { return h.epoch == epoch && h.index < used; }
+
+    // Every live node is nodeAt(i) for some i < size(), in the order they were created
+    NodeHandle nodeAt(std::size_t i) const { return handle((uint32_t)i); }
+
+    T &data(NodeHandle h) { return node(h).data; }
+    const T &data(NodeHandle h) const { return node(h).data; }
+
+    bool isRoot(NodeHandle h) const { return node(h).parent == NodeHandle::NONE; }
+    NodeHandle getParent(NodeHandle h) const { return handle(node(h).parent); }
+    std::size_t getNumChildren(NodeHandle h) const { return node(h).num_children; }
+
+    // Null handles at the end of the list
+    NodeHandle firstChild(NodeHandle h) const { return handle(node(h).first_child); }
+    NodeHandle lastChild(NodeHandle h) const { return handle(node(h).last_child); }
+    NodeHandle nextSibling(NodeHandle h) const { return handle(node(h).next_sibling); }
+    NodeHandle prevSibling(NodeHandle h) const { return handle(node(h).prev_sibling); }
+
+    void addChild(NodeHandle parent, NodeHandle child)
+    {
+        Node &c = node(child);
+        assert(("Prospective child is parentless", c.parent == NodeHandle::NONE));
+        Node &p = node(parent);
+
+        c.parent = parent.index;
+        c.prev_sibling = p.last_child;
+        c.next_sibling = NodeHandle::NONE;
+        if (p.last_child == NodeHandle::NONE)
+        {
+            p.first_child = child.index;
+        }
+        else
+        {
+            nodes[p.last_child].next_sibling = child.index;
+        }
+        p.last_child = child.index;
+        p.num_children++;
+    }
+
+    // The child, and its subtree, become a tree of their own
+    void removeChild(NodeHandle parent, NodeHandle child)
+    {
+        Node &c = node(child);
+        if (c.parent != parent.index || !valid(parent))
+        {
+            throw "is not a child of parent";
+        }
+        Node &p = node(parent);
+
+        if (c.prev_sibling == NodeHandle::NONE)
+        {
+            p.first_child = c.next_sibling;
+        }
+        else
+        {
+            nodes[c.prev_sibling].next_sibling = c.next_sibling;
+        }
+        if (c.next_sibling == NodeHandle::NONE)
+        {
+            p.last_child = c.prev_sibling;
+        }
+        else
+        {
+            nodes[c.next_sibling].prev_sibling = c.prev_sibling;
+        }
+        c.parent = c.prev_sibling = c.next_sibling = NodeHandle::NONE;
+        p.num_children--;
+    }
+
+    // fn(NodeHandle) for each child of h, in order
+    template <typename Fn>
+    void forEachChild(NodeHandle h, Fn fn) const
+    {
+        for (uint32_t i = node(h).first_child; i != NodeHandle::NONE; i = nodes[i].next_sibling)
+        {
+            fn(handle(i));
+        }
+    }
+
+private:
+    struct Node
+    {
+        T data;
+        uint32_t parent;
+        uint32_t first_child;
+        uint32_t last_child;
+        uint32_t next_sibling;
+        uint32_t prev_sibling;
+        uint32_t num_children;
+    };
+
+    Node &node(NodeHandle h)
+    {
+        assert(("Handle is of this tree, and not stale", valid(h)));
+        return nodes[h.index];
+    }
+
+    const Node &node(NodeHandle h) const
+    {
+        assert(("Handle is of this tree, and not stale", valid(h)));
+        return nodes[h.index];
+    }
+
+    NodeHandle handle(uint32_t index) const
+    {
+        NodeHandle h;
+        if (index != NodeHandle::NONE)
+        {
+            h.index = index;
+            h.epoch = epoch;
+        }
+        return h;
+    }
+
+    std::vector<Node> nodes; // [0, used) are live, the rest wait to be reused
+    std::size_t used = 0;
+    uint32_t epoch = 0;
+};
+
+/*! @}
+ */
+
+} // namespace smart_tree
+
+#endif // _FLAT_TREE_H
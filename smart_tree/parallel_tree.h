@@ -0,0 +1,88 @@
+/******************************************************************************/
+/*!
+ * @file  parallel_tree.h
+ * @brief Visiting a Branch subtree across the threads of a WorkStealingPool
+ *
+ *        Header only
+ *
+ *
+ * @author Cathal Harte <cathal.harte@protonmail.com>
+ */
+#ifndef _PARALLEL_TREE_H
+#define _PARALLEL_TREE_H
+
+/*******************************************************************************
+* Includes
+******************************************************************************/
+
+#include "smart_tree.h"
+#include "work_stealing_pool.h"
+
+namespace smart_tree
+{
+
+/*! @addtogroup smart_tree
+ * @{
+ */
+/*******************************************************************************
+* Definitions and types
+*******************************************************************************/
+
+// How many levels below the root the subtrees are handed out as tasks of their own, below that a
+// task walks its whole subtree itself
+#define SUBTREE_SPAWN_DEPTH 8
+
+/*******************************************************************************
+* Function prototypes
+*******************************************************************************/
+
+namespace detail
+{
+
+// The first child carries on on this thread, its siblings are left to be stolen
+template <typename T, typename Fn>
+void visitSubtree(TaskGroup &group, Branch<T> *b, const Fn &fn, int depth)
+{
+    if (depth <= 0)
+    {
+        for (auto &n : preOrder(*b))
+        {
+            fn(n);
+        }
+        return;
+    }
+
+    fn(*b);
+    if (!b->getNumChildren())
+    {
+        return;
+    }
+    for (auto it = b->childrenBegin() + 1; it != b->childrenEnd(); ++it)
+    {
+        Branch<T> *c = it->get();
+        group.run([&group, c, &fn, depth] { visitSubtree(group, c, fn, depth - 1); });
+    }
+    visitSubtree(group, b->childrenBegin()->get(), fn, depth - 1);
+}
+
+} // namespace detail
+
+// fn(Branch<T>&) for every node of the subtree under root, root included, with independent
+// subtrees visited concurrently on the pool. A subtree below spawn_depth is visited by a single
+// thread, in pre-order; beyond that there is no ordering, so fn must be safe to call concurrently.
+// Returns once every node has been visited. The tree must not be changed meanwhile.
+template <typename T, typename Fn>
+void forEachSubtree(WorkStealingPool &pool, Branch<T> &root, const Fn &fn,
+                    int spawn_depth = SUBTREE_SPAWN_DEPTH)
+{
+    TaskGroup group(pool);
+    detail::visitSubtree(group, &root, fn, spawn_depth);
+    group.wait();
+}
+
+/*! @}
+ */
+
+} // namespace smart_tree
+
+#endif // _PARALLEL_TREE_H
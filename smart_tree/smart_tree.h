@@ -17,8 +17,12 @@
 ******************************************************************************/
 
 #include <cassert>
+#include <cstddef>
+#include <deque>
+#include <iterator>
 #include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 namespace smart_tree
@@ -61,8 +65,8 @@ public:
     bool isRoot() { return parent.expired(); }
     std::shared_ptr<Branch<T>> getParent() { return parent.lock(); }
     std::size_t getNumChildren() { return children.size(); }
-    typename std::vector<std::shared_ptr<Branch<T>>>::iterator childrenBegin() { children.begin(); }
-    typename std::vector<std::shared_ptr<Branch<T>>>::iterator childrenEnd() { children.end(); }
+    typename std::vector<std::shared_ptr<Branch<T>>>::iterator childrenBegin() { return children.begin(); }
+    typename std::vector<std::shared_ptr<Branch<T>>>::iterator childrenEnd() { return children.end(); }
 
 private:
     std::weak_ptr<Branch<T>> parent;
@@ -74,10 +78,200 @@ private:
     friend void removeChild(std::shared_ptr<Branch<Y>> parent, std::shared_ptr<Branch<Y>> child);
 };
 
+// Walks over a Branch subtree. The nodes are reached through raw pointers into the children of
+// their parents, so there is no reference count traffic during the walk, and so the tree must not
+// be changed while it is walked.
+//      PreOrder    a node, then the subtrees of its children in turn
+//      PostOrder   the subtrees of the children of a node in turn, then the node
+//      BreadthFirst    level by level
+// All are forward iterators over Branch<T>&, used through the ranges below, e.g.
+//      for (auto &b : smart_tree::preOrder(*root)) { ... }
+template <typename T>
+class PreOrderIterator
+{
+public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef Branch<T> value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef Branch<T> *pointer;
+    typedef Branch<T> &reference;
+
+    PreOrderIterator() {}
+    explicit PreOrderIterator(Branch<T> *root) { stack.push_back(root); }
+
+    reference operator*() const { return *stack.back(); }
+    pointer operator->() const { return stack.back(); }
+
+    PreOrderIterator &operator++()
+    {
+        Branch<T> *b = stack.back();
+        stack.pop_back();
+        // reversed, so that the first child is on top
+        for (auto it = b->childrenEnd(); it != b->childrenBegin();)
+        {
+            --it;
+            stack.push_back(it->get());
+        }
+        return *this;
+    }
+
+    PreOrderIterator operator++(int)
+    {
+        PreOrderIterator prev = *this;
+        ++*this;
+        return prev;
+    }
+
+    bool operator==(const PreOrderIterator &i) const { return current() == i.current(); }
+    bool operator!=(const PreOrderIterator &i) const { return current() != i.current(); }
+
+private:
+    Branch<T> *current() const { return stack.empty() ? nullptr : stack.back(); }
+
+    std::vector<Branch<T> *> stack;
+};
+
+template <typename T>
+class PostOrderIterator
+{
+public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef Branch<T> value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef Branch<T> *pointer;
+    typedef Branch<T> &reference;
+
+    PostOrderIterator() {}
+    explicit PostOrderIterator(Branch<T> *root)
+    {
+        stack.push_back(std::make_pair(root, (std::size_t)0));
+        descend();
+    }
+
+    reference operator*() const { return *stack.back().first; }
+    pointer operator->() const { return stack.back().first; }
+
+    PostOrderIterator &operator++()
+    {
+        stack.pop_back();
+        if (!stack.empty())
+        {
+            stack.back().second++;
+            descend();
+        }
+        return *this;
+    }
+
+    PostOrderIterator operator++(int)
+    {
+        PostOrderIterator prev = *this;
+        ++*this;
+        return prev;
+    }
+
+    bool operator==(const PostOrderIterator &i) const { return current() == i.current(); }
+    bool operator!=(const PostOrderIterator &i) const { return current() != i.current(); }
+
+private:
+    Branch<T> *current() const { return stack.empty() ? nullptr : stack.back().first; }
+
+    // Down to the first node, from the top of the stack, that has no children left to visit
+    void descend()
+    {
+        for (;;)
+        {
+            Branch<T> *b = stack.back().first;
+            std::size_t next = stack.back().second;
+            if (next == b->getNumChildren())
+            {
+                return;
+            }
+            stack.push_back(std::make_pair((b->childrenBegin() + next)->get(), (std::size_t)0));
+        }
+    }
+
+    // each node on the path from the root, with the index of its next child to visit
+    std::vector<std::pair<Branch<T> *, std::size_t>> stack;
+};
+
+template <typename T>
+class BreadthFirstIterator
+{
+public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef Branch<T> value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef Branch<T> *pointer;
+    typedef Branch<T> &reference;
+
+    BreadthFirstIterator() {}
+    explicit BreadthFirstIterator(Branch<T> *root) { queue.push_back(root); }
+
+    reference operator*() const { return *queue.front(); }
+    pointer operator->() const { return queue.front(); }
+
+    BreadthFirstIterator &operator++()
+    {
+        Branch<T> *b = queue.front();
+        queue.pop_front();
+        for (auto it = b->childrenBegin(); it != b->childrenEnd(); ++it)
+        {
+            queue.push_back(it->get());
+        }
+        return *this;
+    }
+
+    BreadthFirstIterator operator++(int)
+    {
+        BreadthFirstIterator prev = *this;
+        ++*this;
+        return prev;
+    }
+
+    bool operator==(const BreadthFirstIterator &i) const { return current() == i.current(); }
+    bool operator!=(const BreadthFirstIterator &i) const { return current() != i.current(); }
+
+private:
+    Branch<T> *current() const { return queue.empty() ? nullptr : queue.front(); }
+
+    std::deque<Branch<T> *> queue;
+};
+
+// A begin / end pair, for range based for loops
+template <typename Iterator>
+class TraversalRange
+{
+public:
+    explicit TraversalRange(Iterator first) : first(first) {}
+    Iterator begin() const { return first; }
+    Iterator end() const { return Iterator(); }
+
+private:
+    Iterator first;
+};
+
 /*******************************************************************************
 * Function prototypes
 *******************************************************************************/
 
+template <typename T>
+TraversalRange<PreOrderIterator<T>> preOrder(Branch<T> &root)
+{
+    return TraversalRange<PreOrderIterator<T>>(PreOrderIterator<T>(&root));
+}
+
+template <typename T>
+TraversalRange<PostOrderIterator<T>> postOrder(Branch<T> &root)
+{
+    return TraversalRange<PostOrderIterator<T>>(PostOrderIterator<T>(&root));
+}
+
+template <typename T>
+TraversalRange<BreadthFirstIterator<T>> breadthFirst(Branch<T> &root)
+{
+    return TraversalRange<BreadthFirstIterator<T>>(BreadthFirstIterator<T>(&root));
+}
+
 template <typename Y>
 void addChild(std::shared_ptr<Branch<Y>> parent, std::shared_ptr<Branch<Y>> child)
 {
@@ -0,0 +1,324 @@
+/**
+* \file smart_tree_bench.cpp
+*
+* \brief Branch against FlatTree, building, walking and tearing down trees
+*        of 10^3 to 10^6 nodes
+*
+* \author Cathal Harte  <cathal.harte@protonmail.com>
+*/
+
+/*******************************************************************************
+* Includes
+*******************************************************************************/
+
+#include <benchmark/benchmark.h>
+#include <smart_tree.h>
+#include <flat_tree.h>
+#include <parallel_tree.h>
+#include <concurrent_tree.h>
+#include <mutex>
+#include <random>
+namespace
+{
+
+/*******************************************************************************
+* Definitions and types
+*******************************************************************************/
+
+typedef std::shared_ptr<smart_tree::Branch<int>> branch_ptr;
+
+/*******************************************************************************
+* Local Function prototypes
+*******************************************************************************/
+
+/*******************************************************************************
+* Data
+*******************************************************************************/
+
+/*******************************************************************************
+* Functions
+*******************************************************************************/
+
+// The parent of each node, node 0 being the root. Parents are picked at random among the nodes
+// before, which gives the shallow and bushy trees our traces have.
+std::vector<int> makeShape(int n)
+{
+    std::mt19937 rng(n);
+    std::vector<int> parents(n, -1);
+    for (int i = 1; i < n; i++)
+    {
+        parents[i] = std::uniform_int_distribution<int>(0, i - 1)(rng);
+    }
+    return parents;
+}
+
+// nodes keeps every node, as the caller building a trace would while it does so
+branch_ptr buildBranch(const std::vector<int> &parents, std::vector<branch_ptr> &nodes)
+{
+    nodes.resize(parents.size());
+    nodes[0] = std::make_shared<smart_tree::Branch<int>>(0);
+    for (size_t i = 1; i < parents.size(); i++)
+    {
+        nodes[i] = std::make_shared<smart_tree::Branch<int>>((int)i);
+        smart_tree::addChild(nodes[parents[i]], nodes[i]);
+    }
+    return nodes[0];
+}
+
+smart_tree::NodeHandle buildFlat(const std::vector<int> &parents, smart_tree::FlatTree<int> &tree,
+                                 std::vector<smart_tree::NodeHandle> &nodes)
+{
+    tree.clear();
+    nodes.resize(parents.size());
+    nodes[0] = tree.create(0);
+    for (size_t i = 1; i < parents.size(); i++)
+    {
+        nodes[i] = tree.emplaceChild(nodes[parents[i]], (int)i);
+    }
+    return nodes[0];
+}
+
+long sumBranch(const branch_ptr &root)
+{
+    long sum = 0;
+    std::vector<smart_tree::Branch<int> *> stack(1, root.get());
+    while (!stack.empty())
+    {
+        smart_tree::Branch<int> *b = stack.back();
+        stack.pop_back();
+        sum += b->data;
+        for (auto it = b->childrenBegin(); it != b->childrenEnd(); ++it)
+        {
+            stack.push_back(it->get());
+        }
+    }
+    return sum;
+}
+
+long sumFlat(const smart_tree::FlatTree<int> &tree, smart_tree::NodeHandle root)
+{
+    long sum = 0;
+    std::vector<smart_tree::NodeHandle> stack(1, root);
+    while (!stack.empty())
+    {
+        smart_tree::NodeHandle h = stack.back();
+        stack.pop_back();
+        sum += tree.data(h);
+        for (smart_tree::NodeHandle c = tree.firstChild(h); !c.isNull(); c = tree.nextSibling(c))
+        {
+            stack.push_back(c);
+        }
+    }
+    return sum;
+}
+
+void BM_build_branch(benchmark::State &state)
+{
+    std::vector<int> parents = makeShape(state.range(0));
+    std::vector<branch_ptr> nodes;
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(buildBranch(parents, nodes).get());
+
+        state.PauseTiming();
+        nodes.clear();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+// Built again into the same tree, as from one frame to the next
+void BM_build_flat(benchmark::State &state)
+{
+    std::vector<int> parents = makeShape(state.range(0));
+    smart_tree::FlatTree<int> tree;
+    std::vector<smart_tree::NodeHandle> nodes;
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(buildFlat(parents, tree, nodes).index);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+void BM_traverse_branch(benchmark::State &state)
+{
+    std::vector<int> parents = makeShape(state.range(0));
+    std::vector<branch_ptr> nodes;
+    branch_ptr root = buildBranch(parents, nodes);
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(sumBranch(root));
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+void BM_traverse_flat(benchmark::State &state)
+{
+    std::vector<int> parents = makeShape(state.range(0));
+    smart_tree::FlatTree<int> tree;
+    std::vector<smart_tree::NodeHandle> nodes;
+    smart_tree::NodeHandle root = buildFlat(parents, tree, nodes);
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(sumFlat(tree, root));
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+// Dropping the last references to the nodes, which frees them one by one
+void BM_teardown_branch(benchmark::State &state)
+{
+    std::vector<int> parents = makeShape(state.range(0));
+    std::vector<branch_ptr> nodes;
+
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+        branch_ptr root = buildBranch(parents, nodes);
+        state.ResumeTiming();
+
+        nodes.clear();
+        root.reset();
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+// clear(), which resets the data of every node as the pointer tree's teardown destroys it
+void BM_teardown_flat(benchmark::State &state)
+{
+    std::vector<int> parents = makeShape(state.range(0));
+    smart_tree::FlatTree<int> tree;
+    std::vector<smart_tree::NodeHandle> nodes;
+
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+        buildFlat(parents, tree, nodes);
+        state.ResumeTiming();
+
+        tree.clear();
+        benchmark::DoNotOptimize(tree.size());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+// Some work per node, as rendering or serializing a node would be
+void BM_visit_preorder(benchmark::State &state)
+{
+    std::vector<int> parents = makeShape(1000000);
+    std::vector<branch_ptr> nodes;
+    branch_ptr root = buildBranch(parents, nodes);
+
+    for (auto _ : state)
+    {
+        long sum = 0;
+        for (auto &b : smart_tree::preOrder(*root))
+        {
+            sum += std::hash<std::string>()(std::to_string(b.data));
+        }
+        benchmark::DoNotOptimize(sum);
+    }
+    state.SetItemsProcessed(state.iterations() * parents.size());
+}
+
+void BM_visit_for_each_subtree(benchmark::State &state)
+{
+    std::vector<int> parents = makeShape(1000000);
+    std::vector<branch_ptr> nodes;
+    branch_ptr root = buildBranch(parents, nodes);
+    smart_tree::WorkStealingPool pool(state.range(0));
+
+    for (auto _ : state)
+    {
+        std::atomic<long> sum(0);
+        smart_tree::forEachSubtree(pool, *root, [&](smart_tree::Branch<int> &b) {
+            sum += std::hash<std::string>()(std::to_string(b.data));
+        });
+        benchmark::DoNotOptimize(sum.load());
+    }
+    state.SetItemsProcessed(state.iterations() * parents.size());
+}
+
+// Every thread recording steps into one shared trace, under a global mutex as it is done today
+struct LockedTrace
+{
+    std::mutex lock;
+    branch_ptr root = std::make_shared<smart_tree::Branch<int>>(0);
+    std::vector<branch_ptr> parents;
+};
+
+LockedTrace *locked_trace;
+smart_tree::ConcurrentTree<int> *concurrent_trace;
+std::vector<smart_tree::NodeHandle> concurrent_parents;
+
+const int trace_parents = 16;
+
+void BM_append_locked_branch(benchmark::State &state)
+{
+    if (state.thread_index() == 0)
+    {
+        locked_trace = new LockedTrace;
+        for (int p = 0; p < trace_parents; p++)
+        {
+            locked_trace->parents.push_back(std::make_shared<smart_tree::Branch<int>>(p));
+            smart_tree::addChild(locked_trace->root, locked_trace->parents.back());
+        }
+    }
+
+    int i = state.thread_index();
+    for (auto _ : state)
+    {
+        branch_ptr child = std::make_shared<smart_tree::Branch<int>>(i);
+        std::lock_guard<std::mutex> guard(locked_trace->lock);
+        smart_tree::addChild(locked_trace->parents[i++ % trace_parents], child);
+    }
+    state.SetItemsProcessed(state.iterations());
+
+    if (state.thread_index() == 0)
+    {
+        delete locked_trace;
+    }
+}
+
+void BM_append_concurrent_tree(benchmark::State &state)
+{
+    if (state.thread_index() == 0)
+    {
+        concurrent_trace = new smart_tree::ConcurrentTree<int>;
+        concurrent_parents.clear();
+        smart_tree::NodeHandle root = concurrent_trace->create(0);
+        for (int p = 0; p < trace_parents; p++)
+        {
+            concurrent_parents.push_back(concurrent_trace->addChild(root, p));
+        }
+    }
+
+    int i = state.thread_index();
+    for (auto _ : state)
+    {
+        concurrent_trace->addChild(concurrent_parents[i++ % trace_parents], i);
+    }
+    state.SetItemsProcessed(state.iterations());
+
+    if (state.thread_index() == 0)
+    {
+        delete concurrent_trace;
+    }
+}
+
+BENCHMARK(BM_build_branch)->RangeMultiplier(10)->Range(1000, 1000000)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_build_flat)->RangeMultiplier(10)->Range(1000, 1000000)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_traverse_branch)->RangeMultiplier(10)->Range(1000, 1000000)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_traverse_flat)->RangeMultiplier(10)->Range(1000, 1000000)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_teardown_branch)->RangeMultiplier(10)->Range(1000, 1000000)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_teardown_flat)->RangeMultiplier(10)->Range(1000, 1000000)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_append_locked_branch)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK(BM_append_concurrent_tree)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK(BM_visit_preorder)->UseRealTime()->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_visit_for_each_subtree)->Arg(1)->Arg(2)->Arg(4)->Arg(8)->UseRealTime()->Unit(benchmark::kMillisecond);
+
+} // namespace
@@ -0,0 +1,430 @@
+/**
+* \file smart_tree_test.cpp
+*
+* \brief smart_tree unit test
+*
+* \author Cathal Harte  <cathal.harte@protonmail.com>
+*/
+
+/*******************************************************************************
+* Includes
+*******************************************************************************/
+
+#include <gtest/gtest.h>
+#include <smart_tree.h>
+#include <flat_tree.h>
+#include <parallel_tree.h>
+#include <work_stealing_pool.h>
+#include <concurrent_tree.h>
+#include <dag.h>
+#include <atomic>
+#include <random>
+#include <thread>
+namespace
+{
+
+/*******************************************************************************
+* Definitions and types
+*******************************************************************************/
+
+typedef std::shared_ptr<smart_tree::Branch<int>> branch_ptr;
+
+/*******************************************************************************
+* Local Function prototypes
+*******************************************************************************/
+
+/*******************************************************************************
+* Data
+*******************************************************************************/
+
+/*******************************************************************************
+* Functions
+*******************************************************************************/
+
+branch_ptr makeBranch(int data)
+{
+    return std::make_shared<smart_tree::Branch<int>>(data);
+}
+
+// 1 with children 2, 5 and 6, 2 with children 3 and 4, and 6 with child 7
+branch_ptr makeSmallTree(std::vector<branch_ptr> &nodes)
+{
+    nodes.clear();
+    for (int i = 0; i <= 7; i++)
+    {
+        nodes.push_back(makeBranch(i));
+    }
+    smart_tree::addChild(nodes[1], nodes[2]);
+    smart_tree::addChild(nodes[2], nodes[3]);
+    smart_tree::addChild(nodes[2], nodes[4]);
+    smart_tree::addChild(nodes[1], nodes[5]);
+    smart_tree::addChild(nodes[1], nodes[6]);
+    smart_tree::addChild(nodes[6], nodes[7]);
+    return nodes[1];
+}
+
+template <typename Range>
+std::vector<int> visitOrder(Range range)
+{
+    std::vector<int> order;
+    for (auto &b : range)
+    {
+        order.push_back(b.data);
+    }
+    return order;
+}
+
+TEST(branch, children_iterate)
+{
+    std::vector<branch_ptr> nodes;
+    branch_ptr root = makeSmallTree(nodes);
+
+    std::vector<int> children;
+    for (auto it = root->childrenBegin(); it != root->childrenEnd(); ++it)
+    {
+        children.push_back((*it)->data);
+    }
+    EXPECT_EQ(children, std::vector<int>({2, 5, 6}));
+}
+
+TEST(branch, traversal_orders)
+{
+    std::vector<branch_ptr> nodes;
+    branch_ptr root = makeSmallTree(nodes);
+
+    EXPECT_EQ(visitOrder(smart_tree::preOrder(*root)), std::vector<int>({1, 2, 3, 4, 5, 6, 7}));
+    EXPECT_EQ(visitOrder(smart_tree::postOrder(*root)), std::vector<int>({3, 4, 2, 5, 7, 6, 1}));
+    EXPECT_EQ(visitOrder(smart_tree::breadthFirst(*root)), std::vector<int>({1, 2, 5, 6, 3, 4, 7}));
+
+    // a subtree, and a lone node
+    EXPECT_EQ(visitOrder(smart_tree::postOrder(*nodes[2])), std::vector<int>({3, 4, 2}));
+    EXPECT_EQ(visitOrder(smart_tree::preOrder(*nodes[7])), std::vector<int>({7}));
+}
+
+// The walk doesn't take references, root is the only owner of the tree throughout
+TEST(branch, traversal_leaves_refcounts_alone)
+{
+    std::vector<branch_ptr> nodes;
+    branch_ptr root = makeSmallTree(nodes);
+    nodes.clear();
+
+    long count = 0;
+    for (auto &b : smart_tree::preOrder(*root))
+    {
+        count++;
+        for (auto it = b.childrenBegin(); it != b.childrenEnd(); ++it)
+        {
+            EXPECT_EQ(it->use_count(), 1);
+        }
+    }
+    EXPECT_EQ(count, 7);
+}
+
+TEST(work_stealing_pool, runs_every_task)
+{
+    smart_tree::WorkStealingPool pool(4);
+    std::atomic<int> sum(0);
+    {
+        smart_tree::TaskGroup group(pool);
+        for (int i = 1; i <= 1000; i++)
+        {
+            group.run([&sum, i] { sum += i; });
+        }
+        group.wait();
+        EXPECT_EQ(sum, 500500);
+    }
+}
+
+// Tasks spawning tasks and waiting on them, deeper than there are workers
+TEST(work_stealing_pool, nested_groups)
+{
+    smart_tree::WorkStealingPool pool(2);
+
+    std::function<long(int)> fib = [&](int n) -> long {
+        if (n < 2)
+        {
+            return n;
+        }
+        long a = 0;
+        smart_tree::TaskGroup group(pool);
+        group.run([&] { a = fib(n - 1); });
+        long b = fib(n - 2);
+        group.wait();
+        return a + b;
+    };
+    EXPECT_EQ(fib(18), 2584);
+}
+
+TEST(for_each_subtree, visits_every_node_once)
+{
+    const int n = 20000;
+    std::mt19937 rng(n);
+    std::vector<branch_ptr> nodes;
+    nodes.push_back(makeBranch(0));
+    for (int i = 1; i < n; i++)
+    {
+        nodes.push_back(makeBranch(i));
+        smart_tree::addChild(nodes[std::uniform_int_distribution<int>(0, i - 1)(rng)], nodes[i]);
+    }
+
+    std::vector<std::atomic<int>> visits(n);
+    for (auto &v : visits)
+    {
+        v = 0;
+    }
+
+    smart_tree::WorkStealingPool pool(4);
+    smart_tree::forEachSubtree(pool, *nodes[0], [&](smart_tree::Branch<int> &b) { visits[b.data]++; });
+
+    for (int i = 0; i < n; i++)
+    {
+        ASSERT_EQ(visits[i], 1) << "node " << i;
+    }
+}
+
+TEST(flat_tree, same_semantics_as_branch)
+{
+    smart_tree::FlatTree<int> tree;
+    smart_tree::NodeHandle root = tree.create(1);
+    smart_tree::NodeHandle a = tree.emplaceChild(root, 2);
+    smart_tree::NodeHandle b = tree.emplaceChild(root, 3);
+    smart_tree::NodeHandle c = tree.emplaceChild(root, 4);
+
+    EXPECT_TRUE(tree.isRoot(root));
+    EXPECT_EQ(tree.getParent(b), root);
+    EXPECT_EQ(tree.getNumChildren(root), 3u);
+
+    tree.removeChild(root, b);
+    EXPECT_TRUE(tree.isRoot(b));
+    EXPECT_EQ(tree.nextSibling(a), c);
+    EXPECT_EQ(tree.prevSibling(c), a);
+    EXPECT_THROW(tree.removeChild(root, b), const char *);
+
+    std::vector<int> children;
+    tree.forEachChild(root, [&](smart_tree::NodeHandle h) { children.push_back(tree.data(h)); });
+    EXPECT_EQ(children, std::vector<int>({2, 4}));
+
+    // cleared in one go, the storage is kept and old handles are stale
+    std::size_t capacity = tree.capacity();
+    tree.clear();
+    EXPECT_EQ(tree.size(), 0u);
+    EXPECT_FALSE(tree.valid(root));
+    smart_tree::NodeHandle fresh = tree.create(5);
+    EXPECT_EQ(fresh.index, root.index);
+    EXPECT_NE(fresh, root);
+    EXPECT_EQ(tree.capacity(), capacity);
+}
+
+// Cleared nodes let go of their data, nothing of the last frame is handed out again
+TEST(flat_tree, clear_resets_the_data)
+{
+    smart_tree::FlatTree<std::shared_ptr<int>> tree;
+    std::shared_ptr<int> held = std::make_shared<int>(1);
+    smart_tree::NodeHandle root = tree.create(held);
+    tree.emplaceChild(root, held);
+    EXPECT_EQ(held.use_count(), 3);
+
+    tree.clear();
+    EXPECT_EQ(held.use_count(), 1);
+    EXPECT_FALSE(tree.data(tree.create()));
+    EXPECT_FALSE(tree.data(tree.create()));
+}
+
+// 1 feeds 2 and 3, which both feed 4
+TEST(dag, multiple_parents)
+{
+    typedef std::shared_ptr<smart_tree::DagNode<int>> dag_ptr;
+    std::vector<dag_ptr> n;
+    for (int i = 0; i <= 4; i++)
+    {
+        n.push_back(std::make_shared<smart_tree::DagNode<int>>(i));
+    }
+    smart_tree::addChild(n[1], n[2]);
+    smart_tree::addChild(n[1], n[3]);
+    smart_tree::addChild(n[3], n[4]);
+    smart_tree::addChild(n[2], n[4]);
+
+    EXPECT_TRUE(n[1]->isRoot());
+    EXPECT_EQ(n[4]->getNumParents(), 2u);
+    EXPECT_EQ(n[4]->getParent(0), n[3]);
+    EXPECT_EQ(n[4]->getParent(1), n[2]);
+    EXPECT_THROW(smart_tree::addChild(n[4], n[1]), const char *);
+    EXPECT_THROW(smart_tree::addChild(n[2], n[4]), const char *);
+
+    std::vector<int> order;
+    for (auto *d : smart_tree::topologicalOrder(std::vector<dag_ptr>(1, n[1])))
+    {
+        order.push_back(d->data);
+    }
+    EXPECT_EQ(order, std::vector<int>({1, 2, 3, 4}));
+
+    // held by its other parent
+    smart_tree::removeChild(n[2], n[4]);
+    EXPECT_EQ(n[4]->getNumParents(), 1u);
+    EXPECT_THROW(smart_tree::removeChild(n[2], n[4]), const char *);
+    std::weak_ptr<smart_tree::DagNode<int>> last = n[4];
+    n[4].reset();
+    EXPECT_FALSE(last.expired());
+    smart_tree::removeChild(n[3], last.lock());
+    EXPECT_TRUE(last.expired());
+}
+
+TEST(concurrent_tree, add_and_remove)
+{
+    smart_tree::ConcurrentTree<int> tree;
+    smart_tree::NodeHandle root = tree.create(1);
+    smart_tree::NodeHandle a = tree.addChild(root, 2);
+    smart_tree::NodeHandle b = tree.addChild(root, 3);
+    smart_tree::NodeHandle c = tree.addChild(root, 4);
+    smart_tree::NodeHandle b_child = tree.addChild(b, 5);
+
+    EXPECT_TRUE(tree.isRoot(root));
+    EXPECT_EQ(tree.getParent(b), root);
+    EXPECT_EQ(tree.getNumChildren(root), 3u);
+    EXPECT_EQ(tree.size(), 5u);
+
+    tree.removeChild(root, b);
+    EXPECT_TRUE(tree.isRemoved(b));
+    EXPECT_THROW(tree.removeChild(root, b), const char *);
+    EXPECT_THROW(tree.removeChild(a, c), const char *);
+
+    std::vector<int> children;
+    tree.forEachChild(root, [&](smart_tree::NodeHandle h) { children.push_back(tree.data(h)); });
+    EXPECT_EQ(children, std::vector<int>({2, 4}));
+
+    // the removed subtree is reclaimed, and its nodes reused
+    tree.reclaim();
+    EXPECT_EQ(tree.size(), 3u);
+    EXPECT_FALSE(tree.valid(b));
+    EXPECT_FALSE(tree.valid(b_child));
+    smart_tree::NodeHandle d = tree.addChild(a, 6);
+    EXPECT_TRUE(d.index == b.index || d.index == b_child.index);
+    EXPECT_TRUE(tree.valid(d));
+
+    children.clear();
+    tree.forEachChild(root, [&](smart_tree::NodeHandle h) { children.push_back(tree.data(h)); });
+    EXPECT_EQ(children, std::vector<int>({2, 4}));
+}
+
+// Many threads appending to a few shared parents while others read, best run under TSan. Every
+// child must be found exactly once, and each thread's children in the order it added them.
+TEST(concurrent_tree, stress_appends_with_readers)
+{
+    const int writers = 8;
+    const int per_writer = 5000;
+    const int num_parents = 4;
+
+    smart_tree::ConcurrentTree<int> tree;
+    smart_tree::NodeHandle root = tree.create(-1);
+    std::vector<smart_tree::NodeHandle> parents;
+    for (int p = 0; p < num_parents; p++)
+    {
+        parents.push_back(tree.addChild(root, -1));
+    }
+
+    std::atomic<bool> done(false);
+    std::vector<std::thread> threads;
+    for (int w = 0; w < writers; w++)
+    {
+        threads.emplace_back([&, w] {
+            for (int i = 0; i < per_writer; i++)
+            {
+                tree.addChild(parents[i % num_parents], w * per_writer + i);
+            }
+        });
+    }
+    // readers walk while the writers append, and remove a few as they go
+    std::atomic<long> seen(0);
+    for (int r = 0; r < 2; r++)
+    {
+        threads.emplace_back([&] {
+            while (!done)
+            {
+                for (auto p : parents)
+                {
+                    tree.forEachChild(p, [&](smart_tree::NodeHandle h) {
+                        EXPECT_GE(tree.data(h), 0);
+                        seen++;
+                    });
+                }
+            }
+        });
+    }
+    for (int w = 0; w < writers; w++)
+    {
+        threads[w].join();
+    }
+    done = true;
+    for (size_t t = writers; t < threads.size(); t++)
+    {
+        threads[t].join();
+    }
+
+    std::vector<int> found(writers * per_writer, 0);
+    for (auto p : parents)
+    {
+        std::vector<int> last(writers, -1);
+        tree.forEachChild(p, [&](smart_tree::NodeHandle h) {
+            int v = tree.data(h);
+            found[v]++;
+            int w = v / per_writer;
+            EXPECT_GT(v, last[w]);
+            last[w] = v;
+        });
+        EXPECT_EQ(tree.getNumChildren(p), (size_t)(writers * per_writer / num_parents));
+    }
+    for (size_t v = 0; v < found.size(); v++)
+    {
+        ASSERT_EQ(found[v], 1) << "child " << v;
+    }
+    EXPECT_GT(seen, 0);
+}
+
+// Removal and reclamation while other threads keep appending
+TEST(concurrent_tree, stress_reclaim)
+{
+    smart_tree::ConcurrentTree<int> tree;
+    smart_tree::NodeHandle root = tree.create(0);
+
+    std::atomic<bool> done(false);
+    std::vector<std::thread> threads;
+    for (int w = 0; w < 4; w++)
+    {
+        threads.emplace_back([&] {
+            for (int i = 0; i < 1000; i++)
+            {
+                smart_tree::NodeHandle c = tree.addChild(root, i);
+                tree.addChild(c, i);
+                if (i % 2)
+                {
+                    tree.removeChild(root, c);
+                }
+            }
+        });
+    }
+    threads.emplace_back([&] {
+        while (!done)
+        {
+            tree.reclaim();
+        }
+    });
+    for (int w = 0; w < 4; w++)
+    {
+        threads[w].join();
+    }
+    done = true;
+    threads.back().join();
+    tree.reclaim();
+
+    EXPECT_EQ(tree.getNumChildren(root), 2000u);
+    EXPECT_EQ(tree.size(), 1u + 2 * 2000u);
+    size_t children = 0;
+    tree.forEachChild(root, [&](smart_tree::NodeHandle h) {
+        EXPECT_EQ(tree.data(h) % 2, 0);
+        EXPECT_EQ(tree.getNumChildren(h), 1u);
+        children++;
+    });
+    EXPECT_EQ(children, 2000u);
+}
+
+} // namespace
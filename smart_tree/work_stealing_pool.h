@@ -0,0 +1,248 @@
+/******************************************************************************/
+/*!
+ * @file  work_stealing_pool.h
+ * @brief A thread pool where each worker keeps its own queue of tasks, and
+ *        idle workers steal from the others
+ *
+ *        Header only
+ *
+ *
+ * @author Cathal Harte <cathal.harte@protonmail.com>
+ */
+#ifndef _WORK_STEALING_POOL_H
+#define _WORK_STEALING_POOL_H
+
+/*******************************************************************************
+* Includes
+******************************************************************************/
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace smart_tree
+{
+
+/*! @addtogroup smart_tree
+ * @{
+ */
+/*******************************************************************************
+* Class prototypes
+*******************************************************************************/
+
+//  Design parameters :
+//      Each worker has a deque of tasks. A worker pushes the tasks it spawns onto the back of its
+//      own deque and takes its next task from the back too, so that it carries on depth first with
+//      what is hot in its cache. An idle worker steals from the front of another's deque, where
+//      the oldest, and for recursive work the largest, tasks are.
+//      Tasks submitted from outside the pool go to the workers' deques in turn.
+//      A thread waiting on a TaskGroup runs tasks rather than block, so tasks may spawn and wait
+//      on tasks of their own without tying up the workers.
+//      The deques are each guarded by their own mutex, only ever held for a push or a pop.
+//      Tasks must not throw.
+class WorkStealingPool
+{
+public:
+    typedef std::function<void()> task_t;
+
+    explicit WorkStealingPool(unsigned num_threads = std::thread::hardware_concurrency())
+        : queues(num_threads ? num_threads : 1)
+    {
+        for (std::size_t i = 0; i < queues.size(); i++)
+        {
+            queues[i].reset(new Queue);
+        }
+        for (std::size_t i = 0; i < queues.size(); i++)
+        {
+            workers.emplace_back([this, i] { workerLoop((int)i); });
+        }
+    }
+
+    ~WorkStealingPool()
+    {
+        {
+            std::lock_guard<std::mutex> guard(sleep_lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto &w : workers)
+        {
+            w.join();
+        }
+    }
+
+    WorkStealingPool(const WorkStealingPool &) = delete;
+    WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+
+    std::size_t numThreads() const { return workers.size(); }
+
+    void submit(task_t task)
+    {
+        int self = workerIndex();
+        std::size_t q = self >= 0 ? (std::size_t)self : next_queue++ % queues.size();
+        {
+            std::lock_guard<std::mutex> guard(queues[q]->lock);
+            queues[q]->tasks.push_back(std::move(task));
+        }
+        pending++;
+        {
+            // taken so that the notify can't slip in between a worker's check and its wait
+            std::lock_guard<std::mutex> guard(sleep_lock);
+        }
+        wake.notify_one();
+    }
+
+    // Runs one task, from our own deque if we are a worker, otherwise stolen.
+    // False when there was none to be found.
+    bool runPendingTask()
+    {
+        task_t task;
+        if (!take(workerIndex(), task))
+        {
+            return false;
+        }
+        task();
+        return true;
+    }
+
+private:
+    struct Queue
+    {
+        std::mutex lock;
+        std::deque<task_t> tasks;
+    };
+
+    // Which worker of this pool the calling thread is, -1 for any other thread
+    int workerIndex() const
+    {
+        return current_pool() == this ? current_index() : -1;
+    }
+
+    bool take(int self, task_t &task)
+    {
+        if (self >= 0)
+        {
+            Queue &own = *queues[self];
+            std::lock_guard<std::mutex> guard(own.lock);
+            if (!own.tasks.empty())
+            {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                pending--;
+                return true;
+            }
+        }
+
+        std::size_t n = queues.size();
+        std::size_t start = self >= 0 ? (std::size_t)self + 1 : steal_from++;
+        for (std::size_t k = 0; k < n; k++)
+        {
+            Queue &victim = *queues[(start + k) % n];
+            std::lock_guard<std::mutex> guard(victim.lock);
+            if (!victim.tasks.empty())
+            {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                pending--;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void workerLoop(int index)
+    {
+        current_pool() = this;
+        current_index() = index;
+
+        for (;;)
+        {
+            task_t task;
+            if (take(index, task))
+            {
+                task();
+                continue;
+            }
+
+            std::unique_lock<std::mutex> guard(sleep_lock);
+            wake.wait(guard, [this] { return stopping || pending > 0; });
+            if (stopping && pending == 0)
+            {
+                return;
+            }
+        }
+    }
+
+    static const WorkStealingPool *&current_pool()
+    {
+        static thread_local const WorkStealingPool *pool = nullptr;
+        return pool;
+    }
+
+    static int &current_index()
+    {
+        static thread_local int index = -1;
+        return index;
+    }
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+
+    std::atomic<long> pending{0};
+    std::atomic<std::size_t> next_queue{0};
+    std::atomic<std::size_t> steal_from{0};
+
+    std::mutex sleep_lock;
+    std::condition_variable wake;
+    bool stopping = false;
+};
+
+// Tasks that are waited on together. wait() helps run the pool's tasks until all of the group's
+// are done, and may be called from inside a task.
+class TaskGroup
+{
+public:
+    explicit TaskGroup(WorkStealingPool &pool) : pool(pool) {}
+    ~TaskGroup() { wait(); }
+
+    TaskGroup(const TaskGroup &) = delete;
+    TaskGroup &operator=(const TaskGroup &) = delete;
+
+    template <typename Fn>
+    void run(Fn fn)
+    {
+        outstanding++;
+        pool.submit([this, fn] {
+            fn();
+            outstanding--;
+        });
+    }
+
+    void wait()
+    {
+        while (outstanding > 0)
+        {
+            if (!pool.runPendingTask())
+            {
+                // ours are running on other threads
+                std::this_thread::yield();
+            }
+        }
+    }
+
+private:
+    WorkStealingPool &pool;
+    std::atomic<long> outstanding{0};
+};
+
+/*! @}
+ */
+
+} // namespace smart_tree
+
+#endif // _WORK_STEALING_POOL_H
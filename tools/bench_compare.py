@@ -0,0 +1,95 @@
+#!/usr/bin/env python3
+"""Compares Google Benchmark JSON results against a stored baseline.
+
+Either argument is a JSON file written with --benchmark_out_format=json, or a
+directory of them as tools/run_benches.sh writes, matched up by file name.
+A benchmark slower than the baseline by more than the threshold is a
+regression, and the exit status is 1 if there is any.
+
+    tools/bench_compare.py bench_baseline bench_current --threshold 0.10
+"""
+
+import argparse
+import json
+import os
+import sys
+
+UNIT_NS = {"ns": 1.0, "us": 1e3, "ms": 1e6, "s": 1e9}
+
+
+def load(path):
+    """{benchmark name: time in ns}; of repeated runs the median is taken."""
+    with open(path) as f:
+        data = json.load(f)
+    times = {}
+    medians = {}
+    for b in data.get("benchmarks", []):
+        if b.get("error_occurred"):
+            continue
+        t = b[args.metric] * UNIT_NS[b.get("time_unit", "ns")]
+        if b.get("run_type") == "aggregate":
+            if b.get("aggregate_name") == "median":
+                medians[b["run_name"]] = t
+        else:
+            times.setdefault(b.get("run_name", b["name"]), t)
+    times.update(medians)
+    return times
+
+
+def files(path):
+    if os.path.isdir(path):
+        return {n: os.path.join(path, n) for n in sorted(os.listdir(path)) if n.endswith(".json")}
+    return {os.path.basename(path): path}
+
+
+def fmt(ns):
+    for unit, scale in (("s", 1e9), ("ms", 1e6), ("us", 1e3)):
+        if ns >= scale:
+            return "%.3f %s" % (ns / scale, unit)
+    return "%.1f ns" % ns
+
+
+parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+parser.add_argument("baseline")
+parser.add_argument("current")
+parser.add_argument("--threshold", type=float, default=0.10,
+                    help="relative slowdown counted as a regression (default 0.10)")
+parser.add_argument("--metric", choices=("real_time", "cpu_time"), default="real_time")
+parser.add_argument("--all", action="store_true", help="list every benchmark, not only changes")
+args = parser.parse_args()
+
+baseline_files = files(args.baseline)
+current_files = files(args.current)
+if len(baseline_files) == 1 and len(current_files) == 1:
+    current_files = {list(baseline_files)[0]: list(current_files.values())[0]}
+
+regressions = 0
+for name, base_path in baseline_files.items():
+    if name not in current_files:
+        print("%s: no current results" % name)
+        continue
+    base = load(base_path)
+    cur = load(current_files[name])
+    print("== %s" % name)
+    for bench, b in base.items():
+        if bench not in cur:
+            print("  %-60s missing" % bench)
+            continue
+        c = cur[bench]
+        change = c / b - 1.0 if b > 0 else 0.0
+        if change > args.threshold:
+            regressions += 1
+            tag = "REGRESSION"
+        elif change < -args.threshold:
+            tag = "improved"
+        elif args.all:
+            tag = ""
+        else:
+            continue
+        print("  %-60s %12s -> %12s %+7.1f%% %s" % (bench, fmt(b), fmt(c), change * 100, tag))
+    for bench in cur:
+        if bench not in base:
+            print("  %-60s new" % bench)
+
+print("%d regression(s) over %.0f%%" % (regressions, args.threshold * 100))
+sys.exit(1 if regressions else 0)
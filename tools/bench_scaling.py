@@ -0,0 +1,70 @@
+#!/usr/bin/env python3
+"""Tabulates the thread scaling of the BM_threads_* benchmarks.
+
+The argument is a JSON file written with --benchmark_out_format=json, or a
+directory of them as tools/run_benches.sh writes. Each case is run with
+max_threads as its argument; the table gives the time at each thread count
+and the speedup over one thread.
+
+    tools/run_benches.sh bench_current --benchmark_filter=BM_threads_
+    tools/bench_scaling.py bench_current
+"""
+
+import argparse
+import json
+import os
+
+UNIT_NS = {"ns": 1.0, "us": 1e3, "ms": 1e6, "s": 1e9}
+
+
+def load(path):
+    """{case: {threads: time in ns}}; of repeated runs the median is taken."""
+    with open(path) as f:
+        data = json.load(f)
+    cases = {}
+    for b in data.get("benchmarks", []):
+        if b.get("error_occurred"):
+            continue
+        if b.get("run_type") == "aggregate" and b.get("aggregate_name") != "median":
+            continue
+        parts = b.get("run_name", b["name"]).split("/")
+        if not parts[0].startswith("BM_threads_") or len(parts) < 2:
+            continue
+        t = b[args.metric] * UNIT_NS[b.get("time_unit", "ns")]
+        times = cases.setdefault(parts[0], {})
+        if b.get("run_type") == "aggregate":
+            times[int(parts[1])] = t
+        else:
+            times.setdefault(int(parts[1]), t)
+    return cases
+
+
+def files(path):
+    if os.path.isdir(path):
+        return [os.path.join(path, n) for n in sorted(os.listdir(path)) if n.endswith(".json")]
+    return [path]
+
+
+parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+parser.add_argument("results")
+parser.add_argument("--metric", choices=("real_time", "cpu_time"), default="real_time")
+args = parser.parse_args()
+
+for path in files(args.results):
+    cases = load(path)
+    if not cases:
+        continue
+    threads = sorted({n for times in cases.values() for n in times})
+    print("== %s" % os.path.basename(path))
+    print("  %-28s" % "threads" + "".join("%19d" % n for n in threads))
+    for case, times in sorted(cases.items()):
+        one = times.get(1)
+        cells = []
+        for n in threads:
+            if n not in times:
+                cells.append("%19s" % "-")
+            elif one:
+                cells.append("%9.3f ms %5.2fx" % (times[n] / 1e6, one / times[n]))
+            else:
+                cells.append("%16.3f ms" % (times[n] / 1e6))
+        print("  %-28s" % case + "".join(cells))
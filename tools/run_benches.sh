@@ -0,0 +1,26 @@
+#!/bin/sh
+# Builds and runs every benchmark of modules_list.txt, each writing its results as JSON to
+# <out_dir>/<bench>.json. Extra arguments go to every benchmark, e.g. a --benchmark_filter.
+#
+#     tools/run_benches.sh bench_baseline                   # store a baseline
+#     tools/run_benches.sh bench_current
+#     tools/bench_compare.py bench_baseline bench_current   # fails on a regression
+set -e
+
+if [ $# -lt 1 ]; then
+    echo "usage: $0 <out_dir> [benchmark args...]" >&2
+    exit 2
+fi
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+mkdir -p "$1"
+out=$(cd "$1" && pwd)
+shift
+
+for dir in $(grep '_bench$' "$root/modules_list.txt"); do
+    name=$(basename "$dir")
+    echo "== $name"
+    cmake -S "$root/$dir" -B "$root/$dir/build" -DCMAKE_BUILD_TYPE=Release > /dev/null
+    cmake --build "$root/$dir/build" -j > /dev/null
+    "$root/$dir/build/$name" --benchmark_out="$out/$name.json" --benchmark_out_format=json "$@"
+done
@@ -0,0 +1,248 @@
+/******************************************************************************/
+/*!
+ * @file  async_visualizer.cpp
+ * @brief Renders trace images on worker threads of its own, so that drawing
+ *        them costs the traced pipeline no more than queueing headers
+ *
+ * @author Cathal Harte <cathal.harte@protonmail.com>
+ */
+
+/*******************************************************************************
+* Includes
+******************************************************************************/
+
+#include "async_visualizer.h"
+
+#include <instrument.h>
+
+#include <cassert>
+#include <stdexcept>
+#include <utility>
+
+namespace tracer
+{
+
+/*******************************************************************************
+* Functions
+*******************************************************************************/
+
+// Checked on the caller's thread, rather than when a worker comes to render the request. A
+// highlight grays src, as a conversion to GRAY would.
+static void checkRequest(const VisRequest &r)
+{
+    cspace::colorspace_t from = r.src.getColorspace();
+    bool supported = false;
+    switch (r.render)
+    {
+    case VIS_HIGHLIGHT:
+        supported = cspace::planConversion(from, cspace::GRAY).stages > 0;
+        break;
+    case VIS_GRAY3:
+        supported = cspace::planConversion(from, cspace::BGR, true).stages > 0;
+        break;
+    case VIS_BGR:
+        supported = cspace::planConversion(from, cspace::BGR).stages > 0;
+        break;
+    }
+    if (!supported)
+    {
+        throw std::runtime_error("a request src of a colorspace it can't be rendered from");
+    }
+
+    if (r.render != VIS_HIGHLIGHT)
+    {
+        return;
+    }
+    if (r.num_masks < 1 || r.num_masks > VIS_MAX_MASKS)
+    {
+        throw std::runtime_error("a highlight request has from 1 to VIS_MAX_MASKS masks");
+    }
+    for (int k = 0; k < r.num_masks; k++)
+    {
+        if (r.masks[k].type() != CV_8UC1 || r.masks[k].size() != r.src.size())
+        {
+            throw std::runtime_error("the masks of a highlight request are single channel and "
+                                     "the size of src");
+        }
+    }
+}
+
+/*******************************************************************************
+* Classes
+*******************************************************************************/
+
+AsyncVisualizer::AsyncVisualizer(vis_sink_t sink, std::size_t queue_depth, unsigned num_threads,
+                                 vis_policy_t policy, unsigned sample_every)
+    : sink(sink), policy(policy), sample_every(sample_every ? sample_every : 1), queue(queue_depth)
+{
+    assert(("A worker at least", num_threads > 0));
+    for (unsigned i = 0; i < num_threads; i++)
+    {
+        workers.emplace_back([this] { workerLoop(); });
+    }
+}
+
+AsyncVisualizer::~AsyncVisualizer()
+{
+    close();
+}
+
+// Under VIS_SAMPLE, of the requests finding the queue full one in sample_every goes in over the
+// oldest, so that what is shown keeps moving while most of the load is shed
+bool AsyncVisualizer::enqueue(VisRequest &&request)
+{
+    checkRequest(request);
+
+    bool pushed = false;
+    bool dropped_oldest = false;
+    switch (policy)
+    {
+    case VIS_BLOCK:
+        pushed = queue.push(std::move(request));
+        break;
+    case VIS_DROP_OLDEST:
+        pushed = queue.pushOverOldest(std::move(request), dropped_oldest);
+        break;
+    case VIS_SAMPLE:
+        pushed = queue.tryPush(std::move(request));
+        if (!pushed && full_arrivals++ % sample_every == 0)
+        {
+            pushed = queue.pushOverOldest(std::move(request), dropped_oldest);
+        }
+        else if (!pushed)
+        {
+            dropped++;
+        }
+        break;
+    }
+    if (dropped_oldest)
+    {
+        dropped++;
+    }
+    if (!pushed)
+    {
+        return false;
+    }
+
+    enqueued++;
+    std::size_t depth = queue.size();
+    INSTRUMENT_COUNTER("vis_queue_depth", (double)depth);
+    std::size_t seen = max_depth;
+    while (depth > seen && !max_depth.compare_exchange_weak(seen, depth))
+    {
+    }
+    return true;
+}
+
+bool AsyncVisualizer::highlight(const cspace::Mat &bg, const cspace::Mat &mask, uint64_t tag)
+{
+    VisRequest r;
+    r.render = VIS_HIGHLIGHT;
+    r.src = bg;
+    r.masks[0] = mask;
+    r.num_masks = 1;
+    r.tag = tag;
+    return enqueue(std::move(r));
+}
+
+bool AsyncVisualizer::gray3(const cspace::Mat &src, uint64_t tag)
+{
+    VisRequest r;
+    r.render = VIS_GRAY3;
+    r.src = src;
+    r.tag = tag;
+    return enqueue(std::move(r));
+}
+
+bool AsyncVisualizer::bgr(const cspace::Mat &src, uint64_t tag)
+{
+    VisRequest r;
+    r.render = VIS_BGR;
+    r.src = src;
+    r.tag = tag;
+    return enqueue(std::move(r));
+}
+
+void AsyncVisualizer::close()
+{
+    if (closed)
+    {
+        return;
+    }
+    closed = true;
+    queue.close();
+    for (auto &w : workers)
+    {
+        w.join();
+    }
+}
+
+VisualizerStats AsyncVisualizer::stats() const
+{
+    VisualizerStats out;
+    out.enqueued = enqueued;
+    out.rendered = rendered;
+    out.dropped = dropped;
+    out.failed = failed;
+    out.depth = queue.size();
+    out.max_depth = max_depth;
+    return out;
+}
+
+// The output buffer is reused while the sink keeps no hold on it. What is thrown by a request is
+// counted and dropped with it, so that one bad request doesn't end the worker, and the program.
+void AsyncVisualizer::workerLoop()
+{
+    VisRequest r;
+    cspace::Mat out;
+    while (queue.pop(r))
+    {
+        if (out.u && out.u->refcount > 1)
+        {
+            out = cspace::Mat();
+        }
+        try
+        {
+            render(r, out);
+            sink(r.tag, out);
+            rendered++;
+        }
+        catch (...)
+        {
+            failed++;
+            out = cspace::Mat();
+        }
+        r = VisRequest(); // lets go of the headers now rather than at the next request
+    }
+}
+
+void AsyncVisualizer::render(const VisRequest &r, cspace::Mat &out) const
+{
+    INSTRUMENT_SCOPE("tracer::visualize");
+    switch (r.render)
+    {
+    case VIS_HIGHLIGHT:
+        if (r.num_masks == 1)
+        {
+            cspace::highlightOverBg(r.src, r.masks[0], out);
+        }
+        else
+        {
+            const cv::Mat *masks[VIS_MAX_MASKS];
+            for (int k = 0; k < r.num_masks; k++)
+            {
+                masks[k] = &r.masks[k];
+            }
+            cspace::highlightOverBg(r.src, masks, r.num_masks, out);
+        }
+        break;
+    case VIS_GRAY3:
+        r.src.to3ChannelGray(out, cspace::BGR);
+        break;
+    case VIS_BGR:
+        r.src.toBGR(out);
+        break;
+    }
+}
+
+} // namespace tracer
@@ -0,0 +1,138 @@
+/******************************************************************************/
+/*!
+ * @file  async_visualizer.h
+ * @brief Renders trace images on worker threads of its own, so that drawing
+ *        them costs the traced pipeline no more than queueing headers
+ *
+ * @author Cathal Harte <cathal.harte@protonmail.com>
+ */
+#ifndef _ASYNC_VISUALIZER_H
+#define _ASYNC_VISUALIZER_H
+
+/*******************************************************************************
+* Includes
+******************************************************************************/
+
+#include "bounded_queue.h"
+
+#include <color_matrix.h>
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <vector>
+
+/*! @addtogroup tracer
+ * @{
+ */
+
+namespace tracer
+{
+/*******************************************************************************
+* Definitions and types
+*******************************************************************************/
+
+// The most masks highlighted in one request, kept fixed so that a request never allocates
+#define VIS_MAX_MASKS 4
+
+typedef enum vis_render
+{
+    VIS_HIGHLIGHT,  // masks highlighted over src, highlightOverBg
+    VIS_GRAY3,      // src as 3 channel gray, to3ChannelGray
+    VIS_BGR         // src as BGR, toBGR
+} vis_render_t;
+
+// What to do with a request that finds the queue full
+typedef enum vis_policy
+{
+    VIS_BLOCK,          // wait for room, the pipeline slows down to the rendering rate
+    VIS_DROP_OLDEST,    // make room by dropping the oldest request, what is shown stays fresh
+    VIS_SAMPLE          // keep one in sample_every, over the oldest, drop the rest
+} vis_policy_t;
+
+struct VisRequest
+{
+    vis_render_t render = VIS_BGR;
+    cspace::Mat src;
+    cspace::Mat masks[VIS_MAX_MASKS];
+    int num_masks = 0;
+    uint64_t tag = 0; // handed back with the image, e.g. a frame and step
+};
+
+struct VisualizerStats
+{
+    uint64_t enqueued = 0;
+    uint64_t rendered = 0;
+    uint64_t dropped = 0;
+    uint64_t failed = 0;        // threw while rendered or sunk, the worker went on to the next
+    std::size_t depth = 0;      // requests waiting now
+    std::size_t max_depth = 0;  // the most there have been waiting
+};
+
+// Called on a worker thread with each rendered image
+typedef std::function<void(uint64_t tag, const cspace::Mat &image)> vis_sink_t;
+
+/*******************************************************************************
+* Class prototypes
+*******************************************************************************/
+
+//  Design parameters :
+//      A request holds headers on the matrices to draw, so queueing one costs the caller a few
+//      reference count increments and a move into a ring allocated up front. The matrices must
+//      not be written over until rendered, as with traced buffers.
+//      Requests are rendered by num_threads workers, in no particular order between workers, and
+//      each image goes to the sink. A request that throws there is counted as failed rather
+//      than taking the worker down.
+//      When the queue is full the policy decides: block, drop the oldest, or sample.
+class AsyncVisualizer
+{
+    public :
+        AsyncVisualizer(vis_sink_t sink, std::size_t queue_depth = 16, unsigned num_threads = 1,
+                        vis_policy_t policy = VIS_DROP_OLDEST, unsigned sample_every = 4);
+        ~AsyncVisualizer();
+
+        AsyncVisualizer(const AsyncVisualizer &) = delete;
+        AsyncVisualizer &operator=(const AsyncVisualizer &) = delete;
+
+        // False if the request was dropped, or the visualizer is closed. Throws on a request that
+        // can't be rendered, which is never queued: a src of a colorspace with no conversion to
+        // the render's, a VIS_HIGHLIGHT without 1 to VIS_MAX_MASKS masks, or with a mask that is
+        // not single channel and the size of src.
+        bool enqueue(VisRequest &&request);
+
+        // The usual requests
+        bool highlight(const cspace::Mat &bg, const cspace::Mat &mask, uint64_t tag = 0);
+        bool gray3(const cspace::Mat &src, uint64_t tag = 0);
+        bool bgr(const cspace::Mat &src, uint64_t tag = 0);
+
+        // Renders what is queued, then stops the workers
+        void close();
+
+        VisualizerStats stats() const;
+
+    private :
+        void workerLoop();
+        void render(const VisRequest &r, cspace::Mat &out) const;
+
+        vis_sink_t sink;
+        vis_policy_t policy;
+        unsigned sample_every;
+        BoundedQueue<VisRequest> queue;
+        std::vector<std::thread> workers;
+        bool closed = false;
+
+        std::atomic<uint64_t> enqueued{0};
+        std::atomic<uint64_t> rendered{0};
+        std::atomic<uint64_t> dropped{0};
+        std::atomic<uint64_t> failed{0};
+        std::atomic<uint64_t> full_arrivals{0};
+        std::atomic<std::size_t> max_depth{0};
+};
+
+}
+
+/*! @}
+ */
+
+#endif  // _ASYNC_VISUALIZER_H
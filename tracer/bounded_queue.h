@@ -0,0 +1,159 @@
+/******************************************************************************/
+/*!
+ * @file  bounded_queue.h
+ * @brief A fixed capacity FIFO handing items between threads
+ *
+ *        Header only template class
+ *
+ * @author Cathal Harte <cathal.harte@protonmail.com>
+ */
+#ifndef _BOUNDED_QUEUE_H
+#define _BOUNDED_QUEUE_H
+
+/*******************************************************************************
+* Includes
+******************************************************************************/
+
+#include <cassert>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+/*! @addtogroup tracer
+ * @{
+ */
+
+namespace tracer
+{
+/*******************************************************************************
+* Class prototypes
+*******************************************************************************/
+
+//  Design parameters :
+//      The items live in a ring allocated once, so a steady stream through the queue allocates
+//      nothing. push() waits while the queue is full, pop() while it is empty. tryPush() and
+//      pushOverOldest() never wait, for producers that would rather lose an item than stall.
+//      close() wakes everyone: pushes are refused from then on, pops drain what is left and then
+//      fail.
+template <typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(std::size_t capacity) : ring(capacity)
+    {
+        assert(("Room for an item at least", capacity > 0));
+    }
+
+    BoundedQueue(const BoundedQueue &) = delete;
+    BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+    // False, and item left alone, if the queue is closed
+    bool push(T &&item)
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        not_full.wait(guard, [this] { return closed || count < ring.size(); });
+        if (closed)
+        {
+            return false;
+        }
+        ring[(head + count++) % ring.size()] = std::move(item);
+        guard.unlock();
+        not_empty.notify_one();
+        return true;
+    }
+
+    bool push(const T &item)
+    {
+        T copy(item);
+        return push(std::move(copy));
+    }
+
+    // False, and item left alone, if the queue is full or closed
+    bool tryPush(T &&item)
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        if (closed || count == ring.size())
+        {
+            return false;
+        }
+        ring[(head + count++) % ring.size()] = std::move(item);
+        guard.unlock();
+        not_empty.notify_one();
+        return true;
+    }
+
+    // Pushes, making room by dropping the oldest item when the queue is full, and says whether it
+    // did in dropped. False if the queue is closed, then nothing is pushed or dropped.
+    bool pushOverOldest(T &&item, bool &dropped)
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        dropped = false;
+        if (closed)
+        {
+            return false;
+        }
+        if (count == ring.size())
+        {
+            // the oldest is assigned over just below
+            head = (head + 1) % ring.size();
+            count--;
+            dropped = true;
+        }
+        ring[(head + count++) % ring.size()] = std::move(item);
+        guard.unlock();
+        not_empty.notify_one();
+        return true;
+    }
+
+    // False once the queue is closed and empty
+    bool pop(T &item)
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        not_empty.wait(guard, [this] { return closed || count > 0; });
+        if (!count)
+        {
+            return false;
+        }
+        item = std::move(ring[head]);
+        head = (head + 1) % ring.size();
+        count--;
+        guard.unlock();
+        not_full.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            closed = true;
+        }
+        not_full.notify_all();
+        not_empty.notify_all();
+    }
+
+    std::size_t size() const
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        return count;
+    }
+    std::size_t capacity() const { return ring.size(); }
+
+private:
+    mutable std::mutex lock;
+    std::condition_variable not_full;
+    std::condition_variable not_empty;
+    std::vector<T> ring;
+    std::size_t head = 0;
+    std::size_t count = 0;
+    bool closed = false;
+};
+
+}
+
+/*! @}
+ */
+
+#endif  // _BOUNDED_QUEUE_H
@@ -0,0 +1,232 @@
+/******************************************************************************/
+/*!
+ * @file  dag_executor.cpp
+ * @brief Runs a graph of processing steps, each as soon as its inputs are
+ *        ready, across the threads of a WorkStealingPool, and records the
+ *        steps with all of their inputs as a DAG
+ *
+ * @author Cathal Harte <cathal.harte@protonmail.com>
+ */
+
+/*******************************************************************************
+* Includes
+******************************************************************************/
+
+#include "dag_executor.h"
+
+#include <instrument.h>
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+
+namespace tracer
+{
+
+/*******************************************************************************
+* Functions
+*******************************************************************************/
+
+static int64_t steadyNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+/*******************************************************************************
+* Classes
+*******************************************************************************/
+
+void StepContext::param(const char *name, double value)
+{
+    if (record->num_params < TRACE_MAX_PARAMS)
+    {
+        record->params[record->num_params].name = name;
+        record->params[record->num_params++].value = value;
+    }
+}
+
+DagExecutor::DagExecutor(smart_tree::WorkStealingPool &pool) : pool(pool), origin_ns(steadyNs())
+{
+}
+
+int64_t DagExecutor::now() const
+{
+    return steadyNs() - origin_ns;
+}
+
+slot_t DagExecutor::addSource(const char *name, trace_kind_t kind)
+{
+    assert(("Sources are declared before the steps", steps.empty()));
+    source_names.push_back(name);
+    source_kinds.push_back(kind);
+    slots.emplace_back();
+    producer.push_back(-1);
+    slot_kinds.push_back(kind);
+    return (slot_t)slots.size() - 1;
+}
+
+slot_t DagExecutor::addStep(const char *name, const std::vector<slot_t> &inputs, step_fn_t fn,
+                            int num_outputs, trace_kind_t output_kind)
+{
+    assert(("At most TRACE_MAX_IO inputs", inputs.size() <= TRACE_MAX_IO));
+    assert(("Between 1 and TRACE_MAX_IO outputs", num_outputs > 0 && num_outputs <= TRACE_MAX_IO));
+
+    StepDef def;
+    def.name = name;
+    def.inputs = inputs;
+    def.first_output = (slot_t)slots.size();
+    def.num_outputs = num_outputs;
+    def.output_kind = output_kind;
+    def.fn = fn;
+
+    // each step read from counts once, however many of its outputs are read
+    std::vector<int> from;
+    for (slot_t s : inputs)
+    {
+        assert(("Inputs are declared before the step", s >= 0 && s < (slot_t)slots.size()));
+        if (producer[s] >= 0 && std::find(from.begin(), from.end(), producer[s]) == from.end())
+        {
+            from.push_back(producer[s]);
+        }
+    }
+    def.num_dependencies = (int)from.size();
+    int index = (int)steps.size();
+    for (int p : from)
+    {
+        steps[p].dependents.push_back(index);
+    }
+    steps.push_back(def);
+
+    for (int k = 0; k < num_outputs; k++)
+    {
+        slots.emplace_back();
+        producer.push_back(index);
+        slot_kinds.push_back(output_kind);
+    }
+    waiting.reset(new std::atomic<int>[steps.size()]);
+    return def.first_output;
+}
+
+// The nodes, and their edges, are all made before any step runs, each step then only fills in its
+// own record
+DagTrace DagExecutor::run(const std::vector<cspace::Mat> &sources)
+{
+    assert(("One matrix per source", sources.size() == source_names.size()));
+
+    DagTrace trace;
+    for (std::size_t i = 0; i < sources.size(); i++)
+    {
+        slots[i] = sources[i];
+
+        auto node = std::make_shared<trace_dag_node_t>();
+        node->data.step = source_names[i];
+        node->data.outputs[0].snapshot.take(sources[i]);
+        node->data.outputs[0].kind = source_kinds[i];
+        node->data.num_outputs = 1;
+        trace.sources.push_back(node);
+    }
+
+    trace.steps.reserve(steps.size());
+    for (std::size_t i = 0; i < steps.size(); i++)
+    {
+        const StepDef &def = steps[i];
+        auto node = std::make_shared<trace_dag_node_t>();
+        for (slot_t s : def.inputs)
+        {
+            const std::shared_ptr<trace_dag_node_t> &from =
+                producer[s] < 0 ? trace.sources[s] : trace.steps[producer[s]];
+            bool linked = false;
+            for (std::size_t p = 0; p < node->getNumParents(); p++)
+            {
+                linked = linked || node->getParent(p) == from;
+            }
+            if (!linked)
+            {
+                smart_tree::addChild(from, node);
+            }
+        }
+        trace.steps.push_back(node);
+
+        // an earlier trace holding the output keeps it, the step gets a new buffer
+        for (int k = 0; k < def.num_outputs; k++)
+        {
+            cspace::Mat &out = slots[def.first_output + k];
+            if (out.u && out.u->refcount > 1)
+            {
+                out = cspace::Mat();
+            }
+        }
+        waiting[i] = def.num_dependencies;
+    }
+
+    smart_tree::TaskGroup group(pool);
+    for (std::size_t i = 0; i < steps.size(); i++)
+    {
+        if (!steps[i].num_dependencies)
+        {
+            group.run([this, i, &group, &trace] { runStep((int)i, group, trace); });
+        }
+    }
+    group.wait();
+    return trace;
+}
+
+// The first dependent made ready is run straight after on this thread, the rest are submitted
+void DagExecutor::runStep(int i, smart_tree::TaskGroup &group, DagTrace &trace)
+{
+    while (i >= 0)
+    {
+        const StepDef &def = steps[i];
+        TraceRecord &r = trace.steps[i]->data;
+
+        StepContext ctx;
+        ctx.record = &r;
+        r.step = def.name;
+        r.num_inputs = ctx.num_inputs = (int)def.inputs.size();
+        for (int k = 0; k < ctx.num_inputs; k++)
+        {
+            ctx.inputs[k] = &slots[def.inputs[k]];
+            r.inputs[k].snapshot.take(slots[def.inputs[k]]);
+            r.inputs[k].kind = slot_kinds[def.inputs[k]];
+        }
+        r.num_outputs = ctx.num_outputs = def.num_outputs;
+        for (int k = 0; k < ctx.num_outputs; k++)
+        {
+            ctx.outputs[k] = &slots[def.first_output + k];
+        }
+
+        r.start_ns = now();
+        {
+            INSTRUMENT_SCOPE(def.name);
+            def.fn(ctx);
+        }
+        r.duration_ns = now() - r.start_ns;
+
+        for (int k = 0; k < r.num_outputs; k++)
+        {
+            r.outputs[k].snapshot.take(slots[def.first_output + k]);
+            r.outputs[k].kind = def.output_kind;
+        }
+
+        int next = -1;
+        for (int d : def.dependents)
+        {
+            if (--waiting[d] == 0)
+            {
+                if (next < 0)
+                {
+                    next = d;
+                }
+                else
+                {
+                    group.run([this, d, &group, &trace] { runStep(d, group, trace); });
+                }
+            }
+        }
+        i = next;
+    }
+}
+
+} // namespace tracer
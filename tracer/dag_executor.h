@@ -0,0 +1,144 @@
+/******************************************************************************/
+/*!
+ * @file  dag_executor.h
+ * @brief Runs a graph of processing steps, each as soon as its inputs are
+ *        ready, across the threads of a WorkStealingPool, and records the
+ *        steps with all of their inputs as a DAG
+ *
+ * @author Cathal Harte <cathal.harte@protonmail.com>
+ */
+#ifndef _DAG_EXECUTOR_H
+#define _DAG_EXECUTOR_H
+
+/*******************************************************************************
+* Includes
+******************************************************************************/
+
+#include "tracer.h"
+
+#include <dag.h>
+#include <work_stealing_pool.h>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <vector>
+
+/*! @addtogroup tracer
+ * @{
+ */
+
+namespace tracer
+{
+/*******************************************************************************
+* Definitions and types
+*******************************************************************************/
+
+// An image or features matrix passed between steps, numbered in the order they are declared
+typedef int slot_t;
+
+typedef smart_tree::DagNode<TraceRecord> trace_dag_node_t;
+
+// What a step sees while it runs
+class StepContext
+{
+    public :
+        const cspace::Mat &in(int i) const { return *inputs[i]; }
+        cspace::Mat &out(int i) { return *outputs[i]; }
+        int numInputs() const { return num_inputs; }
+        int numOutputs() const { return num_outputs; }
+        // Recorded with the step, beyond TRACE_MAX_PARAMS they are dropped
+        void param(const char *name, double value);
+
+    private :
+        friend class DagExecutor;
+
+        const cspace::Mat *inputs[TRACE_MAX_IO];
+        int num_inputs = 0;
+        cspace::Mat *outputs[TRACE_MAX_IO];
+        int num_outputs = 0;
+        TraceRecord *record = nullptr;
+};
+
+typedef std::function<void(StepContext &)> step_fn_t;
+
+// The record of one run, every node reachable from the sources
+struct DagTrace
+{
+    std::vector<std::shared_ptr<trace_dag_node_t>> sources; // the roots, one per source
+    std::vector<std::shared_ptr<trace_dag_node_t>> steps;   // in the order they were added
+};
+
+/*******************************************************************************
+* Class prototypes
+*******************************************************************************/
+
+//  Runs steps in a dependency order, independent ones at once
+//  Design parameters :
+//      The graph is declared up front: sources, the matrices given to each run (the frame...),
+//      then steps, each reading slots already declared and writing slots of its own. A step can
+//      only read what is declared before it, so the graph is acyclic by construction.
+//      A run is Kahn's algorithm spread over the pool: every step waits on a count of the steps
+//      it reads from, those with none are submitted at the start, and a step finishing submits
+//      each dependent whose count it takes to 0. The gray and HSV branches of a frame run side by
+//      side, and whichever thread finishes the last input of a step goes on to it.
+//      Each step is recorded as a node with a parent for each step it read from, sources being
+//      the roots, so multi input steps keep all of their provenance.
+//      The slots keep their buffers from run to run, unless a trace still holds them, in which
+//      case the step writes into a new one and the trace keeps what it saw.
+//      run() is called from one thread at a time; steps must not throw.
+class DagExecutor
+{
+    public :
+        explicit DagExecutor(smart_tree::WorkStealingPool &pool);
+
+        slot_t addSource(const char *name, trace_kind_t kind = TRACE_IMAGE);
+        // Returns the slot of the first output, the others follow it in turn
+        slot_t addStep(const char *name, const std::vector<slot_t> &inputs, step_fn_t fn,
+                       int num_outputs = 1, trace_kind_t output_kind = TRACE_IMAGE);
+
+        std::size_t numSteps() const { return steps.size(); }
+
+        // One source matrix per addSource(), in order. Returns the record of the run.
+        DagTrace run(const std::vector<cspace::Mat> &sources);
+
+        // The result of the last run
+        const cspace::Mat &slot(slot_t s) const { return slots[s]; }
+
+        // Nanoseconds since the executor was created, the clock step timings are on
+        int64_t now() const;
+
+    private :
+        struct StepDef
+        {
+            const char *name;
+            std::vector<slot_t> inputs;
+            slot_t first_output;
+            int num_outputs;
+            trace_kind_t output_kind;
+            step_fn_t fn;
+            std::vector<int> dependents;    // the steps reading its outputs
+            int num_dependencies;           // the steps it reads from
+        };
+
+        void runStep(int i, smart_tree::TaskGroup &group, DagTrace &trace);
+
+        smart_tree::WorkStealingPool &pool;
+        int64_t origin_ns;
+
+        std::vector<const char *> source_names;
+        std::vector<trace_kind_t> source_kinds;
+        std::vector<StepDef> steps;
+
+        std::vector<cspace::Mat> slots;
+        std::vector<int> producer;              // of each slot, -1 for the sources
+        std::vector<trace_kind_t> slot_kinds;
+        std::unique_ptr<std::atomic<int>[]> waiting;    // per step, during a run
+};
+
+}
+
+/*! @}
+ */
+
+#endif  // _DAG_EXECUTOR_H
@@ -0,0 +1,539 @@
+/******************************************************************************/
+/*!
+ * @file  trace_log.cpp
+ * @brief An append only file of traced steps, their pixels included, written
+ *        off the hot path and read back through a memory mapping
+ *
+ * @author Cathal Harte <cathal.harte@protonmail.com>
+ */
+
+/*******************************************************************************
+* Includes
+******************************************************************************/
+
+#include "trace_log.h"
+
+#include <instrument.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace tracer
+{
+
+/*******************************************************************************
+* Definitions
+*******************************************************************************/
+
+static_assert(sizeof(TraceLogFileHeader) == TRACE_LOG_ALIGN, "the file header is padded to a record boundary");
+static_assert(sizeof(TraceLogNodeHeader) == 64, "the node header is packed");
+static_assert(sizeof(TraceLogParam) == 32, "the params are packed");
+static_assert(sizeof(TraceLogIo) == 32, "the inputs / outputs are packed");
+static_assert(sizeof(TraceLogTrailer) == 32, "the trailer is packed");
+
+static const char LOG_MAGIC[8] = {'T', 'R', 'A', 'C', 'E', 'L', 'O', 'G'};
+static const char INDEX_MAGIC[8] = {'T', 'R', 'A', 'C', 'E', 'I', 'D', 'X'};
+
+/*******************************************************************************
+* Functions
+*******************************************************************************/
+
+static int64_t steadyNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+static std::size_t alignUp(std::size_t n, std::size_t align)
+{
+    return (n + align - 1) / align * align;
+}
+
+// Whether the record at offset at lies within the mapping, and everything in it within the record:
+// its name, parameters and inputs / outputs, and the pixels of each, as many bytes as their size
+// and type take. No header of a record is trusted before this, a corrupt log is never read past.
+static bool recordFits(const uint8_t *map, std::size_t map_bytes, uint64_t at)
+{
+    if (at > map_bytes || map_bytes - at < sizeof(TraceLogNodeHeader))
+    {
+        return false;
+    }
+    const uint8_t *record = map + at;
+    const TraceLogNodeHeader &h = *(const TraceLogNodeHeader *)record;
+    if (h.magic != TRACE_LOG_NODE_MAGIC || h.record_bytes > map_bytes - at || h.name_bytes < 1)
+    {
+        return false;
+    }
+    const uint64_t num_io = (uint64_t)h.num_inputs + h.num_outputs;
+    const uint64_t ios_at = sizeof(TraceLogNodeHeader) + alignUp(h.name_bytes, 8) +
+                            (uint64_t)h.num_params * sizeof(TraceLogParam);
+    if (ios_at + num_io * sizeof(TraceLogIo) > h.record_bytes ||
+        record[sizeof(TraceLogNodeHeader) + h.name_bytes - 1] != '\0')
+    {
+        return false;
+    }
+
+    const TraceLogIo *ios = (const TraceLogIo *)(record + ios_at);
+    for (uint64_t k = 0; k < num_io; k++)
+    {
+        const TraceLogIo &io = ios[k];
+        if (io.pixels_offset > h.record_bytes || io.pixels_bytes > h.record_bytes - io.pixels_offset)
+        {
+            return false;
+        }
+        if (io.rows && io.cols)
+        {
+            const uint64_t elem_bytes = CV_ELEM_SIZE(io.type);
+            if (io.rows < 0 || io.cols < 0 || io.type != CV_MAT_TYPE(io.type) || !elem_bytes ||
+                (uint64_t)io.rows * (uint64_t)io.cols > io.pixels_bytes / elem_bytes)
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Appended with insert(), which leaves the batch's reserved capacity as it is, so that nothing is
+// written twice
+static void put(std::vector<uint8_t> &batch, const void *p, std::size_t n)
+{
+    const uint8_t *bytes = (const uint8_t *)p;
+    batch.insert(batch.end(), bytes, bytes + n);
+}
+
+// Zeros up to the next multiple of align from start
+static void padFrom(std::vector<uint8_t> &batch, std::size_t start, std::size_t align)
+{
+    batch.resize(start + alignUp(batch.size() - start, align), 0);
+}
+
+static void writeAll(int fd, const uint8_t *p, std::size_t n)
+{
+    while (n)
+    {
+        ssize_t written = write(fd, p, n);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            throw std::runtime_error("cannot write the trace log");
+        }
+        p += written;
+        n -= written;
+    }
+}
+
+/*******************************************************************************
+* Classes
+*******************************************************************************/
+
+TraceLogWriter::TraceLogWriter(const std::string &path, const TraceLogConfig &cfg) : cfg(cfg)
+{
+    assert(("A batch may be pending at least", cfg.max_pending > 0));
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        throw std::runtime_error("cannot create " + path);
+    }
+
+    batch.reserve(cfg.batch_bytes);
+    TraceLogFileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, LOG_MAGIC, sizeof(header.magic));
+    header.version = TRACE_LOG_VERSION;
+    header.align = TRACE_LOG_ALIGN;
+    put(batch, &header, sizeof(header));
+
+    writer = std::thread(&TraceLogWriter::writerLoop, this);
+}
+
+TraceLogWriter::~TraceLogWriter()
+{
+    try
+    {
+        close();
+    }
+    catch (...)
+    {
+        // nowhere to report it from a destructor, close() first to find out
+    }
+}
+
+// The record's fixed part, then the pixels as the step saw them, a row at a time since the views
+// may be rois
+uint64_t TraceLogWriter::appendFrame(const Tracer &tracer)
+{
+    INSTRUMENT_SCOPE("tracer::TraceLogWriter::appendFrame");
+    rethrowWriteError();
+    assert(("The log is open", fd >= 0));
+    int64_t start = steadyNs();
+
+    const trace_tree_t &tree = tracer.tree();
+    const uint64_t first_id = index.size();
+    for (std::size_t i = 0; i < tree.size(); i++)
+    {
+        smart_tree::NodeHandle h = tree.nodeAt(i);
+        const TraceRecord &r = tree.data(h);
+
+        cspace::Mat views[2 * TRACE_MAX_IO];
+        const TraceIo *ios[2 * TRACE_MAX_IO];
+        const int num_io = r.num_inputs + r.num_outputs;
+        for (int k = 0; k < num_io; k++)
+        {
+            ios[k] = k < r.num_inputs ? &r.inputs[k] : &r.outputs[k - r.num_inputs];
+            views[k] = ios[k]->view();
+            assert(("Traced matrices are 2 dimensional", views[k].dims <= 2));
+        }
+
+        const char *name = r.step ? r.step : "";
+        const std::size_t name_len = std::min(std::strlen(name), (std::size_t)UINT16_MAX - 1);
+        std::size_t bytes = alignUp(sizeof(TraceLogNodeHeader) + alignUp(name_len + 1, 8) +
+                                        r.num_params * sizeof(TraceLogParam) + num_io * sizeof(TraceLogIo),
+                                    TRACE_LOG_ALIGN);
+        TraceLogIo io_headers[2 * TRACE_MAX_IO];
+        for (int k = 0; k < num_io; k++)
+        {
+            TraceLogIo &io = io_headers[k];
+            std::memset(&io, 0, sizeof(io));
+            io.kind = (uint8_t)ios[k]->kind;
+            io.colorspace = (uint8_t)views[k].getColorspace();
+            io.type = views[k].type();
+            io.rows = views[k].rows;
+            io.cols = views[k].cols;
+            io.pixels_offset = bytes;
+            io.pixels_bytes = views[k].total() * views[k].elemSize();
+            bytes += alignUp(io.pixels_bytes, TRACE_LOG_ALIGN);
+        }
+
+        TraceLogNodeHeader header;
+        std::memset(&header, 0, sizeof(header));
+        header.magic = TRACE_LOG_NODE_MAGIC;
+        header.num_inputs = (uint16_t)r.num_inputs;
+        header.num_outputs = (uint16_t)r.num_outputs;
+        header.record_bytes = bytes;
+        header.step_id = first_id + i;
+        header.parent_id = tree.isRoot(h) ? TRACE_LOG_NO_PARENT : first_id + tree.getParent(h).index;
+        header.frame = frame;
+        header.start_ns = r.start_ns;
+        header.duration_ns = r.duration_ns;
+        header.num_params = (uint16_t)r.num_params;
+        header.name_bytes = (uint16_t)(name_len + 1);
+
+        const std::size_t at = batch.size();
+        index.push_back(offset + at);
+        put(batch, &header, sizeof(header));
+        put(batch, name, name_len);
+        batch.push_back(0);
+        padFrom(batch, at, 8);
+        for (int k = 0; k < r.num_params; k++)
+        {
+            TraceLogParam p;
+            std::memset(&p, 0, sizeof(p));
+            std::strncpy(p.name, r.params[k].name ? r.params[k].name : "", TRACE_LOG_PARAM_NAME - 1);
+            p.value = r.params[k].value;
+            put(batch, &p, sizeof(p));
+        }
+        put(batch, io_headers, num_io * sizeof(TraceLogIo));
+        padFrom(batch, at, TRACE_LOG_ALIGN);
+        for (int k = 0; k < num_io; k++)
+        {
+            const cspace::Mat &v = views[k];
+            const std::size_t row_bytes = v.cols * v.elemSize();
+            for (int y = 0; y < v.rows; y++)
+            {
+                put(batch, v.ptr<uint8_t>(y), row_bytes);
+            }
+            padFrom(batch, at, TRACE_LOG_ALIGN);
+        }
+        assert(("The record is the size worked out", batch.size() - at == bytes));
+
+        counters.steps++;
+        counters.bytes += bytes;
+        if (batch.size() >= cfg.batch_bytes)
+        {
+            submit();
+        }
+    }
+
+    frame++;
+    counters.append_ns += steadyNs() - start;
+    return first_id;
+}
+
+void TraceLogWriter::flush()
+{
+    rethrowWriteError();
+    submit();
+}
+
+// The index and trailer go after the last record, as a batch of their own
+void TraceLogWriter::close()
+{
+    if (fd < 0)
+    {
+        rethrowWriteError();
+        return;
+    }
+
+    const uint64_t index_offset = offset + batch.size();
+    put(batch, index.data(), index.size() * sizeof(uint64_t));
+    TraceLogTrailer trailer;
+    std::memset(&trailer, 0, sizeof(trailer));
+    std::memcpy(trailer.magic, INDEX_MAGIC, sizeof(trailer.magic));
+    trailer.index_offset = index_offset;
+    trailer.count = index.size();
+    put(batch, &trailer, sizeof(trailer));
+    submit();
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        closing = true;
+        changed.notify_all();
+    }
+    writer.join();
+    int synced = fdatasync(fd);
+    ::close(fd);
+    fd = -1;
+
+    rethrowWriteError();
+    if (synced)
+    {
+        throw std::runtime_error("cannot sync the trace log");
+    }
+}
+
+TraceLogStats TraceLogWriter::stats() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return counters;
+}
+
+// Waits only while max_pending batches are queued already
+void TraceLogWriter::submit()
+{
+    if (batch.empty())
+    {
+        return;
+    }
+
+    std::unique_lock<std::mutex> guard(lock);
+    int64_t start = steadyNs();
+    changed.wait(guard, [&] { return pending.size() < cfg.max_pending || failed; });
+    counters.wait_ns += steadyNs() - start;
+
+    offset += batch.size();
+    pending.push_back(std::move(batch));
+    if (spare.empty())
+    {
+        batch = std::vector<uint8_t>();
+        batch.reserve(cfg.batch_bytes);
+    }
+    else
+    {
+        batch = std::move(spare.back());
+        spare.pop_back();
+    }
+    changed.notify_all();
+}
+
+// After a failed write the rest of the batches are dropped, for good: written after it they
+// would land at the wrong offsets
+void TraceLogWriter::writerLoop()
+{
+    for (;;)
+    {
+        std::vector<uint8_t> buf;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            changed.wait(guard, [&] { return !pending.empty() || closing; });
+            if (pending.empty())
+            {
+                return;
+            }
+            buf = std::move(pending.front());
+            pending.pop_front();
+            writing = !failed;
+        }
+
+        if (writing)
+        {
+            try
+            {
+                writeAll(fd, buf.data(), buf.size());
+                if (cfg.sync && fdatasync(fd))
+                {
+                    throw std::runtime_error("cannot sync the trace log");
+                }
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                write_error = std::current_exception();
+                failed = true;
+            }
+        }
+
+        std::lock_guard<std::mutex> guard(lock);
+        if (writing && !failed)
+        {
+            counters.batches++;
+        }
+        writing = false;
+        buf.clear();
+        spare.push_back(std::move(buf));
+        changed.notify_all();
+    }
+}
+
+// The error is kept, every call after a failed write throws it
+void TraceLogWriter::rethrowWriteError()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (failed)
+    {
+        std::rethrow_exception(write_error);
+    }
+}
+
+const TraceLogParam *TraceLogNode::params() const
+{
+    return (const TraceLogParam *)(record + sizeof(TraceLogNodeHeader) + alignUp(header().name_bytes, 8));
+}
+
+const TraceLogIo &TraceLogNode::io(int k) const
+{
+    assert(("One of the step's inputs / outputs", k >= 0 && k < numInputs() + numOutputs()));
+    return ((const TraceLogIo *)(params() + numParams()))[k];
+}
+
+// A header on the mapped pixels, which are aligned to TRACE_LOG_ALIGN as allocated ones are. The
+// reader has checked they lie within the record before handing the node out.
+cspace::Mat TraceLogNode::pixels(const TraceLogIo &io) const
+{
+    cspace::Mat m;
+    if (io.rows && io.cols)
+    {
+        m = cv::Mat(io.rows, io.cols, io.type, (void *)(record + io.pixels_offset));
+        m.setColorspace((cspace::colorspace_t)io.colorspace);
+    }
+    return m;
+}
+
+cspace::Mat TraceLogNode::input(int k) const
+{
+    assert(("One of the step's inputs", k < numInputs()));
+    return pixels(io(k));
+}
+
+cspace::Mat TraceLogNode::output(int k) const
+{
+    assert(("One of the step's outputs", k >= 0 && k < numOutputs()));
+    return pixels(io(numInputs() + k));
+}
+
+TraceParam TraceLogNode::param(int k) const
+{
+    assert(("One of the step's parameters", k >= 0 && k < numParams()));
+    TraceParam p;
+    p.name = params()[k].name;
+    p.value = params()[k].value;
+    return p;
+}
+
+TraceLogReader::TraceLogReader(const std::string &path)
+{
+    fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        throw std::runtime_error("cannot open " + path);
+    }
+    struct stat st;
+    if (fstat(fd, &st) || (std::size_t)st.st_size < sizeof(TraceLogFileHeader))
+    {
+        ::close(fd);
+        throw std::runtime_error(path + " is not a trace log");
+    }
+    map_bytes = (std::size_t)st.st_size;
+    void *m = mmap(nullptr, map_bytes, PROT_READ, MAP_SHARED, fd, 0);
+    if (m == MAP_FAILED)
+    {
+        ::close(fd);
+        throw std::runtime_error("cannot map " + path);
+    }
+    map = (uint8_t *)m;
+
+    const TraceLogFileHeader &header = *(const TraceLogFileHeader *)map;
+    if (std::memcmp(header.magic, LOG_MAGIC, sizeof(header.magic)) || header.version != TRACE_LOG_VERSION)
+    {
+        munmap(map, map_bytes);
+        ::close(fd);
+        throw std::runtime_error(path + " is not a trace log of this version");
+    }
+
+    if (map_bytes >= sizeof(TraceLogFileHeader) + sizeof(TraceLogTrailer))
+    {
+        const TraceLogTrailer &trailer = *(const TraceLogTrailer *)(map + map_bytes - sizeof(TraceLogTrailer));
+        const std::size_t end = map_bytes - sizeof(TraceLogTrailer);
+        has_index = !std::memcmp(trailer.magic, INDEX_MAGIC, sizeof(trailer.magic)) &&
+                    trailer.index_offset >= sizeof(TraceLogFileHeader) && trailer.index_offset <= end &&
+                    trailer.count * sizeof(uint64_t) == end - trailer.index_offset;
+        if (has_index)
+        {
+            offsets = (const uint64_t *)(map + trailer.index_offset);
+            count = trailer.count;
+        }
+    }
+    if (!has_index)
+    {
+        walkRecords();
+    }
+}
+
+TraceLogReader::~TraceLogReader()
+{
+    munmap(map, map_bytes);
+    ::close(fd);
+}
+
+// Up to the first record not written in full, or not whole
+void TraceLogReader::walkRecords()
+{
+    uint64_t at = sizeof(TraceLogFileHeader);
+    while (recordFits(map, map_bytes, at))
+    {
+        const TraceLogNodeHeader &h = *(const TraceLogNodeHeader *)(map + at);
+        if (h.step_id != walked.size())
+        {
+            break;
+        }
+        walked.push_back(at);
+        at += h.record_bytes;
+    }
+    offsets = walked.data();
+    count = walked.size();
+}
+
+TraceLogNode TraceLogReader::node(uint64_t id) const
+{
+    assert(("A step of the log", id < count));
+    if (!recordFits(map, map_bytes, offsets[id]))
+    {
+        throw std::runtime_error("the record of a step runs past the end of the trace log");
+    }
+    return TraceLogNode(map + offsets[id]);
+}
+
+} // namespace tracer
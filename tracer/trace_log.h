@@ -0,0 +1,269 @@
+/******************************************************************************/
+/*!
+ * @file  trace_log.h
+ * @brief An append only file of traced steps, their pixels included, written
+ *        off the hot path and read back through a memory mapping
+ *
+ * @author Cathal Harte <cathal.harte@protonmail.com>
+ */
+#ifndef _TRACE_LOG_H
+#define _TRACE_LOG_H
+
+/*******************************************************************************
+* Includes
+******************************************************************************/
+
+#include "tracer.h"
+
+#include <color_matrix.h>
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*! @addtogroup tracer
+ * @{
+ */
+
+namespace tracer
+{
+/*******************************************************************************
+* Definitions and types
+*******************************************************************************/
+
+//  The file, all of it in the writing host's byte order :
+//      TraceLogFileHeader
+//      a record per step, in the order appended, each starting on a TRACE_LOG_ALIGN boundary :
+//          TraceLogNodeHeader
+//          the step name, NUL terminated, padded to 8 bytes
+//          num_params TraceLogParam
+//          num_inputs then num_outputs TraceLogIo
+//          the pixels of each input / output, rows end to end, each on a TRACE_LOG_ALIGN boundary
+//      the index, the offset of each record by step id, then TraceLogTrailer, once closed
+//  Step ids count the steps of the log from 0, so an id is the record's place in the index. A log
+//  cut short, by a crash, has no index; its records are found by walking them from the start up
+//  to the last one written in full.
+
+#define TRACE_LOG_ALIGN 64
+#define TRACE_LOG_VERSION 1
+#define TRACE_LOG_NODE_MAGIC 0x45444f4eu // "NODE"
+#define TRACE_LOG_NO_PARENT UINT64_MAX
+// Parameter names longer than this are cut short
+#define TRACE_LOG_PARAM_NAME 24
+
+struct TraceLogFileHeader
+{
+    char magic[8];          // "TRACELOG"
+    uint32_t version;
+    uint32_t align;
+    uint8_t reserved[48];
+};
+
+struct TraceLogNodeHeader
+{
+    uint32_t magic;         // TRACE_LOG_NODE_MAGIC
+    uint16_t num_inputs;
+    uint16_t num_outputs;
+    uint64_t record_bytes;  // to the next record, pixels included
+    uint64_t step_id;
+    uint64_t parent_id;     // TRACE_LOG_NO_PARENT for a root
+    uint64_t frame;
+    int64_t start_ns;
+    int64_t duration_ns;
+    uint16_t num_params;
+    uint16_t name_bytes;    // the NUL included
+    uint32_t reserved;
+};
+
+struct TraceLogParam
+{
+    char name[TRACE_LOG_PARAM_NAME];
+    double value;
+};
+
+struct TraceLogIo
+{
+    uint8_t kind;           // trace_kind_t
+    uint8_t colorspace;     // cspace::colorspace_t
+    uint16_t reserved;
+    int32_t type;
+    int32_t rows;
+    int32_t cols;
+    uint64_t pixels_offset; // from the start of the record
+    uint64_t pixels_bytes;
+};
+
+struct TraceLogTrailer
+{
+    char magic[8];          // "TRACEIDX"
+    uint64_t index_offset;
+    uint64_t count;
+    uint64_t reserved;
+};
+
+struct TraceLogConfig
+{
+    // Records gather in memory until a batch is this large, then go to the writing thread
+    std::size_t batch_bytes = (std::size_t)8 << 20;
+    // Batches handed over and not yet written, beyond which appending waits
+    std::size_t max_pending = 4;
+    // fdatasync() each batch once written, on the writing thread
+    bool sync = true;
+};
+
+struct TraceLogStats
+{
+    uint64_t steps = 0;
+    uint64_t bytes = 0;         // appended, pixels included
+    uint64_t batches = 0;       // written out
+    int64_t append_ns = 0;      // spent appending, on the caller's thread
+    int64_t wait_ns = 0;        // of which waiting on the writing thread, the disk not keeping up
+};
+
+/*******************************************************************************
+* Class prototypes
+*******************************************************************************/
+
+//  Writes the steps traced frame by frame to a log
+//  Design parameters :
+//      appendFrame() serialises the tracer's tree, the pixels copied as the steps saw them, into
+//      an in memory batch, so that the tracer can go on to newFrame(). Full batches are written,
+//      and synced, by a thread of the log's own; the caller only waits if max_pending batches are
+//      queued already. The batches are kept and reused, so that once warmed up appending does
+//      not allocate.
+//      A failed write fails the log: nothing more is written, and every call after it throws.
+//      A writer is for one thread.
+class TraceLogWriter
+{
+    public :
+        // Creates path, or truncates it
+        explicit TraceLogWriter(const std::string &path, const TraceLogConfig &cfg = TraceLogConfig());
+        // close()
+        ~TraceLogWriter();
+
+        TraceLogWriter(const TraceLogWriter &) = delete;
+        TraceLogWriter &operator=(const TraceLogWriter &) = delete;
+
+        // Every step of the tracer's frame, to be called before Tracer::newFrame(). The steps take
+        // the next ids in the order the tracer recorded them. Returns the id of the first.
+        uint64_t appendFrame(const Tracer &tracer);
+
+        // Hands the batch so far to the writing thread, without waiting for it to be written
+        void flush();
+
+        // Writes what is left and the index, syncs and closes the file
+        void close();
+
+        TraceLogStats stats() const;
+
+    private :
+        void submit();
+        void writerLoop();
+        void rethrowWriteError();
+
+        int fd = -1;
+        TraceLogConfig cfg;
+        uint64_t offset = 0;                // of the end of the file, once everything is written
+        uint64_t frame = 0;
+        std::vector<uint64_t> index;        // record offsets by step id
+        std::vector<uint8_t> batch;
+
+        mutable std::mutex lock;
+        std::condition_variable changed;
+        std::deque<std::vector<uint8_t>> pending;
+        std::vector<std::vector<uint8_t>> spare;
+        bool writing = false;
+        bool closing = false;
+        bool failed = false;                // never reset, once a write has failed
+        std::exception_ptr write_error;
+        std::thread writer;
+
+        TraceLogStats counters;
+};
+
+// A step of a log, as read back. The pixels are views of the log's mapping, read only, valid for
+// as long as the reader.
+class TraceLogNode
+{
+    public :
+        uint64_t id() const { return header().step_id; }
+        uint64_t parent() const { return header().parent_id; }
+        bool isRoot() const { return header().parent_id == TRACE_LOG_NO_PARENT; }
+        uint64_t frame() const { return header().frame; }
+        const char *step() const { return (const char *)(record + sizeof(TraceLogNodeHeader)); }
+        int64_t startNs() const { return header().start_ns; }
+        int64_t durationNs() const { return header().duration_ns; }
+
+        int numInputs() const { return header().num_inputs; }
+        int numOutputs() const { return header().num_outputs; }
+        int numParams() const { return header().num_params; }
+
+        // The pixels, colorspace tag and all, with no copy
+        cspace::Mat input(int k) const;
+        cspace::Mat output(int k) const;
+        trace_kind_t inputKind(int k) const { return (trace_kind_t)io(k).kind; }
+        trace_kind_t outputKind(int k) const { return (trace_kind_t)io(numInputs() + k).kind; }
+        // The name points into the mapping
+        TraceParam param(int k) const;
+
+    private :
+        friend class TraceLogReader;
+        explicit TraceLogNode(const uint8_t *record) : record(record) {}
+
+        const TraceLogNodeHeader &header() const { return *(const TraceLogNodeHeader *)record; }
+        const TraceLogParam *params() const;
+        const TraceLogIo &io(int k) const;
+        cspace::Mat pixels(const TraceLogIo &io) const;
+
+        const uint8_t *record;
+};
+
+//  Reads a log back
+//  Design parameters :
+//      The whole file is mapped, and nothing is read from it up front but the trailer, so that
+//      opening a log of any size is immediate. A step is found through the index in O(1), and
+//      its pixels are paged in only as they are looked at.
+//      A log without an index, one still being written or cut short, is read as far as its
+//      records were written in full, finding them by walking from one to the next.
+//      No offset or size read from the file is trusted: the walk stops at the first record that
+//      runs past the end of the mapping, or whose pixels run past the end of the record, and
+//      node() throws on such a record reached through the index.
+class TraceLogReader
+{
+    public :
+        explicit TraceLogReader(const std::string &path);
+        ~TraceLogReader();
+
+        TraceLogReader(const TraceLogReader &) = delete;
+        TraceLogReader &operator=(const TraceLogReader &) = delete;
+
+        std::size_t size() const { return count; }
+        // False when the records had to be walked, the log not having been closed
+        bool indexed() const { return has_index; }
+
+        TraceLogNode node(uint64_t id) const;
+
+    private :
+        void walkRecords();
+
+        int fd = -1;
+        uint8_t *map = nullptr;
+        std::size_t map_bytes = 0;
+        const uint64_t *offsets = nullptr;  // into the index, or walked
+        std::size_t count = 0;
+        bool has_index = false;
+        std::vector<uint64_t> walked;
+};
+
+}
+
+/*! @}
+ */
+
+#endif  // _TRACE_LOG_H
@@ -0,0 +1,356 @@
+/******************************************************************************/
+/*!
+ * @file  tracer.cpp
+ * @brief Records the link between the inputs and outputs of each processing
+ *        step, as a tree of steps
+ *
+ * @author Cathal Harte <cathal.harte@protonmail.com>
+ */
+
+/*******************************************************************************
+* Includes
+******************************************************************************/
+
+#include "tracer.h"
+
+#include <instrument.h>
+
+#include <algorithm>
+#include <chrono>
+
+namespace tracer
+{
+
+/*******************************************************************************
+* Definitions
+*******************************************************************************/
+
+// Starting size of the buffer table
+#define MIN_BUFFER_SLOTS 64
+
+/*******************************************************************************
+* Internal function prototypes
+*******************************************************************************/
+
+/*******************************************************************************
+* Functions
+*******************************************************************************/
+
+static int64_t steadyNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// What identifies the buffer of a matrix, its allocation where OpenCV has one, else its data
+static const void *bufferKey(const cv::Mat &m)
+{
+    return m.u ? (const void *)m.u : (const void *)m.datastart;
+}
+
+static std::size_t slotOf(const void *key, std::size_t mask)
+{
+    uint64_t k = (uint64_t)(uintptr_t)key;
+    return (std::size_t)(((k >> 4) * 0x9E3779B97F4A7C15ull) >> 20) & mask;
+}
+
+/*******************************************************************************
+* Classes
+*******************************************************************************/
+
+Tracer::Tracer(std::size_t expected_steps) : origin_ns(steadyNs())
+{
+    nodes.reserve(expected_steps);
+
+    std::size_t slots = MIN_BUFFER_SLOTS;
+    while (slots < 2 * expected_steps * TRACE_MAX_IO)
+    {
+        slots *= 2;
+    }
+    buffer_keys.assign(slots, nullptr);
+    buffer_producers.resize(slots);
+    buffer_stores.resize(slots);
+}
+
+int64_t Tracer::now() const
+{
+    return steadyNs() - origin_ns;
+}
+
+// A store still held outside the tree, by a copy of a record, is left to it rather than reused
+void Tracer::newFrame()
+{
+    nodes.clear();
+
+    for (std::shared_ptr<cspace::SnapshotStore> &store : buffer_stores)
+    {
+        if (store && store.use_count() == 1)
+        {
+            store->reset();
+            spare_stores.push_back(std::move(store));
+        }
+        store.reset();
+    }
+    std::fill(buffer_keys.begin(), buffer_keys.end(), nullptr);
+    num_buffers = 0;
+}
+
+long Tracer::findBuffer(const void *key, bool insert)
+{
+    if (insert && 2 * (num_buffers + 1) > buffer_keys.size())
+    {
+        growBuffers();
+    }
+
+    std::size_t mask = buffer_keys.size() - 1;
+    std::size_t i = slotOf(key, mask);
+    while (buffer_keys[i] && buffer_keys[i] != key)
+    {
+        i = (i + 1) & mask;
+    }
+    if (!buffer_keys[i])
+    {
+        if (!insert)
+        {
+            return -1;
+        }
+        buffer_keys[i] = key;
+        buffer_producers[i] = smart_tree::NodeHandle();
+        buffer_stores[i].reset();
+        num_buffers++;
+    }
+    return (long)i;
+}
+
+// Only ever while warming up
+void Tracer::growBuffers()
+{
+    std::vector<const void *> keys(buffer_keys.size() * 2, nullptr);
+    std::vector<smart_tree::NodeHandle> producers(keys.size());
+    std::vector<std::shared_ptr<cspace::SnapshotStore>> stores(keys.size());
+    std::size_t mask = keys.size() - 1;
+    for (std::size_t j = 0; j < buffer_keys.size(); j++)
+    {
+        if (buffer_keys[j])
+        {
+            std::size_t i = slotOf(buffer_keys[j], mask);
+            while (keys[i])
+            {
+                i = (i + 1) & mask;
+            }
+            keys[i] = buffer_keys[j];
+            producers[i] = buffer_producers[j];
+            stores[i] = std::move(buffer_stores[j]);
+        }
+    }
+    buffer_keys.swap(keys);
+    buffer_producers.swap(producers);
+    buffer_stores.swap(stores);
+}
+
+smart_tree::NodeHandle Tracer::producerOf(const cv::Mat &m) const
+{
+    const void *key = bufferKey(m);
+    if (!key)
+    {
+        return smart_tree::NodeHandle();
+    }
+
+    std::size_t mask = buffer_keys.size() - 1;
+    for (std::size_t i = slotOf(key, mask);; i = (i + 1) & mask)
+    {
+        if (buffer_keys[i] == key)
+        {
+            return buffer_producers[i];
+        }
+        if (!buffer_keys[i])
+        {
+            return smart_tree::NodeHandle();
+        }
+    }
+}
+
+void Tracer::snapshot(cspace::MatSnapshot &snap, const cspace::Mat &m)
+{
+    const void *key = bufferKey(m);
+    if (!key)
+    {
+        snap.take(m);
+        return;
+    }
+    std::shared_ptr<cspace::SnapshotStore> &store = buffer_stores[findBuffer(key, true)];
+    if (!store && !spare_stores.empty())
+    {
+        store = std::move(spare_stores.back());
+        spare_stores.pop_back();
+    }
+    else if (!store)
+    {
+        store = std::make_shared<cspace::SnapshotStore>();
+    }
+    snap.take(m, store);
+}
+
+// Anything the snapshot has saved on its own is kept, it is then left as it is
+void Tracer::share(TraceIo &io)
+{
+    const void *key = bufferKey(io.snapshot.live());
+    if (!key || io.snapshot.savedTiles())
+    {
+        return;
+    }
+    long slot = findBuffer(key, true);
+    if (io.snapshot.store() != buffer_stores[slot].get())
+    {
+        snapshot(io.snapshot, io.snapshot.live());
+    }
+}
+
+void Tracer::beforeWrite(const cv::Mat &target)
+{
+    const void *key = bufferKey(target);
+    if (!enabled || !key)
+    {
+        return;
+    }
+    long slot = findBuffer(key, false);
+    if (slot < 0 || !buffer_stores[slot])
+    {
+        return;
+    }
+    INSTRUMENT_SCOPE("tracer::beforeWrite");
+
+    cspace::SnapshotStore &store = *buffer_stores[slot];
+    std::size_t before = store.savedBytes();
+    store.beforeWrite(target);
+    counters.snapshot_bytes += store.savedBytes() - before;
+}
+
+// The record is filled in place in the tree's storage, taking headers on the inputs and outputs
+smart_tree::NodeHandle Tracer::record(const char *step,
+                                      const TraceIo *inputs, int num_inputs,
+                                      const TraceIo *outputs, int num_outputs,
+                                      const TraceParam *params, int num_params,
+                                      int64_t start_ns, int64_t end_ns)
+{
+    if (!enabled)
+    {
+        return smart_tree::NodeHandle();
+    }
+    INSTRUMENT_SCOPE("tracer::record");
+    int64_t record_start = steadyNs();
+
+    smart_tree::NodeHandle h = nodes.create();
+    TraceRecord &r = nodes.data(h);
+    r.step = step;
+    r.num_inputs = std::min(num_inputs, TRACE_MAX_IO);
+    r.num_outputs = std::min(num_outputs, TRACE_MAX_IO);
+    r.num_params = std::min(num_params, TRACE_MAX_PARAMS);
+    std::copy(inputs, inputs + r.num_inputs, r.inputs);
+    std::copy(outputs, outputs + r.num_outputs, r.outputs);
+    std::copy(params, params + r.num_params, r.params);
+    r.start_ns = start_ns;
+    r.duration_ns = end_ns - start_ns;
+
+    for (int k = 0; k < r.num_inputs; k++)
+    {
+        smart_tree::NodeHandle parent = producerOf(r.inputs[k].snapshot.live());
+        if (!parent.isNull())
+        {
+            nodes.addChild(parent, h);
+            break;
+        }
+    }
+
+    for (int k = 0; k < r.num_inputs; k++)
+    {
+        share(r.inputs[k]);
+    }
+    for (int k = 0; k < r.num_outputs; k++)
+    {
+        share(r.outputs[k]);
+        const void *key = bufferKey(r.outputs[k].snapshot.live());
+        if (key)
+        {
+            buffer_producers[findBuffer(key, true)] = h;
+        }
+    }
+
+    counters.steps++;
+    counters.record_ns += steadyNs() - record_start;
+    return h;
+}
+
+Step::Step(Tracer &tracer, const char *name)
+    : tracer(tracer), name(name), start_ns(tracer.isEnabled() ? tracer.now() : 0)
+{
+}
+
+Step::~Step()
+{
+    finish();
+}
+
+// Snapshotted now, so that writes announced before the step is recorded are kept
+Step &Step::input(const cspace::Mat &m, trace_kind_t kind)
+{
+    if (tracer.isEnabled() && num_inputs < TRACE_MAX_IO)
+    {
+        inputs[num_inputs].kind = kind;
+        tracer.snapshot(inputs[num_inputs++].snapshot, m);
+    }
+    return *this;
+}
+
+Step &Step::output(const cspace::Mat &m, trace_kind_t kind)
+{
+    if (num_outputs < TRACE_MAX_IO)
+    {
+        output_kinds[num_outputs] = kind;
+        outputs[num_outputs++] = &m;
+    }
+    return *this;
+}
+
+Step &Step::param(const char *name, double value)
+{
+    if (num_params < TRACE_MAX_PARAMS)
+    {
+        params[num_params].name = name;
+        params[num_params++].value = value;
+    }
+    return *this;
+}
+
+Step &Step::beforeWrite(const cv::Mat &target)
+{
+    if (!done && tracer.isEnabled())
+    {
+        tracer.beforeWrite(target);
+    }
+    return *this;
+}
+
+smart_tree::NodeHandle Step::finish()
+{
+    if (done || !tracer.isEnabled())
+    {
+        done = true;
+        return recorded;
+    }
+    done = true;
+
+    int64_t end_ns = tracer.now();
+    TraceIo outs[TRACE_MAX_IO];
+    for (int k = 0; k < num_outputs; k++)
+    {
+        tracer.snapshot(outs[k].snapshot, *outputs[k]);
+        outs[k].kind = output_kinds[k];
+    }
+    recorded = tracer.record(name, inputs, num_inputs, outs, num_outputs, params, num_params,
+                             start_ns, end_ns);
+    return recorded;
+}
+
+} // namespace tracer
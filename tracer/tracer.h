@@ -0,0 +1,250 @@
+/******************************************************************************/
+/*!
+ * @file  tracer.h
+ * @brief Records the link between the inputs and outputs of each processing
+ *        step, as a tree of steps
+ *
+ * @author Cathal Harte <cathal.harte@protonmail.com>
+ */
+#ifndef _TRACER_H
+#define _TRACER_H
+
+/*******************************************************************************
+* Includes
+******************************************************************************/
+
+#include <color_matrix.h>
+#include <mat_snapshot.h>
+#include <flat_tree.h>
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <opencv2/core.hpp>
+
+/*! @defgroup tracer Tracer.
+ *
+ * @addtogroup tracer
+ * @{
+ * @brief
+ */
+
+namespace tracer
+{
+/*******************************************************************************
+* Definitions and types
+*******************************************************************************/
+
+// The most inputs, outputs and parameters recorded for one step, kept fixed so that a record
+// never allocates
+#define TRACE_MAX_IO 4
+#define TRACE_MAX_PARAMS 6
+
+// What an input or output of a step is. Features (keypoints, contours, descriptors...) are held in
+// a cv::Mat like images are, and are drawn over an image to be visualised.
+typedef enum trace_kind
+{
+    TRACE_IMAGE,
+    TRACE_FEATURES
+} trace_kind_t;
+
+// A numeric parameter of a step. The name is not copied, use string literals.
+struct TraceParam
+{
+    const char *name;
+    double value;
+};
+
+// An input or output, a snapshot sharing the pixels of the original, colorspace tag and all, until
+// they are written over
+struct TraceIo
+{
+    cspace::MatSnapshot snapshot;
+    trace_kind_t kind = TRACE_IMAGE;
+
+    // The pixels as the step saw them
+    cspace::Mat view() const { return snapshot.view(); }
+};
+
+// One step. The step name is not copied, use string literals.
+struct TraceRecord
+{
+    const char *step = nullptr;
+    TraceIo inputs[TRACE_MAX_IO];
+    int num_inputs = 0;
+    TraceIo outputs[TRACE_MAX_IO];
+    int num_outputs = 0;
+    TraceParam params[TRACE_MAX_PARAMS];
+    int num_params = 0;
+    int64_t start_ns = 0; // since the tracer was created
+    int64_t duration_ns = 0;
+};
+
+typedef smart_tree::FlatTree<TraceRecord> trace_tree_t;
+
+// What tracing has cost so far
+struct TracerStats
+{
+    uint64_t steps = 0;
+    uint64_t record_ns = 0; // spent recording, apart from the steps themselves
+    uint64_t snapshot_bytes = 0; // copied aside ahead of writes over traced buffers
+};
+
+/*******************************************************************************
+* Class prototypes
+*******************************************************************************/
+
+//  Records each processing step as a node of a tree
+//  Design parameters :
+//      A step becomes a child of the step that produced its first input, recognised by the
+//      buffer the input shares with that step's output. A step whose inputs were produced by
+//      no traced step (a decoded frame...) is a root.
+//      Inputs and outputs are kept as snapshots, headers on the pixels, so recording copies no
+//      pixels. Code about to write into a buffer that may have been traced (cv::threshold(img,
+//      img...), copyTo into a roi...) calls beforeWrite() first, and the tiles it will write are
+//      copied aside, once, into a store shared by every snapshot of the buffer. Writes that are
+//      not announced show through.
+//      Everything lives in preallocated storage, a FlatTree and an open addressed table from
+//      buffer to producing step and to its snapshot store, so that once warmed up a step is
+//      recorded in a small fixed time without allocating. newFrame() drops the frame's
+//      references, keeps the stores for the next, and starts afresh.
+//      A Tracer is for one thread, give each thread its own.
+class Tracer
+{
+    public :
+        // expected_steps per frame, to size the storage up front
+        explicit Tracer(std::size_t expected_steps = 1024);
+
+        // Recording can be switched off, then steps cost a branch
+        void setEnabled(bool enabled) { this->enabled = enabled; }
+        bool isEnabled() const { return enabled; }
+
+        // Releases the headers of the frame so far and clears the tree, keeping the storage
+        void newFrame();
+
+        // Nanoseconds since the tracer was created, the clock step timings are on
+        int64_t now() const;
+
+        // Records a step which ran from start_ns to end_ns. Returns its node, or a null handle
+        // when recording is switched off.
+        smart_tree::NodeHandle record(const char *step,
+                                      const TraceIo *inputs, int num_inputs,
+                                      const TraceIo *outputs, int num_outputs,
+                                      const TraceParam *params, int num_params,
+                                      int64_t start_ns, int64_t end_ns);
+
+        // Which step last produced the buffer of m, a null handle if none did
+        smart_tree::NodeHandle producerOf(const cv::Mat &m) const;
+
+        // To be called before writing into target, a header on all or part of a buffer. The tiles
+        // about to be written are saved, once, for every traced input and output on the buffer.
+        void beforeWrite(const cv::Mat &target);
+
+        const trace_tree_t &tree() const { return nodes; }
+        const TraceRecord &at(smart_tree::NodeHandle h) const { return nodes.data(h); }
+
+        const TracerStats &stats() const { return counters; }
+        void resetStats() { counters = TracerStats(); }
+
+    private :
+        // Steps snapshot their inputs and outputs through us
+        friend class Step;
+
+        // The slot of a buffer in the table, -1 (or a new slot when insert is set) if it has none
+        long findBuffer(const void *key, bool insert);
+        void growBuffers();
+        // A snapshot of m sharing the store of its buffer, the store is made on first sight of
+        // the buffer in a frame
+        void snapshot(cspace::MatSnapshot &snap, const cspace::Mat &m);
+        // io, taken elsewhere, made to share the store of its buffer
+        void share(TraceIo &io);
+
+        trace_tree_t nodes;
+        bool enabled = true;
+        int64_t origin_ns;
+
+        // buffer -> producing step, and the store of its snapshots, linear probing, a power of 2
+        // in size and at most half full
+        std::vector<const void *> buffer_keys;
+        std::vector<smart_tree::NodeHandle> buffer_producers;
+        std::vector<std::shared_ptr<cspace::SnapshotStore>> buffer_stores;
+        std::size_t num_buffers = 0;
+        // stores of past frames, to be handed to the buffers of the next
+        std::vector<std::shared_ptr<cspace::SnapshotStore>> spare_stores;
+
+        TracerStats counters;
+};
+
+// Traces a step over its lifetime, the step is timed from construction to destruction, e.g.
+//     {
+//         tracer::Step step(tr, "threshold");
+//         step.input(gray).param("thresh", 127);
+//         cv::threshold(gray, mask, 127, 255, cv::THRESH_BINARY);
+//         step.output(mask);
+//     }
+// Inputs are snapshotted as they are given, outputs are looked at when the step is recorded and
+// must outlive the Step. A step writing into its own input, or into any traced buffer, says so with
+// beforeWrite(), e.g.
+//     step.input(img).beforeWrite(img);
+//     cv::threshold(img, img, 127, 255, cv::THRESH_BINARY);
+//     step.output(img);
+// Inputs and outputs beyond TRACE_MAX_IO, and parameters beyond TRACE_MAX_PARAMS, are dropped.
+class Step
+{
+    public :
+        Step(Tracer &tracer, const char *name);
+        ~Step();
+        Step(const Step &) = delete;
+        Step &operator=(const Step &) = delete;
+
+        Step &input(const cspace::Mat &m, trace_kind_t kind = TRACE_IMAGE);
+        Step &output(const cspace::Mat &m, trace_kind_t kind = TRACE_IMAGE);
+        Step &param(const char *name, double value);
+        // Tracer::beforeWrite(), which saves for this step's inputs too, they share the stores of
+        // their buffers
+        Step &beforeWrite(const cv::Mat &target);
+
+        // The node of the step, once it has been recorded
+        smart_tree::NodeHandle node() const { return recorded; }
+
+        // Records now rather than on destruction, the outputs are taken as they stand
+        smart_tree::NodeHandle finish();
+
+    private :
+        Tracer &tracer;
+        const char *name;
+        int64_t start_ns;
+        TraceIo inputs[TRACE_MAX_IO];
+        int num_inputs = 0;
+        const cspace::Mat *outputs[TRACE_MAX_IO];
+        trace_kind_t output_kinds[TRACE_MAX_IO];
+        int num_outputs = 0;
+        TraceParam params[TRACE_MAX_PARAMS];
+        int num_params = 0;
+        bool done = false;
+        smart_tree::NodeHandle recorded;
+};
+
+/*******************************************************************************
+* Function prototypes
+*******************************************************************************/
+
+// Runs fn(in, out) as a traced image -> image step. out is taken to be written, so whatever was
+// traced on its buffer, in included when the step works in place, is kept as it was.
+template <typename Fn>
+smart_tree::NodeHandle traceStep(Tracer &tracer, const char *name, const cspace::Mat &in,
+                                 cspace::Mat &out, Fn fn)
+{
+    Step step(tracer, name);
+    step.input(in).beforeWrite(out);
+    fn(in, out);
+    step.output(out);
+    return step.finish();
+}
+
+}
+
+/*! @}
+ */
+
+#endif  // _TRACER_H
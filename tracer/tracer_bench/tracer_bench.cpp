@@ -0,0 +1,251 @@
+/**
+* \file tracer_bench.cpp
+*
+* \brief The cost of recording a traced step
+*
+* \author Cathal Harte  <cathal.harte@protonmail.com>
+*/
+
+/*******************************************************************************
+* Includes
+*******************************************************************************/
+
+#include <benchmark/benchmark.h>
+#include <tracer.h>
+#include <video_pipeline.h>
+#include <async_visualizer.h>
+#include <trace_log.h>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <opencv2/opencv.hpp>
+namespace
+{
+
+/*******************************************************************************
+* Definitions and types
+*******************************************************************************/
+
+/*******************************************************************************
+* Local Function prototypes
+*******************************************************************************/
+
+/*******************************************************************************
+* Data
+*******************************************************************************/
+
+/*******************************************************************************
+* Functions
+*******************************************************************************/
+
+// A chain of steps that do nothing, so that all that is measured is the recording. The budget is
+// 1us per step; the record_ns counter is what the tracer measured itself, the time per iteration
+// includes the Step bookkeeping and the clock reads around it.
+void BM_record_step(benchmark::State &state)
+{
+    const int steps_per_frame = state.range(0);
+    tracer::Tracer tr(steps_per_frame);
+    std::vector<cspace::Mat> mats(steps_per_frame + 1);
+    for (auto &m : mats)
+    {
+        m.create(1080, 1920, CV_8UC1);
+        m.setColorspace(cspace::GRAY);
+    }
+
+    for (auto _ : state)
+    {
+        tr.newFrame();
+        for (int i = 0; i < steps_per_frame; i++)
+        {
+            tracer::Step step(tr, "noop");
+            step.input(mats[i]).output(mats[i + 1]).param("i", i);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * steps_per_frame);
+    state.counters["record_ns_per_step"] = (double)tr.stats().record_ns / tr.stats().steps;
+}
+
+void BM_record_step_disabled(benchmark::State &state)
+{
+    tracer::Tracer tr;
+    tr.setEnabled(false);
+    cspace::Mat in(1080, 1920, CV_8UC1), out(1080, 1920, CV_8UC1);
+
+    for (auto _ : state)
+    {
+        tracer::Step step(tr, "noop");
+        step.input(in).output(out);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+// A traced 1080p frame, then a step blacking out a roi of range(0) pixels square in place. The
+// snapshot copies the tiles under the roi, against the whole frame for a defensive clone.
+void BM_in_place_roi_snapshot(benchmark::State &state)
+{
+    const int side = state.range(0);
+    tracer::Tracer tr;
+    cspace::Mat frame(1080, 1920, CV_8UC3, cv::Scalar::all(128));
+    frame.setColorspace(cspace::BGR);
+    cspace::Mat gray;
+
+    for (auto _ : state)
+    {
+        tr.newFrame();
+        tracer::traceStep(tr, "gray", frame, gray,
+            [](const cspace::Mat &in, cspace::Mat &out) { in.toGray(out); });
+
+        tracer::Step step(tr, "blackout");
+        cv::Mat roi = frame(cv::Rect(100, 100, side, side));
+        step.input(frame).beforeWrite(roi);
+        roi.setTo(cv::Scalar::all(0));
+        step.output(frame);
+    }
+    state.counters["snapshot_bytes_per_frame"] =
+        (double)tr.stats().snapshot_bytes / state.iterations();
+}
+
+void BM_in_place_roi_clone(benchmark::State &state)
+{
+    const int side = state.range(0);
+    tracer::Tracer tr;
+    cspace::Mat frame(1080, 1920, CV_8UC3, cv::Scalar::all(128));
+    frame.setColorspace(cspace::BGR);
+    cspace::Mat gray, copy;
+
+    for (auto _ : state)
+    {
+        tr.newFrame();
+        tracer::traceStep(tr, "gray", frame, gray,
+            [](const cspace::Mat &in, cspace::Mat &out) { in.toGray(out); });
+
+        tracer::Step step(tr, "blackout");
+        copy = frame.clone();
+        step.input(copy);
+        frame(cv::Rect(100, 100, side, side)).setTo(cv::Scalar::all(0));
+        step.output(frame);
+    }
+}
+
+// range(0) stages of 1ms each, waiting rather than computing so that they overlap whatever the
+// number of cores. Pipelined the frame rate nears 1 / 1ms, run back to back 1 / (range(0) * 1ms).
+void BM_video_pipeline(benchmark::State &state)
+{
+    const int num_stages = state.range(0);
+    const bool pipelined = state.range(1);
+    auto stage = [](tracer::FrameContext &ctx) {
+        tracer::Step step(ctx.tracer(), "wait");
+        step.input(ctx.input());
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    };
+
+    for (auto _ : state)
+    {
+        tracer::VideoPipeline pipe(8, 1, num_stages + 1);
+        if (pipelined)
+        {
+            for (int s = 0; s < num_stages; s++)
+            {
+                pipe.addStage("stage", stage);
+            }
+        }
+        else
+        {
+            pipe.addStage("stages", [&](tracer::FrameContext &ctx) {
+                for (int s = 0; s < num_stages; s++)
+                {
+                    stage(ctx);
+                }
+            });
+        }
+        pipe.start();
+        for (int i = 0; i < 100; i++)
+        {
+            pipe.push(pipe.acquireFrame(cv::Size(640, 480), CV_8UC3));
+        }
+        pipe.close();
+    }
+    state.counters["frames_per_second"] =
+        benchmark::Counter(100 * state.iterations(), benchmark::Counter::kIsRate);
+}
+
+// What drawing a 1080p highlight costs the pipeline, inline and handed to an AsyncVisualizer
+cspace::Mat makeMask(const cspace::Mat &bg)
+{
+    cspace::Mat mask(bg.size(), CV_8UC1);
+    cv::randu(mask, cv::Scalar::all(0), cv::Scalar::all(256));
+    mask.setColorspace(cspace::WHITE_ON_BLACK);
+    return mask;
+}
+
+void BM_visualize_inline(benchmark::State &state)
+{
+    cspace::Mat bg(1080, 1920, CV_8UC3, cv::Scalar::all(128));
+    bg.setColorspace(cspace::BGR);
+    cspace::Mat mask = makeMask(bg);
+    cspace::Mat out;
+
+    for (auto _ : state)
+    {
+        cspace::highlightOverBg(bg, mask, out);
+    }
+}
+
+void BM_visualize_async(benchmark::State &state)
+{
+    cspace::Mat bg(1080, 1920, CV_8UC3, cv::Scalar::all(128));
+    bg.setColorspace(cspace::BGR);
+    cspace::Mat mask = makeMask(bg);
+    tracer::AsyncVisualizer vis([](uint64_t, const cspace::Mat &) {}, 16, 1,
+                                (tracer::vis_policy_t)state.range(0));
+
+    for (auto _ : state)
+    {
+        vis.highlight(bg, mask);
+    }
+    vis.close();
+    tracer::VisualizerStats stats = vis.stats();
+    state.counters["dropped"] = (double)stats.dropped;
+    state.counters["max_depth"] = (double)stats.max_depth;
+}
+
+// A 640x480 frame through gray and a threshold, appended to a log each iteration, with and without
+// the fdatasync of each batch (range(0)). The time is the caller's; wait_ms is how much of it was
+// spent waiting on the writing thread.
+void BM_trace_log_append(benchmark::State &state)
+{
+    tracer::TraceLogConfig cfg;
+    cfg.sync = state.range(0);
+    tracer::TraceLogWriter log("bm_trace_log.bin", cfg);
+    tracer::Tracer tr;
+    cspace::Mat frame(480, 640, CV_8UC3);
+    cv::randu(frame, cv::Scalar::all(0), cv::Scalar::all(256));
+    frame.setColorspace(cspace::BGR);
+    cspace::Mat gray, mask;
+
+    for (auto _ : state)
+    {
+        tr.newFrame();
+        tracer::traceStep(tr, "gray", frame, gray,
+            [](const cspace::Mat &in, cspace::Mat &out) { in.toGray(out); });
+        tracer::traceStep(tr, "threshold", gray, mask,
+            [](const cspace::Mat &in, cspace::Mat &out) { cv::threshold(in, out, 127, 255, cv::THRESH_BINARY); });
+        log.appendFrame(tr);
+    }
+    log.close();
+    tracer::TraceLogStats stats = log.stats();
+    state.SetBytesProcessed(stats.bytes);
+    state.counters["wait_ms"] = stats.wait_ns / 1e6;
+    std::remove("bm_trace_log.bin");
+}
+
+BENCHMARK(BM_record_step)->Arg(16)->Arg(256)->Arg(4096);
+BENCHMARK(BM_record_step_disabled);
+BENCHMARK(BM_in_place_roi_snapshot)->Arg(16)->Arg(256)->Arg(1024);
+BENCHMARK(BM_in_place_roi_clone)->Arg(16)->Arg(256)->Arg(1024);
+BENCHMARK(BM_visualize_inline);
+BENCHMARK(BM_trace_log_append)->Arg(0)->Arg(1)->UseRealTime();
+BENCHMARK(BM_visualize_async)->Arg(tracer::VIS_BLOCK)->Arg(tracer::VIS_DROP_OLDEST)->Arg(tracer::VIS_SAMPLE);
+BENCHMARK(BM_video_pipeline)->Args({4, 1})->Args({4, 0})->Unit(benchmark::kMillisecond)->UseRealTime();
+
+} // namespace
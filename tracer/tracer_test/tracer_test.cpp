@@ -0,0 +1,700 @@
+/**
+* \file tracer_test.cpp
+*
+* \brief tracer unit test
+*
+* \author Cathal Harte  <cathal.harte@protonmail.com>
+*/
+
+/*******************************************************************************
+* Includes
+*******************************************************************************/
+
+#include <gtest/gtest.h>
+#include <tracer.h>
+#include <dag_executor.h>
+#include <video_pipeline.h>
+#include <async_visualizer.h>
+#include <trace_log.h>
+#include <pool_allocator.h>
+#include <condition_variable>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <unistd.h>
+#include <opencv2/opencv.hpp>
+namespace
+{
+
+/*******************************************************************************
+* Definitions and types
+*******************************************************************************/
+
+/*******************************************************************************
+* Local Function prototypes
+*******************************************************************************/
+
+/*******************************************************************************
+* Data
+*******************************************************************************/
+
+/*******************************************************************************
+* Functions
+*******************************************************************************/
+
+cspace::Mat makeFrame()
+{
+    cspace::Mat frame(48, 64, CV_8UC3);
+    cv::randu(frame, cv::Scalar::all(0), cv::Scalar::all(256));
+    frame.setColorspace(cspace::BGR);
+    return frame;
+}
+
+// frame -> gray -> mask, and frame -> hsv alongside
+TEST(tracer, steps_link_through_their_buffers)
+{
+    tracer::Tracer tr;
+    cspace::Mat frame = makeFrame();
+    cspace::Mat gray, mask, hsv;
+
+    smart_tree::NodeHandle to_gray = tracer::traceStep(tr, "gray", frame, gray,
+        [](const cspace::Mat &in, cspace::Mat &out) { in.toGray(out); });
+    smart_tree::NodeHandle to_hsv = tracer::traceStep(tr, "hsv", frame, hsv,
+        [](const cspace::Mat &in, cspace::Mat &out) { in.toHSV(out); });
+    smart_tree::NodeHandle threshold;
+    {
+        tracer::Step step(tr, "threshold");
+        step.input(gray).param("thresh", 127);
+        cv::threshold(gray, mask, 127, 255, cv::THRESH_BINARY);
+        mask.setColorspace(cspace::WHITE_ON_BLACK);
+        step.output(mask);
+        threshold = step.finish();
+    }
+
+    const tracer::trace_tree_t &tree = tr.tree();
+    EXPECT_EQ(tree.size(), 3u);
+    EXPECT_TRUE(tree.isRoot(to_gray)); // the frame came from no traced step
+    EXPECT_TRUE(tree.isRoot(to_hsv));
+    EXPECT_EQ(tree.getParent(threshold), to_gray);
+    EXPECT_EQ(tr.producerOf(mask), threshold);
+
+    const tracer::TraceRecord &r = tr.at(threshold);
+    EXPECT_STREQ(r.step, "threshold");
+    ASSERT_EQ(r.num_params, 1);
+    EXPECT_STREQ(r.params[0].name, "thresh");
+    EXPECT_EQ(r.params[0].value, 127);
+    EXPECT_GE(r.duration_ns, 0);
+    ASSERT_EQ(r.num_outputs, 1);
+    EXPECT_EQ(r.outputs[0].snapshot.live().getColorspace(), cspace::WHITE_ON_BLACK);
+}
+
+// The records are headers on the very pixels, and let go of them at the next frame
+TEST(tracer, records_share_pixels)
+{
+    tracer::Tracer tr;
+    cspace::Mat frame = makeFrame();
+    cspace::Mat gray;
+
+    smart_tree::NodeHandle h = tracer::traceStep(tr, "gray", frame, gray,
+        [](const cspace::Mat &in, cspace::Mat &out) { in.toGray(out); });
+
+    const tracer::TraceRecord &r = tr.at(h);
+    EXPECT_EQ(r.inputs[0].snapshot.live().data, frame.data);
+    EXPECT_EQ(r.inputs[0].snapshot.live().getColorspace(), cspace::BGR);
+    EXPECT_EQ(r.outputs[0].snapshot.live().data, gray.data);
+    EXPECT_EQ(r.outputs[0].snapshot.live().getColorspace(), cspace::GRAY);
+    EXPECT_EQ(frame.u->refcount, 2);
+
+    tr.newFrame();
+    EXPECT_EQ(frame.u->refcount, 1);
+    EXPECT_EQ(tr.tree().size(), 0u);
+    EXPECT_TRUE(tr.producerOf(gray).isNull());
+}
+
+TEST(tracer, switched_off)
+{
+    tracer::Tracer tr;
+    tr.setEnabled(false);
+    cspace::Mat frame = makeFrame();
+    cspace::Mat gray;
+
+    smart_tree::NodeHandle h = tracer::traceStep(tr, "gray", frame, gray,
+        [](const cspace::Mat &in, cspace::Mat &out) { in.toGray(out); });
+    EXPECT_TRUE(h.isNull());
+    EXPECT_EQ(tr.tree().size(), 0u);
+    EXPECT_EQ(frame.u->refcount, 1);
+    EXPECT_FALSE(gray.empty());
+}
+
+// Frame after frame the same storage is used, and the cost of recording is counted
+TEST(tracer, steady_state_reuses_storage)
+{
+    tracer::Tracer tr(16);
+    cspace::Mat frame = makeFrame();
+    cspace::Mat gray, hsv;
+
+    size_t capacity = 0;
+    for (int f = 0; f < 10; f++)
+    {
+        tr.newFrame();
+        tracer::traceStep(tr, "gray", frame, gray,
+            [](const cspace::Mat &in, cspace::Mat &out) { in.toGray(out); });
+        tracer::traceStep(tr, "hsv", frame, hsv,
+            [](const cspace::Mat &in, cspace::Mat &out) { in.toHSV(out); });
+        if (f == 0)
+        {
+            capacity = tr.tree().capacity();
+        }
+        EXPECT_EQ(tr.tree().capacity(), capacity);
+    }
+    EXPECT_EQ(tr.stats().steps, 20u);
+    EXPECT_GT(tr.stats().record_ns, 0u);
+}
+
+// Steps writing over traced pixels, in place and into a roi
+TEST(tracer, in_place_writes_keep_the_trace)
+{
+    tracer::Tracer tr;
+    cspace::Mat frame = makeFrame();
+    cspace::Mat gray;
+    cv::Mat frame_before = frame.clone();
+
+    smart_tree::NodeHandle to_gray = tracer::traceStep(tr, "gray", frame, gray,
+        [](const cspace::Mat &in, cspace::Mat &out) { in.toGray(out); });
+    cv::Mat gray_before = gray.clone();
+
+    smart_tree::NodeHandle threshold;
+    {
+        tracer::Step step(tr, "threshold");
+        step.input(gray).beforeWrite(gray);
+        cv::threshold(gray, gray, 127, 255, cv::THRESH_BINARY);
+        step.output(gray);
+        threshold = step.finish();
+    }
+    EXPECT_EQ(tr.tree().getParent(threshold), to_gray);
+    EXPECT_EQ(cv::norm(tr.at(to_gray).outputs[0].view(), gray_before, cv::NORM_INF), 0);
+    EXPECT_EQ(cv::norm(tr.at(threshold).inputs[0].view(), gray_before, cv::NORM_INF), 0);
+    EXPECT_EQ(cv::norm(tr.at(threshold).outputs[0].view(), gray, cv::NORM_INF), 0);
+
+    // one corner of the frame is blacked out, a tile's worth is copied
+    {
+        tracer::Step step(tr, "blackout");
+        cv::Mat corner = frame(cv::Rect(0, 0, 8, 8));
+        step.input(frame).beforeWrite(corner);
+        corner.setTo(cv::Scalar::all(0));
+        step.output(frame);
+    }
+    EXPECT_EQ(cv::norm(tr.at(to_gray).inputs[0].view(), frame_before, cv::NORM_INF), 0);
+    EXPECT_EQ(tr.at(to_gray).inputs[0].snapshot.savedTiles(), 1);
+    // both images fit in a tile, each is saved once for the traced step which made or read it and
+    // the pending step about to write over it
+    EXPECT_EQ(tr.at(threshold).inputs[0].snapshot.store(), tr.at(to_gray).outputs[0].snapshot.store());
+    const uint64_t gray_bytes = gray.total() * gray.elemSize();
+    const uint64_t frame_bytes = frame.total() * frame.elemSize();
+    EXPECT_EQ(tr.stats().snapshot_bytes, gray_bytes + frame_bytes);
+}
+
+// frame -> gray and frame -> hsv, side by side, then a step taking both
+TEST(dag_executor, diamond_keeps_all_of_its_provenance)
+{
+    smart_tree::WorkStealingPool pool(2);
+    tracer::DagExecutor exec(pool);
+    tracer::slot_t frame = exec.addSource("frame");
+
+    // each branch waits to see the other start, which it only does if they run at once
+    std::atomic<int> started{0};
+    std::atomic<bool> overlapped{true};
+    auto meet = [&] {
+        started++;
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while (started < 2 && std::chrono::steady_clock::now() < deadline)
+        {
+            std::this_thread::yield();
+        }
+        if (started < 2)
+        {
+            overlapped = false;
+        }
+    };
+
+    tracer::slot_t gray = exec.addStep("gray", {frame}, [&](tracer::StepContext &c) {
+        meet();
+        c.in(0).toGray(c.out(0));
+    });
+    tracer::slot_t hsv = exec.addStep("hsv", {frame}, [&](tracer::StepContext &c) {
+        meet();
+        c.in(0).toHSV(c.out(0));
+    });
+    tracer::slot_t value = exec.addStep("value", {gray, hsv}, [](tracer::StepContext &c) {
+        cv::Mat v;
+        cv::extractChannel(c.in(1), v, 2);
+        cv::max(c.in(0), v, c.out(0));
+        c.out(0).setColorspace(cspace::GRAY);
+        c.param("channel", 2);
+    });
+
+    cspace::Mat bgr = makeFrame();
+    tracer::DagTrace trace = exec.run({bgr});
+    EXPECT_TRUE(overlapped);
+
+    cspace::Mat expected_gray, expected_hsv;
+    bgr.toGray(expected_gray);
+    bgr.toHSV(expected_hsv);
+    cv::Mat v, expected;
+    cv::extractChannel(expected_hsv, v, 2);
+    cv::max(expected_gray, v, expected);
+    EXPECT_EQ(cv::norm(exec.slot(value), expected, cv::NORM_INF), 0);
+
+    ASSERT_EQ(trace.steps.size(), 3u);
+    std::shared_ptr<tracer::trace_dag_node_t> last = trace.steps[2];
+    ASSERT_EQ(last->getNumParents(), 2u);
+    EXPECT_EQ(last->getParent(0), trace.steps[0]);
+    EXPECT_EQ(last->getParent(1), trace.steps[1]);
+    EXPECT_EQ(trace.steps[0]->getParent(0), trace.sources[0]);
+    EXPECT_STREQ(last->data.step, "value");
+    EXPECT_EQ(last->data.params[0].value, 2);
+    EXPECT_EQ(last->data.inputs[1].snapshot.live().getColorspace(), cspace::HSV);
+
+    std::vector<tracer::trace_dag_node_t *> order = smart_tree::topologicalOrder(trace.sources);
+    ASSERT_EQ(order.size(), 4u);
+    EXPECT_EQ(order.back(), last.get());
+
+    // the trace keeps the first run's pixels, the second run writes elsewhere
+    const uchar *first = exec.slot(value).data;
+    tracer::DagTrace second = exec.run({bgr});
+    EXPECT_NE(exec.slot(value).data, first);
+    EXPECT_EQ(last->data.outputs[0].snapshot.live().data, first);
+}
+
+// gray in one stage, thresholded in the next
+void addGrayThenThreshold(tracer::VideoPipeline &pipe)
+{
+    pipe.addStage("gray", [](tracer::FrameContext &ctx) {
+        tracer::Step step(ctx.tracer(), "gray");
+        step.input(ctx.input());
+        ctx.input().toGray(ctx.output(0));
+        step.output(ctx.slot(0));
+    });
+    pipe.addStage("threshold", [](tracer::FrameContext &ctx) {
+        tracer::Step step(ctx.tracer(), "threshold");
+        step.input(ctx.slot(0)).param("thresh", 100);
+        cv::threshold(ctx.slot(0), ctx.output(1), 100, 255, cv::THRESH_BINARY);
+        ctx.slot(1).setColorspace(cspace::WHITE_ON_BLACK);
+        step.output(ctx.slot(1));
+    });
+}
+
+// Frame i is all i * 10, what the kept traces show must be their own frame's pixels, although the
+// buffers go round
+TEST(video_pipeline, keeps_the_last_frames)
+{
+    tracer::VideoPipeline pipe(3, 2, 3);
+    addGrayThenThreshold(pipe);
+    pipe.start();
+    for (int i = 0; i < 10; i++)
+    {
+        cspace::Mat frame = pipe.acquireFrame(cv::Size(32, 24), CV_8UC3);
+        frame.setTo(cv::Scalar::all(i * 10));
+        frame.setColorspace(cspace::BGR);
+        pipe.push(frame);
+    }
+    pipe.close();
+    EXPECT_EQ(pipe.stats().frames, 10u);
+
+    std::vector<uint64_t> kept;
+    pipe.forEachRetained([&](const tracer::FrameTrace &t) {
+        kept.push_back(t.index);
+        const tracer::trace_tree_t &tree = t.tracer.tree();
+        ASSERT_EQ(tree.size(), 2u);
+        smart_tree::NodeHandle gray = tree.nodeAt(0), threshold = tree.nodeAt(1);
+        EXPECT_EQ(tree.getParent(threshold), gray);
+
+        double value = (double)t.index * 10;
+        EXPECT_EQ(cv::norm(tree.data(gray).inputs[0].view(), cv::NORM_INF), value);
+        EXPECT_EQ(cv::norm(tree.data(gray).outputs[0].view(), cv::NORM_INF), value);
+        EXPECT_EQ(cv::norm(tree.data(threshold).outputs[0].view(), cv::NORM_INF),
+                  value > 100 ? 255 : 0);
+    });
+    EXPECT_EQ(kept, std::vector<uint64_t>({7, 8, 9}));
+}
+
+// However many frames go through, no more buffers are made than can be held at once
+TEST(video_pipeline, memory_stays_flat)
+{
+    const std::size_t retained = 4, in_flight = 3, slots = 2;
+    tracer::VideoPipeline pipe(retained, slots, in_flight);
+    addGrayThenThreshold(pipe);
+    pipe.start();
+    for (int i = 0; i < 300; i++)
+    {
+        cspace::Mat frame = pipe.acquireFrame(cv::Size(64, 48), CV_8UC3);
+        frame.setTo(cv::Scalar::all(i % 256));
+        frame.setColorspace(cspace::BGR);
+        pipe.push(frame);
+    }
+    pipe.close();
+
+    tracer::PipelineStats stats = pipe.stats();
+    EXPECT_EQ(stats.frames, 300u);
+    EXPECT_LE(stats.pool_buffers, (retained + in_flight + 1) * (slots + 1));
+    ASSERT_EQ(stats.stage_busy_ns.size(), 2u);
+}
+
+// The frames and intermediates of the pool come from the pipeline's allocator as well
+TEST(video_pipeline, pool_uses_the_allocator)
+{
+    cspace::PoolAllocator alloc;
+    {
+        tracer::VideoPipeline pipe(2, 2, 2);
+        pipe.setAllocator(&alloc);
+        addGrayThenThreshold(pipe);
+        pipe.start();
+        for (int i = 0; i < 20; i++)
+        {
+            cspace::Mat frame = pipe.acquireFrame(cv::Size(32, 24), CV_8UC3);
+            ASSERT_EQ(frame.u->currAllocator, &alloc);
+            frame.setTo(cv::Scalar::all(i));
+            frame.setColorspace(cspace::BGR);
+            pipe.push(frame);
+        }
+        pipe.close();
+        EXPECT_GT(alloc.stats().live_bytes, 0u);
+    }
+    EXPECT_EQ(alloc.stats().live_bytes, 0u);
+}
+
+// A sink that holds up the first image until let go, so that the queue fills behind it
+struct GatedSink
+{
+    std::mutex lock;
+    std::condition_variable changed;
+    bool first_in = false;
+    bool open = false;
+    std::vector<uint64_t> tags;
+
+    tracer::vis_sink_t sink()
+    {
+        return [this](uint64_t tag, const cspace::Mat &) {
+            std::unique_lock<std::mutex> guard(lock);
+            tags.push_back(tag);
+            first_in = true;
+            changed.notify_all();
+            changed.wait(guard, [this] { return open; });
+        };
+    }
+    void waitForFirst()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        changed.wait(guard, [this] { return first_in; });
+    }
+    void letGo()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        open = true;
+        changed.notify_all();
+    }
+};
+
+// Request 0 is held in the sink, 1 to 5 arrive at a queue of 2
+std::vector<uint64_t> renderWhileHeldUp(tracer::vis_policy_t policy, tracer::VisualizerStats &stats)
+{
+    GatedSink gate;
+    tracer::AsyncVisualizer vis(gate.sink(), 2, 1, policy, 2);
+    cspace::Mat frame = makeFrame();
+
+    EXPECT_TRUE(vis.bgr(frame, 0));
+    gate.waitForFirst();
+    for (uint64_t tag = 1; tag <= 5; tag++)
+    {
+        vis.bgr(frame, tag);
+    }
+    gate.letGo();
+    vis.close();
+    stats = vis.stats();
+    return gate.tags;
+}
+
+TEST(async_visualizer, drop_oldest_keeps_the_latest)
+{
+    tracer::VisualizerStats stats;
+    std::vector<uint64_t> tags = renderWhileHeldUp(tracer::VIS_DROP_OLDEST, stats);
+    EXPECT_EQ(tags, std::vector<uint64_t>({0, 4, 5}));
+    EXPECT_EQ(stats.enqueued, 6u);
+    EXPECT_EQ(stats.dropped, 3u);
+    EXPECT_EQ(stats.rendered, 3u);
+    EXPECT_EQ(stats.max_depth, 2u);
+    EXPECT_EQ(stats.depth, 0u);
+}
+
+// 3 goes in over 1, 4 is dropped, 5 goes in over 2
+TEST(async_visualizer, sample_keeps_one_in_n)
+{
+    tracer::VisualizerStats stats;
+    std::vector<uint64_t> tags = renderWhileHeldUp(tracer::VIS_SAMPLE, stats);
+    EXPECT_EQ(tags, std::vector<uint64_t>({0, 3, 5}));
+    EXPECT_EQ(stats.dropped, 3u);
+    EXPECT_EQ(stats.rendered, 3u);
+}
+
+// Nothing lost, and the images are those rendered inline
+TEST(async_visualizer, block_renders_everything)
+{
+    cspace::Mat bg = makeFrame();
+    cspace::Mat mask(bg.size(), CV_8UC1);
+    cv::randu(mask, cv::Scalar::all(0), cv::Scalar::all(256));
+    mask.setColorspace(cspace::WHITE_ON_BLACK);
+    cspace::Mat expected = cspace::highlightOverBg(bg, mask);
+
+    std::mutex lock;
+    int matching = 0;
+    tracer::AsyncVisualizer vis([&](uint64_t, const cspace::Mat &image) {
+        std::lock_guard<std::mutex> guard(lock);
+        matching += cv::norm(image, expected, cv::NORM_INF) == 0;
+    }, 2, 2, tracer::VIS_BLOCK);
+
+    for (int i = 0; i < 20; i++)
+    {
+        EXPECT_TRUE(vis.highlight(bg, mask, i));
+    }
+    vis.close();
+    EXPECT_EQ(matching, 20);
+    EXPECT_EQ(vis.stats().dropped, 0u);
+    EXPECT_FALSE(vis.bgr(bg)); // closed
+}
+
+// A highlight with no masks, or more than a request holds, is refused before it is queued
+TEST(async_visualizer, bad_mask_counts_throw)
+{
+    cspace::Mat bg = makeFrame();
+    tracer::AsyncVisualizer vis([](uint64_t, const cspace::Mat &) {}, 2, 1, tracer::VIS_BLOCK);
+    for (int num_masks : {0, -1, VIS_MAX_MASKS + 1})
+    {
+        tracer::VisRequest r;
+        r.render = tracer::VIS_HIGHLIGHT;
+        r.src = bg;
+        r.num_masks = num_masks;
+        EXPECT_THROW(vis.enqueue(std::move(r)), std::runtime_error);
+    }
+    vis.close();
+    EXPECT_EQ(vis.stats().enqueued, 0u);
+    EXPECT_EQ(vis.stats().rendered, 0u);
+}
+
+// As are a mask of another size than the background, and a src of no known colorspace
+TEST(async_visualizer, bad_requests_throw)
+{
+    cspace::Mat bg = makeFrame();
+    tracer::AsyncVisualizer vis([](uint64_t, const cspace::Mat &) {}, 2, 1, tracer::VIS_BLOCK);
+
+    cspace::Mat small_mask(bg.rows / 2, bg.cols, CV_8UC1, cv::Scalar(255));
+    small_mask.setColorspace(cspace::WHITE_ON_BLACK);
+    EXPECT_THROW(vis.highlight(bg, small_mask), std::runtime_error);
+
+    cspace::Mat unknown;
+    unknown = cv::Mat(bg.size(), CV_8UC3, cv::Scalar::all(0));
+    EXPECT_THROW(vis.bgr(unknown), std::runtime_error);
+    EXPECT_THROW(vis.gray3(unknown), std::runtime_error);
+
+    vis.close();
+    EXPECT_EQ(vis.stats().enqueued, 0u);
+}
+
+// A sink that throws costs its request only, the worker goes on with the rest
+TEST(async_visualizer, throwing_sink_is_counted)
+{
+    cspace::Mat bg = makeFrame();
+    std::atomic<int> sunk{0};
+    tracer::AsyncVisualizer vis([&](uint64_t tag, const cspace::Mat &) {
+        if (tag % 2)
+        {
+            throw std::runtime_error("sink failed");
+        }
+        sunk++;
+    }, 2, 1, tracer::VIS_BLOCK);
+
+    for (int i = 0; i < 6; i++)
+    {
+        EXPECT_TRUE(vis.bgr(bg, i));
+    }
+    vis.close();
+    EXPECT_EQ(sunk, 3);
+    EXPECT_EQ(vis.stats().rendered, 3u);
+    EXPECT_EQ(vis.stats().failed, 3u);
+}
+
+// Frames appended in batches small enough that several go to the writing thread, read back
+// through the index, and again without it, as from a log cut short
+TEST(trace_log, round_trip)
+{
+    const std::string path = testing::TempDir() + "trace_log_test.bin";
+    tracer::TraceLogConfig cfg;
+    cfg.batch_bytes = 4096;
+    cfg.max_pending = 2;
+
+    tracer::Tracer tr;
+    std::vector<cspace::Mat> frames, masks;
+    {
+        tracer::TraceLogWriter log(path, cfg);
+        for (int f = 0; f < 3; f++)
+        {
+            cspace::Mat frame = makeFrame();
+            cspace::Mat gray, mask;
+            tracer::traceStep(tr, "gray", frame, gray,
+                [](const cspace::Mat &in, cspace::Mat &out) { in.toGray(out); });
+            {
+                tracer::Step step(tr, "threshold");
+                step.input(gray).param("thresh", 100 + f);
+                cv::threshold(gray, mask, 100 + f, 255, cv::THRESH_BINARY);
+                mask.setColorspace(cspace::WHITE_ON_BLACK);
+                step.output(mask);
+            }
+            EXPECT_EQ(log.appendFrame(tr), 2u * f);
+            tr.newFrame();
+            frames.push_back(frame);
+            masks.push_back(mask);
+        }
+        log.close();
+        EXPECT_EQ(log.stats().steps, 6u);
+        EXPECT_GT(log.stats().batches, 2u);
+    }
+
+    {
+        tracer::TraceLogReader log(path);
+        EXPECT_TRUE(log.indexed());
+        ASSERT_EQ(log.size(), 6u);
+        for (int f = 0; f < 3; f++)
+        {
+            tracer::TraceLogNode gray = log.node(2 * f);
+            tracer::TraceLogNode threshold = log.node(2 * f + 1);
+            EXPECT_STREQ(gray.step(), "gray");
+            EXPECT_TRUE(gray.isRoot());
+            EXPECT_EQ(threshold.parent(), gray.id());
+            EXPECT_EQ(threshold.frame(), (uint64_t)f);
+            ASSERT_EQ(threshold.numParams(), 1);
+            EXPECT_STREQ(threshold.param(0).name, "thresh");
+            EXPECT_EQ(threshold.param(0).value, 100 + f);
+
+            cspace::Mat in = gray.input(0);
+            EXPECT_EQ(in.getColorspace(), cspace::BGR);
+            EXPECT_EQ((uintptr_t)in.data % TRACE_LOG_ALIGN, 0u);
+            EXPECT_EQ(cv::norm(in, frames[f], cv::NORM_INF), 0);
+            cspace::Mat out = threshold.output(0);
+            EXPECT_EQ(out.getColorspace(), cspace::WHITE_ON_BLACK);
+            EXPECT_EQ(cv::norm(out, masks[f], cv::NORM_INF), 0);
+        }
+    }
+
+    // the index gone, and a record only partly written
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    const long bytes = (long)file.tellg();
+    file.close();
+    ASSERT_EQ(truncate(path.c_str(), bytes / 2), 0);
+    {
+        tracer::TraceLogReader log(path);
+        EXPECT_FALSE(log.indexed());
+        ASSERT_GT(log.size(), 0u);
+        EXPECT_LT(log.size(), 6u);
+        EXPECT_STREQ(log.node(0).step(), "gray");
+    }
+    std::remove(path.c_str());
+}
+
+// The pixels of the second step made to run past the end of its record: reached through the
+// index the step throws, and walking the records stops short of it
+TEST(trace_log, corrupt_record_is_not_read)
+{
+    const std::string path = testing::TempDir() + "trace_log_corrupt.bin";
+    tracer::Tracer tr;
+    cspace::Mat frame = makeFrame();
+    cspace::Mat gray, mask;
+    tracer::traceStep(tr, "gray", frame, gray,
+        [](const cspace::Mat &in, cspace::Mat &out) { in.toGray(out); });
+    tracer::traceStep(tr, "threshold", gray, mask, [](const cspace::Mat &in, cspace::Mat &out) {
+        cv::threshold(in, out, 100, 255, cv::THRESH_BINARY);
+        out.setColorspace(cspace::WHITE_ON_BLACK);
+    });
+    {
+        tracer::TraceLogWriter log(path);
+        log.appendFrame(tr);
+        log.close();
+    }
+
+    std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+    tracer::TraceLogNodeHeader first, second;
+    file.seekg(sizeof(tracer::TraceLogFileHeader));
+    file.read((char *)&first, sizeof(first));
+    const long second_at = (long)(sizeof(tracer::TraceLogFileHeader) + first.record_bytes);
+    file.seekg(second_at);
+    file.read((char *)&second, sizeof(second));
+    const long io_at = second_at + (long)(sizeof(second) + (second.name_bytes + 7) / 8 * 8 +
+                                          second.num_params * sizeof(tracer::TraceLogParam));
+    tracer::TraceLogIo io;
+    file.seekg(io_at);
+    file.read((char *)&io, sizeof(io));
+    io.pixels_offset = second.record_bytes;
+    file.seekp(io_at);
+    file.write((const char *)&io, sizeof(io));
+    file.seekg(0, std::ios::end);
+    const long bytes = (long)file.tellg();
+    ASSERT_TRUE(file.good());
+    file.close();
+
+    {
+        tracer::TraceLogReader log(path);
+        EXPECT_TRUE(log.indexed());
+        ASSERT_EQ(log.size(), 2u);
+        EXPECT_STREQ(log.node(0).step(), "gray");
+        EXPECT_THROW(log.node(1), std::runtime_error);
+    }
+
+    ASSERT_EQ(truncate(path.c_str(), bytes - (long)sizeof(tracer::TraceLogTrailer)), 0);
+    {
+        tracer::TraceLogReader log(path);
+        EXPECT_FALSE(log.indexed());
+        EXPECT_EQ(log.size(), 1u);
+    }
+    std::remove(path.c_str());
+}
+
+// /dev/full takes the file but fails every write. Once the writing thread has failed the log
+// stays failed, and every call after throws.
+TEST(trace_log, failed_writes_stay_failed)
+{
+    tracer::TraceLogConfig cfg;
+    cfg.batch_bytes = 4096;
+    cfg.max_pending = 1;
+    cfg.sync = false;
+
+    tracer::Tracer tr;
+    cspace::Mat frame = makeFrame();
+    cspace::Mat gray;
+    tracer::traceStep(tr, "gray", frame, gray,
+        [](const cspace::Mat &in, cspace::Mat &out) { in.toGray(out); });
+
+    tracer::TraceLogWriter log("/dev/full", cfg);
+    // with one batch pending, a third handed over waits until the first is written, or failed
+    bool threw = false;
+    for (int i = 0; i < 4 && !threw; i++)
+    {
+        try
+        {
+            log.appendFrame(tr);
+            log.flush();
+        }
+        catch (const std::runtime_error &)
+        {
+            threw = true;
+        }
+    }
+    EXPECT_TRUE(threw);
+    EXPECT_THROW(log.appendFrame(tr), std::runtime_error);
+    EXPECT_THROW(log.flush(), std::runtime_error);
+    EXPECT_THROW(log.close(), std::runtime_error);
+    EXPECT_THROW(log.close(), std::runtime_error);
+    EXPECT_EQ(log.stats().batches, 0u);
+}
+
+} // namespace
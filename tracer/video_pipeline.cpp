@@ -0,0 +1,288 @@
+/******************************************************************************/
+/*!
+ * @file  video_pipeline.cpp
+ * @brief Traces a video, its frames passing through a pipeline of stages,
+ *        one thread per stage, with the traces of the last frames kept
+ *
+ * @author Cathal Harte <cathal.harte@protonmail.com>
+ */
+
+/*******************************************************************************
+* Includes
+******************************************************************************/
+
+#include "video_pipeline.h"
+
+#include <instrument.h>
+
+#include <cassert>
+#include <chrono>
+#include <utility>
+
+namespace tracer
+{
+
+/*******************************************************************************
+* Functions
+*******************************************************************************/
+
+static int64_t steadyNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+/*******************************************************************************
+* Classes
+*******************************************************************************/
+
+void FramePool::setAllocator(cv::MatAllocator *allocator)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    this->allocator = allocator;
+    use_allocator = true;
+}
+
+// A buffer only the pool holds has a reference count of 1, no one else can take it but through
+// acquire(), under the lock
+cspace::Mat FramePool::acquire(cv::Size size, int type)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    cspace::Mat out;
+    for (auto &b : buffers)
+    {
+        if (b.u && b.u->refcount == 1 && b.size() == size && b.type() == type)
+        {
+            out = b;
+            return out;
+        }
+    }
+    cv::Mat m;
+    m.allocator = use_allocator ? allocator : cspace::getOutputAllocator();
+    m.create(size, type);
+    buffers.push_back(m);
+    out = m;
+    return out;
+}
+
+void FramePool::adopt(const cv::Mat &m)
+{
+    if (!m.u)
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto &b : buffers)
+    {
+        if (b.u == m.u)
+        {
+            return;
+        }
+    }
+    buffers.push_back(m);
+}
+
+bool FramePool::heldElsewhere(const cv::Mat &m) const
+{
+    if (!m.u)
+    {
+        return false;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    int holders = 1;
+    for (auto &b : buffers)
+    {
+        if (b.u == m.u)
+        {
+            holders++;
+            break;
+        }
+    }
+    return m.u->refcount > holders;
+}
+
+std::size_t FramePool::numBuffers() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return buffers.size();
+}
+
+std::size_t FramePool::bytes() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    std::size_t total = 0;
+    for (auto &b : buffers)
+    {
+        total += b.total() * b.elemSize();
+    }
+    return total;
+}
+
+cspace::Mat &FrameContext::output(int i)
+{
+    cspace::Mat &m = slots[i];
+    if (pool->heldElsewhere(m))
+    {
+        cspace::colorspace_t c = m.getColorspace();
+        m = pool->acquire(m.size(), m.type());
+        m.setColorspace(c);
+    }
+    return m;
+}
+
+VideoPipeline::VideoPipeline(std::size_t retained_frames, int num_slots, std::size_t in_flight,
+                             std::size_t steps_per_frame)
+    : free_frames(in_flight)
+{
+    assert(("A frame is kept at least", retained_frames > 0));
+    for (std::size_t i = 0; i < in_flight; i++)
+    {
+        frames.emplace_back(new Frame(steps_per_frame));
+        Frame &f = *frames.back();
+        f.ctx.frame_tracer = &f.tracer;
+        f.ctx.slots.resize(num_slots);
+        f.ctx.pool = &pool;
+        free_frames.push(&f);
+    }
+    ring.reserve(retained_frames);
+    for (std::size_t i = 0; i < retained_frames; i++)
+    {
+        ring.emplace_back(steps_per_frame);
+    }
+}
+
+VideoPipeline::~VideoPipeline()
+{
+    close();
+}
+
+void VideoPipeline::addStage(const char *name, stage_fn_t fn)
+{
+    assert(("Stages are added before start()", !started));
+    stage_names.push_back(name);
+    stage_fns.push_back(fn);
+}
+
+void VideoPipeline::setAllocator(cv::MatAllocator *allocator)
+{
+    assert(("The allocator is set before start()", !started));
+    this->allocator = allocator;
+    use_allocator = true;
+    pool.setAllocator(allocator);
+}
+
+// Each queue has room for every frame, so a stage never waits to hand a frame on
+void VideoPipeline::start()
+{
+    assert(("A stage at least", !stage_fns.empty()));
+    started = true;
+    busy_ns.reset(new std::atomic<uint64_t>[stage_fns.size()]);
+    for (std::size_t s = 0; s < stage_fns.size(); s++)
+    {
+        busy_ns[s] = 0;
+        queues.emplace_back(new BoundedQueue<Frame *>(frames.size()));
+    }
+    for (std::size_t s = 0; s < stage_fns.size(); s++)
+    {
+        threads.emplace_back([this, s] { stageLoop(s); });
+    }
+}
+
+void VideoPipeline::push(const cspace::Mat &frame)
+{
+    assert(("Pushed between start() and close()", started && !closed));
+    Frame *f = nullptr;
+    free_frames.pop(f);
+    f->ctx.frame_index = next_index++;
+    f->ctx.frame_input = frame;
+    queues[0]->push(f);
+}
+
+void VideoPipeline::close()
+{
+    if (!started || closed)
+    {
+        return;
+    }
+    closed = true;
+    queues[0]->close();
+    for (auto &t : threads)
+    {
+        t.join();
+    }
+}
+
+// A stage finds its queue closed once the stage before it is done, and closes the next in turn
+void VideoPipeline::stageLoop(std::size_t s)
+{
+    Frame *f = nullptr;
+    while (queues[s]->pop(f))
+    {
+        int64_t start = steadyNs();
+        if (use_allocator)
+        {
+            cspace::AllocatorScope scope(allocator);
+            INSTRUMENT_SCOPE(stage_names[s]);
+            stage_fns[s](f->ctx);
+        }
+        else
+        {
+            INSTRUMENT_SCOPE(stage_names[s]);
+            stage_fns[s](f->ctx);
+        }
+        busy_ns[s] += (uint64_t)(steadyNs() - start);
+
+        if (s + 1 < queues.size())
+        {
+            queues[s + 1]->push(f);
+        }
+        else
+        {
+            retire(f);
+        }
+    }
+    if (s + 1 < queues.size())
+    {
+        queues[s + 1]->close();
+    }
+}
+
+// The frame's trace takes the place of the oldest kept, whose tracer, cleared, goes on with the
+// frame. The buffers the frame used join the pool.
+void VideoPipeline::retire(Frame *f)
+{
+    pool.adopt(f->ctx.frame_input);
+    for (auto &m : f->ctx.slots)
+    {
+        pool.adopt(m);
+    }
+    {
+        std::lock_guard<std::mutex> guard(ring_lock);
+        FrameTrace &oldest = ring[ring_next];
+        oldest.tracer.newFrame();
+        std::swap(oldest.tracer, f->tracer);
+        oldest.index = f->ctx.frame_index;
+        oldest.valid = true;
+        ring_next = (ring_next + 1) % ring.size();
+    }
+    f->ctx.frame_input = cspace::Mat();
+    done++;
+    INSTRUMENT_COUNTER("frames", (double)done);
+    free_frames.push(f);
+}
+
+PipelineStats VideoPipeline::stats() const
+{
+    PipelineStats out;
+    out.frames = done;
+    for (std::size_t s = 0; s < stage_fns.size() && busy_ns; s++)
+    {
+        out.stage_busy_ns.push_back(busy_ns[s]);
+    }
+    out.pool_buffers = pool.numBuffers();
+    out.pool_bytes = pool.bytes();
+    return out;
+}
+
+} // namespace tracer
@@ -0,0 +1,208 @@
+/******************************************************************************/
+/*!
+ * @file  video_pipeline.h
+ * @brief Traces a video, its frames passing through a pipeline of stages,
+ *        one thread per stage, with the traces of the last frames kept
+ *
+ * @author Cathal Harte <cathal.harte@protonmail.com>
+ */
+#ifndef _VIDEO_PIPELINE_H
+#define _VIDEO_PIPELINE_H
+
+/*******************************************************************************
+* Includes
+******************************************************************************/
+
+#include "tracer.h"
+#include "bounded_queue.h"
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*! @addtogroup tracer
+ * @{
+ */
+
+namespace tracer
+{
+/*******************************************************************************
+* Definitions and types
+*******************************************************************************/
+
+// The trace of one frame
+struct FrameTrace
+{
+    explicit FrameTrace(std::size_t steps_per_frame) : tracer(steps_per_frame) {}
+
+    uint64_t index = 0;
+    bool valid = false; // false until a frame has been kept here
+    Tracer tracer;
+};
+
+struct PipelineStats
+{
+    uint64_t frames = 0;                // through every stage
+    std::vector<uint64_t> stage_busy_ns;    // per stage, time spent in it
+    std::size_t pool_buffers = 0;
+    std::size_t pool_bytes = 0;
+};
+
+/*******************************************************************************
+* Class prototypes
+*******************************************************************************/
+
+// Buffers for frames and their intermediates, handed out again once only the pool holds them
+class FramePool
+{
+    public :
+        // The allocator new buffers are created with, in place of cspace::getOutputAllocator()
+        void setAllocator(cv::MatAllocator *allocator);
+
+        // A buffer of that size and type held by no one else, allocated if there is none free
+        cspace::Mat acquire(cv::Size size, int type);
+        // Takes m's buffer into the pool, unless it is there already
+        void adopt(const cv::Mat &m);
+        // Whether anything besides m, and the pool, holds m's buffer
+        bool heldElsewhere(const cv::Mat &m) const;
+
+        std::size_t numBuffers() const;
+        std::size_t bytes() const;
+
+    private :
+        mutable std::mutex lock;
+        std::vector<cv::Mat> buffers;
+        cv::MatAllocator *allocator = nullptr;
+        bool use_allocator = false;
+};
+
+// What a stage gets to work on
+class FrameContext
+{
+    public :
+        uint64_t index() const { return frame_index; }
+        Tracer &tracer() { return *frame_tracer; }
+        // The frame as pushed
+        const cspace::Mat &input() const { return frame_input; }
+
+        // The frame's working matrices. They keep their buffers from one frame to the next,
+        // intermediates are written without allocating once the pipeline is warm.
+        cspace::Mat &slot(int i) { return slots[i]; }
+        // slot(i) to be written over. When a kept trace still holds its buffer the slot is given a
+        // free one of the same size and type instead, the trace keeps what it saw.
+        cspace::Mat &output(int i);
+
+    private :
+        friend class VideoPipeline;
+
+        uint64_t frame_index = 0;
+        Tracer *frame_tracer = nullptr;
+        cspace::Mat frame_input;
+        std::vector<cspace::Mat> slots;
+        FramePool *pool = nullptr;
+};
+
+typedef std::function<void(FrameContext &)> stage_fn_t;
+
+//  Runs each frame through the stages in turn, each stage on a thread of its own
+//  Design parameters :
+//      The stages are linked by bounded queues, so while stage 2 works on frame N stage 1 is
+//      already on frame N + 1, and the frame rate is set by the slowest stage rather than the
+//      sum of them.
+//      A fixed number of frames is in flight, push() waits for one to come free. Each frame has
+//      its own Tracer, used by one stage at a time.
+//      The traces of the last retained_frames frames are kept in a ring. A finished frame's
+//      tracer is swapped with the oldest in the ring, which lets go of that frame's buffers, so
+//      nothing is allocated or freed frame to frame. The buffers come from a FramePool and go
+//      back to it when no frame or trace holds them, so memory stays flat however long the video.
+class VideoPipeline
+{
+    public :
+        // num_slots working matrices per frame, in_flight frames at once (at least a frame per stage
+        // for the stages to overlap), each tracer sized for steps_per_frame
+        VideoPipeline(std::size_t retained_frames, int num_slots, std::size_t in_flight = 4,
+                      std::size_t steps_per_frame = 64);
+        ~VideoPipeline();
+
+        VideoPipeline(const VideoPipeline &) = delete;
+        VideoPipeline &operator=(const VideoPipeline &) = delete;
+
+        // Stages run in the order added, all are added before start()
+        void addStage(const char *name, stage_fn_t fn);
+        // The allocator the cspace outputs of the stages, and the buffers of the pool, are created
+        // with, e.g. a cspace::PoolAllocator, in place of the global one. Set before start().
+        void setAllocator(cv::MatAllocator *allocator);
+        void start();
+
+        // A buffer from the pool to decode the next frame into. Pushed frames must not be written
+        // over while in flight or kept, decoding each frame into a buffer of its own sees to that.
+        cspace::Mat acquireFrame(cv::Size size, int type) { return pool.acquire(size, type); }
+
+        // Sends a frame down the pipeline, waiting while in_flight frames are
+        void push(const cspace::Mat &frame);
+
+        // Waits for the frames in flight, then stops the stages
+        void close();
+
+        // fn(const FrameTrace &) for each kept trace, oldest first. The ring is locked meanwhile,
+        // the last stage waits for fn to finish.
+        template <typename Fn>
+        void forEachRetained(Fn fn) const
+        {
+            std::lock_guard<std::mutex> guard(ring_lock);
+            for (std::size_t k = 0; k < ring.size(); k++)
+            {
+                const FrameTrace &t = ring[(ring_next + k) % ring.size()];
+                if (t.valid)
+                {
+                    fn(t);
+                }
+            }
+        }
+
+        PipelineStats stats() const;
+
+    private :
+        struct Frame
+        {
+            explicit Frame(std::size_t steps_per_frame) : tracer(steps_per_frame) {}
+
+            Tracer tracer;
+            FrameContext ctx;
+        };
+
+        void stageLoop(std::size_t s);
+        void retire(Frame *f);
+
+        std::vector<const char *> stage_names;
+        std::vector<stage_fn_t> stage_fns;
+        std::vector<std::unique_ptr<BoundedQueue<Frame *>>> queues; // into each stage
+        std::vector<std::thread> threads;
+        std::unique_ptr<std::atomic<uint64_t>[]> busy_ns;
+
+        std::vector<std::unique_ptr<Frame>> frames;
+        BoundedQueue<Frame *> free_frames;
+        uint64_t next_index = 0;
+
+        mutable std::mutex ring_lock;
+        std::vector<FrameTrace> ring;
+        std::size_t ring_next = 0; // the oldest, overwritten next
+        std::atomic<uint64_t> done{0};
+
+        FramePool pool;
+        cv::MatAllocator *allocator = nullptr;
+        bool use_allocator = false;
+        bool started = false;
+        bool closed = false;
+};
+
+}
+
+/*! @}
+ */
+
+#endif  // _VIDEO_PIPELINE_H